@@ -42,6 +42,23 @@ struct lgw_db_entry {
 	char data[0];
 };
 
+/*! \brief kind of value kept under /filter/<name>/<type>/<value> */
+typedef enum {
+	LGW_FILTER_FPORT,
+	LGW_FILTER_DEVADDR,
+	LGW_FILTER_NWKID,
+	LGW_FILTER_DEVEUI,
+	LGW_FILTER_JOINEUI,
+	LGW_FILTER_NB
+} lgw_filter_type_e;
+
+/*! \brief key trees whose changes can be followed with lgw_db_generation */
+typedef enum {
+	LGW_DB_TREE_FILTER,         /*!> /filter/... */
+	LGW_DB_TREE_DEVINFO,        /*!> /devinfo/... */
+	LGW_DB_TREE_NB
+} lgw_db_tree_e;
+
 /*! \brief initial database */
 int lgw_db_init(void);
 
@@ -51,6 +68,27 @@ bool lgw_db_key_exist(const char *key);
 /*! \brief find key specified by family, only for deveui and appeui */
 bool lgw_db_key_exist_ex(const char *prefix, const char *key);
 
+/*!
+ * \brief find value in the filter index of service name
+ *
+ * \details
+ * Lookup in memory, the index is compiled from the /filter keys and
+ * rebuilt after they change. EUI may also match a partial EUI filter.
+ *
+ * \retval true value is listed for this service and type
+ */
+bool lgw_db_filter_exist(const char *name, lgw_filter_type_e type, uint64_t value);
+
+/*!
+ * \brief generation number of a key tree
+ *
+ * \details
+ * The number changes after any key of the tree was written, so an in-memory
+ * copy of the tree is stale when its generation differs. Writes by other
+ * processes are noticed within a second.
+ */
+unsigned lgw_db_generation(lgw_db_tree_e tree);
+
 /*! \brief Get key value specified by family/key */
 int lgw_db_get(const char *family, const char *key, char *value, int valuelen);
 
@@ -27,7 +27,7 @@
 #ifndef __DELAY_PROTO_H
 #define __DELAY_PROTO_H
 
-#define DELAY_PKTS_MAX      64
+#define DELAY_PKTS_MAX      256     /*!> packets kept in memory when there is no db storage */
 
 int delay_pkt_get(int max, struct lgw_pkt_rx_s *pkt_data); 
 
@@ -67,11 +67,15 @@
 
 #define DEFAULT_FETCH_SLEEP_MS              10	        /* number of ms waited when a fetch return no packets */
 
-#define DEFAULT_BEACON_POLL_MS              50	        /* time in ms between polling of beacon TX status */
+#define FETCH_SLEEP_MIN_MS                  1	        /* fetch back-off after a partial batch */
+
+#define FETCH_SLEEP_MAX_MS                  (DEFAULT_FETCH_SLEEP_MS * 4)  /* fetch back-off ceiling when idle */
 
-#define DEFAULT_RXPKTS_LIST_SIZE            32           
+#define JIT_WAIT_MIN_US                     1000	    /* floor of the JiT thread sleep, keeps SPI polling bounded */
 
-#define  MAX_RXPKTS_LIST_SIZE               128         /* MAX sizeof RXPKTS */
+#define JIT_WAIT_MAX_US                     100000	    /* ceiling of the JiT thread sleep when nothing is due */
+
+#define DEFAULT_BEACON_POLL_MS              50	        /* time in ms between polling of beacon TX status */
 
 #define TX_BUFF_SIZE                        ((540 * NB_PKT_MAX) + 30 + STATUS_SIZE)
 
@@ -84,7 +88,9 @@
 
 #define ACK_BUFF_SIZE                       64
 
-#define NB_LBT_QUEUE                        8
+#define GPS_PPS_MSG_MAX_US                  900000	/* a time message later than this after its PPS is not trusted */
+
+#define NB_LBT_QUEUE                        16	/* downlinks waiting for, or holding, an LBT assessment */
 
 #define UNIX_GPS_EPOCH_OFFSET               315964800 
 
@@ -96,10 +102,8 @@
 
 #ifdef HP0C
 #define MAX_PKT_PTHREADS          5
-#define MAX_PTHREADS_COUNT        32
 #else
 #define MAX_PKT_PTHREADS          3
-#define MAX_PTHREADS_COUNT        48
 #endif
 
 #define IF_DELAY            31  /*!> DELAY channel */
@@ -169,8 +173,43 @@ double difftimespec(struct timespec end, struct timespec beginning);
 int get_tx_gain_lut_index(uint8_t rf_chain, int8_t rf_power, uint8_t * lut_index);
 
 /*!
- * \brief 
+ * \brief borrow the next batch of the uplink ring for serv_ct->serv
+ * \retval number of packets in serv_ct->rxpkt, 0 when the service is up to date
+ *
+ * The batch is shared with the other services and must not be modified. A batch
+ * still held by serv_ct is released first.
  */
 int get_rxpkt(serv_ct_s* serv_ct);
 
+/*!
+ * \brief give back the batch borrowed by get_rxpkt, if any
+ */
+void release_rxpkt(serv_ct_s* serv_ct);
+
+/*!
+ * \brief serv_ct for one read of the uplink ring by serv, from a pool
+ * \retval NULL when out of memory
+ */
+serv_ct_s* serv_ct_new(serv_s* serv);
+
+/*!
+ * \brief release the batch held by serv_ct and give serv_ct back to its pool
+ */
+void serv_ct_free(serv_ct_s* serv_ct);
+
+/*!
+ * \brief true when the uplink ring holds batches not yet read by serv
+ */
+bool rxpkt_pending(serv_s* serv);
+
+/*!
+ * \brief register serv as a reader of the uplink ring, starting from the next batch
+ */
+void rxpkt_attach(serv_s* serv);
+
+/*!
+ * \brief stop serv from holding slots of the uplink ring
+ */
+void rxpkt_detach(serv_s* serv);
+
 #endif							/* _DR_PKT_FWD_H_ */
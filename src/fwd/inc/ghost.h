@@ -43,7 +43,9 @@
 #define GHST_RX_BUFFSIZE     240	/* Size of buffer held for receiving packets  */
 #define GHST_TX_BUFFSIZE     320	/* Size of buffer held for sending packets  */
 
-#define GHST_NB_PKT                12
+#define GHST_RING_DEFAULT          256     /* packets waiting for thread_up, rounded up to a power of 2 */
+#define GHST_RING_MAX              8192
+#define GHST_NB_MSG                32      /* datagrams taken by one recvmmsg */
 
 /* -------------------------------------------------------------------------- */
 /* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
@@ -55,6 +57,9 @@ void ghost_stop(void);
 /* Call this to pull data from the receive buffer for ghost nodes.. */
 int ghost_get(int max_pkt, struct lgw_pkt_rx_s *pkt_data);
 
+/* Datagrams received and those dropped because the ring was full, since start. */
+void ghost_counters(uint32_t *nb_rx, uint32_t *nb_drop);
+
 #endif
 
 /* --- EOF ------------------------------------------------------------------ */
@@ -0,0 +1,81 @@
+/*
+ *  ____  ____      _    ____ ___ _   _  ___
+ *  |  _ \|  _ \    / \  / ___|_ _| \ | |/ _ \
+ *  | | | | |_) |  / _ \| |  _ | ||  \| | | | |
+ *  | |_| |  _ <  / ___ \ |_| || || |\  | |_| |
+ *  |____/|_| \_\/_/   \_\____|___|_| \_|\___/
+ *
+ * Dragino_gw_fwd -- An opensource lora gateway forward
+ *
+ * See http://www.dragino.com for more information about
+ * the lora gateway project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ *
+ * Maintainer: skerlan
+ *
+ */
+
+/*!
+ * \file
+ * \brief incremental NMEA/UBX framer for the GPS tty
+ *
+ * Bytes are fed as they are read, every byte is looked at once.  A frame
+ * split over several reads is completed by the next ones, the framer
+ * hands out whole frames, checksums are left to lgw_parse_nmea and
+ * lgw_parse_ubx.
+ */
+
+#ifndef _LORA_PKTFWD_GPSFRAME_H
+#define _LORA_PKTFWD_GPSFRAME_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>     /* C99 types */
+#include <stdbool.h>    /* bool type */
+#include <stddef.h>     /* size_t */
+#include <time.h>       /* timespec */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC CONSTANTS ----------------------------------------------------- */
+
+#define GPS_FRAME_MAX           256     /*!> longer frames are skipped, NMEA sentences are 82 chars at most */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC TYPES --------------------------------------------------------- */
+
+enum gps_frame_type_e {
+    GPS_FRAME_NMEA,
+    GPS_FRAME_UBX
+};
+
+struct gps_framer_s {
+    uint8_t state;                      /*!> private */
+    size_t need;                        /*!> private, UBX size once the header is in, or bytes left to skip */
+    enum gps_frame_type_e type;         /*!> of the complete frame */
+    size_t len;                         /*!> bytes in frame */
+    struct timespec arrival;            /*!> read time of the first byte of frame */
+    uint32_t nb_dropped;                /*!> frames given up: too long, or cut by a new sync char */
+    char frame[GPS_FRAME_MAX];
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+void gps_framer_init(struct gps_framer_s *f);
+
+/*!
+ * \brief Feed bytes read from the tty
+ * \param data bytes read
+ * \param size number of bytes
+ * \param arrival time the read returned, stamped on the frames starting in data
+ * \param complete [out] true when frame, len, type and arrival hold a whole frame
+ * \return bytes consumed, feed the rest once the frame is handled
+ */
+size_t gps_framer_feed(struct gps_framer_s *f, const char *data, size_t size, const struct timespec *arrival, bool *complete);
+
+#endif
@@ -35,6 +35,8 @@
 #include "linkedlists.h"
 #include "jitqueue.h"
 #include "stats.h"
+#include "sscan.h"
+#include "mac-header-decode.h"
 
 #include "loragw_gps.h"
 
@@ -92,16 +94,41 @@ typedef enum {     /*!> thread type for control thread head */
     watchdog
 } thread_type;
 
-typedef struct _rxpkts {   /*!> rx packages receive from radio or socke */
-    //bool deal;
+#define RXPKTS_RING_SIZE            32            /*!> slots of the uplink ring, must be a power of 2 */
+#define SERV_REJECT_MAX             16            /*!> preempted downlinks waiting for their TX_ACK, per service */
+
+typedef struct {           /*!> a batch received from radio or socket, read-only once published */
+    uint32_t refcnt;       /*!> one for the ring slot plus one per service borrowing it */
+    uint32_t seq;          /*!> ring sequence it was published at */
     uint32_t entry_us;     //插入添加时间
-    uint8_t stamps;        //这个指示当前有什么服务对这个包打上了印记
+    struct timespec fetch_time;     /*!> CLOCK_MONOTONIC, when thread_up received the batch */
     uint8_t nb_pkt;
-    uint8_t bind;          //当前还剩多少连接，当连接为0时，将会移除这个包
+    uint8_t nb_radio;      /*!> rxpkt[0..nb_radio-1] come from the concentrator, the others are ghost or delayed */
     struct lgw_pkt_rx_s rxpkt[NB_PKT_MAX];
-    LGW_LIST_ENTRY(_rxpkts) list;
+    mac_meta_s meta[NB_PKT_MAX];    /*!> MAC header of rxpkt[i], parsed before the batch is published */
 } rxpkts_s;
 
+/*!>!
+ * \brief single producer / multi consumer ring carrying uplink batches to the services
+ *
+ * thread_up is the only writer of head. Every started service owns a read
+ * cursor (serv_s.rxbus), a slot is free again as soon as the slowest cursor
+ * has passed it. A reader which falls a whole ring behind is lapped: it loses
+ * its oldest batch and the loss is counted, the producer never waits for it.
+ *
+ * Slots only hold references: readers borrow the batch itself, and the last
+ * one to release it (the ring included) frees it. No lock: a reader loads the
+ * slot and takes its reference inside a read section (odd serv_s.rxbus.gp),
+ * the producer drops the reference of a replaced slot only once every read
+ * section open at the replacement is closed. The reader then checks the seq
+ * of the batch and moves its cursor by CAS, and retries when it was lapped.
+ */
+typedef struct {
+    uint32_t head;                          /*!> sequence of the next slot to publish */
+    uint32_t nb_overrun;                    /*!> batches lost by lapped readers, all services */
+    rxpkts_s* slot[RXPKTS_RING_SIZE];
+} rxpkts_ring_s;
+
 typedef enum {
     NOFILTER,
     INCLUDE,
@@ -119,7 +146,12 @@ typedef struct spectral_scan_s {
     uint32_t freq_hz_start;		/*!> first channel frequency, in Hz */
     uint8_t nb_chan;			/*!> number of channels to scan (200kHz between each channel) */
     uint16_t nb_scan;			/*!> number of scan points for each frequency scan */
-    uint32_t pace_s;			/*!> number of seconds between 2 scans in the thread */
+    uint32_t pace_s;			/*!> number of seconds between 2 scans in the thread (2 sweeps in sweep mode) */
+    bool sweep;					/*!> scan the nb_chan channels back to back, between downlinks */
+    uint32_t ring_records;		/*!> capacity of the result ring file, 0 to disable it */
+    char ring_path[64];			/*!> result ring file, see sscan.h */
+    char export_host[64];		/*!> results are also sent there as JSON datagrams, when set */
+    char export_port[8];
 } spectral_scan_t;
 
 /*!> mqtt service information */
@@ -135,14 +167,17 @@ typedef struct {
     char port_down[8];			// downlink port 
     int  sock_up;				// up socket
     int  sock_down;				// down socket
+    pthread_mutex_t mx_sock;    /*!> socket reconnect against sending */
+    uint32_t sock_gen;          /*!> bumped under mx_sock when sock_up is reopened */
+    pthread_mutex_t mx_reject;  /*!> posted by any service thread, drained by the pull_down thread of this one */
+    uint16_t reject[SERV_REJECT_MAX];   /*!> tokens of its downlinks preempted by another service */
+    int  nb_reject;
     int  pull_interval;	        // send a PULL_DATA request every X seconds 
     struct timeval push_timeout_half;       /*!> time-out value (in ms) for upstream datagrams */
     struct timeval pull_timeout;
     mqttinfo_s *mqtt;
 } serv_net_s;
 
-LGW_LIST_HEAD(rxpkts_list, _rxpkts);     //定义一个数据链头，用来保存接收到的数据包         
-
 /*!>!
  * \brief server是一个描述什么样服务的数据结构
  * 
@@ -154,6 +189,7 @@ typedef struct _server {
         bool enabled;
         char name[32];              // identify of server
         char *key;			        // gateway key to connect to service
+        uint8_t dn_prio[JIT_PRIO_NB];   /*!> JiT priority of the downlinks of this service, by jit_priority_e class */
     } info;
 
     struct {
@@ -183,6 +219,13 @@ typedef struct _server {
         bool stop_sig;
     } thread;
 
+    struct {
+        bool attached;              /*!> service is a reader of GW.rxring */
+        uint32_t cursor;            /*!> sequence of the next batch to read */
+        uint32_t gp;                /*!> odd while get_rxpkt reads a slot, see rxpkts_ring_s */
+        uint32_t overrun;           /*!> batches lost because the ring lapped this reader */
+    } rxbus;
+
     serv_net_s* net;
 
     report_s* report;
@@ -193,10 +236,14 @@ typedef struct _server {
 
 LGW_LIST_HEAD_NOLOCK(serv_list, _server);  // pkts list head of rxpkts for server 
 
-typedef struct {
+typedef struct _serv_ct {
     int nb_pkt;
-    struct lgw_pkt_rx_s rxpkt[NB_PKT_MAX];
+    struct lgw_pkt_rx_s* rxpkt;     /*!> borrowed from batch, read-only, valid until release_rxpkt */
+    const mac_meta_s* rxmeta;       /*!> MAC header of each rxpkt, same lifetime */
+    struct timespec dequeue_time;   /*!> CLOCK_MONOTONIC, when get_rxpkt handed the batch out */
+    rxpkts_s* batch;
     serv_s* serv;
+    struct _serv_ct* next;          /*!> handed back to the thread which allocated it */
 } serv_ct_s;
 
 typedef struct _thread_info {
@@ -212,12 +259,6 @@ typedef struct _thread_info {
 
 LGW_LIST_HEAD(pthread_list, _thread_info);     //定义一个数据链头，用来控制线程数量         
 
-struct lbt_chan_stat {
-    uint32_t freq_hz;
-    uint32_t count_us;  // 时间
-    bool chan_is_free;
-};
-
 typedef struct {
     struct {
         char gateway_id[17];    /*!> string form of gateway mac address */
@@ -255,10 +296,16 @@ typedef struct {
         time_t   last_loop;               /*!> timestamp for watchdog */
         uint32_t time_interval;           /*!> time interval for send status(seconds) */
         uint8_t  fcnt_gap;
+        uint16_t jit_queue_size;          /*!> capacity of each JiT queue (packets) */
+        bool     jit_preemption;          /*!> higher priority downlinks may evict colliding lower priority ones */
+        uint16_t metrics_port;            /*!> loopback TCP port of the Prometheus endpoint (0 = disabled) */
+        uint32_t delay_quota_kb;          /*!> disk space of the delay journal */
+        uint16_t delay_replay_rate;       /*!> delayed packets replayed per second once online (0 = no limit) */
         char   time_diff[8];              /*!> time diff of UTC, UTC + diff = TZ */
         char   ghost_host[32];
         char   ghost_port[16];
-        char   delay_db_path[64];
+        uint16_t ghost_ring_size;         /*!> ghost packets buffered between the listener and thread_up */
+        char   delay_journal_dir[80];     /*!> directory of the delay journal, packets are kept in memory when empty */
         region_s   region;
         uint32_t autoquit_threshold;/*!> enable auto-quit after a number of non-acknowledged PULL_DATA (0 = disabled) */
     } cfg;
@@ -301,7 +348,7 @@ typedef struct {
         uint32_t lbt_tty_baude;         /*!> bauderate */
         uint32_t lbt_freq_hz;               
         uint16_t lbt_scan_time_ms;      /*!> scan time for LBT */
-        struct lbt_chan_stat lbt_stat[16];
+        uint8_t lbt_pipeline_depth;     /*!> AT+GETCHANSTAT commands in flight on the tty */
     } lbt;
 
     struct {
@@ -342,7 +389,7 @@ typedef struct {
     spectral_scan_t spectral_scan_params; //Spectral Scan
 #endif
 
-    struct rxpkts_list rxpkts_list;
+    rxpkts_ring_s rxring;
 
     struct serv_list serv_list;
 } gw_s;
@@ -361,8 +408,14 @@ typedef struct {
                               .cfg.td_enabled = false,                               \
                               .cfg.radiostream_enabled = true,                       \
                               .cfg.ghoststream_enabled = false,                      \
+                              .cfg.ghost_ring_size = GHST_RING_DEFAULT,              \
                               .cfg.delay_enabled = false,                            \
                               .cfg.fcnt_gap = 12,                                    \
+                              .cfg.jit_queue_size = JIT_QUEUE_MAX,                   \
+                              .cfg.jit_preemption = false,                           \
+                              .cfg.metrics_port = 0,                                 \
+                              .cfg.delay_quota_kb = 4096,                            \
+                              .cfg.delay_replay_rate = 50,                           \
                               .cfg.autoquit_threshold = 0,                           \
                               .cfg.mac_decode = false,                               \
                               .cfg.mac2file = false,                                 \
@@ -387,6 +440,7 @@ typedef struct {
                               .lbt.lbt_tty_baude = 9600,                             \
                               .lbt.lbt_rssi_target = -85,                            \
                               .lbt.lbt_scan_time_ms = 6,                             \
+                              .lbt.lbt_pipeline_depth = 1,                           \
                               .beacon.beacon_period    = 0,                          \
                               .beacon.beacon_freq_hz   = DEFAULT_BEACON_FREQ_HZ,     \
                               .beacon.beacon_freq_nb   = DEFAULT_BEACON_FREQ_NB,     \
@@ -404,7 +458,7 @@ typedef struct {
                               .log.nb_pkt_received_fsk   = 0,                        \
                               .log.mx_report = PTHREAD_MUTEX_INITIALIZER,            \
                               .serv_list = LGW_LIST_HEAD_NOLOCK_INIT_VALUE,          \
-                              .rxpkts_list = LGW_LIST_HEAD_INIT_VALUE,               \
+                              .rxring.head = 0,                                      \
                           }
 
 #define DECLARE_GW extern gw_s GW
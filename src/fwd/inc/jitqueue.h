@@ -21,14 +21,18 @@ License: Revised BSD License, see LICENSE.TXT file include in the project
 
 #include <stdint.h>     /*!> C99 types */
 #include <stdbool.h>    /*!> bool type */
+#include <pthread.h>    /*!> per-queue mutex */
 
 #include "loragw_hal.h"
 
 /*!> -------------------------------------------------------------------------- */
 /*!> --- PUBLIC CONSTANTS ----------------------------------------------------- */
 
-#define JIT_QUEUE_MAX           32  /*!> Maximum number of packets to be stored in JiT queue */
+#define JIT_QUEUE_MAX           32  /*!> Default number of packets to be stored in JiT queue */
+#define JIT_QUEUE_SIZE_MAX      1024 /*!> Upper bound of the configurable queue capacity */
 #define JIT_NUM_BEACON_IN_QUEUE 3   /*!> Number of beacons to be loaded in JiT queue at any time */
+#define JIT_DELAY_NONE          0xFFFFFFFF  /*!> jit_next_delay: nothing queued */
+#define JIT_PREEMPT_MAX         4   /*!> Maximum number of packets one enqueue may evict */
 
 /*!> -------------------------------------------------------------------------- */
 /*!> --- PUBLIC TYPES --------------------------------------------------------- */
@@ -40,6 +44,15 @@ enum jit_pkt_type_e {
     JIT_PKT_TYPE_BEACON
 };
 
+/*!> Default scheduling classes, from lowest to highest priority */
+enum jit_priority_e {
+    JIT_PRIO_CLASS_C,
+    JIT_PRIO_CLASS_B,
+    JIT_PRIO_CLASS_A,
+    JIT_PRIO_JOIN_ACCEPT,
+    JIT_PRIO_NB
+};
+
 enum jit_error_e {
     JIT_ERROR_OK,           /*!> Packet ok to be sent */
     JIT_ERROR_TOO_LATE,     /*!> Too late to send this packet */
@@ -54,10 +67,20 @@ enum jit_error_e {
     JIT_ERROR_INVALID       /*!> Packet is invalid */
 };
 
+/*!> Scheduling information attached to a downlink, handed back if it gets evicted */
+struct jit_meta_s {
+    uint8_t priority;               /*!> Higher value wins a collision when preemption is allowed */
+    bool preempt;                   /*!> May evict colliding packets of lower priority */
+    void *origin;                   /*!> Opaque to the queue, the service which requested the downlink */
+    uint16_t token;                 /*!> Opaque to the queue, the request token to NACK */
+    uint32_t id;                    /*!> Opaque to the queue, downlink ID of its LBT assessment (0: none) */
+};
+
 struct jit_node_s {
     /*!> API fields */
     struct lgw_pkt_tx_s pkt;        /*!> TX packet */
     enum jit_pkt_type_e pkt_type;   /*!> Packet type: Downlink, Beacon... */
+    struct jit_meta_s meta;         /*!> Priority and origin of the packet */
 
     /*!> Internal fields */
     uint32_t pre_delay;             /*!> Amount of time before packet timestamp to be reserved */
@@ -65,9 +88,13 @@ struct jit_node_s {
 };
 
 struct jit_queue_s {
-    uint8_t num_pkt;                /*!> Total number of packets in the queue (downlinks, beacons...) */
+    pthread_mutex_t mx_queue;       /*!> Protects every field below */
+    uint16_t capacity;              /*!> Number of nodes allocated */
+    uint16_t num_pkt;               /*!> Total number of packets in the queue (downlinks, beacons...) */
     uint8_t num_beacon;             /*!> Number of beacons in the queue */
-    struct jit_node_s nodes[JIT_QUEUE_MAX]; /*!> Nodes/packets array in the queue */
+    uint32_t max_pre_delay;         /*!> Largest pre_delay queued, bounds the collision scan */
+    uint32_t max_post_delay;        /*!> Largest post_delay queued, bounds the collision scan */
+    struct jit_node_s *nodes;       /*!> Nodes/packets sorted by count_us (roll-over aware), earliest first */
 };
 
 /*!> -------------------------------------------------------------------------- */
@@ -93,10 +120,11 @@ bool jit_queue_is_empty(struct jit_queue_s *queue);
 @brief Initialize a Just in Time queue.
 
 @param queue[in] Just in Time queue to be initialized. Memory should have been allocated already.
+@param capacity[in] Number of packets the queue can hold, 0 for JIT_QUEUE_MAX.
 
-This function is used to reset every elements in the allocated queue.
+This function is used to reset every elements in the queue and allocate its nodes.
 */
-void jit_queue_init(struct jit_queue_s *queue);
+void jit_queue_init(struct jit_queue_s *queue, uint16_t capacity);
 
 /*!>*
 @brief Add a packet in a Just-in-Time queue
@@ -113,6 +141,34 @@ sent over the air. So all checks should happen before the packet being actually
 */
 enum jit_error_e jit_enqueue(struct jit_queue_s *queue, uint32_t time_us, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e pkt_type);
 
+/*!>*
+@brief Add a packet in a Just-in-Time queue, evicting lower priority packets if allowed
+
+@param queue[in/out] Just in Time queue in which the packet should be inserted
+@param time_us[in] Current concentrator time
+@param packet[in] Packet to be queued in JiT queue
+@param pkt_type[in] Type of packet to be queued: Downlink, Beacon
+@param meta[in] Priority and origin of the packet, NULL for the default priority without preemption
+@param evicted[out] Packets evicted and not rescheduled, room for JIT_PREEMPT_MAX nodes (can be NULL if meta is)
+@param nb_evicted[out] Number of packets returned in evicted (can be NULL if meta is)
+@return success if the function was able to queue the packet
+
+When the packet collides only with downlinks of strictly lower priority which are not about to be
+programmed, and at most JIT_PREEMPT_MAX of them, those are removed to make room. Evicted class C
+downlinks are moved to the next free gap when there is one, the others are returned to the caller
+which has to reject them towards their origin.
+*/
+enum jit_error_e jit_enqueue_prio(struct jit_queue_s *queue, uint32_t time_us, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e pkt_type, const struct jit_meta_s *meta, struct jit_node_s *evicted, int *nb_evicted);
+
+/*!>*
+@brief Default scheduling class of a packet
+
+@param pkt_type[in] Type of packet: Downlink, Beacon
+@param packet[in] Packet, its MAC header tells join-accepts apart
+@return scheduling class, JIT_PRIO_CLASS_C for beacons (they never preempt nor get evicted)
+*/
+enum jit_priority_e jit_priority_class(enum jit_pkt_type_e pkt_type, const struct lgw_pkt_tx_s *packet);
+
 /*!>*
 @brief Dequeue a packet from a Just-in-Time queue
 
@@ -120,12 +176,13 @@ enum jit_error_e jit_enqueue(struct jit_queue_s *queue, uint32_t time_us, struct
 @param index[in] in the queue where to get the packet to be removed
 @param packet[out] that was at index
 @param pkt_type[out] Type of packet dequeued: Downlink, Beacon
+@param meta[out] Priority and origin given at enqueue, zeroed for packets queued without (can be NULL)
 @return success if the function was able to dequeue the packet
 
 This function is typically used when a packet is about to be placed on concentrator buffer for TX.
 The index is generally got using the jit_peek function.
 */
-enum jit_error_e jit_dequeue(struct jit_queue_s *queue, int index, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e *pkt_type);
+enum jit_error_e jit_dequeue(struct jit_queue_s *queue, int index, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e *pkt_type, struct jit_meta_s *meta);
 
 /*!>*
 @brief Check if there is a packet soon to be sent from the JiT queue.
@@ -136,11 +193,35 @@ enum jit_error_e jit_dequeue(struct jit_queue_s *queue, int index, struct lgw_pk
 @return success if the function was able to parse the queue. pkt_idx is set to -1 if no packet found.
 
 This function is typically used to check in JiT queue if there is a packet soon to be sent.
-It search the packet with the highest priority in queue, and check if its timestamp is near
-enough the current concentrator time.
+The queue is kept sorted, so only its head is checked against the current concentrator time,
+after outdated packets have been dropped from it.
 */
 enum jit_error_e jit_peek(struct jit_queue_s *queue, uint32_t time_us, int *pkt_idx);
 
+/*!>*
+@brief Time left before jit_peek will hand out a packet of the queue.
+
+@param queue[in] Just in Time queue to parse
+@param time_us[in] Current concentrator time
+@return delay in microseconds, 0 if a packet is already due, JIT_DELAY_NONE if the queue is empty.
+*/
+uint32_t jit_next_delay(struct jit_queue_s *queue, uint32_t time_us);
+
+/*!>*
+@brief Current enqueue sequence number, to be passed to jit_wait.
+
+Read it before parsing the queues so that a packet enqueued meanwhile is not slept over.
+*/
+uint32_t jit_queue_seq(void);
+
+/*!>*
+@brief Block until a packet is enqueued in any JiT queue or the timeout expires.
+
+@param seq[in] Sequence number returned by jit_queue_seq before the queues were parsed
+@param timeout_us[in] Maximum time to wait in microseconds
+*/
+void jit_wait(uint32_t seq, uint32_t timeout_us);
+
 /*!>*
 @brief Debug function to print the queue's content on console
 
@@ -0,0 +1,127 @@
+/*
+ *  ____  ____      _    ____ ___ _   _  ___
+ *  |  _ \|  _ \    / \  / ___|_ _| \ | |/ _ \
+ *  | | | | |_) |  / _ \| |  _ | ||  \| | | | |
+ *  | |_| |  _ <  / ___ \ |_| || || |\  | |_| |
+ *  |____/|_| \_\/_/   \_\____|___|_| \_|\___/
+ *
+ * Dragino_gw_fwd -- An opensource lora gateway forward
+ *
+ * See http://www.dragino.com for more information about
+ * the lora gateway project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ *
+ * Maintainer: skerlan
+ *
+ */
+
+/*!
+ * \file
+ * \brief append-only journal of mmap'd segment files
+ *
+ * A journal is a directory of fixed size segment files named after their
+ * sequence number (0000002a.seg), each one a header followed by records.
+ * A record is its length, the CRC32 of its bytes and the bytes, padded to
+ * 4.  Records are only appended to the newest segment, a torn record fails
+ * its CRC and ends its segment.  The read position is kept in the cursor
+ * file, segments behind it are removed; when the quota is reached the
+ * oldest segment is dropped, read or not.
+ *
+ * One writer and one reader at most, the caller serializes them.
+ */
+
+#ifndef _LORA_PKTFWD_JOURNAL_H
+#define _LORA_PKTFWD_JOURNAL_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>     /* C99 types */
+#include <stdbool.h>    /* bool type */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC CONSTANTS ----------------------------------------------------- */
+
+#define JOURNAL_MAGIC           0x4C4E4A44  /*!> "DJNL" */
+#define JOURNAL_VERSION         1
+#define JOURNAL_REC_MAGIC       0xD5A7
+#define JOURNAL_SEG_SIZE        (256 * 1024)
+#define JOURNAL_REC_MAX         1024        /*!> bytes of one record */
+#define JOURNAL_PATH_MAX        128
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC TYPES --------------------------------------------------------- */
+
+struct journal_seg_hdr_s {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t hdr_size;                      /*!> sizeof(struct journal_seg_hdr_s), records start there */
+    uint32_t seg_size;
+    uint32_t seq;                           /*!> the one in the file name */
+    uint32_t tag;                           /*!> record format of the owner, segments of another one are removed */
+    uint8_t reserved[44];
+};
+
+struct journal_rec_hdr_s {
+    uint16_t magic;                         /*!> JOURNAL_REC_MAGIC, 0 past the last record */
+    uint16_t len;                           /*!> bytes following, padding excluded */
+    uint32_t crc;                           /*!> CRC32 of len and the bytes */
+};
+
+struct journal_s {
+    char dir[JOURNAL_PATH_MAX];
+    uint32_t tag;
+    uint32_t max_segs;                      /*!> quota in segments, at least 2 */
+    uint32_t first;                         /*!> oldest segment still on disk */
+    uint32_t wseq;                          /*!> segment appended to */
+    uint32_t woff;                          /*!> where the next record goes */
+    uint32_t wsync;                         /*!> records before this offset were flushed */
+    uint8_t *wmap;
+    uint32_t rseq;                          /*!> segment of the next record to read */
+    uint32_t roff;
+    uint8_t *rmap;                          /*!> read-only mapping of rseq, NULL until needed */
+    int cfd;                                /*!> cursor file */
+    uint32_t nb_pending;                    /*!> records appended and not read yet */
+    uint32_t nb_dropped;                    /*!> unread records lost to the quota since open */
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/*!
+ * \brief Open or create the journal in dir, recovering the records and the cursor left there
+ * \param quota bytes of segment files on disk
+ * \param tag record format, segments written with another tag are removed
+ * \return 0 on success, -1 with errno set
+ */
+int journal_open(struct journal_s *j, const char *dir, uint64_t quota, uint32_t tag);
+
+void journal_close(struct journal_s *j);
+
+/*!
+ * \brief Append a record of len bytes, 0 < len <= JOURNAL_REC_MAX
+ * \return 0 on success, -1 with errno set
+ */
+int journal_append(struct journal_s *j, const void *data, uint16_t len);
+
+/*!
+ * \brief Copy the next record to buf, records longer than max are skipped
+ * \return record length, 0 when every record was read
+ */
+int journal_read(struct journal_s *j, void *buf, uint16_t max);
+
+/*!
+ * \brief Store the read position and remove the segments read
+ */
+void journal_commit(struct journal_s *j);
+
+/*!
+ * \brief Write the records appended since the last sync and the cursor to disk
+ */
+void journal_sync(struct journal_s *j);
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ *  ____  ____      _    ____ ___ _   _  ___
+ *  |  _ \|  _ \    / \  / ___|_ _| \ | |/ _ \
+ *  | | | | |_) |  / _ \| |  _ | ||  \| | | | |
+ *  | |_| |  _ <  / ___ \ |_| || || |\  | |_| |
+ *  |____/|_| \_\/_/   \_\____|___|_| \_|\___/
+ *
+ * Dragino_gw_fwd -- An opensource lora gateway forward
+ *
+ * See http://www.dragino.com for more information about
+ * the lora gateway project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ *
+ * Maintainer: skerlan
+ *
+ */
+
+/*!
+ * \file
+ * \brief append-only JSON writer used to serialize rxpk objects
+ *
+ * Every append checks the room left and sets a sticky error flag instead of
+ * writing past the end, so a caller only checks once per object and rolls
+ * back to the position it saved with jsonw_reset.
+ */
+
+#ifndef _LORA_PKTFWD_JSONW_H
+#define _LORA_PKTFWD_JSONW_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>				/* C99 types */
+#include <stdbool.h>			/* bool type */
+#include <time.h>				/* timespec */
+
+#include "loragw_hal.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC TYPES --------------------------------------------------------- */
+
+typedef struct {
+    char* buf;
+    int len;                    /* bytes written so far */
+    int size;                   /* capacity of buf, one byte is kept for the terminator */
+    bool err;                   /* an append did not fit, sticky until jsonw_reset */
+} jsonw_s;
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/*!
+ * \brief start writing at buf + len
+ */
+void jsonw_init(jsonw_s* w, void* buf, int size, int len);
+
+/*!
+ * \brief rewind to a position saved from w->len and clear the error flag
+ */
+void jsonw_reset(jsonw_s* w, int len);
+
+void jsonw_raw(jsonw_s* w, const char* s, int n);
+
+/*!
+ * \brief append a string literal, its length is known at compile time
+ */
+#define jsonw_lit(w, s)     jsonw_raw((w), (s), sizeof(s) - 1)
+
+void jsonw_char(jsonw_s* w, char c);
+
+void jsonw_uint(jsonw_s* w, uint32_t v);
+
+void jsonw_int(jsonw_s* w, int32_t v);
+
+/*!
+ * \brief append v as 8 upper case hex digits, no quotes
+ */
+void jsonw_hex32(jsonw_s* w, uint32_t v);
+
+/*!
+ * \brief append v / 10^decimals with exactly that many decimals, eg. (868100000, 6) -> 868.100000
+ */
+void jsonw_fixed(jsonw_s* w, int64_t v, int decimals);
+
+/*!
+ * \brief append a float rounded to one decimal, same output as "%.1f"
+ */
+void jsonw_float1(jsonw_s* w, float v);
+
+/*!
+ * \brief append data base64 encoded (with padding), no quotes
+ */
+void jsonw_b64(jsonw_s* w, const uint8_t* data, int size);
+
+/*!
+ * \brief append a quoted ISO 8601 UTC time with microseconds, "2021-01-31T08:00:00.000000Z"
+ *
+ * The calendar part is cached per thread, gmtime only runs when the day changes.
+ */
+void jsonw_utc(jsonw_s* w, const struct timespec* t);
+
+/*!
+ * \brief append the ,"stat",,"modu",,"datr",,"codr" members of an rxpk
+ * \retval 0 on success, -1 when status, modulation, datarate, bandwidth or coderate is unknown
+ *
+ * Nothing is appended on failure.
+ */
+int jsonw_rxpk_modu(jsonw_s* w, const struct lgw_pkt_rx_s* p);
+
+#endif							/* _LORA_PKTFWD_JSONW_H */
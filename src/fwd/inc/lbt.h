@@ -0,0 +1,75 @@
+/*
+ *  ____  ____      _    ____ ___ _   _  ___
+ *  |  _ \|  _ \    / \  / ___|_ _| \ | |/ _ \
+ *  | | | | |_) |  / _ \| |  _ | ||  \| | | | |
+ *  | |_| |  _ <  / ___ \ |_| || || |\  | |_| |
+ *  |____/|_| \_\/_/   \_\____|___|_| \_|\___/
+ *
+ * Dragino_gw_fwd -- An opensource lora gateway forward
+ *
+ * See http://www.dragino.com for more information about
+ * the lora gateway project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ *
+ * Maintainer: skerlan
+ *
+ */
+
+/*!
+ * \file
+ * \brief listen before talk through an external module on a tty
+ */
+
+#ifndef _LORA_PKTFWD_LBT_H
+#define _LORA_PKTFWD_LBT_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>     /* C99 types */
+#include <stdbool.h>    /* bool type */
+
+#include "jitqueue.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC CONSTANTS ----------------------------------------------------- */
+
+#define LBT_SCAN_LEAD_MAX_US    120000  /*!> a channel is assessed at most this long before its TX */
+#define LBT_SCAN_LEAD_MIN_US    40000   /*!> and at least this long, the result has to be back before JiT programs the TX */
+#define LBT_PIPELINE_MAX        8       /*!> upper bound of the commands in flight on the tty */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/*!
+ * \brief Request the assessment of a downlink channel
+ * \param packet downlink, its frequency is assessed shortly before its count_us
+ * \param time_us current concentrator time
+ * \param id [out] downlink ID to give back to lbt_chan_is_free, never 0
+ * \return JIT_ERROR_OK, JIT_ERROR_FULL when NB_LBT_QUEUE requests are pending
+ */
+enum jit_error_e lbt_enqueue(const struct lgw_pkt_tx_s *packet, uint32_t time_us, uint32_t *id);
+
+/*!
+ * \brief Drop a request whose downlink did not make it into the JiT queue
+ */
+void lbt_cancel(uint32_t id);
+
+/*!
+ * \brief Result of the assessment of a downlink, the request is released
+ * \param id downlink ID returned by lbt_enqueue, 0 when there is none
+ * \param count_us TX time of the downlink, it may have been moved since
+ * \return true only when the channel was assessed free for this TX time
+ */
+bool lbt_chan_is_free(uint32_t id, uint32_t count_us);
+
+/*!
+ * \brief LBT engine: drives the tty from an epoll loop until exit_sig or quit_sig
+ */
+void thread_lbt(void);
+
+#endif
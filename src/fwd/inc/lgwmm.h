@@ -33,7 +33,9 @@ extern "C" {
 #ifndef _LGW_MM_H
 #define _LGW_MM_H
 
-#include <stdarg.h> 
+#include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
 /* IWYU pragma: private, include "fwd.h" */
 
 void *lgw_std_malloc(size_t size) attribute_malloc;
@@ -153,6 +155,77 @@ int __lgw_vasprintf(char **strp, const char *format, va_list ap, const char *fil
 #define lgw_vasprintf(ret, fmt, ap) \
 	__lgw_vasprintf((ret), (fmt), (ap), __FILE__, __LINE__, __PRETTY_FUNCTION__)
 
+/*!
+ * \brief fixed size object pool
+ *
+ * Objects are carved from chunks of chunk_objs objects, chunks are never given
+ * back to malloc: a pool costs its high-water mark.  Every thread keeps a few
+ * free objects of each pool it uses, the pool lock is only taken to move a
+ * batch of them from or to the shared free list, so a producer thread and a
+ * consumer thread pass objects to each other a batch at a time.
+ *
+ * Build with -DLGW_MM_DEBUG to poison freed objects and check the poison
+ * when they are handed out again.
+ */
+typedef struct lgw_slab_s {
+    const char *name;
+    size_t size;                /*!> object size, rounded up to pointers */
+    unsigned chunk_objs;        /*!> objects per chunk */
+    unsigned cache_batch;       /*!> objects moved at once to or from a thread cache, a thread keeps
+                                     2 * cache_batch - 1 idle at most; 0 for the default of 8 */
+    pthread_mutex_t mx_slab;    /*!> protects free_list, nb_free, nb_total and next */
+    void *free_list;            /*!> objects in no thread cache */
+    uint32_t nb_free;
+    uint32_t nb_total;          /*!> objects carved, free or not */
+    uint32_t nb_used;           /*!> handed out and not freed yet */
+    uint32_t nb_used_max;
+    struct lgw_slab_s *next;    /*!> list of the pools in use, for the statistics */
+} lgw_slab_s;
+
+#define LGW_SLAB_ALIGN(size)    (((size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+#define LGW_SLAB_INIT(pool_name, obj_size, objs)                    \
+    LGW_SLAB_INIT_CACHE(pool_name, obj_size, objs, 0)
+
+/*!> for large objects: fewer of them left idle in each thread cache */
+#define LGW_SLAB_INIT_CACHE(pool_name, obj_size, objs, batch) {     \
+    .name = (pool_name),                                            \
+    .size = LGW_SLAB_ALIGN(obj_size),                               \
+    .chunk_objs = (objs),                                           \
+    .cache_batch = (batch),                                         \
+    .mx_slab = PTHREAD_MUTEX_INITIALIZER,                           \
+}
+
+typedef struct {
+    const char *name;
+    size_t size;
+    uint32_t nb_total;
+    uint32_t nb_used;
+    uint32_t nb_used_max;
+} lgw_slab_stat_s;
+
+/*!
+ * \brief Take an object from pool, its content is undefined
+ * \retval NULL only when a new chunk could not be allocated
+ */
+void *lgw_slab_alloc(lgw_slab_s *pool);
+
+/*!
+ * \brief Take an object from pool, zero filled
+ */
+void *lgw_slab_zalloc(lgw_slab_s *pool);
+
+/*!
+ * \brief Give an object back to the pool it came from, NULL is ignored
+ */
+void lgw_slab_free(lgw_slab_s *pool, void *obj);
+
+/*!
+ * \brief Occupancy of the pools which carved at least one chunk
+ * \return number of entries written to stat, at most max
+ */
+int lgw_slab_stats(lgw_slab_stat_s *stat, int max);
+
 /*!
   \brief call __builtin_alloca to ensure we get gcc builtin semantics
   \param size The size of the buffer we want allocated
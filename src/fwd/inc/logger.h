@@ -63,8 +63,41 @@
 #define STORAGEMSG   "[STORAGE]"
 #endif
 
+/*!> categories compiled in, eg. -DLOG_BUILD_MASK=0x4D keeps INFO, WARNING, ERROR and JIT_ERROR:
+ *   the other lgw_log calls and the evaluation of their arguments are removed at build time */
+#ifndef LOG_BUILD_MASK
+#define LOG_BUILD_MASK  0xFFFF
+#endif
+
 #define MSG(args...) printf(args)
 
-void lgw_log(int FLAG, const char *format, ...);
+#define lgw_log(FLAG, ...)                          \
+    do {                                            \
+        if ((FLAG) & LOG_BUILD_MASK)                \
+            lgw_log_msg((FLAG), __VA_ARGS__);       \
+    } while (0)
+
+/*!
+ * \brief queue a message for the logger thread if GW.log.debug_mask enables FLAG
+ *
+ * Only the format pointer and the arguments are stored, the format must be a
+ * string literal (or outlive the call), %s arguments are copied.
+ */
+void lgw_log_msg(int FLAG, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/*!
+ * \brief start the logger thread, messages are printed synchronously until then
+ */
+int lgw_log_start(void);
+
+/*!
+ * \brief stop the logger thread and write what is left, logging is synchronous again
+ */
+void lgw_log_stop(void);
+
+/*!
+ * \brief write every queued message now
+ */
+void lgw_log_flush(void);
   
 #endif /* _LGW_LOGGER_H */
@@ -9,6 +9,8 @@
 #ifndef __LORAMAC_CRYPTO_H__
 #define __LORAMAC_CRYPTO_H__
 
+#include "aes.h"
+
 /*!
  * Computes the LoRaMAC frame MIC field
  *
@@ -48,6 +50,29 @@ void LoRaMacPayloadEncrypt( const uint8_t *buffer, uint16_t size, const uint8_t
  */
 void LoRaMacPayloadDecrypt( const uint8_t *buffer, uint16_t size, const uint8_t *key, uint32_t address, uint8_t dir, uint32_t sequenceCounter, uint8_t *decBuffer );
 
+/*!
+ * Expands a session key once, for the *Keyed functions below
+ *
+ * \param [IN]  key             - AES key to be used
+ * \param [OUT] ctx             - Expanded key schedule
+ */
+void LoRaMacKeySchedule( const uint8_t *key, aes_context *ctx );
+
+/*!
+ * LoRaMacComputeMic with an already expanded key
+ */
+void LoRaMacComputeMicKeyed( const uint8_t *buffer, uint16_t size, const aes_context *key, uint32_t address, uint8_t dir, uint32_t sequenceCounter, uint32_t *mic );
+
+/*!
+ * LoRaMacPayloadEncrypt with an already expanded key
+ */
+void LoRaMacPayloadEncryptKeyed( const uint8_t *buffer, uint16_t size, const aes_context *key, uint32_t address, uint8_t dir, uint32_t sequenceCounter, uint8_t *encBuffer );
+
+/*!
+ * LoRaMacPayloadDecrypt with an already expanded key
+ */
+void LoRaMacPayloadDecryptKeyed( const uint8_t *buffer, uint16_t size, const aes_context *key, uint32_t address, uint8_t dir, uint32_t sequenceCounter, uint8_t *decBuffer );
+
 /*!
  * Computes the LoRaMAC Join Request frame MIC field
  *
@@ -8,6 +8,9 @@
 #define __LORAMAC_HEADER_DECODE_H__
 
 #include <stdint.h>
+#include <stdbool.h>
+
+#include "aes.h"
 
 /*! Frame header (FHDR) maximum field size */
 #define LORAMAC_FHDR_MAX_FIELD_SIZE             22
@@ -37,6 +40,10 @@ typedef struct {
     char devaddr_str[17];
     char appskey_str[33];
     char nwkskey_str[33];
+    aes_context appskey_ctx;    /*!> appskey expanded once, see LoRaMacKeySchedule */
+    aes_context nwkskey_ctx;
+    uint32_t fcntup;            /*!> last confirmed 32 bits uplink counter */
+    bool fcntup_valid;
 } devinfo_s;
 
 /*!
@@ -370,8 +377,36 @@ typedef enum eLoRaMacParserStatus
     LORAMAC_PARSER_ERROR,
 }LoRaMacParserStatus_t;
 
+/*!
+ * \brief MAC header of a received frame, parsed once by thread_up for all the services
+ */
+typedef struct {
+    bool valid;                 /*!> LoRaMacParserData would accept the frame, nothing below is set otherwise */
+    uint8_t mtype;              /*!> FRAME_TYPE_xxx */
+    uint8_t fctrl;
+    uint8_t fopts_len;
+    uint8_t fport;              /*!> 0 when the frame has no FPort */
+    uint8_t frm_size;           /*!> FRMPayload size, it starts right after FPort */
+    uint16_t fcnt;
+    uint32_t devaddr;           /*!> data frames */
+    uint32_t mic;
+    uint64_t deveui;            /*!> join request */
+    uint64_t joineui;
+} mac_meta_s;
+
 LoRaMacParserStatus_t LoRaMacParserData( LoRaMacMessageData_t* macMsg );
 
+/*!
+ * \brief parse the MAC header of an uplink into meta
+ */
+void mac_meta_parse(mac_meta_s* meta, const uint8_t* payload, uint16_t size);
+
+/*!
+ * \brief fill macMsg over payload from meta, as LoRaMacParserData would have left it
+ * \retval false meta is not valid, macMsg->BufSize is 0
+ */
+bool mac_meta_msg(const mac_meta_s* meta, uint8_t* payload, uint16_t size, LoRaMacMessageData_t* macMsg);
+
 void decode_mac_pkt_up(LoRaMacMessageData_t* macMsg, void* pkt);
 void decode_mac_pkt_down(LoRaMacMessageData_t* macMsg, void* pkt);
 
@@ -0,0 +1,82 @@
+/*
+ *  ____  ____      _    ____ ___ _   _  ___
+ *  |  _ \|  _ \    / \  / ___|_ _| \ | |/ _ \
+ *  | | | | |_) |  / _ \| |  _ | ||  \| | | | |
+ *  | |_| |  _ <  / ___ \ |_| || || |\  | |_| |
+ *  |____/|_| \_\/_/   \_\____|___|_| \_|\___/
+ *
+ * Dragino_gw_fwd -- An opensource lora gateway forward
+ *
+ * See http://www.dragino.com for more information about
+ * the lora gateway project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ *
+ * Maintainer: skerlan
+ *
+ */
+
+/*!
+ * \file
+ * \brief latency histograms and their Prometheus endpoint
+ *
+ * Latencies are counted in microseconds, in log buckets: 4 buckets per
+ * power of two, so a bucket is at most 25% wide.  Recording is a couple of
+ * relaxed atomic adds, no lock, no allocation, any thread may record.
+ */
+
+#ifndef _LORA_PKTFWD_METRICS_H
+#define _LORA_PKTFWD_METRICS_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>     /* C99 types */
+#include <stdbool.h>    /* bool type */
+#include <time.h>       /* timespec */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC CONSTANTS ----------------------------------------------------- */
+
+#define METRICS_SUB_BITS        2       /*!> log2 of the buckets per power of two */
+#define METRICS_NB_BUCKET       ((32 - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC TYPES --------------------------------------------------------- */
+
+typedef enum {
+    METRICS_RX_DEQUEUE,     /*!> concentrator timestamp of an uplink to its dequeue by a service */
+    METRICS_DEQUEUE_SEND,   /*!> dequeue of a batch to the send of its PUSH_DATA */
+    METRICS_PUSH_ACK,       /*!> PUSH_DATA to PUSH_ACK */
+    METRICS_PULL_ACK,       /*!> PULL_DATA to PULL_ACK */
+    METRICS_JIT_LEAD,       /*!> time left before the TX when a downlink is enqueued */
+    METRICS_LGW_SEND,       /*!> duration of lgw_send */
+    METRICS_NB_HIST
+} metrics_hist_e;
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/*!
+ * \brief Count one latency
+ * \param us latency in microseconds
+ */
+void metrics_observe(metrics_hist_e h, uint32_t us);
+
+/*!
+ * \brief Count the latency between two CLOCK_MONOTONIC readings, ignored when end is before start
+ */
+void metrics_observe_ts(metrics_hist_e h, const struct timespec *start, const struct timespec *end);
+
+/*!
+ * \brief Serve the histograms and the service counters as Prometheus text
+ *
+ * Listens on 127.0.0.1:GW.cfg.metrics_port, answers every connection with
+ * the current values whatever it asked, until exit_sig or quit_sig.
+ */
+void thread_metrics(void);
+
+#endif
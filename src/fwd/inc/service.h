@@ -62,12 +62,23 @@ int init_sock(const char* addr, const char* port, const void* timeout, int size)
 typedef struct FilterParams {
     uint32_t fport;
     uint32_t addr;
-    char deveui[32];
-    char joineui[32];
+    bool has_eui;           /*!> join request, deveui and joineui are set */
+    uint64_t deveui;
+    uint64_t joineui;
 } FilterParams_t;
 
 bool pkt_basic_filter(serv_s* serv, FilterParams_t *FP);
 
+/*!
+ * \brief true when serv has any of the filters of pkt_basic_filter enabled
+ */
+bool pkt_filter_enabled(serv_s* serv);
+
+/*!
+ * \brief filter parameters of a parsed uplink
+ */
+void pkt_filter_params(FilterParams_t *FP, const mac_meta_s *meta);
+
 /*!
  */
 int parse_cfg(const char* cfgfile);
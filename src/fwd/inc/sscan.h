@@ -0,0 +1,134 @@
+/*
+ *  ____  ____      _    ____ ___ _   _  ___
+ *  |  _ \|  _ \    / \  / ___|_ _| \ | |/ _ \
+ *  | | | | |_) |  / _ \| |  _ | ||  \| | | | |
+ *  | |_| |  _ <  / ___ \ |_| || || |\  | |_| |
+ *  |____/|_| \_\/_/   \_\____|___|_| \_|\___/
+ *
+ * Dragino_gw_fwd -- An opensource lora gateway forward
+ *
+ * See http://www.dragino.com for more information about
+ * the lora gateway project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ *
+ * Maintainer: skerlan
+ *
+ */
+
+/*!
+ * \file
+ * \brief spectral scan results: mmap'd ring file and UDP export
+ *
+ * The file is a header followed by capacity fixed size records, record n
+ * (counted since the file was created) lives in slot n % capacity.  The
+ * forwarder is the only writer, any number of processes may map the file
+ * read-only and follow it with sscan_ring_read.
+ */
+
+#ifndef _LORA_PKTFWD_SSCAN_H
+#define _LORA_PKTFWD_SSCAN_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>     /* C99 types */
+#include <stdbool.h>    /* bool type */
+#include <time.h>       /* timespec */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC CONSTANTS ----------------------------------------------------- */
+
+#define SSCAN_MAGIC             0x4E435353  /*!> "SSCN" */
+#define SSCAN_VERSION           2
+#define SSCAN_NB_BINS           33          /*!> LGW_SPECTRAL_SCAN_RESULT_SIZE */
+#define SSCAN_RING_DEFAULT      4096        /*!> records, about 400kB */
+#define SSCAN_RING_PATH         "/tmp/sscan.ring"
+#define SSCAN_SEQ_BUSY          UINT32_MAX  /*!> record being written, never a record number */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC TYPES --------------------------------------------------------- */
+
+struct sscan_hdr_s {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_size;                      /*!> sizeof(struct sscan_rec_s) */
+    uint32_t capacity;                      /*!> records in the file */
+    uint32_t nb_bins;
+    uint32_t head;                          /*!> records written so far modulo 2^32, the next one goes to slot head % capacity */
+    int16_t levels_dbm[SSCAN_NB_BINS];      /*!> lower bound of each bin, the same for every record */
+    uint8_t reserved[128 - 20 - 2 * SSCAN_NB_BINS];
+};
+
+struct sscan_rec_s {
+    uint32_t seq;                           /*!> record number, SSCAN_SEQ_BUSY while it is rewritten */
+    uint32_t sweep;                         /*!> records of one pass over the band share it */
+    uint64_t time_ns;                       /*!> UTC end of the scan */
+    uint32_t freq_hz;                       /*!> center of the 200kHz channel */
+    uint16_t nb_scan;                       /*!> scan points, the sum of results */
+    uint16_t duration_ms;                   /*!> from start to completion */
+    uint16_t results[SSCAN_NB_BINS];        /*!> scan points per level bin */
+};
+
+struct sscan_ring_s {
+    int fd;
+    bool writer;
+    size_t size;
+    struct sscan_hdr_s *hdr;
+    struct sscan_rec_s *recs;
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/*!
+ * \brief Map the ring file for writing, the records of a file of the same geometry are kept
+ * \return 0 on success, -1 with errno set
+ */
+int sscan_ring_create(struct sscan_ring_s *ring, const char *path, uint32_t capacity);
+
+/*!
+ * \brief Map an existing ring file read-only
+ * \return 0 on success, -1 with errno set (EPROTO: not a ring file of this version)
+ */
+int sscan_ring_attach(struct sscan_ring_s *ring, const char *path);
+
+void sscan_ring_close(struct sscan_ring_s *ring);
+
+/*!
+ * \brief Store the bin levels, they only change with the sx1261 rssi offset
+ */
+void sscan_ring_set_levels(struct sscan_ring_s *ring, const int16_t *levels_dbm);
+
+/*!
+ * \brief Append a record, its seq field is set here
+ */
+void sscan_ring_append(struct sscan_ring_s *ring, struct sscan_rec_s *rec);
+
+/*!
+ * \brief Number of records written so far modulo 2^32, the next record to come is this one
+ */
+uint32_t sscan_ring_head(const struct sscan_ring_s *ring);
+
+/*!
+ * \brief Copy record seq
+ * \return 0 on success, -1 when it is not written yet or was overwritten meanwhile
+ */
+int sscan_ring_read(const struct sscan_ring_s *ring, uint32_t seq, struct sscan_rec_s *rec);
+
+/*!
+ * \brief Connected UDP socket to send records to
+ * \return socket, -1 on failure
+ */
+int sscan_export_open(const char *host, const char *port);
+
+/*!
+ * \brief Send a record as a JSON datagram, {"sscan":{"time":..,"freq":..,"levels":[..],"results":[..]}}
+ * \return 0 on success, -1 on failure
+ */
+int sscan_export_send(int sock, const struct sscan_rec_s *rec, const int16_t *levels_dbm);
+
+#endif
@@ -37,6 +37,7 @@
 // Definitions
 //
 #define STATUS_SIZE     300
+#define STAT_CACHE_LINE 64
 
 typedef enum {
 	TX_OK,
@@ -87,20 +88,55 @@ typedef struct {
     uint32_t meas_up_ack_rcv;
 } stat_up_s;
 
+/*!
+ * \brief counters of a service, all uint32_t: the reporter sums them as an array
+ */
+typedef struct {
+    stat_up_s   stat_up;
+    stat_dw_s stat_down;
+    uint32_t meas_nb_beacon_queued;
+    uint32_t meas_nb_beacon_sent;
+    uint32_t meas_nb_beacon_rejected;
+} stat_cnt_s;
+
+/*!
+ * \brief writer of a counter block, one block per service thread
+ */
+typedef enum {
+    STAT_BLK_UP,        /*!> push_up */
+    STAT_BLK_ACK,       /*!> push_ack */
+    STAT_BLK_DOWN,      /*!> pull_down and the tx acks it sends */
+    STAT_NB_BLK
+} stat_blk_e;
+
+/*!
+ * \brief counters only grow, the reporter reports the difference with the last sums
+ *
+ * Writers add with relaxed atomics to the block of their thread, which
+ * sits on its own cache line, and never wait for the reporter.
+ */
+typedef struct {
+    stat_cnt_s cnt;
+} __attribute__((aligned(STAT_CACHE_LINE))) stat_blk_s;
+
+#define STAT_ADD(report, blk, field, n)     __atomic_fetch_add(&(report)->blk_cnt[(blk)].cnt.field, (n), __ATOMIC_RELAXED)
+
 typedef struct {
     bool statusstream;
     bool report_ready;
     char stat_format[16];               // format for json statistics
     char status_report[STATUS_SIZE];
     uint16_t stat_interval; 	     // time interval (in sec) at which statistics are collected and displayed
-    uint32_t meas_nb_beacon_queued;
-    uint32_t meas_nb_beacon_sent;
-    uint32_t meas_nb_beacon_rejected;
-    stat_up_s   stat_up;
-    stat_dw_s stat_down;
+    stat_blk_s blk_cnt[STAT_NB_BLK];
+    stat_cnt_s last;                 // sums of the previous report, reporter only
     pthread_mutex_t mx_report;	 // control access to the queue for each server
 } report_s;
 
 void report_start();
 
+/*!
+ * \brief Totals of the counters of a service since it started, modulo 2^32
+ */
+void stat_sum(report_s *report, stat_cnt_s *sum);
+
 #endif							// _LORA_PKTFWD_STATS_H
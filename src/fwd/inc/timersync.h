@@ -26,6 +26,9 @@ Maintainer: Michael Coracin
 /* -------------------------------------------------------------------------- */
 /* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
 
+/* Estimate the sx130x counter from the host monotonic clock, without SPI access nor lock.
+   SX1301: returns -1 until thread_timersync has taken its first sample.
+   SX1302: the counter is read again, under mx_concent, when the sample is older than 100ms. */
 int get_concentrator_time(uint32_t* concent_time);
 
 void thread_timersync(void);
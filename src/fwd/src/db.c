@@ -32,12 +32,18 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <dirent.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <errno.h>
 #include <sqlite3.h>
 
 #include "fwd.h"
 #include "db.h"
 
 #define MAX_DB_FIELD       256
+#define DB_READERS         4        /*!> read connections, shared by all threads */
+#define DB_QUEUE_MAX       4096     /*!> writes waiting for the db thread */
+#define DB_OVERLAY_SIZE    64
 
 #define CREATE_TB_LIVEPKTS_SQL "CREATE TABLE IF NOT EXISTS `livepkts` (\
   `id`  INTEGER PRIMARY KEY AUTOINCREMENT,\
@@ -57,65 +63,112 @@
 
 #define CREATE_TB_FILTER_SQL "CREATE TABLE IF NOT EXISTS a.filter(name VARCHAR(64), type VARCHAR(32), value VARCHAR(32));"
 
-#define CREATE_TRG_CLEAN_PKT "CREATE TRIGGER IF NOT EXISTS `trg_clean_pkt` AFTER INSERT ON livepkts BEGIN \
-    INSERT OR REPLACE INTO gwdb VALUES('/fwd/pkts/total', (SELECT ifnull(1+(SELECT value FROM gwdb WHERE key LIKE '/fwd/pkts/total'), 1)));\
-    DELETE FROM livepkts WHERE id < ((SELECT id FROM livepkts ORDER BY id DESC LIMIT 1) - 128);\
-    END;"
-
-#define CREATE_TRG_UP_HOURS "CREATE TRIGGER IF NOT EXISTS `trg_up_hours` AFTER INSERT ON LIVEPKTS WHEN new.pdtype LIKE '%'||'UP' BEGIN \
-    INSERT OR REPLACE INTO gwdb VALUES('/fwd/pkts/up/total', (SELECT ifnull(1+(SELECT value FROM gwdb WHERE key LIKE '/fwd/pkts/up/total'), 1)));\
-    INSERT OR REPLACE INTO gwdb SELECT '/fwd/pkts/hours/up/'||strftime('%m/%d-%H',datetime('now', 'localtime')), (SELECT ifnull(1+(SELECT value FROM gwdb WHERE key LIKE '/fwd/pkts/hours/up/'|| strftime('%m/%d-%H',datetime('now', 'localtime'))), 1));\
-    INSERT OR REPLACE INTO gwdb SELECT '/fwd/pkts/hours/down/'||strftime('%m/%d-%H',datetime('now', 'localtime')), (SELECT ifnull(0+(SELECT value FROM gwdb WHERE key LIKE '/fwd/pkts/hours/down/'|| strftime('%m/%d-%H',datetime('now', 'localtime'))), 0));\
-    END;"
-
-#define CREATE_TRG_DOWN_HOURS "CREATE TRIGGER IF NOT EXISTS `trg_down_hours` AFTER INSERT ON LIVEPKTS WHEN new.pdtype LIKE '%'||'DOWN' BEGIN \
-    INSERT OR REPLACE INTO gwdb values('/fwd/pkts/down/total', (SELECT ifnull(1+(SELECT value FROM gwdb WHERE key LIKE '/fwd/pkts/down/total'), 1)));\
-    INSERT OR REPLACE INTO gwdb SELECT '/fwd/pkts/hours/up/'||strftime('%m/%d-%H',datetime('now', 'localtime')), (SELECT ifnull(0+(SELECT value FROM gwdb WHERE key LIKE '/fwd/pkts/hours/up/'|| strftime('%m/%d-%H',datetime('now', 'localtime'))), 0));\
-    INSERT OR REPLACE INTO gwdb SELECT '/fwd/pkts/hours/down/'||strftime('%m/%d-%H',datetime('now', 'localtime')), (SELECT ifnull(1+(SELECT value FROM gwdb WHERE key LIKE '/fwd/pkts/hours/down/'|| strftime('%m/%d-%H',datetime('now', 'localtime'))), 1));\
-    END;"
+/*!> the packet counters used to be kept by these triggers, see PACKET COUNTERS */
+#define DROP_TRG_SQL "DROP TRIGGER IF EXISTS `trg_clean_pkt`;\
+    DROP TRIGGER IF EXISTS `trg_up_hours`;\
+    DROP TRIGGER IF EXISTS `trg_down_hours`;"
 
 #define DEFINE_SQL_STATEMENT(stmt,sql) static sqlite3_stmt *stmt; \
 	const char stmt##_sql[] = sql;
 
+/*!> statements of the write connection, only used by db_write_thread */
 DEFINE_SQL_STATEMENT(put_stmt, "INSERT OR REPLACE INTO gwdb (key, value) VALUES (?, ?);")
-DEFINE_SQL_STATEMENT(get_stmt, "SELECT value FROM gwdb WHERE key=?;")
 DEFINE_SQL_STATEMENT(del_stmt, "DELETE FROM gwdb WHERE key=?;")
 DEFINE_SQL_STATEMENT(deltree_stmt, "DELETE FROM gwdb WHERE key || '/' LIKE ? || '/' || '%';")
 DEFINE_SQL_STATEMENT(deltree_all_stmt, "DELETE FROM gwdb;")
-DEFINE_SQL_STATEMENT(gettree_stmt, "SELECT key, value FROM gwdb WHERE key || '/' LIKE ? || '/' || '%' ORDER BY key;")
-DEFINE_SQL_STATEMENT(gettree_all_stmt, "SELECT key, value FROM gwdb ORDER BY key;")
-DEFINE_SQL_STATEMENT(showkey_stmt, "SELECT key, value FROM gwdb WHERE key LIKE '%' || '/' || ? ORDER BY key;")
-DEFINE_SQL_STATEMENT(showkey_stmt_ex, "SELECT key FROM gwdb WHERE key LIKE '%' || '/' || ? || '%' ORDER BY key;")
-DEFINE_SQL_STATEMENT(gettree_prefix_stmt, "SELECT key, value FROM gwdb WHERE key > ?1 AND key <= ?1 || X'ffff';")
+DEFINE_SQL_STATEMENT(data_version_stmt, "PRAGMA data_version;")
 DEFINE_SQL_STATEMENT(put_pkt_stmt, "INSERT INTO livepkts (pdtype, freq, dr, cnt, devaddr, content, payload) VALUES (?, ?, ?, ?, ?, ?, ?);")
+/*!> livepkts keeps the last 128 packets */
+DEFINE_SQL_STATEMENT(trim_pkt_stmt, "DELETE FROM livepkts WHERE id < (SELECT max(id) FROM livepkts) - 128;")
+
+/*!> statements prepared on each read connection */
+typedef enum {
+	RD_GET,
+	RD_GETTREE,
+	RD_GETTREE_ALL,
+	RD_SHOWKEY,
+	RD_SHOWKEY_EX,
+	RD_GETTREE_PREFIX,
+	RD_FILTER,
+	RD_NB
+} db_read_stmt_e;
+
+static const char *read_stmt_sql[RD_NB] = {
+	[RD_GET]            = "SELECT value FROM gwdb WHERE key=?;",
+	[RD_GETTREE]        = "SELECT key, value FROM gwdb WHERE key || '/' LIKE ? || '/' || '%' ORDER BY key;",
+	[RD_GETTREE_ALL]    = "SELECT key, value FROM gwdb ORDER BY key;",
+	[RD_SHOWKEY]        = "SELECT key, value FROM gwdb WHERE key LIKE '%' || '/' || ? ORDER BY key;",
+	[RD_SHOWKEY_EX]     = "SELECT key FROM gwdb WHERE key LIKE '%' || '/' || ? || '%' ORDER BY key;",
+	[RD_GETTREE_PREFIX] = "SELECT key, value FROM gwdb WHERE key > ?1 AND key <= ?1 || X'ffff';",
+	[RD_FILTER]         = "SELECT key FROM gwdb WHERE key LIKE '/filter/%';",
+};
+
+typedef struct {
+	pthread_mutex_t lock;
+	sqlite3 *db;
+	sqlite3_stmt *stmt[RD_NB];
+} db_reader_s;
+
+typedef enum {
+	DB_OP_PUT,
+	DB_OP_DEL,
+	DB_OP_DELTREE,
+	DB_OP_PUTPKT
+} db_op_e;
+
+/*!> one queued write, the strings live in the same allocation */
+typedef struct _db_op {
+	struct _db_op *next;
+	db_op_e type;
+	unsigned seq;
+	double freq;
+	uint16_t cnt;
+	char *arg[6];       /*!> key, value / prefix / pdtype, dr, devaddr, content, payload */
+} db_op_s;
+
+/*!> a write not committed yet, value NULL is a deleted key */
+typedef struct _db_overlay {
+	struct _db_overlay *next;
+	unsigned seq;
+	char *value;
+	char key[0];
+} db_overlay_s;
+
 //DEFINE_SQL_STATEMENT(import_stmt, "ATTACH DATABASE '/etc/lora/devskey' AS a; SELECT devaddr, appskey, nwkskey FROM a.abpdevs;");
 
 
-pthread_mutex_t mx_dblock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t dbcond;
-static pthread_t syncthread;
-static sqlite3 *GWDB;
+static pthread_t writethread;
+static sqlite3 *GWDB;               /*!> write connection, owned by db_write_thread once started */
 static int doexit;
-static int dosync;
 
-static void db_sync(void);
+static db_reader_s db_reader[DB_READERS];
+static unsigned db_reader_next = 0;
+
+static db_op_s *db_queue = NULL;    /*!> LIFO pushed under mx_overlay, except putpkt, reversed by db_write_thread */
+static int db_queue_len = 0;
+static pthread_mutex_t mx_wakeup = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cv_wakeup;    /*!> on CLOCK_MONOTONIC, a wall clock step must not stall the writes */
+static bool db_woken = false;
+
+static pthread_mutex_t mx_overlay = PTHREAD_MUTEX_INITIALIZER;
+static db_overlay_s *overlay_key[DB_OVERLAY_SIZE];
+static db_overlay_s *overlay_tree = NULL;   /*!> pending deltree, key is the prefix */
+static unsigned db_seq = 0;
+
+static void db_touch(const char *key);
 
 static int init_stmt(sqlite3_stmt **stmt, const char *sql, size_t len)
 {
-	pthread_mutex_lock(&mx_dblock);
 	if (sqlite3_prepare_v2(GWDB, sql, len, stmt, NULL) != SQLITE_OK) {
 		MSG("%s[DB] Couldn't prepare statement '%s': %s\n", WARNMSG, sql, sqlite3_errmsg(GWDB));
-		pthread_mutex_unlock(&mx_dblock);
 		return -1;
 	}
-	pthread_mutex_unlock(&mx_dblock);
 
 	return 0;
 }
 
 /*!>! \internal
  * \brief Clean up the prepared SQLite3 statement
- * \note mx_dblock should already be locked prior to calling this method
  */
 static int clean_stmt(sqlite3_stmt **stmt, const char *sql)
 {
@@ -129,39 +182,30 @@ static int clean_stmt(sqlite3_stmt **stmt, const char *sql)
 }
 
 /*!>! \internal
- * \brief Clean up all prepared SQLite3 statements
- * \note mx_dblock should already be locked prior to calling this method
+ * \brief Clean up all prepared SQLite3 statements of the write connection
  */
 static void clean_statements(void)
 {
-	clean_stmt(&get_stmt, get_stmt_sql);
 	clean_stmt(&del_stmt, del_stmt_sql);
 	clean_stmt(&deltree_stmt, deltree_stmt_sql);
 	clean_stmt(&deltree_all_stmt, deltree_all_stmt_sql);
-	clean_stmt(&gettree_stmt, gettree_stmt_sql);
-	clean_stmt(&gettree_all_stmt, gettree_all_stmt_sql);
-	clean_stmt(&gettree_prefix_stmt, gettree_prefix_stmt_sql);
-	clean_stmt(&showkey_stmt, showkey_stmt_sql);
-	clean_stmt(&showkey_stmt_ex, showkey_stmt_ex_sql);
+	clean_stmt(&data_version_stmt, data_version_stmt_sql);
 	clean_stmt(&put_stmt, put_stmt_sql);
 	clean_stmt(&put_pkt_stmt, put_pkt_stmt_sql);
+	clean_stmt(&trim_pkt_stmt, trim_pkt_stmt_sql);
 }
 
 static int init_statements(void)
 {
 	/*!> Don't initialize create_gwdb_statement here as the GWDB table needs to exist
 	 * brefore these statements can be initialized */
-	return init_stmt(&get_stmt, get_stmt_sql, sizeof(get_stmt_sql))
-	|| init_stmt(&del_stmt, del_stmt_sql, sizeof(del_stmt_sql))
+	return init_stmt(&del_stmt, del_stmt_sql, sizeof(del_stmt_sql))
 	|| init_stmt(&deltree_stmt, deltree_stmt_sql, sizeof(deltree_stmt_sql))
 	|| init_stmt(&deltree_all_stmt, deltree_all_stmt_sql, sizeof(deltree_all_stmt_sql))
-	|| init_stmt(&gettree_stmt, gettree_stmt_sql, sizeof(gettree_stmt_sql))
-	|| init_stmt(&gettree_all_stmt, gettree_all_stmt_sql, sizeof(gettree_all_stmt_sql))
-	|| init_stmt(&gettree_prefix_stmt, gettree_prefix_stmt_sql, sizeof(gettree_prefix_stmt_sql))
-	|| init_stmt(&showkey_stmt, showkey_stmt_sql, sizeof(showkey_stmt_sql))
-    || init_stmt(&showkey_stmt_ex, showkey_stmt_ex_sql, sizeof(showkey_stmt_ex_sql))
+	|| init_stmt(&data_version_stmt, data_version_stmt_sql, sizeof(data_version_stmt_sql))
 	|| init_stmt(&put_stmt, put_stmt_sql, sizeof(put_stmt_sql))
-	|| init_stmt(&put_pkt_stmt, put_pkt_stmt_sql, sizeof(put_pkt_stmt_sql));
+	|| init_stmt(&put_pkt_stmt, put_pkt_stmt_sql, sizeof(put_pkt_stmt_sql))
+	|| init_stmt(&trim_pkt_stmt, trim_pkt_stmt_sql, sizeof(trim_pkt_stmt_sql));
 }
 
 /*!>
@@ -190,15 +234,11 @@ static int db_create_table(void)
 
 static int db_open(void)
 {
-	pthread_mutex_lock(&mx_dblock);
 	if (sqlite3_open(LGW_DB_FILE, &GWDB) != SQLITE_OK) {
 		MSG("%s[DB] Unable to open LGW database '%s': %s\n", WARNMSG, LGW_DB_FILE, sqlite3_errmsg(GWDB));
-		pthread_mutex_unlock(&mx_dblock);
 		return -1;
 	}
 
-	pthread_mutex_unlock(&mx_dblock);
-
 	return 0;
 }
 
@@ -211,9 +251,8 @@ static int db_init(void)
 	return db_open();
 }
 
-/*!> We purposely don't lock around the sqlite3 call because the transaction
- * calls will be called with the database lock held. For any other use, make
- * sure to take the mx_dblock yourself. */
+/*!> Runs on the write connection: only lgw_db_init, before db_write_thread
+ * starts, and db_write_thread itself may call this. */
 static int db_exec_sql(const char *sql, int (*callback)(void *, int, char **, char **), void *arg)
 {
 	char *errmsg = NULL;
@@ -243,77 +282,414 @@ static int lgw_db_rollback_transaction(void)
 	return db_exec_sql("ROLLBACK", NULL, NULL);
 }
 
-int lgw_db_put(const char *family, const char *key, const char *value)
+/*!> -------------------------------------------------------------------------- */
+/*!> --- READ CONNECTIONS ----------------------------------------------------- */
+
+/*!>!
+ * Readers never touch the write connection: in WAL mode a read connection
+ * sees the last commit and does not wait for the one in progress. The pool
+ * is shared, a reader only waits for another reader of the same connection.
+ */
+
+static void reader_close(db_reader_s *reader)
 {
-	char fullkey[MAX_DB_FIELD];
-	size_t fullkey_len;
-	int res = 0;
+	int i;
 
-	if (strlen(family) + strlen(key) + 2 > sizeof(fullkey) - 1) {
-		MSG("%s[DB] Family and key length must be less than %zu bytes\n", WARNMSG, sizeof(fullkey) - 3);
+	for (i = 0; i < RD_NB; i++) {
+		if (reader->stmt[i]) {
+			sqlite3_finalize(reader->stmt[i]);
+			reader->stmt[i] = NULL;
+		}
+	}
+	sqlite3_close_v2(reader->db);
+	reader->db = NULL;
+}
+
+static int reader_open(db_reader_s *reader)
+{
+	int i;
+
+	if (sqlite3_open_v2(LGW_DB_FILE, &reader->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+		MSG("%s[DB] Unable to open read connection '%s': %s\n", WARNMSG, LGW_DB_FILE, sqlite3_errmsg(reader->db));
+		reader_close(reader);
 		return -1;
 	}
 
-	fullkey_len = snprintf(fullkey, sizeof(fullkey), "/%s/%s", family, key);
+	sqlite3_busy_timeout(reader->db, 100);
+	sqlite3_exec(reader->db, "PRAGMA query_only = 1;", NULL, NULL, NULL);
 
-	pthread_mutex_lock(&mx_dblock);
-	if (sqlite3_bind_text(put_stmt, 1, fullkey, fullkey_len, SQLITE_STATIC) != SQLITE_OK) {
-		MSG("%s[DB] Couldn't bind key to stmt: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
-		res = -1;
-	} else if (sqlite3_bind_text(put_stmt, 2, value, -1, SQLITE_STATIC) != SQLITE_OK) {
-		MSG("%s[DB] Couldn't bind value to stmt: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
-		res = -1;
-	} else if (sqlite3_step(put_stmt) != SQLITE_DONE) {
-		MSG("%s[DB] Couldn't execute statement: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
-		res = -1;
+	for (i = 0; i < RD_NB; i++) {
+		if (sqlite3_prepare_v2(reader->db, read_stmt_sql[i], -1, &reader->stmt[i], NULL) != SQLITE_OK) {
+			MSG("%s[DB] Couldn't prepare statement '%s': %s\n", WARNMSG, read_stmt_sql[i], sqlite3_errmsg(reader->db));
+			reader_close(reader);
+			return -1;
+		}
 	}
 
-	sqlite3_reset(put_stmt);
-	db_sync();
-	pthread_mutex_unlock(&mx_dblock);
+	return 0;
+}
 
-	return res;
+/*!>! \internal
+ * \brief take a free read connection, release it with reader_put()
+ */
+static db_reader_s *reader_get(void)
+{
+	unsigned start = __atomic_fetch_add(&db_reader_next, 1, __ATOMIC_RELAXED) % DB_READERS;
+	db_reader_s *reader = NULL;
+	int i;
+
+	for (i = 0; i < DB_READERS; i++) {
+		if (!pthread_mutex_trylock(&db_reader[(start + i) % DB_READERS].lock)) {
+			reader = &db_reader[(start + i) % DB_READERS];
+			break;
+		}
+	}
+
+	if (reader == NULL) {
+		reader = &db_reader[start];
+		pthread_mutex_lock(&reader->lock);
+	}
+
+	if (reader->db == NULL && reader_open(reader)) {
+		pthread_mutex_unlock(&reader->lock);
+		return NULL;
+	}
+
+	return reader;
 }
 
-int lgw_db_putpkt(char* pdtype, double freq, char* dr, uint16_t cnt, char* devaddr, char* content, char* payload)
+static void reader_put(db_reader_s *reader)
 {
-	int res = 0;
+	pthread_mutex_unlock(&reader->lock);
+}
 
-	pthread_mutex_lock(&mx_dblock);
+/*!> -------------------------------------------------------------------------- */
+/*!> --- WRITE QUEUE ---------------------------------------------------------- */
 
-	if (sqlite3_bind_text(put_pkt_stmt, 1, pdtype, -1, SQLITE_STATIC) != SQLITE_OK) {
-		MSG("%s[DB] Couldn't bind payloadd type to stmt: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
-		res = -1;
-	} else if (sqlite3_bind_double(put_pkt_stmt, 2, freq) != SQLITE_OK) {
-		MSG("%s[DB] Couldn't bind frequuency to stmt: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
-		res = -1;
-	} else if (sqlite3_bind_text(put_pkt_stmt, 3, dr, -1, SQLITE_STATIC) != SQLITE_OK) {
-		MSG("%s[DB] Couldn't bind datarate to stmt: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
-		res = -1;
-	} else if (sqlite3_bind_int(put_pkt_stmt, 4, cnt) != SQLITE_OK) {
-		MSG("%s[DB] Couldn't bind count to stmt: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
-		res = -1;
-	} else if (sqlite3_bind_text(put_pkt_stmt, 5, devaddr, -1, SQLITE_STATIC) != SQLITE_OK) {
-		MSG("%s[DB] Couldn't bind devaddr to stmt: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
-		res = -1;
-	} else if (sqlite3_bind_text(put_pkt_stmt, 6, content, -1, SQLITE_STATIC) != SQLITE_OK) {
-		MSG("%s[DB] Couldn't bind conten to stmt: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
-		res = -1;
-	} else if (sqlite3_bind_text(put_pkt_stmt, 7, payload, -1, SQLITE_STATIC) != SQLITE_OK) {
-		MSG("%s[DB] Couldn't bind payload to stmt: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
-		res = -1;
-	} else if (sqlite3_step(put_pkt_stmt) != SQLITE_DONE) {
-		MSG("%s[DB] Couldn't execute statement: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
-		res = -1;
+/*!>!
+ * Writers only queue their change and return, db_write_thread applies the
+ * queue in one transaction about once a second. Until it is committed, a
+ * put or del is also kept in the overlay so lgw_db_get reads its own writes.
+ * Pattern and tree reads only see committed data.
+ */
+
+/*!>! \internal
+ * \brief same match as deltree_stmt, an empty prefix is the whole db
+ */
+static bool tree_match(const char *prefix, const char *key)
+{
+	size_t len = strlen(prefix);
+
+	return len == 0 || (!strncmp(key, prefix, len) && (key[len] == '\0' || key[len] == '/'));
+}
+
+static unsigned overlay_hash(const char *key)
+{
+	unsigned hash = 5381;
+
+	while (*key)
+		hash = hash * 33 + (unsigned char) *key++;
+
+	return hash % DB_OVERLAY_SIZE;
+}
+
+static db_overlay_s *overlay_new(const char *key, const char *value, unsigned seq)
+{
+	size_t key_len = strlen(key), value_len = value ? strlen(value) : 0;
+	db_overlay_s *entry = lgw_malloc(sizeof(db_overlay_s) + key_len + value_len + 2);
+
+	if (!entry)
+		return NULL;
+
+	entry->seq = seq;
+	memcpy(entry->key, key, key_len + 1);
+	if (value) {
+		entry->value = entry->key + key_len + 1;
+		memcpy(entry->value, value, value_len + 1);
 	}
 
-	sqlite3_reset(put_pkt_stmt);
-	db_sync();
-	pthread_mutex_unlock(&mx_dblock);
+	return entry;
+}
+
+/*!>! \note mx_overlay is assumed to be held, value NULL marks a deleted key */
+static void overlay_put(const char *key, const char *value, unsigned seq)
+{
+	db_overlay_s **pp, *entry;
+
+	for (pp = &overlay_key[overlay_hash(key)]; *pp; pp = &(*pp)->next) {
+		if (!strcmp((*pp)->key, key)) {
+			entry = *pp;
+			*pp = entry->next;
+			lgw_free(entry);
+			break;
+		}
+	}
+
+	entry = overlay_new(key, value, seq);
+	if (entry) {
+		entry->next = overlay_key[overlay_hash(key)];
+		overlay_key[overlay_hash(key)] = entry;
+	}
+}
+
+/*!>! \note mx_overlay is assumed to be held */
+static void overlay_deltree(const char *prefix, unsigned seq)
+{
+	db_overlay_s **pp, *entry;
+	int i;
+
+	for (i = 0; i < DB_OVERLAY_SIZE; i++) {
+		pp = &overlay_key[i];
+		while (*pp) {
+			if (tree_match(prefix, (*pp)->key)) {
+				entry = *pp;
+				*pp = entry->next;
+				lgw_free(entry);
+			} else
+				pp = &(*pp)->next;
+		}
+	}
+
+	entry = overlay_new(prefix, NULL, seq);
+	if (entry) {
+		entry->next = overlay_tree;
+		overlay_tree = entry;
+	}
+}
+
+/*!>!
+ * \brief look for a pending write of key
+ * \retval 1 pending put, value copied as db_get_common does
+ * \retval 0 pending delete
+ * \retval -1 nothing pending, read the db
+ */
+static int overlay_get(const char *key, char **buffer, int bufferlen)
+{
+	db_overlay_s *entry;
+	int res = -1;
+
+	pthread_mutex_lock(&mx_overlay);
+	for (entry = overlay_key[overlay_hash(key)]; entry; entry = entry->next) {
+		if (!strcmp(entry->key, key))
+			break;
+	}
+
+	if (entry) {
+		/*!> an entry is always newer than the deltree covering it */
+		if (entry->value) {
+			if (bufferlen == -1)
+				*buffer = lgw_strdup(entry->value);
+			else
+				strncpy(*buffer, entry->value, bufferlen);
+			res = 1;
+		} else
+			res = 0;
+	} else {
+		for (entry = overlay_tree; entry; entry = entry->next) {
+			if (tree_match(entry->key, key)) {
+				res = 0;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&mx_overlay);
 
 	return res;
 }
 
+/*!>! \brief forget the pending write seq of key once it is committed */
+static void overlay_drop(db_overlay_s **head, const char *key, unsigned seq)
+{
+	db_overlay_s **pp, *entry;
+
+	pthread_mutex_lock(&mx_overlay);
+	for (pp = head; *pp; pp = &(*pp)->next) {
+		if ((*pp)->seq == seq && !strcmp((*pp)->key, key)) {
+			entry = *pp;
+			*pp = entry->next;
+			lgw_free(entry);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mx_overlay);
+}
+
+static db_op_s *db_op_new(db_op_e type, int nb_arg, const char **arg)
+{
+	size_t len = 0, arg_len;
+	db_op_s *op;
+	char *p;
+	int i;
+
+	for (i = 0; i < nb_arg; i++)
+		len += (arg[i] ? strlen(arg[i]) : 0) + 1;
+
+	op = lgw_malloc(sizeof(db_op_s) + len);
+	if (!op)
+		return NULL;
+
+	op->type = type;
+	p = (char *)(op + 1);
+	for (i = 0; i < nb_arg; i++) {
+		arg_len = arg[i] ? strlen(arg[i]) : 0;
+		op->arg[i] = p;
+		if (arg_len)
+			memcpy(p, arg[i], arg_len);
+		p[arg_len] = '\0';
+		p += arg_len + 1;
+	}
+
+	return op;
+}
+
+/*!>! \internal
+ * \brief wake db_write_thread, only the first write since it woke signals
+ */
+static void db_wakeup(void)
+{
+	if (__atomic_exchange_n(&db_woken, true, __ATOMIC_ACQ_REL))
+		return;
+
+	pthread_mutex_lock(&mx_wakeup);
+	pthread_cond_signal(&cv_wakeup);
+	pthread_mutex_unlock(&mx_wakeup);
+}
+
+/*!>! \internal
+ * \brief hand a write to db_write_thread
+ *
+ * put, del and deltree are recorded in the overlay and pushed under
+ * mx_overlay, so seq follows the queue order and those writers serialize
+ * on it.  Only putpkt, which has no overlay entry, pushes without a lock.
+ */
+static int db_queue_push(db_op_s *op)
+{
+	bool overlay;
+
+	if (!op)
+		return -1;
+
+	overlay = op->type != DB_OP_PUTPKT;
+	if (__atomic_add_fetch(&db_queue_len, 1, __ATOMIC_RELAXED) > DB_QUEUE_MAX) {
+		__atomic_sub_fetch(&db_queue_len, 1, __ATOMIC_RELAXED);
+		MSG("%s[DB] write queue full, drop the write\n", WARNMSG);
+		lgw_free(op);
+		return -1;
+	}
+
+	if (overlay) {
+		pthread_mutex_lock(&mx_overlay);
+		op->seq = ++db_seq;
+		if (op->type == DB_OP_DELTREE)
+			overlay_deltree(op->arg[0], op->seq);
+		else
+			overlay_put(op->arg[0], op->type == DB_OP_PUT ? op->arg[1] : NULL, op->seq);
+	}
+
+	op->next = __atomic_load_n(&db_queue, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&db_queue, &op->next, op, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	if (overlay)
+		pthread_mutex_unlock(&mx_overlay);
+
+	db_wakeup();
+	return 0;
+}
+
+int lgw_db_put(const char *family, const char *key, const char *value)
+{
+	char fullkey[MAX_DB_FIELD];
+	const char *arg[2];
+
+	if (snprintf(fullkey, sizeof(fullkey), "/%s/%s", family, key) >= (int) sizeof(fullkey)) {
+		MSG("%s[DB] Family and key length must be less than %zu bytes\n", WARNMSG, sizeof(fullkey) - 3);
+		return -1;
+	}
+
+	arg[0] = fullkey;
+	arg[1] = value;
+	return db_queue_push(db_op_new(DB_OP_PUT, 2, arg));
+}
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PACKET COUNTERS ------------------------------------------------------ */
+
+/*!>!
+ * Totals and hourly up/down counts of livepkts are counted here and written
+ * to /fwd/pkts by db_write_thread with the batch, instead of by triggers on
+ * every insert. Two hour slots are kept, the previous hour is complete in
+ * the db long before its slot is reused.
+ */
+
+typedef struct {
+	long hour;              /*!> local hours since the epoch, 0 is unused */
+	uint32_t up;
+	uint32_t down;
+} pkt_hour_s;
+
+static pthread_mutex_t mx_pkt_hour = PTHREAD_MUTEX_INITIALIZER;
+static pkt_hour_s pkt_hour[2];
+static uint32_t pkt_total = 0;
+static uint32_t pkt_up = 0;
+static uint32_t pkt_down = 0;
+static uint32_t pkt_flushed = 0;    /*!> pkt_total written by the last flush */
+
+/*!> same test as the trigger: pdtype LIKE '%UP' */
+static bool pdtype_is(const char *pdtype, const char *dir)
+{
+	size_t len = pdtype ? strlen(pdtype) : 0, dir_len = strlen(dir);
+
+	return len >= dir_len && !strcasecmp(pdtype + len - dir_len, dir);
+}
+
+static void pkt_count(const char *pdtype)
+{
+	bool up = pdtype_is(pdtype, "UP"), down = pdtype_is(pdtype, "DOWN");
+	time_t now = time(NULL);
+	pkt_hour_s *slot;
+	struct tm tm;
+	long hour;
+
+	if (up || down) {
+		localtime_r(&now, &tm);
+		hour = (now + tm.tm_gmtoff) / 3600;
+		slot = &pkt_hour[hour % 2];
+		if (__atomic_load_n(&slot->hour, __ATOMIC_ACQUIRE) != hour) {
+			pthread_mutex_lock(&mx_pkt_hour);
+			if (slot->hour != hour) {
+				slot->up = 0;
+				slot->down = 0;
+				__atomic_store_n(&slot->hour, hour, __ATOMIC_RELEASE);
+			}
+			pthread_mutex_unlock(&mx_pkt_hour);
+		}
+		__atomic_add_fetch(up ? &slot->up : &slot->down, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(up ? &pkt_up : &pkt_down, 1, __ATOMIC_RELAXED);
+	}
+
+	/*!> last, so the flush of a new total also sees the hour counters */
+	__atomic_add_fetch(&pkt_total, 1, __ATOMIC_RELEASE);
+}
+
+int lgw_db_putpkt(char* pdtype, double freq, char* dr, uint16_t cnt, char* devaddr, char* content, char* payload)
+{
+	const char *arg[5] = { pdtype, dr, devaddr, content, payload };
+	db_op_s *op = db_op_new(DB_OP_PUTPKT, 5, arg);
+
+	if (!op)
+		return -1;
+
+	op->freq = freq;
+	op->cnt = cnt;
+	if (db_queue_push(op))
+		return -1;
+
+	/*!> a dropped insert is not counted, op belongs to the writer now */
+	pkt_count(pdtype);
+	return 0;
+}
+
 /*!>!
  * \internal
  * \brief Get key value specified by family/key.
@@ -330,23 +706,37 @@ static int db_get_common(const char *family, const char *key, char **buffer, int
 	const unsigned char *result;
 	char fullkey[MAX_DB_FIELD];
 	size_t fullkey_len;
+	db_reader_s *reader;
+	sqlite3_stmt *stmt;
 	int res = 0;
 
-	if (strlen(family) + strlen(key) + 2 > sizeof(fullkey) - 1) {
+	fullkey_len = snprintf(fullkey, sizeof(fullkey), "/%s/%s", family, key);
+	if (fullkey_len >= sizeof(fullkey)) {
 		MSG("%s[DB] Family and key length must be less than %zu bytes\n", WARNMSG, sizeof(fullkey) - 3);
 		return -1;
 	}
 
-	fullkey_len = snprintf(fullkey, sizeof(fullkey), "/%s/%s", family, key);
+	switch (overlay_get(fullkey, buffer, bufferlen)) {
+		case 1:
+			return 0;
+		case 0:
+			MSG("%s[DB] Unable to find key '%s' in family '%s'\n", WARNMSG, key, family);
+			return -1;
+		default:
+			break;
+	}
 
-	pthread_mutex_lock(&mx_dblock);
-	if (sqlite3_bind_text(get_stmt, 1, fullkey, fullkey_len, SQLITE_STATIC) != SQLITE_OK) {
-		MSG("%s[DB] Couldn't bind key to stmt: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
+	if (!(reader = reader_get()))
+		return -1;
+
+	stmt = reader->stmt[RD_GET];
+	if (sqlite3_bind_text(stmt, 1, fullkey, fullkey_len, SQLITE_STATIC) != SQLITE_OK) {
+		MSG("%s[DB] Couldn't bind key to stmt: %s\n", WARNMSG, sqlite3_errmsg(reader->db));
 		res = -1;
-	} else if (sqlite3_step(get_stmt) != SQLITE_ROW) {
+	} else if (sqlite3_step(stmt) != SQLITE_ROW) {
 		MSG("%s[DB] Unable to find key '%s' in family '%s'\n", WARNMSG, key, family);
 		res = -1;
-	} else if (!(result = sqlite3_column_text(get_stmt, 0))) {
+	} else if (!(result = sqlite3_column_text(stmt, 0))) {
 		MSG("%s[DB] Couldn't get value\n", WARNMSG);
 		res = -1;
 	} else {
@@ -358,30 +748,30 @@ static int db_get_common(const char *family, const char *key, char **buffer, int
 			strncpy(*buffer, value, bufferlen);
 		}
 	}
-	sqlite3_reset(get_stmt);
-	pthread_mutex_unlock(&mx_dblock);
+	sqlite3_reset(stmt);
+	reader_put(reader);
 
 	return res;
 }
 
 bool lgw_db_key_exist(const char *key) {
-	pthread_mutex_lock(&mx_dblock);
-    if (!lgw_strlen_zero(key) && (sqlite3_bind_text(showkey_stmt, 1, key, -1, SQLITE_STATIC) != SQLITE_OK)) {
-        MSG("%s[DB] Could bind %s to stmt: %s\n", WARNMSG, LGW_DB_FILE, sqlite3_errmsg(GWDB));
-        sqlite3_reset(showkey_stmt);
-        pthread_mutex_unlock(&mx_dblock);
+    db_reader_s *reader;
+    sqlite3_stmt *stmt;
+    bool found = false;
+
+    if (!(reader = reader_get()))
         return false;
-    }
 
-    if (sqlite3_step(showkey_stmt) == SQLITE_ROW) {
-        sqlite3_reset(showkey_stmt);
-        pthread_mutex_unlock(&mx_dblock);
-        return true;
+    stmt = reader->stmt[RD_SHOWKEY];
+    if (!lgw_strlen_zero(key) && (sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC) != SQLITE_OK)) {
+        MSG("%s[DB] Could bind %s to stmt: %s\n", WARNMSG, LGW_DB_FILE, sqlite3_errmsg(reader->db));
+    } else if (sqlite3_step(stmt) == SQLITE_ROW) {
+        found = true;
     }
 
-    sqlite3_reset(showkey_stmt);
-    pthread_mutex_unlock(&mx_dblock);
-    return false;
+    sqlite3_reset(stmt);
+    reader_put(reader);
+    return found;
 }
 
 int get_key(const char *src, char *dest)
@@ -409,30 +799,334 @@ int get_key(const char *src, char *dest)
 }
 
 bool lgw_db_key_exist_ex(const char *prefix, const char *key) {
-    pthread_mutex_lock(&mx_dblock);
-    if (!lgw_strlen_zero(key) && (sqlite3_bind_text(showkey_stmt_ex, 1, prefix, -1, SQLITE_STATIC) != SQLITE_OK)) {
-        MSG("%s[DB] Could bind %s to stmt: %s\n", WARNMSG, LGW_DB_FILE, sqlite3_errmsg(GWDB));
-        sqlite3_reset(showkey_stmt_ex);
-        pthread_mutex_unlock(&mx_dblock);
+    db_reader_s *reader;
+    sqlite3_stmt *stmt;
+    bool found = false;
+    char dest[32];
+
+    if (!(reader = reader_get()))
+        return false;
+
+    stmt = reader->stmt[RD_SHOWKEY_EX];
+    if (!lgw_strlen_zero(key) && (sqlite3_bind_text(stmt, 1, prefix, -1, SQLITE_STATIC) != SQLITE_OK)) {
+        MSG("%s[DB] Could bind %s to stmt: %s\n", WARNMSG, LGW_DB_FILE, sqlite3_errmsg(reader->db));
+        sqlite3_reset(stmt);
+        reader_put(reader);
         return false;
     }
 
-    char dest[32];
-    while (sqlite3_step(showkey_stmt_ex) == SQLITE_ROW) {
-        const char *key_src = sqlite3_column_text(showkey_stmt_ex, 0);
+    while (!found && sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *key_src = (const char *) sqlite3_column_text(stmt, 0);
         if (key_src) {
             memset(dest, 0x00, sizeof(dest));
             if (!get_key(key_src, dest) && strstr(key, dest)) {
-                sqlite3_reset(showkey_stmt_ex);
-                pthread_mutex_unlock(&mx_dblock);
-                return true;
+                found = true;
             }
         }
     }
 
-    sqlite3_reset(showkey_stmt_ex);
-    pthread_mutex_unlock(&mx_dblock);
-    return false;
+    sqlite3_reset(stmt);
+    reader_put(reader);
+    return found;
+}
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- TREE GENERATION ------------------------------------------------------ */
+
+/*!>!
+ * Key trees cached in memory are stamped with a generation number. Writes
+ * through this file bump the generation of the tree they touch once they
+ * are committed, writes from other processes are seen by polling PRAGMA
+ * data_version on the write connection and bump every tree.
+ */
+
+static const char *tree_prefix[LGW_DB_TREE_NB] = { "/filter", "/devinfo" };
+static unsigned tree_gen[LGW_DB_TREE_NB] = { 1, 1 };   /*!> 0 is never built */
+static int tree_data_version = -1;
+
+/*!>! \internal
+ * \brief key NULL means the whole db
+ */
+static void db_touch(const char *key)
+{
+	int t;
+
+	for (t = 0; t < LGW_DB_TREE_NB; t++) {
+		if (key == NULL || !strncmp(key, tree_prefix[t], strlen(tree_prefix[t])))
+			__atomic_add_fetch(&tree_gen[t], 1, __ATOMIC_RELEASE);
+	}
+}
+
+/*!>! \internal
+ * \brief other processes writing the db are only visible through data_version
+ * \note only called by db_write_thread
+ */
+static void db_poll_version(void)
+{
+	int version;
+
+	if (sqlite3_step(data_version_stmt) == SQLITE_ROW) {
+		version = sqlite3_column_int(data_version_stmt, 0);
+		if (version != tree_data_version) {
+			if (tree_data_version != -1)
+				db_touch(NULL);
+			tree_data_version = version;
+		}
+	}
+	sqlite3_reset(data_version_stmt);
+}
+
+unsigned lgw_db_generation(lgw_db_tree_e tree)
+{
+	if (tree >= LGW_DB_TREE_NB)
+		return 0;
+
+	return __atomic_load_n(&tree_gen[tree], __ATOMIC_ACQUIRE);
+}
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- FILTER INDEX --------------------------------------------------------- */
+
+/*!>!
+ * The /filter/<name>/<type>/<value> keys are compiled into one index per
+ * service, so a filter decision costs a few binary searches instead of a
+ * SQLite query per key. The index is rebuilt lazily by the first lookup
+ * after the generation of the /filter tree moved.
+ */
+
+#define FILTER_EUI_LEN      16
+
+typedef struct {
+	uint64_t *value;                        /*!> sorted, complete values */
+	int nb_value;
+	char (*part)[FILTER_EUI_LEN + 1];       /*!> partial EUI, matched anywhere in the EUI */
+	int nb_part;
+} filter_set_s;
+
+typedef struct _filter_index {
+	char name[64];
+	filter_set_s set[LGW_FILTER_NB];
+	struct _filter_index *next;
+} filter_index_s;
+
+static const char *filter_type_name[LGW_FILTER_NB] = { "fport", "devaddr", "nwkid", "deveui", "joineui" };
+
+static pthread_rwlock_t rw_filter = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t mx_filter_build = PTHREAD_MUTEX_INITIALIZER;
+static filter_index_s *filter_index = NULL;
+static unsigned filter_built = 0;            /*!> generation filter_index was built from */
+
+static int filter_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void filter_free(filter_index_s *index)
+{
+	int i;
+	filter_index_s *next;
+
+	while (index) {
+		next = index->next;
+		for (i = 0; i < LGW_FILTER_NB; i++) {
+			lgw_free(index->set[i].value);
+			lgw_free(index->set[i].part);
+		}
+		lgw_free(index);
+		index = next;
+	}
+}
+
+static int filter_add_value(filter_set_s *set, uint64_t value)
+{
+	uint64_t *p = lgw_realloc(set->value, sizeof(uint64_t) * (set->nb_value + 1));
+	if (!p)
+		return -1;
+	set->value = p;
+	set->value[set->nb_value++] = value;
+	return 0;
+}
+
+static int filter_add_part(filter_set_s *set, const char *part)
+{
+	char (*p)[FILTER_EUI_LEN + 1] = lgw_realloc(set->part, sizeof(*p) * (set->nb_part + 1));
+	if (!p)
+		return -1;
+	set->part = p;
+	strcpy(set->part[set->nb_part++], part);
+	return 0;
+}
+
+/*!>! \internal
+ * \brief add one /filter/<name>/<type>/<value> key to the index list
+ */
+static int filter_add_key(filter_index_s **head, const char *key)
+{
+	char name[64], type[16], value[64], eui[FILTER_EUI_LEN + 1];
+	char *end = NULL;
+	unsigned long long num;
+	filter_index_s *index;
+	int i, t, len = 0;
+
+	if (sscanf(key, "/filter/%63[^/]/%15[^/]/%63s", name, type, value) != 3)
+		return 0;
+
+	for (t = 0; t < LGW_FILTER_NB; t++) {
+		if (!strcmp(type, filter_type_name[t]))
+			break;
+	}
+	if (t == LGW_FILTER_NB)
+		return 0;
+
+	for (index = *head; index; index = index->next) {
+		if (!strcmp(index->name, name))
+			break;
+	}
+	if (!index) {
+		index = lgw_malloc(sizeof(filter_index_s));
+		if (!index)
+			return -1;
+		strcpy(index->name, name);
+		index->next = *head;
+		*head = index;
+	}
+
+	switch (t) {
+		case LGW_FILTER_DEVEUI:
+		case LGW_FILTER_JOINEUI:
+			/*!> same as get_key: keep the hex digits, a partial EUI is a wildcard */
+			for (i = 0; value[i] != '\0'; i++) {
+				if (!isxdigit((unsigned char)value[i]))
+					continue;
+				if (len == FILTER_EUI_LEN)
+					return 0;   /*!> longer than an EUI, never matches */
+				eui[len++] = toupper((unsigned char)value[i]);
+			}
+			eui[len] = '\0';
+			if (len == FILTER_EUI_LEN)
+				return filter_add_value(&index->set[t], strtoull(eui, NULL, 16));
+			return filter_add_part(&index->set[t], eui);
+		default:
+			num = strtoull(value, &end, t == LGW_FILTER_FPORT ? 10 : 16);
+			if (end == value || *end != '\0') {
+				MSG("%s[DB] ignore invalid filter key: %s\n", WARNMSG, key);
+				return 0;
+			}
+			return filter_add_value(&index->set[t], num);
+	}
+}
+
+/*!>! \internal
+ * \brief build the filter index from the committed filter tree
+ * \retval 0 index built in *out, NULL when the tree is empty
+ * \retval -1 the tree could not be read, nothing built
+ */
+static int filter_build(filter_index_s **out)
+{
+	filter_index_s *head = NULL, *index;
+	db_reader_s *reader;
+	const char *key;
+	int i, res;
+
+	if (!(reader = reader_get()))
+		return -1;
+
+	while ((res = sqlite3_step(reader->stmt[RD_FILTER])) == SQLITE_ROW) {
+		key = (const char *) sqlite3_column_text(reader->stmt[RD_FILTER], 0);
+		if (key && filter_add_key(&head, key)) {
+			MSG("%s[DB] out of memory building the filter index\n", ERRMSG);
+			break;
+		}
+	}
+	sqlite3_reset(reader->stmt[RD_FILTER]);
+	reader_put(reader);
+
+	if (res != SQLITE_DONE) {
+		filter_free(head);
+		return -1;
+	}
+
+	for (index = head; index; index = index->next) {
+		for (i = 0; i < LGW_FILTER_NB; i++) {
+			if (index->set[i].nb_value > 1)
+				qsort(index->set[i].value, index->set[i].nb_value, sizeof(uint64_t), filter_cmp);
+		}
+	}
+
+	*out = head;
+	return 0;
+}
+
+static void filter_refresh(void)
+{
+	filter_index_s *fresh, *old;
+	unsigned gen;
+
+	gen = lgw_db_generation(LGW_DB_TREE_FILTER);
+	if (gen == __atomic_load_n(&filter_built, __ATOMIC_ACQUIRE))
+		return;
+
+	/*!> one rebuild at a time, the others keep using the current index */
+	if (pthread_mutex_trylock(&mx_filter_build))
+		return;
+
+	/*!> keep the current index, the next lookup tries again */
+	if (filter_build(&fresh)) {
+		pthread_mutex_unlock(&mx_filter_build);
+		return;
+	}
+
+	pthread_rwlock_wrlock(&rw_filter);
+	old = filter_index;
+	filter_index = fresh;
+	__atomic_store_n(&filter_built, gen, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&rw_filter);
+
+	pthread_mutex_unlock(&mx_filter_build);
+
+	filter_free(old);
+}
+
+/*!>! \internal
+ * \note rw_filter is assumed to be held
+ */
+static filter_set_s *filter_find(const char *name, lgw_filter_type_e type)
+{
+	filter_index_s *index;
+
+	for (index = filter_index; index; index = index->next) {
+		if (!strcmp(index->name, name))
+			return &index->set[type];
+	}
+	return NULL;
+}
+
+bool lgw_db_filter_exist(const char *name, lgw_filter_type_e type, uint64_t value)
+{
+	bool found = false;
+	filter_set_s *set;
+	char eui[FILTER_EUI_LEN + 1];
+	int i;
+
+	if (type >= LGW_FILTER_NB)
+		return false;
+
+	filter_refresh();
+
+	pthread_rwlock_rdlock(&rw_filter);
+	set = filter_find(name, type);
+	if (set) {
+		found = set->nb_value > 0 && bsearch(&value, set->value, set->nb_value, sizeof(uint64_t), filter_cmp) != NULL;
+		if (!found && set->nb_part > 0) {
+			snprintf(eui, sizeof(eui), "%016" PRIX64, value);
+			for (i = 0; i < set->nb_part && !found; i++)
+				found = strstr(eui, set->part[i]) != NULL;
+		}
+	}
+	pthread_rwlock_unlock(&rw_filter);
+
+	return found;
 }
 
 int lgw_db_get(const char *family, const char *key, char *value, int valuelen)
@@ -455,62 +1149,128 @@ int lgw_db_get_allocated(const char *family, const char *key, char **out)
 int lgw_db_del(const char *family, const char *key)
 {
 	char fullkey[MAX_DB_FIELD];
-	size_t fullkey_len;
-	int res = 0;
+	char found, *value = &found;
+	const char *arg[1];
 
-	if (strlen(family) + strlen(key) + 2 > sizeof(fullkey) - 1) {
+	if (snprintf(fullkey, sizeof(fullkey), "/%s/%s", family, key) >= (int) sizeof(fullkey)) {
 		MSG("%s[DB] Family and key length must be less than %zu bytes\n", WARNMSG, sizeof(fullkey) - 3);
 		return -1;
 	}
 
-	fullkey_len = snprintf(fullkey, sizeof(fullkey), "/%s/%s", family, key);
+	/*!> a missing key is reported as before the writes were queued */
+	if (db_get_common(family, key, &value, 1))
+		return -1;
 
-	pthread_mutex_lock(&mx_dblock);
-	if (sqlite3_bind_text(del_stmt, 1, fullkey, fullkey_len, SQLITE_STATIC) != SQLITE_OK) {
-		MSG("%s[DB] Couldn't bind key to stmt: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
-		res = -1;
-	} else if (sqlite3_step(del_stmt) != SQLITE_DONE) {
-		MSG("%s[DB] Unable to find key '%s' in family '%s'\n", WARNMSG, key, family);
-		res = -1;
+	arg[0] = fullkey;
+	return db_queue_push(db_op_new(DB_OP_DEL, 1, arg));
+}
+
+/*!>! \internal
+ * \brief number of keys under prefix a deltree queued now deletes
+ *
+ * Committed keys not deleted in the overlay, plus the pending puts of keys
+ * not committed yet.
+ */
+static int db_tree_count(const char *prefix)
+{
+	size_t len = strlen(prefix);
+	db_overlay_s *entry, *copy, *pending = NULL;
+	db_reader_s *reader;
+	sqlite3_stmt *stmt;
+	char none, *p = &none;
+	int i, nb = 0, res = 0;
+
+	/*!> keys put and not committed yet, copied so that the lookups below do not hold mx_overlay */
+	pthread_mutex_lock(&mx_overlay);
+	for (i = 0; i < DB_OVERLAY_SIZE && !res; i++) {
+		for (entry = overlay_key[i]; entry; entry = entry->next) {
+			if (!entry->value || !tree_match(prefix, entry->key))
+				continue;
+			if (!(copy = overlay_new(entry->key, NULL, entry->seq))) {
+				res = -1;
+				break;
+			}
+			copy->next = pending;
+			pending = copy;
+		}
 	}
-	sqlite3_reset(del_stmt);
-	db_sync();
-	pthread_mutex_unlock(&mx_dblock);
+	pthread_mutex_unlock(&mx_overlay);
 
-	return res;
+	if (res || !(reader = reader_get())) {
+		nb = -1;
+		goto done;
+	}
+
+	stmt = reader->stmt[len ? RD_GETTREE : RD_GETTREE_ALL];
+	if (len && (sqlite3_bind_text(stmt, 1, prefix, len, SQLITE_STATIC) != SQLITE_OK)) {
+		MSG("%s[DB] Could not bind %s to stmt: %s\n", WARNMSG, prefix, sqlite3_errmsg(reader->db));
+		sqlite3_reset(stmt);
+		reader_put(reader);
+		nb = -1;
+		goto done;
+	}
+
+	while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (overlay_get((const char *) sqlite3_column_text(stmt, 0), &p, 0))
+			nb++;
+	}
+	sqlite3_reset(stmt);
+
+	if (res != SQLITE_DONE) {
+		MSG("%s[DB] Couldn't execute stmt: %s\n", WARNMSG, sqlite3_errmsg(reader->db));
+		reader_put(reader);
+		nb = -1;
+		goto done;
+	}
+
+	/*!> a pending put without a committed row adds a key */
+	stmt = reader->stmt[RD_GET];
+	for (entry = pending; entry; entry = entry->next) {
+		sqlite3_bind_text(stmt, 1, entry->key, -1, SQLITE_STATIC);
+		if (sqlite3_step(stmt) != SQLITE_ROW)
+			nb++;
+		sqlite3_reset(stmt);
+	}
+	reader_put(reader);
+
+done:
+	while ((entry = pending)) {
+		pending = entry->next;
+		lgw_free(entry);
+	}
+	return nb;
 }
 
 int lgw_db_deltree(const char *family, const char *keytree)
 {
-	sqlite3_stmt *stmt = deltree_stmt;
 	char prefix[MAX_DB_FIELD];
-	int res = 0;
+	const char *arg[1];
+	int res;
 
 	if (!lgw_strlen_zero(family)) {
 		if (!lgw_strlen_zero(keytree)) {
 			/*!> Family and key tree */
-			snprintf(prefix, sizeof(prefix), "/%s/%s", family, keytree);
+			res = snprintf(prefix, sizeof(prefix), "/%s/%s", family, keytree);
 		} else {
 			/*!> Family only */
-			snprintf(prefix, sizeof(prefix), "/%s", family);
+			res = snprintf(prefix, sizeof(prefix), "/%s", family);
+		}
+
+		/*!> a cut prefix would delete a wider tree */
+		if (res >= (int) sizeof(prefix)) {
+			MSG("%s[DB] Requested prefix is too long: %s\n", WARNMSG, family);
+			return -1;
 		}
 	} else {
 		prefix[0] = '\0';
-		stmt = deltree_all_stmt;
 	}
 
-	pthread_mutex_lock(&mx_dblock);
-	if (!lgw_strlen_zero(prefix) && (sqlite3_bind_text(stmt, 1, prefix, -1, SQLITE_STATIC) != SQLITE_OK)) {
-		MSG("%s[DB] Could bind %s to stmt: %s\n", WARNMSG, prefix, sqlite3_errmsg(GWDB));
-		res = -1;
-	} else if (sqlite3_step(stmt) != SQLITE_DONE) {
-		MSG("%s[DB] Couldn't execute stmt: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
-		res = -1;
-	}
-	res = sqlite3_changes(GWDB);
-	sqlite3_reset(stmt);
-	db_sync();
-	pthread_mutex_unlock(&mx_dblock);
+	if ((res = db_tree_count(prefix)) < 0)
+		return -1;
+
+	arg[0] = prefix;
+	if (db_queue_push(db_op_new(DB_OP_DELTREE, 1, arg)))
+		return -1;
 
 	return res;
 }
@@ -557,7 +1317,9 @@ static struct lgw_db_entry *db_gettree_common(sqlite3_stmt *stmt)
 struct lgw_db_entry *lgw_db_gettree(const char *family, const char *keytree)
 {
 	char prefix[MAX_DB_FIELD];
-	sqlite3_stmt *stmt = gettree_stmt;
+	db_read_stmt_e rd = RD_GETTREE;
+	db_reader_s *reader;
+	sqlite3_stmt *stmt;
 	size_t res = 0;
 	struct lgw_db_entry *ret;
 
@@ -576,20 +1338,23 @@ struct lgw_db_entry *lgw_db_gettree(const char *family, const char *keytree)
 		}
 	} else {
 		prefix[0] = '\0';
-		stmt = gettree_all_stmt;
+		rd = RD_GETTREE_ALL;
 	}
 
-	pthread_mutex_lock(&mx_dblock);
+	if (!(reader = reader_get()))
+		return NULL;
+
+	stmt = reader->stmt[rd];
 	if (res && (sqlite3_bind_text(stmt, 1, prefix, res, SQLITE_STATIC) != SQLITE_OK)) {
-		MSG("%s[DB] Could not bind %s to stmt: %s\n", WARNMSG, prefix, sqlite3_errmsg(GWDB));
+		MSG("%s[DB] Could not bind %s to stmt: %s\n", WARNMSG, prefix, sqlite3_errmsg(reader->db));
 		sqlite3_reset(stmt);
-		pthread_mutex_unlock(&mx_dblock);
+		reader_put(reader);
 		return NULL;
 	}
 
 	ret = db_gettree_common(stmt);
 	sqlite3_reset(stmt);
-	pthread_mutex_unlock(&mx_dblock);
+	reader_put(reader);
 
 	return ret;
 }
@@ -597,6 +1362,8 @@ struct lgw_db_entry *lgw_db_gettree(const char *family, const char *keytree)
 struct lgw_db_entry *lgw_db_gettree_by_prefix(const char *family, const char *key_prefix)
 {
 	char prefix[MAX_DB_FIELD];
+	db_reader_s *reader;
+	sqlite3_stmt *stmt;
 	size_t res;
 	struct lgw_db_entry *ret;
 
@@ -606,17 +1373,20 @@ struct lgw_db_entry *lgw_db_gettree_by_prefix(const char *family, const char *ke
 		return NULL;
 	}
 
-	pthread_mutex_lock(&mx_dblock);
-	if (sqlite3_bind_text(gettree_prefix_stmt, 1, prefix, res, SQLITE_STATIC) != SQLITE_OK) {
-		MSG("%s[DB] Could not bind %s to stmt: %s\n", WARNMSG, prefix, sqlite3_errmsg(GWDB));
-		sqlite3_reset(gettree_prefix_stmt);
-		pthread_mutex_unlock(&mx_dblock);
+	if (!(reader = reader_get()))
+		return NULL;
+
+	stmt = reader->stmt[RD_GETTREE_PREFIX];
+	if (sqlite3_bind_text(stmt, 1, prefix, res, SQLITE_STATIC) != SQLITE_OK) {
+		MSG("%s[DB] Could not bind %s to stmt: %s\n", WARNMSG, prefix, sqlite3_errmsg(reader->db));
+		sqlite3_reset(stmt);
+		reader_put(reader);
 		return NULL;
 	}
 
-	ret = db_gettree_common(gettree_prefix_stmt);
-	sqlite3_reset(gettree_prefix_stmt);
-	pthread_mutex_unlock(&mx_dblock);
+	ret = db_gettree_common(stmt);
+	sqlite3_reset(stmt);
+	reader_put(reader);
 
 	return ret;
 }
@@ -631,52 +1401,219 @@ void lgw_db_freetree(struct lgw_db_entry *dbe)
 	}
 }
 
-/*!>!
- * \internal
- * \brief Signal the GWDB sync thread to do its thing.
- *
- * \note mx_dblock is assumed to be held when calling this function.
+/*!>! \internal
+ * \brief apply one queued write on the write connection
  */
-static void db_sync(void)
+static int db_apply(db_op_s *op)
 {
-	dosync = 1;
-	pthread_cond_signal(&dbcond);
+	sqlite3_stmt *stmt = NULL;
+	int res = 0;
+
+	switch (op->type) {
+		case DB_OP_PUT:
+			stmt = put_stmt;
+			if (sqlite3_bind_text(stmt, 1, op->arg[0], -1, SQLITE_STATIC) != SQLITE_OK ||
+			    sqlite3_bind_text(stmt, 2, op->arg[1], -1, SQLITE_STATIC) != SQLITE_OK) {
+				MSG("%s[DB] Couldn't bind key to stmt: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
+				res = -1;
+			}
+			break;
+		case DB_OP_DEL:
+			stmt = del_stmt;
+			if (sqlite3_bind_text(stmt, 1, op->arg[0], -1, SQLITE_STATIC) != SQLITE_OK) {
+				MSG("%s[DB] Couldn't bind key to stmt: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
+				res = -1;
+			}
+			break;
+		case DB_OP_DELTREE:
+			if (lgw_strlen_zero(op->arg[0])) {
+				stmt = deltree_all_stmt;
+			} else {
+				stmt = deltree_stmt;
+				if (sqlite3_bind_text(stmt, 1, op->arg[0], -1, SQLITE_STATIC) != SQLITE_OK) {
+					MSG("%s[DB] Could bind %s to stmt: %s\n", WARNMSG, op->arg[0], sqlite3_errmsg(GWDB));
+					res = -1;
+				}
+			}
+			break;
+		case DB_OP_PUTPKT:
+			stmt = put_pkt_stmt;
+			if (sqlite3_bind_text(stmt, 1, op->arg[0], -1, SQLITE_STATIC) != SQLITE_OK ||
+			    sqlite3_bind_double(stmt, 2, op->freq) != SQLITE_OK ||
+			    sqlite3_bind_text(stmt, 3, op->arg[1], -1, SQLITE_STATIC) != SQLITE_OK ||
+			    sqlite3_bind_int(stmt, 4, op->cnt) != SQLITE_OK ||
+			    sqlite3_bind_text(stmt, 5, op->arg[2], -1, SQLITE_STATIC) != SQLITE_OK ||
+			    sqlite3_bind_text(stmt, 6, op->arg[3], -1, SQLITE_STATIC) != SQLITE_OK ||
+			    sqlite3_bind_text(stmt, 7, op->arg[4], -1, SQLITE_STATIC) != SQLITE_OK) {
+				MSG("%s[DB] Couldn't bind packet to stmt: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
+				res = -1;
+			}
+			break;
+	}
+
+	if (res == 0 && sqlite3_step(stmt) != SQLITE_DONE) {
+		MSG("%s[DB] Couldn't execute statement: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
+		res = -1;
+	}
+
+	sqlite3_reset(stmt);
+	return res;
+}
+
+static void db_put_counter(const char *key, uint32_t value)
+{
+	if (sqlite3_bind_text(put_stmt, 1, key, -1, SQLITE_STATIC) != SQLITE_OK ||
+	    sqlite3_bind_int64(put_stmt, 2, value) != SQLITE_OK ||
+	    sqlite3_step(put_stmt) != SQLITE_DONE) {
+		MSG("%s[DB] Couldn't write counter %s: %s\n", WARNMSG, key, sqlite3_errmsg(GWDB));
+	}
+	sqlite3_reset(put_stmt);
+}
+
+/*!>! \internal
+ * \brief write the packet counters and trim livepkts
+ * \note only called by db_write_thread, inside the batch transaction
+ */
+static void pkt_flush(void)
+{
+	uint32_t total = __atomic_load_n(&pkt_total, __ATOMIC_ACQUIRE);
+	char key[64], hour[16];
+	struct tm tm;
+	time_t t;
+	int i;
+
+	if (total == pkt_flushed)
+		return;
+
+	db_put_counter("/fwd/pkts/total", total);
+	db_put_counter("/fwd/pkts/up/total", __atomic_load_n(&pkt_up, __ATOMIC_RELAXED));
+	db_put_counter("/fwd/pkts/down/total", __atomic_load_n(&pkt_down, __ATOMIC_RELAXED));
+
+	for (i = 0; i < 2; i++) {
+		t = __atomic_load_n(&pkt_hour[i].hour, __ATOMIC_ACQUIRE) * 3600;
+		if (t == 0)
+			continue;
+		gmtime_r(&t, &tm);      /*!> hour is already local */
+		strftime(hour, sizeof(hour), "%m/%d-%H", &tm);
+		snprintf(key, sizeof(key), "/fwd/pkts/hours/up/%s", hour);
+		db_put_counter(key, __atomic_load_n(&pkt_hour[i].up, __ATOMIC_RELAXED));
+		snprintf(key, sizeof(key), "/fwd/pkts/hours/down/%s", hour);
+		db_put_counter(key, __atomic_load_n(&pkt_hour[i].down, __ATOMIC_RELAXED));
+	}
+
+	if (sqlite3_step(trim_pkt_stmt) != SQLITE_DONE)
+		MSG("%s[DB] Couldn't trim livepkts: %s\n", WARNMSG, sqlite3_errmsg(GWDB));
+	sqlite3_reset(trim_pkt_stmt);
+
+	pkt_flushed = total;
+}
+
+/*!>! \internal
+ * \brief commit a batch of queued writes, oldest first
+ * \retval 0 committed, the ops are freed
+ * \retval -1 rolled back, the ops are left to the caller, still queued and in the overlay
+ */
+static int db_apply_batch(db_op_s *batch)
+{
+	db_op_s *op, *next;
+	uint32_t flushed = pkt_flushed;
+	int nb = 0;
+
+	lgw_db_begin_transaction();
+	for (op = batch; op; op = op->next) {
+		db_apply(op);
+		nb++;
+	}
+	pkt_flush();
+	if (lgw_db_commit_transaction()) {
+		lgw_db_rollback_transaction();
+		pkt_flushed = flushed;
+		MSG("%s[DB] commit failed, %d write(s) kept for the next batch\n", WARNMSG, nb);
+		return -1;
+	}
+
+	/*!> committed, readers find it in the db now */
+	for (op = batch; op; op = next) {
+		next = op->next;
+		switch (op->type) {
+			case DB_OP_PUT:
+			case DB_OP_DEL:
+				overlay_drop(&overlay_key[overlay_hash(op->arg[0])], op->arg[0], op->seq);
+				db_touch(op->arg[0]);
+				break;
+			case DB_OP_DELTREE:
+				overlay_drop(&overlay_tree, op->arg[0], op->seq);
+				db_touch(lgw_strlen_zero(op->arg[0]) ? NULL : op->arg[0]);
+				break;
+			default:
+				break;
+		}
+		lgw_free(op);
+	}
+
+	__atomic_sub_fetch(&db_queue_len, nb, __ATOMIC_RELAXED);
+	return 0;
 }
 
 /*!>!
  * \internal
- * \brief GWDB sync thread
+ * \brief GWDB write thread
  *
- * This thread is in charge of syncing GWDB to disk after a change.
+ * This thread owns the write connection and applies the queued writes.
  * By pushing it off to this thread to take care of, this I/O bound operation
  * will not block other threads from performing other critical processing.
- * If changes happen rapidly, this thread will also ensure that the sync
- * operations are rate limited.
+ * If changes happen rapidly, this thread will also ensure that the commits
+ * are rate limited to about one a second.
  */
-static void *db_sync_thread()
+static void *db_write_thread()
 {
-	pthread_mutex_lock(&mx_dblock);
-	lgw_db_begin_transaction();
+	db_op_s *batch, *op, *prev;
+	db_op_s *retry = NULL;      /*!> ops of a batch rolled back, before the ones queued since */
+	struct timespec ts;
+
 	for (;;) {
-		/*!> If dosync is set, db_sync() was called during sleep(1),
-		 * and the pending transaction should be committed.
-		 * Otherwise, block until db_sync() is called.
-		 */
-		while (!dosync) {
-			pthread_cond_wait(&dbcond, &mx_dblock);
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += 1;
+		pthread_mutex_lock(&mx_wakeup);
+		while (!__atomic_load_n(&db_woken, __ATOMIC_ACQUIRE)) {
+			if (pthread_cond_timedwait(&cv_wakeup, &mx_wakeup, &ts) == ETIMEDOUT)
+				break;
 		}
-		dosync = 0;
-		if (lgw_db_commit_transaction()) {
-			lgw_db_rollback_transaction();
+		__atomic_store_n(&db_woken, false, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&mx_wakeup);
+
+		db_poll_version();
+
+		batch = __atomic_exchange_n(&db_queue, NULL, __ATOMIC_ACQUIRE);
+
+		/*!> the queue is LIFO, apply in the order of the calls */
+		for (prev = NULL; batch; batch = op) {
+			op = batch->next;
+			batch->next = prev;
+			prev = batch;
 		}
-		if (doexit) {
-			pthread_mutex_unlock(&mx_dblock);
-			break;
+		batch = prev;
+
+		if (retry) {
+			for (op = retry; op->next; op = op->next)
+				;
+			op->next = batch;
+			batch = retry;
+			retry = NULL;
+		}
+
+		if (batch && db_apply_batch(batch))
+			retry = batch;
+
+		if (__atomic_load_n(&doexit, __ATOMIC_ACQUIRE)) {
+			/*!> a commit failing at exit is not retried forever */
+			if (retry || __atomic_load_n(&db_queue, __ATOMIC_ACQUIRE) == NULL)
+				break;
+			continue;
 		}
-		lgw_db_begin_transaction();
-		pthread_mutex_unlock(&mx_dblock);
-		sleep(1);
-		pthread_mutex_lock(&mx_dblock);
+
+		if (batch)
+			sleep(1);
 	}
 
 	return NULL;
@@ -688,18 +1625,22 @@ static void *db_sync_thread()
  */
 static void gwdb_atexit(void)
 {
-	/*!> Set doexit to 1 to kill thread. db_sync must be called with
-	 * mutex held. */
-	pthread_mutex_lock(&mx_dblock);
-	doexit = 1;
-	db_sync();
-	pthread_mutex_unlock(&mx_dblock);
+	int i;
+
+	/*!> db_write_thread drains the queue before it leaves */
+	__atomic_store_n(&doexit, 1, __ATOMIC_RELEASE);
+	db_wakeup();
+	pthread_join(writethread, NULL);
+
+	for (i = 0; i < DB_READERS; i++) {
+		pthread_mutex_lock(&db_reader[i].lock);
+		if (db_reader[i].db)
+			reader_close(&db_reader[i]);
+		pthread_mutex_unlock(&db_reader[i].lock);
+	}
 
-	pthread_join(syncthread, NULL);
-	pthread_mutex_lock(&mx_dblock);
 	clean_statements();
 	sqlite3_close_v2(GWDB);
-	pthread_mutex_unlock(&mx_dblock);
 }
 
 int import_devskey(void *notuse, int argc, char **value, char **name)
@@ -733,7 +1674,15 @@ int import_filter(void *notuse, int argc, char **value, char **name)
 
 int lgw_db_init(void)
 {
-	pthread_cond_init(&dbcond, NULL);
+	pthread_condattr_t cattr;
+	int i;
+
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cv_wakeup, &cattr);
+	pthread_condattr_destroy(&cattr);
+	for (i = 0; i < DB_READERS; i++)
+		pthread_mutex_init(&db_reader[i].lock, NULL);
 
 	if (db_init()) {
 		return -1;
@@ -749,9 +1698,7 @@ int lgw_db_init(void)
 	//db_exec_sql(CREATE_TB_ABP_SQL, NULL, NULL);
 	//db_exec_sql("DELETE FROM abpdevs", NULL, NULL);
 	//db_exec_sql("ATTACH `/etc/lora/devskey` as a;INSERT OR REPLACE INTO abpdevs SELECT * FROM a.abpdevs;", NULL, NULL);
-	db_exec_sql(CREATE_TRG_CLEAN_PKT, NULL, NULL);
-	db_exec_sql(CREATE_TRG_UP_HOURS, NULL, NULL);
-	db_exec_sql(CREATE_TRG_DOWN_HOURS, NULL, NULL);
+	db_exec_sql(DROP_TRG_SQL, NULL, NULL);
 	db_exec_sql("ATTACH DATABASE '/etc/lora/devskey' AS a", NULL, NULL);
 	db_exec_sql(CREATE_TB_FILTER_SQL, NULL, NULL);
     db_exec_sql("SELECT devaddr, appskey, nwkskey FROM a.abpdevs", import_devskey, NULL);
@@ -763,7 +1710,9 @@ int lgw_db_init(void)
         return -1;
     }
 
-	if (pthread_create(&syncthread, NULL, db_sync_thread, NULL)) {
+	db_poll_version();
+
+	if (pthread_create(&writethread, NULL, db_write_thread, NULL)) {
 	    sqlite3_close_v2(GWDB);
 		return -1;
 	}
@@ -33,47 +33,45 @@
 #include <inttypes.h>  
 #include <math.h>
 #include <errno.h>
-
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <sqlite3.h>
+#include <stddef.h>
 
 #include "fwd.h"
 #include "service.h"
 #include "delay_service.h"
+#include "journal.h"
 
 #include "timersync.h"
 #include "loragw_aux.h"
 
 #include "loragw_hal.h"
 
-#define CREATE_TB_DELAY_PKTS "CREATE TABLE IF NOT EXISTS delay_pkts(id INTEGER PRIMARY KEY AUTOINCREMENT, payload BLOB, size INTEGER);"
-
-const char *store_pkts = "INSERT OR REPLACE INTO delay_pkts (payload, size) VALUES (?, ?);";
-const char *get_pkts = "SELECT id, payload, size FROM delay_pkts ORDER BY id LIMIT ?;";
-const char *del_pkts = "DELETE FROM delay_pkts WHERE id < ?;";
-
-static sqlite3* delay_db;
-static sqlite3_stmt *store_pkts_stmt;
-static sqlite3_stmt *get_pkts_stmt;
-static sqlite3_stmt *del_pkts_stmt;
-static sqlite3_stmt *count_pkts_stmt;
-static char *err_msg = 0;
+/*!> a journal record is the packet up to its payload, then the payload bytes used */
+#define DELAY_REC_HDR           offsetof(struct lgw_pkt_rx_s, payload)
+#define DELAY_JOURNAL_TAG       ((uint32_t)(sizeof(struct lgw_pkt_rx_s) << 16 | DELAY_REC_HDR))
+#define DELAY_SYNC_S            2       /*!> records stored while offline reach the disk at least this often */
 
-static bool has_db_storage = false;
+static struct journal_s delay_journal;
+static pthread_mutex_t mx_delay_journal = PTHREAD_MUTEX_INITIALIZER;
+static bool has_journal = false;
 
 DECLARE_GW;
 
 typedef struct _delay_pkt {
-    struct lgw_pkt_rx_s *rxpkt;
-    uint8_t nb_pkt;
+    struct lgw_pkt_rx_s rxpkt;
     LGW_LIST_ENTRY(_delay_pkt) list;
 } delay_pkt_s;
 
+/*!> one entry per packet, a pool object is the size of a packet whatever the batch */
+static lgw_slab_s delay_pkt_slab = LGW_SLAB_INIT("delay_pkt", sizeof(delay_pkt_s), 16);
+
 LGW_LIST_HEAD_STATIC(delay_pkt_list, _delay_pkt);    /*?> defined data list for delay package */
 
 static bool delay_service_status_alive = false;
 
+/*!> replay budget, in packets, refilled at delay_replay_rate up to one second worth */
+static double replay_tokens = 0;
+static struct timespec replay_last;
+
 static void delay_package_thread(void* arg);
 
 int delay_start(serv_s* serv) {
@@ -81,9 +79,25 @@ int delay_start(serv_s* serv) {
     if (!GW.cfg.delay_enabled)
         return -1;
 
+    clock_gettime(CLOCK_MONOTONIC, &replay_last);
+    replay_tokens = 0;
+
+    if (GW.cfg.delay_journal_dir[0] != '\0') {
+        if (journal_open(&delay_journal, GW.cfg.delay_journal_dir, (uint64_t)GW.cfg.delay_quota_kb * 1024, DELAY_JOURNAL_TAG) == -1) {
+            lgw_log(LOG_WARNING, "%s[\033[1;34mDELAY\033[m] Unable to open journal '%s': %s, packets are kept in memory\n", WARNMSG, GW.cfg.delay_journal_dir, strerror(errno));
+        } else {
+            has_journal = true;
+            lgw_log(LOG_INFO, "%s[\033[1;34mDELAY\033[m] journal '%s' opened, %u packet(s) to replay\n", INFOMSG, GW.cfg.delay_journal_dir, delay_journal.nb_pending);
+        }
+    }
+
     if (lgw_pthread_create_background(&serv->thread.t_up, NULL, (void *(*)(void *))delay_package_thread, serv)) {
         lgw_log(LOG_WARNING, "%s[%s] Can't create delay push up pthread.\n", WARNMSG, serv->info.name);
         serv->state.live = false;
+        if (has_journal) {
+            journal_close(&delay_journal);
+            has_journal = false;
+        }
         return -1;
     }
 
@@ -93,34 +107,10 @@ int delay_start(serv_s* serv) {
     serv->state.startup_time = time(NULL);  //UTC seconds
     serv->state.connecting = false;
 
-    LGW_LIST_LOCK(&GW.rxpkts_list);
-    GW.info.service_count++;
-    LGW_LIST_UNLOCK(&GW.rxpkts_list);
+    rxpkt_attach(serv);
     lgw_db_put("service/delay", serv->info.name, "running");
     lgw_db_put("thread", serv->info.name, "running");
 
-    if (GW.cfg.delay_db_path[0] != '\0') {
-    if (sqlite3_open(GW.cfg.delay_db_path, &delay_db) != SQLITE_OK) {
-            lgw_log(LOG_WARNING, "%s[\033[1;34mDELAY\033[m] Unable to open storage database '%s': %s\n", WARNMSG, GW.cfg.delay_db_path, sqlite3_errmsg(delay_db));
-        } else if (sqlite3_exec(delay_db, CREATE_TB_DELAY_PKTS, NULL, 0, &err_msg) != SQLITE_OK) {
-            lgw_log(LOG_WARNING, "%s[\033[1;34mDELAY\033[m] Unable to create storage tables.\n", WARNMSG);
-            sqlite3_free(err_msg);
-        } else if (sqlite3_prepare_v2(delay_db, store_pkts, -1, &store_pkts_stmt, 0) != SQLITE_OK) {
-            lgw_log(LOG_WARNING, "%s[\033[1;34mDELAY\033[m] Unable prepare store_pkts stmt : %s\n", WARNMSG, sqlite3_errmsg(delay_db));
-        } else if (sqlite3_prepare_v2(delay_db, get_pkts, -1, &get_pkts_stmt, 0) != SQLITE_OK) {
-            lgw_log(LOG_WARNING, "%s[\033[1;34mDELAY\033[m] Unable prepare get_pkts stmt : %s\n", WARNMSG, sqlite3_errmsg(delay_db));
-        } else if (sqlite3_prepare_v2(delay_db, del_pkts, -1, &del_pkts_stmt, 0) != SQLITE_OK) {
-            lgw_log(LOG_WARNING, "%s[\033[1;34mDELAY\033[m] Unable prepare del_pkts stmt : %s\n", WARNMSG, sqlite3_errmsg(delay_db));
-        } else if (sqlite3_prepare_v2(delay_db, "SELECT COUNT(*) FROM delay_pkts", -1, &count_pkts_stmt, 0) != SQLITE_OK) {
-            lgw_log(LOG_WARNING, "%s[\033[1;34mDELAY\033[m] Unable prepare count_pkts stmt : %s\n", WARNMSG, sqlite3_errmsg(delay_db));
-        } else 
-            has_db_storage = true;
-
-        if (!has_db_storage) {
-            sqlite3_close_v2(delay_db);
-        }
-    }
-
     return 0;
 }
 
@@ -134,168 +124,198 @@ int delay_stop(serv_s* serv) {
 
     serv->state.live = false;
     delay_service_status_alive = false;
-    LGW_LIST_LOCK(&GW.rxpkts_list);
-    GW.info.service_count--;
-    LGW_LIST_UNLOCK(&GW.rxpkts_list);
+    rxpkt_detach(serv);
     lgw_db_del("service/delay", serv->info.name);
     lgw_db_del("thread", serv->info.name);
 
-    if (has_db_storage) {
-        sqlite3_finalize(store_pkts_stmt);
-        sqlite3_finalize(get_pkts_stmt);
-        sqlite3_finalize(del_pkts_stmt);
-        sqlite3_finalize(count_pkts_stmt);
-        sqlite3_close_v2(delay_db);
+    if (has_journal) {
+        pthread_mutex_lock(&mx_delay_journal);
+        journal_close(&delay_journal);
+        has_journal = false;
+        pthread_mutex_unlock(&mx_delay_journal);
     }
 
     return 0;
 }
 
+static int delay_replay_budget(int max) {
+    struct timespec now;
+    int budget;
+
+    if (GW.cfg.delay_replay_rate == 0)
+        return max;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    replay_tokens += difftimespec(now, replay_last) * GW.cfg.delay_replay_rate;
+    replay_last = now;
+    if (replay_tokens > GW.cfg.delay_replay_rate)
+        replay_tokens = GW.cfg.delay_replay_rate;
+
+    budget = (int)replay_tokens;
+    return (budget < max) ? budget : max;
+}
+
+static void delay_journal_sync(struct timespec *last_sync) {
+    pthread_mutex_lock(&mx_delay_journal);
+    journal_sync(&delay_journal);
+    pthread_mutex_unlock(&mx_delay_journal);
+    clock_gettime(CLOCK_MONOTONIC, last_sync);
+}
+
 int delay_pkt_get(int max, struct lgw_pkt_rx_s *pkt_data) {	/*!> Calculate the number of available packets */
     
     if (!GW.info.network_status || (!delay_service_status_alive) || (max < 1)) 
         return 0;
 
-    uint8_t nb_pkt = 0;
+    int nb_pkt = 0, len;
     
-    if (!has_db_storage) { 
+    if (!has_journal) { 
         if (delay_pkt_list.size < 1)
             return 0;
+        max = delay_replay_budget(max);
         delay_pkt_s *entry = NULL;
         LGW_LIST_LOCK(&delay_pkt_list);
         LGW_LIST_TRAVERSE_SAFE_BEGIN(&delay_pkt_list, entry, list) {
-            if ((nb_pkt + entry->nb_pkt) > max)
+            if (nb_pkt >= max)
                 break;
-            memcpy(pkt_data, entry->rxpkt, sizeof(struct lgw_pkt_rx_s) * entry->nb_pkt);
-            nb_pkt += entry->nb_pkt;
-            pkt_data += entry->nb_pkt;
+            memcpy(pkt_data, &entry->rxpkt, sizeof(struct lgw_pkt_rx_s));
+            nb_pkt++;
+            pkt_data++;
             LGW_LIST_REMOVE_CURRENT(list);
-            lgw_free(entry->rxpkt);
-            lgw_free(entry);
+            lgw_slab_free(&delay_pkt_slab, entry);
             delay_pkt_list.size--;
         }
         LGW_LIST_TRAVERSE_SAFE_END;
         LGW_LIST_UNLOCK(&delay_pkt_list);
 
-        lgw_log(LOG_DEBUG, "%s[\033[1;34mDELAY\033[m] get %i, remain %i packet(s)\n", DEBUGMSG, nb_pkt, delay_pkt_list.size);
+        if (nb_pkt > 0)
+            lgw_log(LOG_DEBUG, "%s[\033[1;34mDELAY\033[m] get %i, remain %i packet(s)\n", DEBUGMSG, nb_pkt, delay_pkt_list.size);
 
     } else {
-        int count = 0;
-
-        if (sqlite3_step(count_pkts_stmt) == SQLITE_ROW) {
-            count = sqlite3_column_int(count_pkts_stmt, 0);
-            sqlite3_reset(count_pkts_stmt);
-        }
-
-        if (count == 0) {
-            return 0;
-        }
-
-        uint32_t id = 0; 
-        const void *rxpkt = NULL;
-        int pkts = 0;
-
-        sqlite3_bind_int(get_pkts_stmt, 1, max);
-
-        while (sqlite3_step(get_pkts_stmt) == SQLITE_ROW && (nb_pkt < max)) {
-            rxpkt = sqlite3_column_blob(get_pkts_stmt, 1);
-            pkts = sqlite3_column_int(get_pkts_stmt, 2);
-            if (nb_pkt + pkts > max)
-                break;
-            id = sqlite3_column_int(get_pkts_stmt, 0);
-            memcpy(pkt_data, rxpkt, sizeof(struct lgw_pkt_rx_s) * pkts);
-            pkt_data += pkts;
-            nb_pkt += pkts;
-        };
-
-        sqlite3_reset(get_pkts_stmt);
-
-        lgw_log(LOG_DEBUG, "%s[\033[1;34mDELAY\033[m] get %i packets from db storage.\n", DEBUGMSG, nb_pkt);
-
-        if (id > 0) {
-            sqlite3_bind_int(del_pkts_stmt, 1, id + 1);
-            pkts = sqlite3_column_count(del_pkts_stmt);
-            sqlite3_step(del_pkts_stmt);
-            sqlite3_reset(del_pkts_stmt);
-            lgw_log(LOG_DEBUG, "%s[\033[1;34mDELAY\033[m] remove %i packets from db storage.\n", DEBUGMSG, pkts);
+        pthread_mutex_lock(&mx_delay_journal);
+        if (delay_journal.nb_pending > 0) {
+            max = delay_replay_budget(max);
+            /*!> a record has the layout of the packet, it is read in place */
+            while (nb_pkt < max && (len = journal_read(&delay_journal, pkt_data, sizeof(struct lgw_pkt_rx_s))) > 0) {
+                if ((size_t)len != DELAY_REC_HDR + pkt_data->size)
+                    continue;
+                nb_pkt++;
+                pkt_data++;
+            }
+            if (nb_pkt > 0)
+                journal_commit(&delay_journal);
         }
+        pthread_mutex_unlock(&mx_delay_journal);
 
+        if (nb_pkt > 0)
+            lgw_log(LOG_DEBUG, "%s[\033[1;34mDELAY\033[m] get %i packets from journal, remain %u\n", DEBUGMSG, nb_pkt, delay_journal.nb_pending);
     }
 
+    replay_tokens -= nb_pkt;
+
     return nb_pkt;
 }
 
 static void delay_package_thread(void* arg) {
     serv_s* serv = (serv_s*) arg;
 
-    int count = 0, i = 0;
+    int i = 0, nb_pkt = 0;
+    bool unsynced = false;
 
     struct lgw_pkt_rx_s *p; 
+    struct lgw_pkt_rx_s rxpkt[NB_PKT_MAX];
+    struct timespec now, last_sync, deadline;
+    delay_pkt_s *entry;
 
     lgw_log(LOG_INFO, "%s[THREAD][%s-UP] Starting....\n", INFOMSG, serv->info.name);
 
+    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+
     while (!serv->thread.stop_sig) {
 
-        sem_wait(&serv->thread.sema);
+        if (unsynced) {
+            /*!> the last packets stored are not left in the page cache for long */
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += DELAY_SYNC_S;
+            if (sem_timedwait(&serv->thread.sema, &deadline) == -1 && errno == ETIMEDOUT) {
+                delay_journal_sync(&last_sync);
+                unsynced = false;
+                continue;
+            }
+        } else {
+            sem_wait(&serv->thread.sema);
+        }
 
         do {
-            serv_ct_s *serv_ct = lgw_malloc(sizeof(serv_ct_s));
-            serv_ct->serv = serv;
+            serv_ct_s *serv_ct = serv_ct_new(serv);
+            if (serv_ct == NULL)
+                break;
             serv_ct->nb_pkt = get_rxpkt(serv_ct);     
                                                       
             if (GW.info.network_status || (serv_ct->nb_pkt == 0)) { 
-                lgw_free(serv_ct);
+                serv_ct_free(serv_ct);
                 break;
             }
             
             p = &serv_ct->rxpkt[0];
             if (p->if_chain == IF_DELAY) {
-                lgw_free(serv_ct);
+                serv_ct_free(serv_ct);
                 continue;
             }
 
-            for (i = 0; i < serv_ct->nb_pkt; i++) {
-                p = &serv_ct->rxpkt[i];
-                p->if_chain = IF_DELAY;
+            /*!> the batch is shared with the other services, tag a private copy */
+            nb_pkt = serv_ct->nb_pkt;
+            memcpy(rxpkt, serv_ct->rxpkt, nb_pkt * sizeof(struct lgw_pkt_rx_s));
+            serv_ct_free(serv_ct);
+
+            for (i = 0; i < nb_pkt; i++) {
+                rxpkt[i].if_chain = IF_DELAY;
             }
 
-            if (!has_db_storage) {
-                delay_pkt_s *entry = lgw_malloc(sizeof(delay_pkt_s));
-                entry->rxpkt = lgw_malloc(sizeof(struct lgw_pkt_rx_s) * serv_ct->nb_pkt);
-                entry->nb_pkt = serv_ct->nb_pkt;
-                memcpy(entry->rxpkt, serv_ct->rxpkt, serv_ct->nb_pkt * sizeof(struct lgw_pkt_rx_s));
+            if (!has_journal) {
                 LGW_LIST_LOCK(&delay_pkt_list);
-                LGW_LIST_INSERT_TAIL(&delay_pkt_list, entry, list);
-                if (delay_pkt_list.size > DELAY_PKTS_MAX) {
-                    entry = LGW_LIST_REMOVE_HEAD(&delay_pkt_list, list);
-                    lgw_free(entry->rxpkt);
-                    lgw_free(entry);
-                    delay_pkt_list.size--;
-                    lgw_log(LOG_DEBUG, "%s[\033[1;34mDELAY\033[m] Do Remove, overload MAXPKTS!\n", DEBUGMSG);
+                for (i = 0; i < nb_pkt; i++) {
+                    if (delay_pkt_list.size >= DELAY_PKTS_MAX) {
+                        /*!> full, the oldest entry is recycled for the newest packet */
+                        entry = LGW_LIST_REMOVE_HEAD(&delay_pkt_list, list);
+                        delay_pkt_list.size--;
+                        lgw_log(LOG_DEBUG, "%s[\033[1;34mDELAY\033[m] Do Remove, overload MAXPKTS!\n", DEBUGMSG);
+                    } else {
+                        entry = lgw_slab_alloc(&delay_pkt_slab);
+                        if (entry == NULL) {
+                            lgw_log(LOG_WARNING, "%s[\033[1;34mDELAY\033[m] out of memory, drop %d packet(s) of the batch\n", WARNMSG, nb_pkt - i);
+                            break;
+                        }
+                    }
+                    entry->rxpkt = rxpkt[i];
+                    entry->list.next = NULL;
+                    LGW_LIST_INSERT_TAIL(&delay_pkt_list, entry, list);
                 }
                 LGW_LIST_UNLOCK(&delay_pkt_list);
                 lgw_log(LOG_DEBUG, "%s[\033[1;34mDELAY\033[m] Store package, total %d \n", DEBUGMSG, delay_pkt_list.size);
             } else {
-                sqlite3_bind_blob(store_pkts_stmt, 1, serv_ct->rxpkt, serv_ct->nb_pkt * sizeof(struct lgw_pkt_rx_s), SQLITE_STATIC);
-                sqlite3_bind_int(store_pkts_stmt, 2,  serv_ct->nb_pkt);
-                sqlite3_step(store_pkts_stmt);
-                sqlite3_reset(store_pkts_stmt);
-
-                if (sqlite3_step(count_pkts_stmt) == SQLITE_ROW) {
-                    count = sqlite3_column_int(count_pkts_stmt, 0);
-                    sqlite3_reset(count_pkts_stmt);
+                pthread_mutex_lock(&mx_delay_journal);
+                for (i = 0; i < nb_pkt; i++) {
+                    if (journal_append(&delay_journal, &rxpkt[i], DELAY_REC_HDR + rxpkt[i].size) == -1) {
+                        lgw_log(LOG_WARNING, "%s[\033[1;34mDELAY\033[m] Unable to store packet in journal: %s\n", WARNMSG, strerror(errno));
+                        break;
+                    }
+                }
+                pthread_mutex_unlock(&mx_delay_journal);
+
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                if (difftimespec(now, last_sync) >= DELAY_SYNC_S) {
+                    delay_journal_sync(&last_sync);
+                    unsynced = false;
+                } else {
+                    unsynced = true;
                 }
 
-                lgw_log(LOG_DEBUG, "%s[\033[1;34mDELAY\033[m] Store %u package, total %d \n", DEBUGMSG, serv_ct->nb_pkt, count);
+                lgw_log(LOG_DEBUG, "%s[\033[1;34mDELAY\033[m] Store %u package, total %u, %u lost to the quota\n", DEBUGMSG, nb_pkt, delay_journal.nb_pending, delay_journal.nb_dropped);
             }
 
-            lgw_free(serv_ct);
-
-            wait_ms(100);
-
-        } while (GW.rxpkts_list.size > 1 && (!serv->thread.stop_sig));
+        } while (rxpkt_pending(serv) && (!serv->thread.stop_sig));
     }
 
     lgw_log(LOG_INFO, "\n%s[THREAD][%s-UP] Ended!\n", INFOMSG, serv->info.name);
 }
-
@@ -54,6 +54,9 @@
 #include <getopt.h>
 #include <limits.h>
 #include <semaphore.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sched.h>              /*!> sched_yield */
 
 #include "fwd.h"
 #include "parson.h"
@@ -64,6 +67,10 @@
 #include "stats.h"
 #include "timersync.h"
 #include "uart.h"
+#include "lbt.h"
+#include "sscan.h"
+#include "gpsframe.h"
+#include "metrics.h"
 
 #include "loragw_gps.h"
 #include "loragw_aux.h"
@@ -76,13 +83,14 @@ volatile bool quit_sig = false;	/*!> 1 -> application terminates without shuttin
 /*!> -------------------------------------------------------------------------- */
 /*!> --- privite DECLARATION ---------------------------------------- */
 
+/*!> uplink batches come and go with every fetch, serv_ct with every read of the services */
+static lgw_slab_s rxpkts_slab = LGW_SLAB_INIT_CACHE("rxpkts", sizeof(rxpkts_s), 4, 1);  /*!> ~11KB each, at most one idle per thread */
+static lgw_slab_s serv_ct_slab = LGW_SLAB_INIT("serv_ct", sizeof(serv_ct_s), 16);
+
 /*!> -------------------------------------------------------------------------- */
 /*!> --- PUBLIC DECLARATION ---------------------------------------- */
 
 uint32_t cur_hal_time = 0;
-int pthread_count = 0;
-
-pthread_mutex_t mx_pthread_count = PTHREAD_MUTEX_INITIALIZER;
 
 // initialize GW
 INIT_GW;
@@ -168,7 +176,6 @@ void lgw_unregister_atexit(void (*func)(void))
 
 static void sig_handler(int sigio);
 
-static bool lbt_getchan_stat(int fd, uint32_t freq_hz, int8_t rssi_target, uint16_t scan_time_ms);
 
 /*!> threads */
 static void thread_up(void);
@@ -177,7 +184,6 @@ static void thread_valid(void);
 static void thread_jit(void);
 static void thread_watchdog(void);
 static void thread_rxpkt_recycle(void);
-static void thread_lbt_scan(void);
 
 #ifdef SX1302MOD
 static void thread_spectral_scan(void);
@@ -321,33 +327,25 @@ int send_tx_ack(serv_s* serv, uint8_t token_h, uint8_t token_l, enum jit_error_e
                 memcpy((void *)(buff_ack + buff_index), (void *)"\"COLLISION_PACKET\"", 18);
                 buff_index += 18;
                 /*!> update stats */
-                pthread_mutex_lock(&serv->report->mx_report);
-                serv->report->stat_down.meas_nb_tx_rejected_collision_packet += 1;
-                pthread_mutex_unlock(&serv->report->mx_report);
+                STAT_ADD(serv->report, STAT_BLK_DOWN, stat_down.meas_nb_tx_rejected_collision_packet, 1);
                 break;
             case JIT_ERROR_TOO_LATE:
                 memcpy((void *)(buff_ack + buff_index), (void *)"\"TOO_LATE\"", 10);
                 buff_index += 10;
                 /*!> update stats */
-                pthread_mutex_lock(&serv->report->mx_report);
-                serv->report->stat_down.meas_nb_tx_rejected_too_late += 1;
-                pthread_mutex_unlock(&serv->report->mx_report);
+                STAT_ADD(serv->report, STAT_BLK_DOWN, stat_down.meas_nb_tx_rejected_too_late, 1);
                 break;
             case JIT_ERROR_TOO_EARLY:
                 memcpy((void *)(buff_ack + buff_index), (void *)"\"TOO_EARLY\"", 11);
                 buff_index += 11;
                 /*!> update stats */
-                pthread_mutex_lock(&serv->report->mx_report);
-                serv->report->stat_down.meas_nb_tx_rejected_too_early += 1;
-                pthread_mutex_unlock(&serv->report->mx_report);
+                STAT_ADD(serv->report, STAT_BLK_DOWN, stat_down.meas_nb_tx_rejected_too_early, 1);
                 break;
             case JIT_ERROR_COLLISION_BEACON:
                 memcpy((void *)(buff_ack + buff_index), (void *)"\"COLLISION_BEACON\"", 18);
                 buff_index += 18;
                 /*!> update stats */
-                pthread_mutex_lock(&serv->report->mx_report);
-                serv->report->stat_down.meas_nb_tx_rejected_collision_beacon += 1;
-                pthread_mutex_unlock(&serv->report->mx_report);
+                STAT_ADD(serv->report, STAT_BLK_DOWN, stat_down.meas_nb_tx_rejected_collision_beacon, 1);
                 break;
             case JIT_ERROR_TX_FREQ:
                 memcpy((void *)(buff_ack + buff_index), (void *)"\"TX_FREQ\"", 9);
@@ -412,25 +410,139 @@ void print_tx_status(uint8_t tx_status) {
     }
 }
 
+/*!> -------------------------------------------------------------------------- */
+/*!> --- UPLINK RING ---------------------------------------------------------- */
+
+void rxpkt_attach(serv_s* serv) {
+    /*!> a batch published meanwhile is read or lapped like any other */
+    __atomic_store_n(&serv->rxbus.cursor, __atomic_load_n(&GW.rxring.head, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    __atomic_store_n(&serv->rxbus.attached, true, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&GW.info.service_count, 1, __ATOMIC_RELAXED);
+}
+
+void rxpkt_detach(serv_s* serv) {
+    __atomic_store_n(&serv->rxbus.attached, false, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&GW.info.service_count, 1, __ATOMIC_RELAXED);
+}
+
+bool rxpkt_pending(serv_s* serv) {
+    return __atomic_load_n(&serv->rxbus.cursor, __ATOMIC_ACQUIRE) != __atomic_load_n(&GW.rxring.head, __ATOMIC_ACQUIRE);
+}
+
+static void rxpkt_unref(rxpkts_s* batch) {
+    if (batch != NULL && __atomic_sub_fetch(&batch->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        lgw_slab_free(&rxpkts_slab, batch);
+}
+
+serv_ct_s* serv_ct_new(serv_s* serv) {
+    serv_ct_s* serv_ct = lgw_slab_zalloc(&serv_ct_slab);
+
+    if (serv_ct != NULL)
+        serv_ct->serv = serv;
+    return serv_ct;
+}
+
+void serv_ct_free(serv_ct_s* serv_ct) {
+    if (serv_ct == NULL)
+        return;
+    release_rxpkt(serv_ct);
+    lgw_slab_free(&serv_ct_slab, serv_ct);
+}
+
+void release_rxpkt(serv_ct_s* serv_ct) {
+    rxpkt_unref(serv_ct->batch);
+    serv_ct->batch = NULL;
+    serv_ct->rxpkt = NULL;
+    serv_ct->rxmeta = NULL;
+    serv_ct->nb_pkt = 0;
+}
+
 int get_rxpkt(serv_ct_s* serv_ct) {
-    int ret = 0;
-    rxpkts_s* rxpkt_entry;
+    uint32_t cursor;
+    rxpkts_s* batch = NULL;
     serv_s* serv = serv_ct->serv;
 
-    LGW_LIST_LOCK(&GW.rxpkts_list);
-    LGW_LIST_TRAVERSE(&GW.rxpkts_list, rxpkt_entry, list) {
+    release_rxpkt(serv_ct);
+
+    for (;;) {
+        cursor = __atomic_load_n(&serv->rxbus.cursor, __ATOMIC_ACQUIRE);
+        if (cursor == __atomic_load_n(&GW.rxring.head, __ATOMIC_ACQUIRE))
+            break;
 
-        if (serv->info.stamp == (serv->info.stamp & rxpkt_entry->stamps))
+        /*!> read section: put_rxpkt keeps the ring reference of the slot until it is closed */
+        __atomic_add_fetch(&serv->rxbus.gp, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        batch = __atomic_load_n(&GW.rxring.slot[cursor & (RXPKTS_RING_SIZE - 1)], __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&batch->refcnt, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&serv->rxbus.gp, 1, __ATOMIC_RELEASE);
+
+        /*!> the slot may have been replaced, or the cursor lapped, since it was read */
+        if (batch->seq == cursor &&
+            __atomic_compare_exchange_n(&serv->rxbus.cursor, &cursor, cursor + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+        rxpkt_unref(batch);
+        batch = NULL;
+    }
+
+    if (batch == NULL)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &serv_ct->dequeue_time);
+    metrics_observe_ts(METRICS_RX_DEQUEUE, &batch->fetch_time, &serv_ct->dequeue_time);
+
+    serv_ct->batch = batch;
+    serv_ct->rxpkt = batch->rxpkt;
+    serv_ct->rxmeta = batch->meta;
+    return batch->nb_pkt;
+}
+
+/*!> only called by thread_up, the ring takes over the reference of batch */
+static void put_rxpkt(rxpkts_s* batch) {
+    uint32_t head = GW.rxring.head;
+    uint32_t cursor, gp;
+    rxpkts_s* old;
+    serv_s* serv_entry = NULL;
+    int i;
+
+    batch->entry_us = cur_hal_time;
+    batch->refcnt = 1;
+    batch->seq = head;
+
+    /*!> parsed once here, every service reads the same header */
+    for (i = 0; i < batch->nb_pkt; i++)
+        mac_meta_parse(&batch->meta[i], batch->rxpkt[i].payload, batch->rxpkt[i].size);
+
+    /*!> free the slot: readers still one whole ring behind lose their oldest batch */
+    LGW_LIST_TRAVERSE(&GW.serv_list, serv_entry, list) {
+        if (!__atomic_load_n(&serv_entry->rxbus.attached, __ATOMIC_ACQUIRE))
             continue;
-        
-        rxpkt_entry->stamps |= serv->info.stamp;
-        memcpy(serv_ct->rxpkt, rxpkt_entry->rxpkt, sizeof(struct lgw_pkt_rx_s) * rxpkt_entry->nb_pkt);
-        rxpkt_entry->bind--;
-        ret = rxpkt_entry->nb_pkt;
-        break;
+        cursor = __atomic_load_n(&serv_entry->rxbus.cursor, __ATOMIC_ACQUIRE);
+        while (head - cursor >= RXPKTS_RING_SIZE) {
+            if (!__atomic_compare_exchange_n(&serv_entry->rxbus.cursor, &cursor, cursor + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                continue;   /*!> the reader moved, check again */
+            __atomic_add_fetch(&serv_entry->rxbus.overrun, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&GW.rxring.nb_overrun, 1, __ATOMIC_RELAXED);
+            lgw_log(LOG_DEBUG, "%s[%s-UP] uplink ring overrun, drop oldest batch (total=%u)\n", DEBUGMSG, serv_entry->info.name, serv_entry->rxbus.overrun);
+            break;
+        }
+    }
+
+    old = GW.rxring.slot[head & (RXPKTS_RING_SIZE - 1)];
+    __atomic_store_n(&GW.rxring.slot[head & (RXPKTS_RING_SIZE - 1)], batch, __ATOMIC_RELEASE);
+    __atomic_store_n(&GW.rxring.head, head + 1, __ATOMIC_RELEASE);
+
+    /*!> wait for the read sections which may have seen old, not for the ones opened since */
+    if (old != NULL) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        LGW_LIST_TRAVERSE(&GW.serv_list, serv_entry, list) {
+            gp = __atomic_load_n(&serv_entry->rxbus.gp, __ATOMIC_ACQUIRE);
+            while ((gp & 1) && __atomic_load_n(&serv_entry->rxbus.gp, __ATOMIC_ACQUIRE) == gp)
+                sched_yield();
+        }
     }
-    LGW_LIST_UNLOCK(&GW.rxpkts_list);
-    return ret;
+
+    /*!> services which still read it hold their own reference */
+    rxpkt_unref(old);
 }
 
 /*!> -------------------------------------------------------------------------- */
@@ -456,6 +568,7 @@ int main(int argc, char *argv[]) {
     pthread_t thrid_timersync;
 #endif
     pthread_t thrid_watchdog;
+    pthread_t thrid_metrics;
 
     /*!> Parse command line options */
     while( (i = getopt( argc, argv, "hc:" )) != -1 )
@@ -482,6 +595,9 @@ int main(int argc, char *argv[]) {
     strcpy(GW.hal.board, "sx1302");
 #endif
 
+    /*!> messages are written by the logger thread from now on */
+    lgw_log_start();
+
     /*!> display version informations */
     lgw_log(LOG_INFO, "*** Dragino Packet Forwarder for Lora Gateway ***\n");
     lgw_log(LOG_INFO, "*** LoRa concentrator HAL library version info %s ***\n", lgw_version_info());
@@ -530,7 +646,7 @@ int main(int argc, char *argv[]) {
     }
 
     if (GW.lbt.lbt_tty_enabled) {
-        if (lgw_pthread_create(&thrid_lbt_scan, NULL, (void *(*)(void *))thread_lbt_scan, NULL))
+        if (lgw_pthread_create(&thrid_lbt_scan, NULL, (void *(*)(void *))thread_lbt, NULL))
             lgw_log(LOG_ERROR, "%s[FWD] impossible to create lbt scan thread\n", ERRMSG);
     }
 
@@ -698,8 +814,8 @@ int main(int argc, char *argv[]) {
         lgw_db_put("thread", "thread_rxpkt_recycle", "running");
 
     /*!> JIT queue initialization */
-    jit_queue_init(&GW.tx.jit_queue[0]);
-    jit_queue_init(&GW.tx.jit_queue[1]);
+    jit_queue_init(&GW.tx.jit_queue[0], GW.cfg.jit_queue_size);
+    jit_queue_init(&GW.tx.jit_queue[1], GW.cfg.jit_queue_size);
 
     // Timer synchronization needed for downstream ...
 #ifdef SX1301MOD
@@ -753,6 +869,15 @@ int main(int argc, char *argv[]) {
             lgw_db_put("thread", "thread_watchdog", "running");
     }
 
+    /*!> spawn thread for the metrics endpoint */
+    if (GW.cfg.metrics_port > 0) {
+        if (lgw_pthread_create(&thrid_metrics, NULL, (void *(*)(void *))thread_metrics, NULL)) {
+            lgw_log(LOG_ERROR, "%s[FWD] impossible to create metrics thread\n", ERRMSG);
+            GW.cfg.metrics_port = 0;    /*!> nothing to join */
+        } else
+            lgw_db_put("thread", "thread_metrics", "running");
+    }
+
     /*!> for debug
     LGW_LIST_TRAVERSE(&GW.serv_list, serv_entry, list) { 
         printf("servname: %s\n", serv_entry->info.name);
@@ -818,8 +943,11 @@ int main(int argc, char *argv[]) {
     }
 #endif
 
+    if (GW.cfg.metrics_port > 0)
+        pthread_join(thrid_metrics, NULL);	/*!> its poll is bounded, it sees exit_sig shortly */
+
     if (GW.lbt.lbt_tty_enabled) {
-        pthread_cancel(thrid_lbt_scan);	    /*!> don't wait for timer sync thread */
+        pthread_join(thrid_lbt_scan, NULL);	/*!> its epoll wait is bounded, it sees exit_sig shortly */
     }
 
     stop_clean_service();
@@ -847,6 +975,8 @@ int main(int argc, char *argv[]) {
 
     }
 
+    lgw_log_stop();
+
     printf("%sExiting packet forwarder program\n", INFOMSG);
     exit(EXIT_SUCCESS);
 }
@@ -856,12 +986,13 @@ int main(int argc, char *argv[]) {
 
 static void thread_up(void) {
 
-    /*!> allocate memory for packet fetching and processing */
-    struct lgw_pkt_rx_s rxpkt[NB_PKT_MAX];	/*!> array containing inbound packets + metadata */
+    /*!> packets are fetched straight into the batch handed over to the services */
+    rxpkts_s* batch = NULL;
+    struct lgw_pkt_rx_s* rxpkt;
     int nb_pkt;
+    int fetch_sleep_ms = FETCH_SLEEP_MIN_MS;
     //uint32_t lastest_us = 0;
 
-    rxpkts_s *rxpkt_entry = NULL;
     serv_s* serv_entry = NULL;
 
 
@@ -869,6 +1000,16 @@ static void thread_up(void) {
 
     while (!exit_sig && !quit_sig) {
 
+        if (batch == NULL) {
+            batch = lgw_slab_alloc(&rxpkts_slab);   /*!> not cleared, thread_up fills what the services read */
+            if (batch == NULL) {
+                lgw_log(LOG_ERROR, "%s[fwd-UP] can't allocate uplink batch\n", ERRMSG);
+                wait_ms(FETCH_SLEEP_MAX_MS);
+                continue;
+            }
+        }
+        rxpkt = batch->rxpkt;
+
         /*!> fetch packets */
 
         if (GW.cfg.radiostream_enabled == true) {
@@ -882,7 +1023,9 @@ static void thread_up(void) {
         if (nb_pkt == LGW_HAL_ERROR) {
             lgw_log(LOG_ERROR, "%s[fwd-UP] HAL receive failed, try restart HAL\n", ERRMSG);
             //exit(EXIT_FAILURE);
+            nb_pkt = 0;
         }
+        batch->nb_radio = nb_pkt;
 
         if (GW.cfg.ghoststream_enabled == true)
             nb_pkt = ghost_get(NB_PKT_MAX - nb_pkt, &rxpkt[nb_pkt]) + nb_pkt;
@@ -890,43 +1033,35 @@ static void thread_up(void) {
         if (GW.cfg.delay_enabled == true)
             nb_pkt = delay_pkt_get(NB_PKT_MAX - nb_pkt, &rxpkt[nb_pkt]) + nb_pkt;  
 
-        /*!> wait a short time if no packets, nor status report */
-        if (nb_pkt == 0) {
-            wait_ms(DEFAULT_FETCH_SLEEP_MS);
+        /*!> back off exponentially while idle, the concentrator FIFO keeps what arrives meanwhile */
+        if (nb_pkt <= 0) {
+            wait_ms(fetch_sleep_ms);
+            fetch_sleep_ms = (fetch_sleep_ms * 2 > FETCH_SLEEP_MAX_MS) ? FETCH_SLEEP_MAX_MS : fetch_sleep_ms * 2;
             continue;
         }
 
         //lastest_us = rxpkt[0].count_us;
 
-        rxpkt_entry = lgw_malloc(sizeof(rxpkts_s));     //rxpkts结构体包含有一个lora_pkt_rx_s结构数组
-
-        if (NULL == rxpkt_entry) {
-            continue;
-        }
-
-        rxpkt_entry->list.next = NULL;
-        rxpkt_entry->entry_us = cur_hal_time;
-        rxpkt_entry->stamps = 0;
-        rxpkt_entry->nb_pkt = nb_pkt;
-        rxpkt_entry->bind = GW.info.service_count;
-        memcpy(rxpkt_entry->rxpkt, rxpkt, sizeof(struct lgw_pkt_rx_s) * nb_pkt);
+        batch->nb_pkt = nb_pkt;
+        clock_gettime(CLOCK_MONOTONIC, &batch->fetch_time);
+        put_rxpkt(batch);
+        batch = NULL;
 
-        LGW_LIST_LOCK(&GW.rxpkts_list);
-        LGW_LIST_INSERT_TAIL(&GW.rxpkts_list, rxpkt_entry, list);
-        LGW_LIST_UNLOCK(&GW.rxpkts_list);
-
-        lgw_log(LOG_DEBUG, "%s[fwd-UP] Size of package list is %d\n", DEBUGMSG, GW.rxpkts_list.size);
-            
         LGW_LIST_TRAVERSE(&GW.serv_list, serv_entry, list) {
             if (sem_post(&serv_entry->thread.sema)) {
                 lgw_log(LOG_DEBUG, "%s[%s-UP] post sem: %s\n", DEBUGMSG, serv_entry->info.name, strerror(errno));
             }
         }
 
-        wait_ms(DEFAULT_FETCH_SLEEP_MS);
+        /*!> a full batch means more is likely pending, fetch again right away */
+        fetch_sleep_ms = FETCH_SLEEP_MIN_MS;
+        if (nb_pkt < NB_PKT_MAX)
+            wait_ms(fetch_sleep_ms);
 
     }
 
+    lgw_slab_free(&rxpkts_slab, batch);
+
     lgw_log(LOG_INFO, "%s[THREAD][fwd-UP] Ended!\n", INFOMSG);
 }
 
@@ -935,9 +1070,8 @@ static void thread_up(void) {
 
 static void thread_rxpkt_recycle(void) {
     int time_ms = 1000;  
-    int deal = 0;
+    uint32_t overrun = 0, last_overrun = 0;
 
-    rxpkts_s* rxpkt_entry = NULL;
     serv_s* serv_entry = NULL;
 
     lgw_log(LOG_INFO, "%s[THREAD][RECYCLE] Starting...\n", INFOMSG);
@@ -946,46 +1080,18 @@ static void thread_rxpkt_recycle(void) {
 
         wait_ms(time_ms);
 
-        if (GW.rxpkts_list.size > 1) {   
-            LGW_LIST_TRAVERSE(&GW.serv_list, serv_entry, list) {
-                if (sem_post(&serv_entry->thread.sema))
-                    lgw_log(LOG_DEBUG, "%s[%s-recycle] post sema: %s\n", DEBUGMSG, serv_entry->info.name, strerror(errno));
-            }
-        }
-
-        if (GW.rxpkts_list.size > DEFAULT_RXPKTS_LIST_SIZE) {   
-
-            deal = 0;
-
-            LGW_LIST_LOCK(&GW.rxpkts_list);
-            LGW_LIST_TRAVERSE_SAFE_BEGIN(&GW.rxpkts_list, rxpkt_entry, list) {
-                /*!> 16s = 2 * rxwindows + N */
-                if ((cur_hal_time - rxpkt_entry->entry_us > 16000000) || (rxpkt_entry->bind < 1)) {
-                    LGW_LIST_REMOVE_CURRENT(list);
-                    lgw_free(rxpkt_entry);
-                    GW.rxpkts_list.size--;
-                    deal++;
-                }
-            }
-            LGW_LIST_TRAVERSE_SAFE_END;
-            LGW_LIST_UNLOCK(&GW.rxpkts_list);
-            lgw_log(LOG_DEBUG, "%s[RECYCLE]  recycle deal(=%d), remain(=%d)\n", DEBUGMSG, deal, GW.rxpkts_list.size);
+        /*!> slots are released by the readers themselves, only wake up the ones left behind */
+        LGW_LIST_TRAVERSE(&GW.serv_list, serv_entry, list) {
+            if (!serv_entry->rxbus.attached || !rxpkt_pending(serv_entry))
+                continue;
+            if (sem_post(&serv_entry->thread.sema))
+                lgw_log(LOG_DEBUG, "%s[%s-recycle] post sema: %s\n", DEBUGMSG, serv_entry->info.name, strerror(errno));
         }
 
-        if (GW.rxpkts_list.size > MAX_RXPKTS_LIST_SIZE) {   
-            deal = 0;
-            LGW_LIST_LOCK(&GW.rxpkts_list);
-            LGW_LIST_TRAVERSE_SAFE_BEGIN(&GW.rxpkts_list, rxpkt_entry, list) {
-                if ((cur_hal_time - rxpkt_entry->entry_us > 12000000) || (rxpkt_entry->bind < 1)) {
-                    LGW_LIST_REMOVE_CURRENT(list);
-                    lgw_free(rxpkt_entry);
-                    GW.rxpkts_list.size--;
-                    deal++;
-                }
-            }
-            LGW_LIST_TRAVERSE_SAFE_END;
-            LGW_LIST_UNLOCK(&GW.rxpkts_list);
-            lgw_log(LOG_DEBUG, "%s[RECYCLE] remove entry_us > 12s, deal(=%d), remain(=%d)\n", DEBUGMSG, deal, GW.rxpkts_list.size);
+        overrun = __atomic_load_n(&GW.rxring.nb_overrun, __ATOMIC_RELAXED);
+        if (overrun != last_overrun) {
+            lgw_log(LOG_WARNING, "%s[RECYCLE] uplink ring overrun, %u batches lost by slow services (total=%u)\n", WARNMSG, overrun - last_overrun, overrun);
+            last_overrun = overrun;
         }
     }
 
@@ -1001,28 +1107,25 @@ static void thread_jit(void) {
     enum jit_error_e jit_result;
     enum jit_pkt_type_e pkt_type;
     uint8_t tx_status;
+    struct jit_meta_s pkt_meta;
     bool chanisfree = true;
-    bool matching = false;   //匹配lbt查找
-    int i, j;
+    int i;
+    uint32_t seq, delay_us, next_us;
+    struct timespec send_start, send_end;
 
     lgw_log(LOG_INFO, "%s[THREAD][JIT] starting...\n", INFOMSG);
 
     while (!exit_sig && !quit_sig) {
-        wait_ms(10);
+        /*!> taken before peeking, an enqueue racing with this pass cuts the wait short */
+        seq = jit_queue_seq();
 
         for (i = 0; i < LGW_RF_CHAIN_NB; i++) {
             /*!> transfer data and metadata to the concentrator, and schedule TX */
-#ifdef SX1302MOD
-            pthread_mutex_lock(&GW.hal.mx_concent);
-            lgw_get_instcnt(&cur_hal_time);
-            pthread_mutex_unlock(&GW.hal.mx_concent);
-#else
             get_concentrator_time(&cur_hal_time);
-#endif
             jit_result = jit_peek(&GW.tx.jit_queue[i], cur_hal_time, &pkt_index);
             if (jit_result == JIT_ERROR_OK) {
                 if (pkt_index > -1) {
-                    jit_result = jit_dequeue(&GW.tx.jit_queue[i], pkt_index, &pkt, &pkt_type);
+                    jit_result = jit_dequeue(&GW.tx.jit_queue[i], pkt_index, &pkt, &pkt_type, &pkt_meta);
                     if (jit_result == JIT_ERROR_OK) {
                         /*!> update beacon stats */
                         if (pkt_type == JIT_PKT_TYPE_BEACON) {
@@ -1059,25 +1162,16 @@ static void thread_jit(void) {
                         }
 
                         /*!> send packet to concentrator */
-                        if (GW.lbt.lbt_tty_enabled) {
-                            matching = false;
-                            for (j = 0; j < NB_LBT_QUEUE; j++) {
-                                if (pkt.count_us == GW.lbt.lbt_stat[j].count_us) { 
-                                    chanisfree = GW.lbt.lbt_stat[j].chan_is_free;
-                                    matching = true;
-                                    break;
-                                }
-                            }
-                            if (!matching) {
-                                lgw_log(LOG_DEBUG, "%s[LBT] time not matching\n", DEBUGMSG);
-                                chanisfree = false;
-                            }
-                        }
+                        if (GW.lbt.lbt_tty_enabled)
+                            chanisfree = lbt_chan_is_free(pkt_meta.id, pkt.count_us);
 
                         if (chanisfree) {
                             pthread_mutex_lock(&GW.hal.mx_concent); /*!> may have to wait for a fetch to finish */
+                            clock_gettime(CLOCK_MONOTONIC, &send_start);
                             result = lgw_send(&pkt);
+                            clock_gettime(CLOCK_MONOTONIC, &send_end);
                             pthread_mutex_unlock(&GW.hal.mx_concent); /*!> free concentrator ASAP */
+                            metrics_observe_ts(METRICS_LGW_SEND, &send_start, &send_end);
                         } else {
                             result = LGW_LBT_ISSUE;
                         }
@@ -1109,6 +1203,18 @@ static void thread_jit(void) {
                 lgw_log(LOG_ERROR, "%s[JIT] jit_peek failed on rf_chain %d with %d\n", ERRMSG, i, jit_result);
             }
         }
+
+        /*!> sleep until the earliest packet enters its programming window, or something new is queued */
+        delay_us = JIT_WAIT_MAX_US;
+        for (i = 0; i < LGW_RF_CHAIN_NB; i++) {
+            next_us = jit_next_delay(&GW.tx.jit_queue[i], cur_hal_time);
+            if (next_us < delay_us)
+                delay_us = next_us;
+        }
+        if (delay_us < JIT_WAIT_MIN_US)
+            delay_us = JIT_WAIT_MIN_US;
+
+        jit_wait(seq, delay_us);
     }
 
     lgw_log(LOG_INFO, "%s[THREAD][JIT] ENDED!\n", INFOMSG);
@@ -1118,10 +1224,13 @@ static void thread_jit(void) {
 /*!> -------------------------------------------------------------------------- */
 /*!> --- THREAD 4: PARSE GPS MESSAGE AND KEEP GATEWAY IN SYNC ----------------- */
 
-static void gps_process_sync(void) {
+static void gps_process_sync(const struct timespec *arrival) {
     struct timespec gps_time;
     struct timespec utc;
+    struct timespec now;
     uint32_t trig_tstamp;		/*!> concentrator timestamp associated with PPM pulse */
+    uint32_t now_tstamp;
+    uint32_t trig_age_us, frame_age_us;
     int i = lgw_gps_get(&utc, &gps_time, NULL, NULL);
 
     /*!> get GPS time for synchronization */
@@ -1139,6 +1248,19 @@ static void gps_process_sync(void) {
         return;
     }
 
+    /*!> the frame tells the time of the PPS before it: the trigger has to be
+     *   older than the frame, by less than a second, or it latched another PPS */
+    if (get_concentrator_time(&now_tstamp) == 0) {
+        clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+        frame_age_us = (uint32_t)(1E6 * difftimespec(now, *arrival));
+        trig_age_us = now_tstamp - trig_tstamp;
+        if (trig_age_us < frame_age_us || trig_age_us - frame_age_us > GPS_PPS_MSG_MAX_US) {
+            lgw_log(LOG_TIMERSYNC, "%s[GPS] PPS and time message do not match (PPS %uus ago, message %uus ago), skipped\n", WARNMSG, trig_age_us, frame_age_us);
+            return;
+        }
+        lgw_log(LOG_TIMERSYNC, "%s[GPS] time message %uus after its PPS\n", DEBUGMSG, trig_age_us - frame_age_us);
+    }
+
     /*!> try to update time reference with the new GPS time & timestamp */
     pthread_mutex_lock(&GW.gps.mx_timeref);
     i = lgw_gps_sync(&GW.gps.time_reference_gps, trig_tstamp, utc, gps_time);
@@ -1171,109 +1293,70 @@ static void gps_process_coords(void) {
 static void thread_gps(void) {
     /*!> serial variables */
     char serial_buff[128];		/*!> buffer to receive GPS data */
-    size_t wr_idx = 0;			/*!> pointer to end of chars in buffer */
+    struct gps_framer_s framer;	/*!> frame being assembled, kept across reads */
+    struct pollfd pfd;
+    struct timespec arrival;	/*!> time the last read returned */
+    ssize_t nb_char;
+    size_t rd_idx, frame_size;
+    bool complete;
+    int ready;
     int retries = 0;
 
     /*!> variables for PPM pulse GPS synchronization */
     enum gps_msg latest_msg;	/*!> keep track of latest NMEA message parsed */
 
     lgw_log(LOG_INFO, "%s[GPS] GPS thread starting\n", INFOMSG);
-    /*!> initialize some variables before loop */
-    memset(serial_buff, 0, sizeof serial_buff);
+    gps_framer_init(&framer);
 
-    while (!exit_sig && !quit_sig) {
-        size_t rd_idx = 0;
-        size_t frame_end_idx = 0;
+    /*!> read what is there as soon as it is there, instead of LGW_GPS_MIN_MSG_SIZE bytes */
+    fcntl(GW.gps.gps_tty_fd, F_SETFL, fcntl(GW.gps.gps_tty_fd, F_GETFL) | O_NONBLOCK);
+    pfd.fd = GW.gps.gps_tty_fd;
+    pfd.events = POLLIN;
 
-        /*!> blocking non-canonical read on serial port */
-        ssize_t nb_char = read(GW.gps.gps_tty_fd, serial_buff + wr_idx, LGW_GPS_MIN_MSG_SIZE);
+    while (!exit_sig && !quit_sig) {
+        /*!> bounded wait, so that exit is noticed */
+        ready = poll(&pfd, 1, 1000);
+        nb_char = ready > 0 ? read(GW.gps.gps_tty_fd, serial_buff, sizeof(serial_buff)) : 0;
         if (nb_char <= 0) {
+            if (nb_char < 0 && errno == EAGAIN)
+                continue;
             if ((++retries % 10) == 0) {
-                lgw_log(LOG_WARNING, "%s[GPS] read() returned value %d\n", WARNMSG, nb_char);
+                lgw_log(LOG_WARNING, "%s[GPS] read() returned value %d\n", WARNMSG, (int)nb_char);
                 retries = 0;
             }
-            wait_ms(1000); 
+            if (ready > 0)
+                wait_ms(1000);  /*!> error or hang up, do not spin on it */
             continue;
         }
+        clock_gettime(CLOCK_MONOTONIC_RAW, &arrival);
 
         retries = 0;
 
-        wr_idx += (size_t) nb_char;
-
-        /*!>******************************************
-         * Scan buffer for UBX/NMEA sync chars and *
-         * attempt to decode frame if one is found *
-         *******************************************/
-        while (rd_idx < wr_idx) {
-            size_t frame_size = 0;
-
-            /*!> Scan buffer for UBX sync char */
-            if (serial_buff[rd_idx] == (char)LGW_GPS_UBX_SYNC_CHAR) {
-
-                /*!>**********************
-                 * Found UBX sync char *
-                 ***********************/
-                latest_msg = lgw_parse_ubx(&serial_buff[rd_idx], (wr_idx - rd_idx), &frame_size);
-
-                if (frame_size > 0) {
-                    if (latest_msg == INCOMPLETE) {
-                        /*!> UBX header found but frame appears to be missing bytes */
-                        frame_size = 0;
-                    } else if (latest_msg == INVALID) {
-                        /*!> message header received but message appears to be corrupted */
-                        lgw_log(LOG_WARNING, "%s[GPS] could not get a valid message from GPS (no time)\n", WARNMSG);
-                        frame_size = 0;
-                    } else if (latest_msg == UBX_NAV_TIMEGPS) {
-                        gps_process_sync();
-                    }
-                }
-            } else if (serial_buff[rd_idx] == LGW_GPS_NMEA_SYNC_CHAR) {
-                /*!>***********************
-                 * Found NMEA sync char *
-                 ************************/
-                /*!> scan for NMEA end marker (LF = 0x0a) */
-                char *nmea_end_ptr = memchr(&serial_buff[rd_idx], (int)0x0a, (wr_idx - rd_idx));
-
-                if (nmea_end_ptr) {
-                    /*!> found end marker */
-                    frame_size = nmea_end_ptr - &serial_buff[rd_idx] + 1;
-                    latest_msg = lgw_parse_nmea(&serial_buff[rd_idx], frame_size);
-
-                    if (latest_msg == INVALID || latest_msg == UNKNOWN) {
-                        /*!> checksum failed */
-                        frame_size = 0;
-                    } else if (latest_msg == NMEA_GGA) {	/*!> Get location from GGA frames */
-                        gps_process_coords();
-                    } else if (latest_msg == NMEA_RMC) {	/*!> Get time/date from RMC frames */
-                        gps_process_sync();
-                    }
-                }
-            }
+        /*!> Decode the frames completed by these bytes */
+        for (rd_idx = 0; rd_idx < (size_t)nb_char; ) {
+            rd_idx += gps_framer_feed(&framer, serial_buff + rd_idx, nb_char - rd_idx, &arrival, &complete);
+            if (!complete)
+                continue;
 
-            if (frame_size > 0) {
-                /*!> At this point message is a checksum verified frame
-                   we're processed or ignored. Remove frame from buffer */
-                rd_idx += frame_size;
-                frame_end_idx = rd_idx;
+            if (framer.type == GPS_FRAME_UBX) {
+                latest_msg = lgw_parse_ubx(framer.frame, framer.len, &frame_size);
+                if (latest_msg == INVALID) {
+                    /*!> message header received but message appears to be corrupted */
+                    lgw_log(LOG_WARNING, "%s[GPS] could not get a valid message from GPS (no time)\n", WARNMSG);
+                } else if (latest_msg == UBX_NAV_TIMEGPS) {
+                    gps_process_sync(&framer.arrival);
+                }
             } else {
-                rd_idx++;
+                latest_msg = lgw_parse_nmea(framer.frame, framer.len);
+                if (latest_msg == NMEA_GGA) {	/*!> Get location from GGA frames */
+                    gps_process_coords();
+                } else if (latest_msg == NMEA_RMC) {	/*!> Get time/date from RMC frames */
+                    gps_process_sync(&framer.arrival);
+                }
             }
-        }/*!> ...for(rd_idx = 0... */
-
-        if (frame_end_idx) {
-            /*!> Frames have been processed. Remove bytes to end of last processed frame */
-            memcpy(serial_buff, &serial_buff[frame_end_idx], wr_idx - frame_end_idx);
-            wr_idx -= frame_end_idx;
-        }
-
-        /*!> ...for(rd_idx = 0... */
-        /*!> Prevent buffer overflow */
-        if ((sizeof(serial_buff) - wr_idx) < LGW_GPS_MIN_MSG_SIZE) {
-            memcpy(serial_buff, &serial_buff[LGW_GPS_MIN_MSG_SIZE], wr_idx - LGW_GPS_MIN_MSG_SIZE);
-            wr_idx -= LGW_GPS_MIN_MSG_SIZE;
         }
     }
-    lgw_log(LOG_INFO, "%s[GPS] End of GPS thread\n", INFOMSG);
+    lgw_log(LOG_INFO, "%s[GPS] End of GPS thread (%u frames dropped)\n", INFOMSG, framer.nb_dropped);
 }
 
 /*!> -------------------------------------------------------------------------- */
@@ -1369,22 +1452,68 @@ static void thread_watchdog(void) {
 /*!> -------------------------------------------------------------------------- */
 /*!> --- THREAD : BACKGROUND SPECTRAL SCAN                                  --- */
 #ifdef SX1302MOD
+
+#define SSCAN_CHAN_STEP_HZ      200000  /*!> channel width of a scan */
+#define SSCAN_POLL_MS           10      /*!> status polling period once the scan should be over */
+#define SSCAN_GUARD_MS          20      /*!> kept free before the next downlink is programmed */
+#define SSCAN_TIMEOUT_MS        2000
+
+/*!> time before the JiT thread programs its next downlink, JIT_DELAY_NONE when nothing is queued */
+static uint32_t sscan_next_downlink_us(void) {
+    uint32_t now_us, delay_us, next_us = JIT_DELAY_NONE;
+    int i;
+
+    if (get_concentrator_time(&now_us) != 0)
+        return next_us;     /*!> the TX status check before the scan still applies */
+    for (i = 0; i < LGW_RF_CHAIN_NB; i++) {
+        delay_us = jit_next_delay(&GW.tx.jit_queue[i], now_us);
+        if (delay_us < next_us)
+            next_us = delay_us;
+    }
+    return next_us;
+}
+
 static void thread_spectral_scan(void) {
     int i, x;
+    uint8_t chan = 0;
+    uint32_t sweep = 0;
     uint32_t freq_hz = GW.spectral_scan_params.freq_hz_start;
-    uint32_t freq_hz_stop = GW.spectral_scan_params.freq_hz_start + GW.spectral_scan_params.nb_chan * 200E3;
+    uint32_t scan_ms = SSCAN_POLL_MS;   /*!> duration of the last scan, the next one should take as long */
+    uint32_t next_us;
     int16_t levels[LGW_SPECTRAL_SCAN_RESULT_SIZE];
     uint16_t results[LGW_SPECTRAL_SCAN_RESULT_SIZE];
     struct timeval tm_start;
+    struct timespec t_start, t_end, utc;
     lgw_spectral_scan_status_t status;
     uint8_t tx_status = TX_FREE;
     bool spectral_scan_started;
     bool exit_thread = false;
+    struct sscan_ring_s ring;
+    struct sscan_rec_s rec;
+    bool ring_ok = false;
+    int export_sock = -1;
+
+    _Static_assert(SSCAN_NB_BINS == LGW_SPECTRAL_SCAN_RESULT_SIZE, "sscan record does not match the HAL result size");
+
+    if (GW.spectral_scan_params.ring_records > 0) {
+        if (sscan_ring_create(&ring, GW.spectral_scan_params.ring_path, GW.spectral_scan_params.ring_records) == 0) {
+            ring_ok = true;
+            lgw_log(LOG_INFO, "%s[SCAN] results in %s (%u records, %u so far)\n", INFOMSG, GW.spectral_scan_params.ring_path, GW.spectral_scan_params.ring_records, sscan_ring_head(&ring));
+        } else {
+            lgw_log(LOG_ERROR, "%s[SCAN] cannot map %s (%s)\n", ERRMSG, GW.spectral_scan_params.ring_path, strerror(errno));
+        }
+    }
+    if (GW.spectral_scan_params.export_host[0] != '\0') {
+        export_sock = sscan_export_open(GW.spectral_scan_params.export_host, GW.spectral_scan_params.export_port);
+        if (export_sock == -1)
+            lgw_log(LOG_ERROR, "%s[SCAN] cannot export to %s:%s\n", ERRMSG, GW.spectral_scan_params.export_host, GW.spectral_scan_params.export_port);
+    }
 
     /*!> main loop task */
     while (!exit_sig && !quit_sig) {
         /*!> Pace the scan thread (1 sec min), and avoid waiting several seconds when exit */
-        for (i = 0; i < (int)(GW.spectral_scan_params.pace_s ? GW.spectral_scan_params.pace_s : 1); i++) {
+        /*!> in sweep mode, the channels of a sweep are scanned back to back */
+        for (i = 0; (!GW.spectral_scan_params.sweep || chan == 0) && i < (int)(GW.spectral_scan_params.pace_s ? GW.spectral_scan_params.pace_s : 1); i++) {
             if (exit_sig || quit_sig) {
                 exit_thread = true;
                 break;
@@ -1395,6 +1524,14 @@ static void thread_spectral_scan(void) {
             break;
         }
 
+        /*!> Let the next downlink go first when the scan would not be over before it is programmed */
+        while (!exit_sig && !quit_sig) {
+            next_us = sscan_next_downlink_us();
+            if (next_us == JIT_DELAY_NONE || next_us / 1000 > scan_ms + SSCAN_GUARD_MS)
+                break;
+            wait_ms(next_us / 1000 + SSCAN_GUARD_MS);
+        }
+
         spectral_scan_started = false;
 
         /*!> Start spectral scan (if no downlink programmed) */
@@ -1418,165 +1555,111 @@ static void thread_spectral_scan(void) {
             if (x != 0) {
                 lgw_log(LOG_ERROR, "%s[SCAN] spectral scan start failed\n", ERRMSG);
                 pthread_mutex_unlock(&GW.hal.mx_concent);
+                wait_ms(SSCAN_TIMEOUT_MS);
                 continue; /*!> main while loop */
             }
             spectral_scan_started = true;
+            clock_gettime(CLOCK_MONOTONIC, &t_start);
         }
         pthread_mutex_unlock(&GW.hal.mx_concent);
 
-        if (spectral_scan_started == true) {
-            /*!> Wait for scan to be completed */
-            status = LGW_SPECTRAL_SCAN_STATUS_UNKNOWN;
-            timeout_start(&tm_start);
-            do {
-                /*!> handle timeout */
-                if (timeout_check(tm_start, 2000) != 0) {
-                    lgw_log(LOG_ERROR, "%s%s: [SCAN] TIMEOUT on Spectral Scan\n", ERRMSG, __FUNCTION__);
-                    break;  /*!> do while */
-                }
+        if (spectral_scan_started == false) {
+            wait_ms(scan_ms);   /*!> the same channel is tried again */
+            continue;
+        }
 
-                /*!> get spectral scan status */
-                pthread_mutex_lock(&GW.hal.mx_concent);
-                x = lgw_spectral_scan_get_status(&status);
-                pthread_mutex_unlock(&GW.hal.mx_concent);
-                if (x != 0) {
-                    lgw_log(LOG_ERROR, "%s[SCAN] spectral scan status failed\n", ERRMSG);
-                    break; /*!> do while */
-                }
+        /*!> Nothing to poll for before the scan can be over */
+        if (scan_ms > SSCAN_POLL_MS)
+            wait_ms(scan_ms - SSCAN_POLL_MS);
+
+        /*!> Wait for scan to be completed */
+        status = LGW_SPECTRAL_SCAN_STATUS_UNKNOWN;
+        timeout_start(&tm_start);
+        do {
+            /*!> handle timeout */
+            if (timeout_check(tm_start, SSCAN_TIMEOUT_MS) != 0) {
+                lgw_log(LOG_ERROR, "%s%s: [SCAN] TIMEOUT on Spectral Scan\n", ERRMSG, __FUNCTION__);
+                break;  /*!> do while */
+            }
 
-                /*!> wait a bit before checking status again */
-                wait_ms(10);
-            } while (status != LGW_SPECTRAL_SCAN_STATUS_COMPLETED && status != LGW_SPECTRAL_SCAN_STATUS_ABORTED);
+            /*!> get spectral scan status */
+            pthread_mutex_lock(&GW.hal.mx_concent);
+            x = lgw_spectral_scan_get_status(&status);
+            pthread_mutex_unlock(&GW.hal.mx_concent);
+            if (x != 0) {
+                lgw_log(LOG_ERROR, "%s[SCAN] spectral scan status failed\n", ERRMSG);
+                break; /*!> do while */
+            }
 
-            if (status == LGW_SPECTRAL_SCAN_STATUS_COMPLETED) {
-                /*!> Get spectral scan results */
-                memset(levels, 0, sizeof levels);
-                memset(results, 0, sizeof results);
-                pthread_mutex_lock(&GW.hal.mx_concent);
-                x = lgw_spectral_scan_get_results(levels, results);
-                pthread_mutex_unlock(&GW.hal.mx_concent);
-                if (x != 0) {
-                    lgw_log(LOG_ERROR, "%s[SCAN] spectral scan get results failed\n", ERRMSG);
-                    continue; /*!> main while loop */
-                }
+            /*!> wait a bit before checking status again */
+            if (status != LGW_SPECTRAL_SCAN_STATUS_COMPLETED && status != LGW_SPECTRAL_SCAN_STATUS_ABORTED)
+                wait_ms(SSCAN_POLL_MS);
+        } while (status != LGW_SPECTRAL_SCAN_STATUS_COMPLETED && status != LGW_SPECTRAL_SCAN_STATUS_ABORTED);
+
+        if (status == LGW_SPECTRAL_SCAN_STATUS_COMPLETED) {
+            clock_gettime(CLOCK_MONOTONIC, &t_end);
+            clock_gettime(CLOCK_REALTIME, &utc);
+            scan_ms = (uint32_t)(1000 * difftimespec(t_end, t_start));
 
-                /*!> print results */
+            /*!> Get spectral scan results */
+            memset(levels, 0, sizeof levels);
+            memset(results, 0, sizeof results);
+            pthread_mutex_lock(&GW.hal.mx_concent);
+            x = lgw_spectral_scan_get_results(levels, results);
+            pthread_mutex_unlock(&GW.hal.mx_concent);
+            if (x != 0) {
+                lgw_log(LOG_ERROR, "%s[SCAN] spectral scan get results failed\n", ERRMSG);
+                continue; /*!> main while loop */
+            }
+
+            memset(&rec, 0, sizeof(rec));
+            rec.time_ns = (uint64_t)utc.tv_sec * 1000000000ULL + utc.tv_nsec;
+            rec.freq_hz = freq_hz;
+            rec.sweep = sweep;
+            rec.nb_scan = GW.spectral_scan_params.nb_scan;
+            rec.duration_ms = scan_ms > UINT16_MAX ? UINT16_MAX : scan_ms;
+            memcpy(rec.results, results, sizeof(rec.results));
+
+            if (ring_ok) {
+                if (chan == 0)
+                    sscan_ring_set_levels(&ring, levels);
+                sscan_ring_append(&ring, &rec);
+            }
+            if (export_sock != -1 && sscan_export_send(export_sock, &rec, levels) != 0)
+                lgw_log(LOG_DEBUG, "%s[SCAN] export of record %llu failed\n", DEBUGMSG, (unsigned long long)rec.seq);
+
+            if (ring_ok || export_sock != -1) {
+                lgw_log(LOG_DEBUG, "%s[SCAN] %u Hz scanned in %ums (sweep %u)\n", DEBUGMSG, freq_hz, scan_ms, sweep);
+            } else {
+                /*!> no other place to put them */
                 lgw_log(LOG_INFO, "%s[SCAN] SPECTRAL SCAN - %u Hz: ", INFOMSG, freq_hz);
                 for (i = 0; i < LGW_SPECTRAL_SCAN_RESULT_SIZE; i++) {
                     lgw_log(LOG_INFO, "%u ", results[i]);
                 }
                 lgw_log(LOG_INFO, "\n");
+            }
 
-                /*!> Next frequency to scan */
-                freq_hz += 200000; /*!> 200kHz channels */
-                if (freq_hz >= freq_hz_stop) {
-                    freq_hz = GW.spectral_scan_params.freq_hz_start;
-                }
-            } else if (status == LGW_SPECTRAL_SCAN_STATUS_ABORTED) {
-                lgw_log(LOG_INFO, "%s[SCAN] %s: spectral scan has been aborted\n", INFOMSG, __FUNCTION__);
-            } else {
-                lgw_log(LOG_ERROR, "%s[SCAN] %s: spectral scan status us unexpected 0x%02X\n", ERRMSG, __FUNCTION__, status);
+            /*!> Next frequency to scan */
+            if (++chan >= GW.spectral_scan_params.nb_chan) {
+                chan = 0;
+                sweep++;
             }
+            freq_hz = GW.spectral_scan_params.freq_hz_start + chan * SSCAN_CHAN_STEP_HZ;
+        } else if (status == LGW_SPECTRAL_SCAN_STATUS_ABORTED) {
+            lgw_log(LOG_INFO, "%s[SCAN] %s: spectral scan has been aborted\n", INFOMSG, __FUNCTION__);
+        } else {
+            lgw_log(LOG_ERROR, "%s[SCAN] %s: spectral scan status us unexpected 0x%02X\n", ERRMSG, __FUNCTION__, status);
         }
     }
-    lgw_log(LOG_INFO, "\n%s[THREAD][SCAN] Ended!\n", INFOMSG);
-}
 
-#endif
+    if (export_sock != -1)
+        close(export_sock);
+    if (ring_ok)
+        sscan_ring_close(&ring);
 
-static bool lbt_getchan_stat(int fd, uint32_t freq_hz, int8_t rssi_target, uint16_t scan_time_ms) 
-{
-    int ret;
-    struct timespec s_time;
-    struct timespec e_time;
-
-    if (fd < 0) return false;
-
-    clock_gettime(CLOCK_MONOTONIC, &s_time);
-    char buffer[48] = {'\0'};
-    snprintf(buffer, sizeof(buffer), "AT+GETCHANSTAT=%u,%i,%u\r\n", freq_hz, rssi_target, scan_time_ms);
-    lgw_log(LOG_DEBUG, "%s[LBT] command: %s", DEBUGMSG, buffer);
-    ret = uart_send(fd, buffer, strlen(buffer) + 1); 
-    if (ret == -1) {
-        lgw_log(LOG_ERROR, "%s[LBT] get channel stat error (cannot send command to uart)\n", ERRMSG);
-        return false;
-    }
-    memset(buffer, 0, sizeof(buffer));
-    uart_read(fd, buffer, 4, 1000);  /*!> 1000 (1s) default timeout ms for read ,  4 is sizeof FREE */
-    clock_gettime(CLOCK_MONOTONIC, &e_time);
-    lgw_log(LOG_DEBUG, "%s[LBT] scan use %i ms\n", DEBUGMSG, (int)(1000 * difftimespec(e_time, s_time)));
-
-    if (buffer[0] == 'F') {
-        lgw_log(LOG_DEBUG, "%s[LBT] chan(%u) is FREE\n", DEBUGMSG, freq_hz);
-        return true;
-    } else {
-        lgw_log(LOG_DEBUG, "%s[LBT] chan(%u) is BUSY\n", DEBUGMSG, freq_hz);
-        return false;
-    }
+    lgw_log(LOG_INFO, "\n%s[THREAD][SCAN] Ended!\n", INFOMSG);
 }
 
-/*!> -------------------------------------------------------------------------- */
-/*!> --- THREAD : BACKGROUND LBT SCAN                                  --- */
-
-static void thread_lbt_scan(void) 
-{
-    int i, j;
-    uint32_t current_concentrator_time;
-    uint32_t diff_time;
-
-    for (i = 0; i < NB_LBT_QUEUE; i++) {
-        GW.lbt.lbt_stat[i].freq_hz = 0;
-        GW.lbt.lbt_stat[i].count_us = 0;
-        GW.lbt.lbt_stat[i].chan_is_free = false;
-    }
-
-    lgw_log(LOG_INFO, "%s[LBT] start lbt scan program\n", INFOMSG);
-
-    while (!exit_sig && !quit_sig) {
-
-        if (GW.lbt.lbt_tty_fd < 0) {
-            GW.lbt.lbt_tty_fd = uart_open(GW.lbt.lbt_tty_path);
-            if (GW.lbt.lbt_tty_fd != -1)
-                uart_config(GW.lbt.lbt_tty_fd, GW.lbt.lbt_tty_baude, 9, 9, 9, 9);  /*!> 9 use default */
-            else {
-                lgw_log(LOG_ERROR, "%s[LBT] cannot open tty path, continue\n", ERRMSG);
-                wait_ms(5000); 
-                continue;
-            }
-        }
-
-#ifdef SX1302MOD
-        current_concentrator_time = cur_hal_time;
-#else
-        get_concentrator_time(&current_concentrator_time);
 #endif
 
-        j = 0;
-
-        for (i = 0; i < NB_LBT_QUEUE; i++) {
-            diff_time = GW.lbt.lbt_stat[i].count_us - current_concentrator_time;
-
-            if (diff_time > 40000 &&  diff_time < 120000) {   
-                GW.lbt.lbt_stat[i].chan_is_free = lbt_getchan_stat(GW.lbt.lbt_tty_fd, GW.lbt.lbt_stat[i].freq_hz, GW.lbt.lbt_rssi_target, 6);
-                lgw_log(LOG_DEBUG, "%s[LBT] (%d)scan chan(%u) free=%s, us=%u\n", DEBUGMSG, i, GW.lbt.lbt_stat[i].freq_hz, GW.lbt.lbt_stat[i].chan_is_free ? "TRUE" : "FALSE", GW.lbt.lbt_stat[i].count_us);
-                j++;
-                wait_ms(12);  // rssi_scan_time_ms
-            } //else {
-               // GW.lbt.lbt_stat[i].chan_is_free = false;
-                //wait_ms(60);
-            //}
-            
-            if (diff_time > 10000000)  // (10s will be remove)
-                GW.lbt.lbt_stat[i].count_us = 0;
-        }
-
-        wait_ms(5 + 30 * j);  // rssi_scan_time_ms
-    }
-
-    if (GW.lbt.lbt_tty_fd > 0)
-        uart_close(GW.lbt.lbt_tty_fd);
-
-    lgw_log(LOG_INFO, "%s[THREAD][LBT] Exited!\n", INFOMSG);
-}
-
 /*!> --- EOF ------------------------------------------------------------------ */
@@ -24,13 +24,8 @@
  * \brief lora packages simulation
  */
 
-/*!> fix an issue between POSIX and C99 */
-#ifdef __MACH__
-#elif __STDC_VERSION__ >= 199901L
-#define _XOPEN_SOURCE 600
-#else
-#define _XOPEN_SOURCE 500
-#endif
+/*!> recvmmsg */
+#define _GNU_SOURCE
 
 #include <stdint.h>				/*!> C99 types */
 #include <stdbool.h>			/*!> bool type */
@@ -43,6 +38,7 @@
 #include <unistd.h>				/*!> getopt, access */
 #include <stdlib.h>				/*!> atoi, exit */
 #include <errno.h>				/*!> error messages */
+#include <stddef.h>				/*!> offsetof */
 
 #include <sys/socket.h>			/*!> socket specific definitions */
 #include <netinet/in.h>			/*!> INET constants and stuff */
@@ -53,6 +49,7 @@
 #include "fwd.h"
 #include "ghost.h"
 #include "loragw_hal.h"
+#include "loragw_aux.h"
 
 DECLARE_GW;
 
@@ -61,13 +58,17 @@ DECLARE_GW;
 
 static volatile bool ghost_run = false;	/*!> false -> ghost thread terminates cleanly */
 
-static pthread_mutex_t cb_ghost = PTHREAD_MUTEX_INITIALIZER;	/*!> control access to the ghoststream measurements */
-
 static int sock_ghost;			/*!> socket for downstream traffic */
 static char gateway_id[16] = "";	/*!> string form of gateway mac address */
 
-static struct lgw_pkt_rx_s rxpkt[GHST_NB_PKT];
-static uint8_t cnt_ghost = 0;
+/*!> single producer (thread_ghost) / single consumer (ghost_get) ring, the
+ * datagrams are received straight into the payload of the free slots */
+static struct lgw_pkt_rx_s *ghost_ring;
+static uint32_t ghost_ring_mask;
+static uint32_t ghost_head;		/*!> slots filled so far, written by thread_ghost only */
+static uint32_t ghost_tail;		/*!> slots taken so far, written by ghost_get only */
+static uint32_t ghost_nb_rx;
+static uint32_t ghost_nb_drop;	/*!> datagrams received while the ring was full */
 
 /*!> ghost thread */
 static pthread_t thrid_ghost;
@@ -107,8 +108,8 @@ static void print_rx(struct lgw_pkt_rx_s *p) {
 }
 
 
-/*!> Method to fill lgw_pkt_rx_s with data */
-static void fill_rx(struct lgw_pkt_rx_s *p, uint8_t *payload, uint32_t us) {
+/*!> Method to fill lgw_pkt_rx_s with data, the payload is already there */
+static void fill_rx(struct lgw_pkt_rx_s *p, uint16_t size, uint32_t us) {
 	p->freq_hz = (uint32_t) 868320000;
 	p->if_chain = 2;
 	p->status = STAT_CRC_OK;
@@ -123,8 +124,7 @@ static void fill_rx(struct lgw_pkt_rx_s *p, uint8_t *payload, uint32_t us) {
 	p->snr_min = 11;
 	p->snr_max = 43;
 	p->crc = 2234;
-	p->size = 48;
-	memcpy((p->payload), payload, p->size);
+	p->size = size;
 }
 
 static void thread_ghost(void);
@@ -138,6 +138,7 @@ bool ghost_start(const char *ghost_addr, const char *ghost_port, const char *gwi
 		return true;
 
 	int i;						/*!> loop variable and temporary variable for return value */
+	uint32_t size;
 
 	/*!> copy the static coordinates (so if the gps changes, this is not reflected!) */
 	strncpy(gateway_id, gwid, sizeof(gateway_id));
@@ -145,6 +146,7 @@ bool ghost_start(const char *ghost_addr, const char *ghost_port, const char *gwi
 	struct addrinfo addresses;
 	struct addrinfo *result;	/*!> store result of getaddrinfo */
 	struct addrinfo *q;			/*!> pointer to move into *result data */
+	struct timeval rcv_timeout = {1, 0};	/*!> ghost_run is checked at least every second */
 	char host_name[64];
 	char port_name[64];
 
@@ -167,7 +169,7 @@ bool ghost_start(const char *ghost_addr, const char *ghost_port, const char *gwi
 		else {
             i = bind(sock_ghost, q->ai_addr, q->ai_addrlen);
 			if( i == -1 ) {
-			    shutdown(sock_ghost, SHUT_RDWR);
+			    close(sock_ghost);
 				continue; /*!> bind failed, try next field */
 			} else
 			    break;
@@ -183,19 +185,38 @@ bool ghost_start(const char *ghost_addr, const char *ghost_port, const char *gwi
 			lgw_log(LOG_INFO, "[INFO~][ghost] result %i host:%s service:%s\n", i, host_name, port_name);
 			++i;
 		}
+		freeaddrinfo(result);
         return false;
 	}
 
 	freeaddrinfo(result);
 
+	setsockopt(sock_ghost, SOL_SOCKET, SO_RCVTIMEO, &rcv_timeout, sizeof rcv_timeout);
+
+	/*!> the ring is a power of 2 so that the free running indexes wrap with it */
+	for (size = 16; size < GW.cfg.ghost_ring_size && size < GHST_RING_MAX; size <<= 1);
+	ghost_ring = lgw_calloc(size, sizeof(struct lgw_pkt_rx_s));
+	if (ghost_ring == NULL) {
+		close(sock_ghost);
+        return false;
+	}
+	ghost_ring_mask = size - 1;
+	ghost_head = ghost_tail = 0;
+	ghost_nb_rx = ghost_nb_drop = 0;
+
 	/*!> spawn thread to manage ghost connection */
+	ghost_run = true;
 	i = lgw_pthread_create(&thrid_ghost, NULL, (void *(*)(void *))thread_ghost, NULL);
 	if (i != 0) {
 		lgw_log(LOG_ERROR, "[ERROR~][ghost] impossible to create ghost thread\n");
+		ghost_run = false;
+		close(sock_ghost);
+		lgw_free(ghost_ring);
+		ghost_ring = NULL;
         return false;
 	}
 
-	ghost_run = true;
+	lgw_log(LOG_INFO, "[INFO~][ghost] listening, ring of %u packets\n", size);
 
     return true;
 	/*!> We are done here, ghost thread is initialized and should be running by now. */
@@ -203,89 +224,108 @@ bool ghost_start(const char *ghost_addr, const char *ghost_port, const char *gwi
 }
 
 void ghost_stop(void) {
-    cnt_ghost = 0;
+	if (!ghost_run)
+		return;
 	ghost_run = false;			/*!> terminate the loop. */
-	pthread_cancel(thrid_ghost);	/*!> don't wait for downstream thread (is this okay??) */
-	shutdown(sock_ghost, SHUT_RDWR);	/*!> close the socket. */
+	shutdown(sock_ghost, SHUT_RDWR);	/*!> wakes recvmmsg up */
+	pthread_join(thrid_ghost, NULL);
+	close(sock_ghost);
+	lgw_free(ghost_ring);
+	ghost_ring = NULL;
 }
 
 /*!> Call this to pull data from the receive buffer for ghost nodes.. */
 int ghost_get(int max_pkt, struct lgw_pkt_rx_s *pkt_data) {	/*!> Calculate the number of available packets */
-    int i = cnt_ghost;
-    if (cnt_ghost == 0) {
-        return 0;
-    }
-
-	pthread_mutex_lock(&cb_ghost);
-
-    memcpy(pkt_data, &rxpkt, sizeof(struct lgw_pkt_rx_s) * cnt_ghost);
+	struct lgw_pkt_rx_s *p;
+	uint32_t tail = ghost_tail;
+	uint32_t nb = __atomic_load_n(&ghost_head, __ATOMIC_ACQUIRE) - tail;
+	uint32_t i;
+
+	if (nb == 0 || max_pkt < 1)
+		return 0;
+	if (nb > (uint32_t)max_pkt)
+		nb = max_pkt;
+
+	for (i = 0; i < nb; i++) {
+		p = &ghost_ring[(tail + i) & ghost_ring_mask];
+		memcpy(&pkt_data[i], p, offsetof(struct lgw_pkt_rx_s, payload) + p->size);
+	}
 
-    cnt_ghost = 0;  /*!> reset */
+	/*!> the slots go back to thread_ghost once copied */
+	__atomic_store_n(&ghost_tail, tail + nb, __ATOMIC_RELEASE);
 
-	pthread_mutex_unlock(&cb_ghost);
+	lgw_log(LOG_DEBUG, "[DEBUG][ghost] copied %u packets from ghost\n", nb);
 
-	if (i > 0) {
-		lgw_log(LOG_INFO, "[INFO~][ghost] copied %i packets from ghost \n", i);
-	}
+	return nb;
+}
 
-	return i;
+void ghost_counters(uint32_t *nb_rx, uint32_t *nb_drop) {
+	*nb_rx = __atomic_load_n(&ghost_nb_rx, __ATOMIC_RELAXED);
+	*nb_drop = __atomic_load_n(&ghost_nb_drop, __ATOMIC_RELAXED);
 }
 
 static void thread_ghost(void) {
 
-    struct timeval current_unix_time;
-    uint32_t rec_us;
+	struct mmsghdr msgs[GHST_NB_MSG];
+	struct iovec iovecs[GHST_NB_MSG];
+	struct timespec now;
+	struct lgw_pkt_rx_s *p;
+	uint32_t head, nb_free, nb_msg, rec_us;
+	int i, nb;
 
-	/*!> data buffers */
-    uint8_t databuf_rec[GHST_RX_BUFFSIZE];
-
-    int byte_nb;
-
-    struct sockaddr_storage dist_addr;
-    socklen_t addr_len = sizeof dist_addr;
+	/*!> datagrams that find the ring full are received here and dropped */
+	static uint8_t databuf_drop[GHST_NB_MSG][GHST_RX_BUFFSIZE];
 
 	lgw_log(LOG_INFO, "[INFO~][ghost] Ghost thread started...\n");
 
 	while (ghost_run) {			
 
-        memset( databuf_rec, 0, sizeof(databuf_rec) );
-        byte_nb = recvfrom( sock_ghost, databuf_rec, sizeof(databuf_rec), 0, (struct sockaddr *)&dist_addr, &addr_len );
+		head = ghost_head;
+		nb_free = ghost_ring_mask + 1 - (head - __atomic_load_n(&ghost_tail, __ATOMIC_ACQUIRE));
+		nb_msg = (nb_free == 0) ? GHST_NB_MSG : (nb_free < GHST_NB_MSG ? nb_free : GHST_NB_MSG);
 
-        if( byte_nb == -1 )
-        {
-            lgw_log( LOG_ERROR, "[ERROR~][ghost] recvfrom returned %s \n", strerror( errno ) );
-            continue;
-        }
+		memset(msgs, 0, nb_msg * sizeof(struct mmsghdr));
+		for (i = 0; i < (int)nb_msg; i++) {
+			iovecs[i].iov_base = (nb_free == 0) ? databuf_drop[i] : ghost_ring[(head + i) & ghost_ring_mask].payload;
+			iovecs[i].iov_len = GHST_RX_BUFFSIZE;
+			msgs[i].msg_hdr.msg_iov = &iovecs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
 
-		pthread_mutex_lock(&cb_ghost);
+		/*!> waits for the first datagram only, then takes what is already queued */
+		nb = recvmmsg(sock_ghost, msgs, nb_msg, MSG_WAITFORONE, NULL);
 
-		/*!> make a copy to the data received to the circular buffer, and shift the write index. */
-		if (++cnt_ghost > GHST_NB_PKT) {
-			lgw_log(LOG_WARNING, "[WARNING~][ghost] buffer is full, dropping packet)\n");
-		} else {
-            gettimeofday(&current_unix_time, NULL);
-            rec_us = current_unix_time.tv_sec + current_unix_time.tv_usec;
-            fill_rx(&rxpkt[cnt_ghost - 1], databuf_rec, rec_us);
-			lgw_log(LOG_INFO, "[INFO~][ghost] RECEIVED ghst_index = %i \n", cnt_ghost);
-        }
+		if (nb == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && ghost_run) {
+				lgw_log(LOG_ERROR, "[ERROR~][ghost] recvmmsg returned %s \n", strerror(errno));
+				wait_ms(100);
+			}
+			continue;
+		}
 
-		pthread_mutex_unlock(&cb_ghost);
+		if (nb == 0)	/*!> shutdown */
+			continue;
 
-        /*!> Display info about the sender */
-        /*!>
-        i = getnameinfo( (struct sockaddr *)&dist_addr, addr_len, host_name, sizeof host_name, port_name, sizeof port_name, NI_NUMERICHOST );
+		__atomic_fetch_add(&ghost_nb_rx, nb, __ATOMIC_RELAXED);
 
-        if( i == -1 )
-        {
-            lgw_log( LOG_ERROR, "[ERROR~][ghost] getnameinfo returned %s \n", gai_strerror( i ) );
-            continue;
-        }
-        
-        lgw_log( LOG_INFO, "[INFO~][ghost] -> pkt in , host %s (port %s), %i bytes \n", host_name, port_name, byte_nb );
-        */
+		if (nb_free == 0) {
+			__atomic_fetch_add(&ghost_nb_drop, nb, __ATOMIC_RELAXED);
+			lgw_log(LOG_WARNING, "[WARNING~][ghost] buffer is full, dropping %i packet(s)\n", nb);
+			continue;
+		}
+
+		/*!> one timestamp per batch, on the monotonic microsecond clock like a concentrator counter */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		rec_us = (uint32_t)((uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
 
-        
-    }
+		for (i = 0; i < nb; i++) {
+			p = &ghost_ring[(head + i) & ghost_ring_mask];
+			fill_rx(p, (uint16_t)msgs[i].msg_len, rec_us);
+		}
+
+		/*!> publish the slots to ghost_get */
+		__atomic_store_n(&ghost_head, head + nb, __ATOMIC_RELEASE);
+	}
 
 	lgw_log(LOG_INFO, "[INFO~][ghost] End of ghost thread\n");
 }
@@ -0,0 +1,161 @@
+/*!>
+ *  ____  ____      _    ____ ___ _   _  ___
+ *  |  _ \|  _ \    / \  / ___|_ _| \ | |/ _ \
+ *  | | | | |_) |  / _ \| |  _ | ||  \| | | | |
+ *  | |_| |  _ <  / ___ \ |_| || || |\  | |_| |
+ *  |____/|_| \_\/_/   \_\____|___|_| \_|\___/
+ *
+ * Dragino_gw_fwd -- An opensource lora gateway forward
+ *
+ * See http://www.dragino.com for more information about
+ * the lora gateway project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ *
+ * Maintainer: skerlan
+ *
+ */
+
+/*!>!
+ * \file
+ * \brief incremental NMEA/UBX framer for the GPS tty
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "gpsframe.h"
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define NMEA_SYNC_CHAR          '$'
+#define NMEA_END_CHAR           '\n'
+#define UBX_SYNC_CHAR1          0xB5
+#define UBX_SYNC_CHAR2          0x62
+#define UBX_HEADER_SIZE         6       /*!> sync chars, class, id, 16 bits length */
+#define UBX_CHECKSUM_SIZE       2
+
+enum gps_framer_state_e {
+    FRAMER_HUNT,                        /*!> looking for a sync char */
+    FRAMER_NMEA,                        /*!> up to LF */
+    FRAMER_UBX_SYNC,                    /*!> second sync char */
+    FRAMER_UBX_HEADER,                  /*!> up to the length */
+    FRAMER_UBX_BODY,                    /*!> up to need bytes */
+    FRAMER_UBX_SKIP                     /*!> need bytes of a frame too long to keep */
+};
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PRIVATE FUNCTIONS ---------------------------------------------------- */
+
+/*!> a sync char starts a new frame wherever it shows up outside of a UBX payload */
+static bool gps_framer_start(struct gps_framer_s *f, uint8_t c, const struct timespec *arrival) {
+    if (c == NMEA_SYNC_CHAR)
+        f->state = FRAMER_NMEA;
+    else if (c == UBX_SYNC_CHAR1)
+        f->state = FRAMER_UBX_SYNC;
+    else
+        return false;
+
+    f->frame[0] = (char)c;
+    f->len = 1;
+    f->arrival = *arrival;
+    return true;
+}
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PUBLIC FUNCTIONS ----------------------------------------------------- */
+
+void gps_framer_init(struct gps_framer_s *f) {
+    memset(f, 0, sizeof(*f));
+    f->state = FRAMER_HUNT;
+}
+
+size_t gps_framer_feed(struct gps_framer_s *f, const char *data, size_t size, const struct timespec *arrival, bool *complete) {
+    size_t i;
+    uint8_t c;
+
+    *complete = false;
+
+    for (i = 0; i < size; i++) {
+        c = (uint8_t)data[i];
+
+        switch (f->state) {
+            case FRAMER_HUNT:
+                gps_framer_start(f, c, arrival);
+                break;
+
+            case FRAMER_NMEA:
+                if (c == NMEA_SYNC_CHAR || c == UBX_SYNC_CHAR1) {
+                    /*!> the LF of the previous sentence was lost */
+                    f->nb_dropped++;
+                    gps_framer_start(f, c, arrival);
+                    break;
+                }
+                if (f->len == sizeof(f->frame)) {
+                    f->nb_dropped++;
+                    f->state = FRAMER_HUNT;
+                    break;
+                }
+                f->frame[f->len++] = (char)c;
+                if (c == NMEA_END_CHAR) {
+                    f->type = GPS_FRAME_NMEA;
+                    f->state = FRAMER_HUNT;
+                    *complete = true;
+                    return i + 1;
+                }
+                break;
+
+            case FRAMER_UBX_SYNC:
+                if (c == UBX_SYNC_CHAR2) {
+                    f->frame[f->len++] = (char)c;
+                    f->state = FRAMER_UBX_HEADER;
+                } else if (!gps_framer_start(f, c, arrival)) {
+                    f->state = FRAMER_HUNT;
+                }
+                break;
+
+            case FRAMER_UBX_HEADER:
+                f->frame[f->len++] = (char)c;
+                if (f->len == UBX_HEADER_SIZE) {
+                    f->need = UBX_HEADER_SIZE + ((uint8_t)f->frame[4] | ((size_t)(uint8_t)f->frame[5] << 8)) + UBX_CHECKSUM_SIZE;
+                    if (f->need > sizeof(f->frame)) {
+                        /*!> not a message the forwarder uses, do not mistake its payload for sync chars */
+                        f->nb_dropped++;
+                        f->need -= UBX_HEADER_SIZE;
+                        f->state = FRAMER_UBX_SKIP;
+                    } else {
+                        f->state = FRAMER_UBX_BODY;
+                    }
+                }
+                break;
+
+            case FRAMER_UBX_BODY:
+                f->frame[f->len++] = (char)c;
+                if (f->len == f->need) {
+                    f->type = GPS_FRAME_UBX;
+                    f->state = FRAMER_HUNT;
+                    *complete = true;
+                    return i + 1;
+                }
+                break;
+
+            case FRAMER_UBX_SKIP:
+                if (--f->need == 0)
+                    f->state = FRAMER_HUNT;
+                break;
+
+            default:
+                f->state = FRAMER_HUNT;
+                break;
+        }
+    }
+
+    return size;
+}
+
+/*!> --- EOF ------------------------------------------------------------------ */
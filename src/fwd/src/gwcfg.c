@@ -30,6 +30,7 @@
 #include <arpa/inet.h>
 
 #include "fwd.h"
+#include "lbt.h"
 #include "parson.h"
 #include "loragw_aux.h"
 #include "loragw_hal.h"
@@ -213,6 +214,8 @@ static int parse_SX130x_configuration(const char* conf_file) {
                 /*!> Enable the sx1261 radio hardware configuration to allow spectral scan */
                 sx1261conf.enable = true;
                 MSG("[INFO~][SETTING] Spectral Scan with SX1261 is enabled\n");
+                GW.spectral_scan_params.ring_records = SSCAN_RING_DEFAULT;
+                strcpy(GW.spectral_scan_params.ring_path, SSCAN_RING_PATH);
                 /*!> Get Spectral Scan Parameters */
                 val = json_object_get_value(conf_scan_obj, "freq_start"); 
                 if (json_value_get_type(val) == JSONNumber) {
@@ -238,6 +241,40 @@ static int parse_SX130x_configuration(const char* conf_file) {
                 } else {
                     MSG("%s[SETTING] Data type for spectral_scan.pace_s seems wrong, please check\n", WARNMSG);
                 }
+                val = json_object_get_value(conf_scan_obj, "sweep"); 
+                if (val != NULL) {
+                    if (json_value_get_type(val) == JSONBoolean)
+                        GW.spectral_scan_params.sweep = (bool)json_value_get_boolean(val);
+                    else
+                        MSG("%s[SETTING] Data type for spectral_scan.sweep seems wrong, please check\n", WARNMSG);
+                }
+                val = json_object_get_value(conf_scan_obj, "ring_records"); 
+                if (val != NULL) {
+                    if (json_value_get_type(val) == JSONNumber)
+                        GW.spectral_scan_params.ring_records = (uint32_t)json_value_get_number(val);
+                    else
+                        MSG("%s[SETTING] Data type for spectral_scan.ring_records seems wrong, please check\n", WARNMSG);
+                }
+                str = json_object_get_string(conf_scan_obj, "ring_path");
+                if (str != NULL) {
+                    strncpy(GW.spectral_scan_params.ring_path, str, sizeof(GW.spectral_scan_params.ring_path));
+                    GW.spectral_scan_params.ring_path[sizeof(GW.spectral_scan_params.ring_path) - 1] = '\0';
+                }
+                str = json_object_get_string(conf_scan_obj, "export_host");
+                if (str != NULL) {
+                    strncpy(GW.spectral_scan_params.export_host, str, sizeof(GW.spectral_scan_params.export_host));
+                    GW.spectral_scan_params.export_host[sizeof(GW.spectral_scan_params.export_host) - 1] = '\0';
+                }
+                val = json_object_get_value(conf_scan_obj, "export_port"); 
+                if (val != NULL) {
+                    if (json_value_get_type(val) == JSONNumber)
+                        snprintf(GW.spectral_scan_params.export_port, sizeof(GW.spectral_scan_params.export_port), "%u", (uint16_t)json_value_get_number(val));
+                    else
+                        MSG("%s[SETTING] Data type for spectral_scan.export_port seems wrong, please check\n", WARNMSG);
+                }
+                MSG("[INFO~][SETTING] Spectral Scan %s, results to %s (%u records)%s%s\n", GW.spectral_scan_params.sweep ? "sweeps the band" : "one channel per pace",
+                    GW.spectral_scan_params.ring_records ? GW.spectral_scan_params.ring_path : "no ring", GW.spectral_scan_params.ring_records,
+                    GW.spectral_scan_params.export_host[0] ? " and udp " : "", GW.spectral_scan_params.export_host);
             }
         }
 
@@ -1171,7 +1208,9 @@ static int parse_gateway_configuration(const char* conf_file) {
     JSON_Value *root_val;
     JSON_Object *conf_obj = NULL;
     JSON_Object *serv_obj = NULL;
+    JSON_Object *prio_obj = NULL;
     JSON_Array *serv_arry = NULL;
+    const char *prio_name[JIT_PRIO_NB] = { "class_c", "class_b", "class_a", "join_accept" };
     JSON_Value *val = NULL; /*!> needed to detect the absence of some fields */
     const char *str; /*!> pointer to sub-strings in the JSON data */
     const char *strr; /*!> pointer to minor-strings in the JSON data */
@@ -1248,11 +1287,30 @@ static int parse_gateway_configuration(const char* conf_file) {
         }
     } 
 
-    str = json_object_get_string(conf_obj, "delay_db_path");
+    str = json_object_get_string(conf_obj, "delay_journal_dir");
     if (str != NULL) {
-        strncpy(GW.cfg.delay_db_path, str, sizeof GW.cfg.delay_db_path);
-        GW.cfg.delay_db_path[sizeof GW.cfg.delay_db_path - 1] = '\0'; 
-        lgw_log(LOG_INFO, "[INFO~][SETTING] Storeage path is configured to \"%s\"\n", GW.cfg.delay_db_path);
+        strncpy(GW.cfg.delay_journal_dir, str, sizeof GW.cfg.delay_journal_dir);
+        GW.cfg.delay_journal_dir[sizeof GW.cfg.delay_journal_dir - 1] = '\0'; 
+        lgw_log(LOG_INFO, "[INFO~][SETTING] delay journal directory is configured to \"%s\"\n", GW.cfg.delay_journal_dir);
+    } else {
+        /*!> the sqlite storage of older configurations becomes a journal beside it */
+        str = json_object_get_string(conf_obj, "delay_db_path");
+        if (str != NULL && str[0] != '\0') {
+            snprintf(GW.cfg.delay_journal_dir, sizeof GW.cfg.delay_journal_dir, "%.*s.journal", (int)sizeof GW.cfg.delay_journal_dir - 9, str);
+            lgw_log(LOG_INFO, "[INFO~][SETTING] delay_db_path is replaced by delay_journal_dir, journal in \"%s\"\n", GW.cfg.delay_journal_dir);
+        }
+    }
+
+    val = json_object_get_value(conf_obj, "delay_quota_kb");
+    if (json_value_get_type(val) == JSONNumber) {
+        GW.cfg.delay_quota_kb = (uint32_t)json_value_get_number(val);
+        lgw_log(LOG_INFO, "[INFO~][SETTING] delay journal quota is %u kB\n", GW.cfg.delay_quota_kb);
+    }
+
+    val = json_object_get_value(conf_obj, "delay_replay_rate");
+    if (json_value_get_type(val) == JSONNumber) {
+        GW.cfg.delay_replay_rate = (uint16_t)json_value_get_number(val);
+        lgw_log(LOG_INFO, "[INFO~][SETTING] delayed packets are replayed at %u packets/s\n", GW.cfg.delay_replay_rate);
     }
 
     val = json_object_get_value(conf_obj, "td_enable"); 
@@ -1431,6 +1489,12 @@ static int parse_gateway_configuration(const char* conf_file) {
         lgw_log(LOG_INFO, "[INFO~][SETTING] ghost_port is configured to \"%s\"\n", GW.cfg.ghost_port);
     }
 
+    val = json_object_get_value(conf_obj, "ghost_ring_size");
+    if (json_value_get_type(val) == JSONNumber) {
+        GW.cfg.ghost_ring_size = (uint16_t)json_value_get_number(val);
+        lgw_log(LOG_INFO, "[INFO~][SETTING] ghost_ring_size is configured to %u\n", GW.cfg.ghost_ring_size);
+    }
+
     str = json_object_get_string(conf_obj, "platform");
     if (str != NULL) {
         strncpy(GW.info.platform, str, sizeof GW.info.platform);
@@ -1460,6 +1524,29 @@ static int parse_gateway_configuration(const char* conf_file) {
     }
     lgw_log(LOG_INFO, "[INFO~][SETTING] FCNT_GAP is configured to %u, largest fcnt is %u \n", GW.cfg.fcnt_gap, 65536 * GW.cfg.fcnt_gap);
 
+    val = json_object_get_value(conf_obj, "jit_queue_size");
+    if (val != NULL) {
+        GW.cfg.jit_queue_size = (uint16_t)json_value_get_number(val);
+        if (GW.cfg.jit_queue_size > JIT_QUEUE_SIZE_MAX || GW.cfg.jit_queue_size < JIT_NUM_BEACON_IN_QUEUE + 1)
+            GW.cfg.jit_queue_size = JIT_QUEUE_MAX;
+    }
+    lgw_log(LOG_INFO, "[INFO~][SETTING] JiT queue size is configured to %u packets\n", GW.cfg.jit_queue_size);
+
+    val = json_object_get_value(conf_obj, "jit_preemption");
+    if (json_value_get_type(val) == JSONBoolean) {
+        GW.cfg.jit_preemption = (bool)json_value_get_boolean(val);
+    }
+    lgw_log(LOG_INFO, "[INFO~][SETTING] JiT preemption of lower priority downlinks is %s\n", GW.cfg.jit_preemption ? "enabled" : "disabled");
+
+    val = json_object_get_value(conf_obj, "metrics_port");
+    if (json_value_get_type(val) == JSONNumber) {
+        GW.cfg.metrics_port = (uint16_t)json_value_get_number(val);
+    }
+    if (GW.cfg.metrics_port > 0)
+        lgw_log(LOG_INFO, "[INFO~][SETTING] metrics endpoint on 127.0.0.1:%u\n", GW.cfg.metrics_port);
+    else
+        lgw_log(LOG_INFO, "[INFO~][SETTING] metrics endpoint is disabled\n");
+
     /*
     val = json_object_get_value(conf_obj, "status_index");
     if (json_value_get_type(val) == JSONNumber) {
@@ -1617,6 +1704,14 @@ static int parse_gateway_configuration(const char* conf_file) {
         if (val != NULL)
             GW.lbt.lbt_scan_time_ms = (uint16_t)json_value_get_number(val);
         lgw_log(LOG_INFO, "[INFO~][SETTING] LBT rssi scan time is configured to \"%u\"\n", GW.lbt.lbt_scan_time_ms);
+
+        val = json_object_get_value(conf_obj, "lbt_pipeline_depth");
+        if (val != NULL) {
+            GW.lbt.lbt_pipeline_depth = (uint8_t)json_value_get_number(val);
+            if (GW.lbt.lbt_pipeline_depth < 1 || GW.lbt.lbt_pipeline_depth > LBT_PIPELINE_MAX)
+                GW.lbt.lbt_pipeline_depth = 1;
+        }
+        lgw_log(LOG_INFO, "[INFO~][SETTING] LBT pipeline depth is configured to \"%u\"\n", GW.lbt.lbt_pipeline_depth);
     }
 
     /*!> Beacon signal period (optional) */
@@ -1701,10 +1796,18 @@ static int parse_gateway_configuration(const char* conf_file) {
 
             serv_entry->info.stamp = 1 << (i+1);  //PKT is the first service
 
+            /*!> default downlink priorities, the jit_priority_e class itself */
+            for (try = 0; try < JIT_PRIO_NB; try++)
+                serv_entry->info.dn_prio[try] = try;
+
             /*!> service network information */
             serv_entry->net = (serv_net_s*)lgw_malloc(sizeof(serv_net_s));
             serv_entry->net->sock_up = -1;
             serv_entry->net->sock_down = -1;
+            pthread_mutex_init(&serv_entry->net->mx_sock, NULL);
+            pthread_mutex_init(&serv_entry->net->mx_reject, NULL);
+            serv_entry->net->sock_gen = 0;
+            serv_entry->net->nb_reject = 0;
             serv_entry->net->push_timeout_half.tv_sec = 0;
             serv_entry->net->push_timeout_half.tv_usec = DEFAULT_PUSH_TIMEOUT_MS * 500;
             serv_entry->net->pull_timeout.tv_sec = 0;
@@ -1817,7 +1920,14 @@ static int parse_gateway_configuration(const char* conf_file) {
 
             if (serv_entry->info.type == semtech) {
 
-                serv_entry->report = (report_s*)lgw_malloc(sizeof(report_s));
+                /*!> aligned for the counter blocks, see stat_blk_s */
+                if (posix_memalign((void **)&serv_entry->report, STAT_CACHE_LINE, sizeof(report_s)) != 0) {
+                    lgw_log(LOG_ERROR, "%s[SETTING][%s] can't allocate the service report, service skipped\n", ERRMSG, serv_entry->info.name);
+                    lgw_free(serv_entry->net);
+                    lgw_free(serv_entry);
+                    continue;
+                }
+                memset(serv_entry->report, 0, sizeof(report_s));
                 serv_entry->report->report_ready = false;
                 memcpy(serv_entry->report->stat_format, "semtech", sizeof(serv_entry->report->stat_format));
                 serv_entry->report->stat_interval = DEFAULT_STAT_INTERVAL;
@@ -1874,6 +1984,19 @@ static int parse_gateway_configuration(const char* conf_file) {
                     lgw_log(LOG_INFO, "[INFO~][SETTING][%s] stat_interval is configure to \"%d\"\n", serv_entry->info.name, serv_entry->report->stat_interval);
                 }
 
+                /*!> JiT priorities of this server's downlinks, eg. {"join_accept":3,"class_a":2,"class_b":1,"class_c":0} */
+                prio_obj = json_object_get_object(serv_obj, "downlink_priority");
+                if (prio_obj != NULL) {
+                    for (try = 0; try < JIT_PRIO_NB; try++) {
+                        val = json_object_get_value(prio_obj, prio_name[try]);
+                        if (val != NULL)
+                            serv_entry->info.dn_prio[try] = (uint8_t)json_value_get_number(val);
+                    }
+                    lgw_log(LOG_INFO, "[INFO~][SETTING][%s] downlink priorities: join_accept=%u, class_a=%u, class_b=%u, class_c=%u\n", serv_entry->info.name,
+                            serv_entry->info.dn_prio[JIT_PRIO_JOIN_ACCEPT], serv_entry->info.dn_prio[JIT_PRIO_CLASS_A],
+                            serv_entry->info.dn_prio[JIT_PRIO_CLASS_B], serv_entry->info.dn_prio[JIT_PRIO_CLASS_C]);
+                }
+
             } //end of not as pkt type
             serv_entry->filter.fwd_valid_pkt = true;
             serv_entry->filter.fwd_error_pkt = true;
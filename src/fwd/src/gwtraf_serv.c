@@ -29,6 +29,7 @@
 #include <string.h>
 #include <semaphore.h>
 #include <time.h>
+#include <math.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -36,6 +37,7 @@
 #include "fwd.h"
 #include "service.h"
 #include "gwtraf_service.h"
+#include "jsonw.h"
 
 #include "loragw_hal.h"
 #include "loragw_aux.h"
@@ -52,9 +54,7 @@ int gwtraf_start(serv_s* serv) {
     }
     serv->state.live = true;
     serv->state.stall_time = 0;
-    LGW_LIST_LOCK(&GW.rxpkts_list);
-    GW.info.service_count++;
-    LGW_LIST_UNLOCK(&GW.rxpkts_list);
+    rxpkt_attach(serv);
     lgw_db_put("service/traffic", serv->info.name, "running");
     lgw_db_put("thread", serv->info.name, "running");
 
@@ -66,9 +66,7 @@ void gwtraf_stop(serv_s* serv) {
     serv->thread.stop_sig = true;
 	pthread_join(serv->thread.t_up, NULL);
     serv->state.live = false;
-    LGW_LIST_LOCK(&GW.rxpkts_list);
-    GW.info.service_count--;
-    LGW_LIST_UNLOCK(&GW.rxpkts_list);
+    rxpkt_detach(serv);
     serv->net->sock_up = -1;
     serv->net->sock_down = -1;
     lgw_db_del("service/traffic", serv->info.name);
@@ -90,31 +88,30 @@ static void gwtraf_push_up(void* arg) {
 	/*!> data buffers */
 	uint8_t buff_up[TX_BUFF_SIZE];	/*!> buffer to compose the upstream packet */
 	int buff_index;
+	jsonw_s w;					/*!> rxpk array writer on buff_up */
 
 	/*!> GPS synchronization variables */
 	struct timespec pkt_utc_time;
-	struct tm *x;				/*!> broken-up UTC time */
 
 	/*!> variables for identification */
 	char iso_timestamp[24];
 	time_t system_time;
 
-	uint32_t mote_addr = 0;
-	uint16_t mote_fcnt = 0;
-    uint8_t mote_fport = 0;
+    const mac_meta_s *meta;
 
     lgw_log(LOG_INFO, "[INFO~][%s] Starting gwtraf_push_up...\n", serv->info.name);
 	while (!serv->thread.stop_sig) {
 		// wait for data to arrive
 		sem_wait(&serv->thread.sema);
 
-        serv_ct_s *serv_ct = lgw_malloc(sizeof(serv_ct_s));
-        serv_ct->serv = serv;
+        serv_ct_s *serv_ct = serv_ct_new(serv);
+        if (serv_ct == NULL)
+            continue;
 
         nb_pkt = serv_ct->nb_pkt = get_rxpkt(serv_ct);     //only get the first rxpkt of list
 
         if (nb_pkt == 0) {
-            lgw_free(serv_ct);
+            serv_ct_free(serv_ct);
             continue;
         }
 
@@ -143,11 +140,12 @@ static void gwtraf_push_up(void* arg) {
         if (j > 0) {
             buff_index += j;
         } else {
-            lgw_free(serv_ct);
+            serv_ct_free(serv_ct);
             continue;
         }
 
         strt = buff_index;
+        jsonw_init(&w, buff_up, TX_BUFF_SIZE, buff_index);
 
         /*!> serialize Lora packet metadata and payload 
          * JSON structure: {"type":"uplink","gw":"...","time":"...","rxpk":[{...},{...}]}
@@ -156,8 +154,9 @@ static void gwtraf_push_up(void* arg) {
         int valid_pkt_count = 0;
         for (i = 0; i < nb_pkt; i++) {
             p = &serv_ct->rxpkt[i];
+            meta = &serv_ct->rxmeta[i];
 
-            int start_index = buff_index;
+            int start_index = w.len;
 
             /*!> basic packet filtering */
             switch (p->status) {
@@ -180,212 +179,70 @@ static void gwtraf_push_up(void* arg) {
                 continue;		/*!> skip that packet */
             }
 
-            if (p->size >= 8) {
-                mote_addr = p->payload[1];
-                mote_addr |= p->payload[2] << 8;
-                mote_addr |= p->payload[3] << 16;
-                mote_addr |= p->payload[4] << 24;
-                mote_fcnt = p->payload[6];
-                mote_fcnt |= p->payload[7] << 8;
-                mote_fport = p->payload[8];  /*!> if optslen = 0 */
-            } else {
-                mote_addr = 0;
-                mote_fcnt = 0;
-                mote_fport = 0;
-            }
-
-            if (mote_addr != 0 && mote_fport != 0) {
-                FilterParams_t FP = {0};
-                memset(&FP, 0x00, sizeof(FilterParams_t));
-                FP.addr = mote_addr;
-                FP.fport = mote_fport;
+            if (meta->valid && pkt_filter_enabled(serv)) {
+                FilterParams_t FP;
+                pkt_filter_params(&FP, meta);
                 if (pkt_basic_filter(serv, &FP)) {
                     lgw_log(LOG_INFO, "[INFO~][%s-up] Drop a packet.\n", serv->info.name);
                     continue;
                 }
             }
 
-            /*!> RAW timestamp, 8-17 useful chars */
-            if (valid_pkt_count > 0) {
-                /*!> Add comma separator for subsequent packets */
-                j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, ",{\"tmst\":%u", p->count_us);
-            } else {
-                /*!> Start first packet JSON object */
-                j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, "{\"tmst\":%u", p->count_us);
-            }
-            if (j > 0) {
-                buff_index += j;
-            } else {
-                lgw_log(LOG_ERROR, "ERROR: [%s-up] failed to add field \"tmst\" to the transmission buffer.\n", serv->info.name);
-                continue;		/*!> skip that packet */
-                //exit(EXIT_FAILURE);
-            }
+            /*!> RAW timestamp, add comma separator for subsequent packets */
+            if (valid_pkt_count > 0)
+                jsonw_char(&w, ',');
+            jsonw_lit(&w, "{\"tmst\":");
+            jsonw_uint(&w, p->count_us);
 
-            /*!> Packet RX time (GPS based), 37 useful chars */
+            /*!> Packet RX time (GPS based) */
             if (ref_ok == true) {
                 /*!> convert packet timestamp to UTC absolute time */
-                j = lgw_cnt2utc(local_ref, p->count_us, &pkt_utc_time);
-                if (j == LGW_GPS_SUCCESS) {
-                    /*!> split the UNIX timestamp to its calendar components */
-                    x = gmtime(&(pkt_utc_time.tv_sec));
-                    j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, ",\"time\":\"%04i-%02i-%02iT%02i:%02i:%02i.%06liZ\"", (x->tm_year) + 1900, (x->tm_mon) + 1, x->tm_mday, x->tm_hour, x->tm_min, x->tm_sec, (pkt_utc_time.tv_nsec) / 1000);	/*!> ISO 8601 format */
-                    if (j > 0) {
-                        buff_index += j;
-                    } else {
-                        lgw_log(LOG_ERROR, "ERROR: [%s-up] failed to add field \"time\" to the transmission buffer.\n", serv->info.name);
-                        continue;	/*!> skip that packet */
-                        //exit(EXIT_FAILURE);
-                    }
+                if (lgw_cnt2utc(local_ref, p->count_us, &pkt_utc_time) == LGW_GPS_SUCCESS) {
+                    jsonw_lit(&w, ",\"time\":");
+                    jsonw_utc(&w, &pkt_utc_time);
                 }
             }
 
-            /*!> Packet concentrator channel, RF chain & RX frequency, 34-36 useful chars */
-            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index,
-                                    ",\"chan\":%1u,\"rfch\":%1u,\"freq\":%.6lf",
-                                    p->if_chain, p->rf_chain, ((double)p->freq_hz / 1e6));
-            if (j > 0) {
-                buff_index += j;
-            } else {
-                continue;
-            }
-
-            /*!> Packet status, 9-10 useful chars */
-            switch (p->status) {
-            case STAT_CRC_OK:
-                memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":1", 9);
-                buff_index += 9;
-                break;
-            case STAT_CRC_BAD:
-                memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":-1", 10);
-                buff_index += 10;
-                break;
-            case STAT_NO_CRC:
-                memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":0", 9);
-                buff_index += 9;
-                break;
-            default:
+            /*!> Packet concentrator channel, RF chain & RX frequency */
+            jsonw_lit(&w, ",\"chan\":");
+            jsonw_uint(&w, p->if_chain);
+            jsonw_lit(&w, ",\"rfch\":");
+            jsonw_uint(&w, p->rf_chain);
+            jsonw_lit(&w, ",\"freq\":");
+            jsonw_fixed(&w, p->freq_hz, 6);
+
+            /*!> Packet status, modulation, datarate & coding rate */
+            if (jsonw_rxpk_modu(&w, p) != 0) {
+                jsonw_reset(&w, start_index);
                 continue;		/*!> skip that packet */
             }
 
-            /*!> Packet modulation, 13-14 useful chars */
+            /*!> Lora SNR */
             if (p->modulation == MOD_LORA) {
-                memcpy((void *)(buff_up + buff_index), (void *)",\"modu\":\"LORA\"", 14);
-                buff_index += 14;
-
-                /*!> Lora datarate & bandwidth, 16-19 useful chars */
-                switch (p->datarate) {
-                case DR_LORA_SF7:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF7", 12);
-                    buff_index += 12;
-                    break;
-                case DR_LORA_SF8:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF8", 12);
-                    buff_index += 12;
-                    break;
-                case DR_LORA_SF9:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF9", 12);
-                    buff_index += 12;
-                    break;
-                case DR_LORA_SF10:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF10", 13);
-                    buff_index += 13;
-                    break;
-                case DR_LORA_SF11:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF11", 13);
-                    buff_index += 13;
-                    break;
-                case DR_LORA_SF12:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF12", 13);
-                    buff_index += 13;
-                    break;
-                default:
-                    continue;	/*!> skip that packet */
-                }
-                switch (p->bandwidth) {
-                case BW_125KHZ:
-                    memcpy((void *)(buff_up + buff_index), (void *)"BW125\"", 6);
-                    buff_index += 6;
-                    break;
-                case BW_250KHZ:
-                    memcpy((void *)(buff_up + buff_index), (void *)"BW250\"", 6);
-                    buff_index += 6;
-                    break;
-                case BW_500KHZ:
-                    memcpy((void *)(buff_up + buff_index), (void *)"BW500\"", 6);
-                    buff_index += 6;
-                    break;
-                default:
-                    continue;	/*!> skip that packet */
-                }
-
-                /*!> Packet ECC coding rate, 11-13 useful chars */
-                switch (p->coderate) {
-                case CR_LORA_4_5:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/5\"", 13);
-                    buff_index += 13;
-                    break;
-                case CR_LORA_4_6:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/6\"", 13);
-                    buff_index += 13;
-                    break;
-                case CR_LORA_4_7:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/7\"", 13);
-                    buff_index += 13;
-                    break;
-                case CR_LORA_4_8:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/8\"", 13);
-                    buff_index += 13;
-                    break;
-                case 0:		/*!> treat the CR0 case (mostly false sync) */
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"OFF\"", 13);
-                    buff_index += 13;
-                    break;
-                default:
-                    continue;	/*!> skip that packet */
-                }
-
-                /*!> Lora SNR, 11-13 useful chars */
-                j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, ",\"lsnr\":%.1f", p->snr);
-                if (j > 0) {
-                    buff_index += j;
-                } else {
-                    continue;	/*!> skip that packet */
-                }
-            } else if (p->modulation == MOD_FSK) {
-                memcpy((void *)(buff_up + buff_index), (void *)",\"modu\":\"FSK\"", 13);
-                buff_index += 13;
-
-                /*!> FSK datarate, 11-14 useful chars */
-                j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, ",\"datr\":%u", p->datarate);
-                if (j > 0) {
-                    buff_index += j;
-                } else {
-                    continue;	/*!> skip that packet */
-                }
-            } else {
-                continue;		/*!> skip that packet */
+                jsonw_lit(&w, ",\"lsnr\":");
+                jsonw_float1(&w, p->snr);
             }
 
-            /*!> Packet RSSI, payload size, 18-23 useful chars */
-            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, ",\"rssi\":%.0f,\"size\":%u", p->rssis, p->size);
-            if (j > 0) {
-                buff_index += j;
-            } else {
-                continue;		/*!> skip that packet */
-            }
-
-            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, ",\"mote\":\"%08X\",\"fcnt\":%u", mote_addr, mote_fcnt);
-            if (j > 0) {
-                buff_index += j;
-            } else {
-                continue;		/*!> skip that packet */
-            }
+            /*!> Packet RSSI, payload size, mote */
+            jsonw_lit(&w, ",\"rssi\":");
+            jsonw_int(&w, lroundf(p->rssis));
+            jsonw_lit(&w, ",\"size\":");
+            jsonw_uint(&w, p->size);
+            jsonw_lit(&w, ",\"mote\":\"");
+            jsonw_hex32(&w, meta->devaddr);
+            jsonw_lit(&w, "\",\"fcnt\":");
+            jsonw_uint(&w, meta->fcnt);
 
             /*!> End of packet serialization */
-            buff_up[buff_index] = '}';
-            ++buff_index;
+            jsonw_char(&w, '}');
+            if (w.err) {
+                lgw_log(LOG_ERROR, "ERROR: [%s-up] transmission buffer full, packet skipped.\n", serv->info.name);
+                jsonw_reset(&w, start_index);
+                continue;
+            }
             valid_pkt_count++;
         }
+        buff_index = w.len;
 
         /*!> Send the complete JSON after processing all packets */
         if (valid_pkt_count > 0) {
@@ -416,7 +273,7 @@ static void gwtraf_push_up(void* arg) {
             }
         }
         
-        lgw_free(serv_ct);
+        serv_ct_free(serv_ct);
 	}
     lgw_log(LOG_INFO, "[INFO~][THREAD][%s] ENDed!\n", serv->info.name);
 }
@@ -15,17 +15,21 @@ License: Revised BSD License, see LICENSE.TXT file include in the project
 /*!> -------------------------------------------------------------------------- */
 /*!> --- DEPENDANCIES --------------------------------------------------------- */
 
-//#define _GNU_SOURCE     /*!> needed for qsort_r to be defined */
-#include <stdlib.h>     /*!> qsort_r */
+#include <stdlib.h>
 #include <stdio.h>      /*!> printf, fprintf, snprintf, fopen, fputs */
 #include <string.h>     /*!> memset, memcpy */
 #include <pthread.h>
 #include <assert.h>
 #include <math.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/time.h>
 
 #include "logger.h"
+#include "compiler.h"
+#include "lgwmm.h"
 #include "jitqueue.h"
+#include "metrics.h"
 
 /*!> -------------------------------------------------------------------------- */
 /*!> --- PRIVATE MACROS ------------------------------------------------------- */
@@ -45,108 +49,243 @@ License: Revised BSD License, see LICENSE.TXT file include in the project
 
 /*!> -------------------------------------------------------------------------- */
 /*!> --- PRIVATE VARIABLES (GLOBAL) ------------------------------------------- */
-static pthread_mutex_t mx_jit_queue = PTHREAD_MUTEX_INITIALIZER; /*!> control access to JIT queue */
+static pthread_mutex_t mx_jit_wait = PTHREAD_MUTEX_INITIALIZER;   /*!> protects jit_enqueue_seq, queues have their own lock */
+static pthread_cond_t cv_jit_queue;                              /*!> signaled on every successful enqueue, on CLOCK_MONOTONIC */
+static pthread_once_t cv_jit_once = PTHREAD_ONCE_INIT;
+static uint32_t jit_enqueue_seq = 0;                              /*!> number of enqueues so far, all queues */
 
 /*!> -------------------------------------------------------------------------- */
 /*!> --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
 
-/*!> -------------------------------------------------------------------------- */
-/*!> --- PUBLIC FUNCTIONS DEFINITION ----------------------------------------- */
+/*!> a wall clock step must not stretch or cut the wait of jit_wait */
+static void cv_jit_create(void) {
+    pthread_condattr_t attr;
 
-bool jit_queue_is_full(struct jit_queue_s *queue) {
-    bool result;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cv_jit_queue, &attr);
+    pthread_condattr_destroy(&attr);
+}
 
-    pthread_mutex_lock(&mx_jit_queue);
+/*!> [WARNING~][JIT] unsigned arithmetic (handle roll-over): every queued
+ *   timestamp is within TX_MAX_ADVANCE_DELAY of the current time, far less
+ *   than half the counter range, so the sign of the difference orders them */
+static inline bool jit_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
 
-    result = (queue->num_pkt == JIT_QUEUE_MAX)?true:false;
+/*!> index of the first node not scheduled before count_us, queue locked */
+static int jit_lower_bound(struct jit_queue_s *queue, uint32_t count_us) {
+    int lo = 0, hi = queue->num_pkt, mid;
 
-    pthread_mutex_unlock(&mx_jit_queue);
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (jit_before(queue->nodes[mid].pkt.count_us, count_us))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-    return result;
+/*!> queue locked */
+static void jit_remove(struct jit_queue_s *queue, int index) {
+    if (queue->nodes[index].pkt_type == JIT_PKT_TYPE_BEACON)
+        queue->num_beacon--;
+    queue->num_pkt--;
+    memmove(&queue->nodes[index], &queue->nodes[index + 1], (queue->num_pkt - index) * sizeof(struct jit_node_s));
+    if (queue->num_pkt == 0) {
+        queue->max_pre_delay = 0;
+        queue->max_post_delay = 0;
+    }
 }
 
-bool jit_queue_is_empty(struct jit_queue_s *queue) {
-    bool result;
+bool jit_collision_test(uint32_t p1_count_us, uint32_t p1_pre_delay, uint32_t p1_post_delay, uint32_t p2_count_us, uint32_t p2_pre_delay, uint32_t p2_post_delay) {
+    if (((p1_count_us - p2_count_us) <= (p1_pre_delay + p2_post_delay + TX_MARGIN_DELAY)) ||
+        ((p2_count_us - p1_count_us) <= (p2_pre_delay + p1_post_delay + TX_MARGIN_DELAY))) {
+        return true;
+    } else {
+        return false;
+    }
+}
 
-    pthread_mutex_lock(&mx_jit_queue);
+/*!> Indexes of the nodes colliding with the given packet, at most max of them,
+ *  returns how many were found, queue locked.
+ *  Only the neighbours which can reach count_us are tested: the scan stops once
+ *  the largest pre/post delay in the queue cannot bridge the gap anymore.
+ *  Beacon Guard is ignored for Class A/C downlinks. */
+static int jit_find_collisions(struct jit_queue_s *queue, uint32_t count_us, uint32_t pre_delay, uint32_t post_delay, enum jit_pkt_type_e pkt_type, int *found, int max) {
+    int pos = jit_lower_bound(queue, count_us);
+    int i, n = 0;
+    uint32_t target_pre_delay;
+    bool ignore_guard = (pkt_type == JIT_PKT_TYPE_DOWNLINK_CLASS_A) || (pkt_type == JIT_PKT_TYPE_DOWNLINK_CLASS_C);
+
+    for (i = pos; i < queue->num_pkt && n < max; i++) {
+        if ((queue->nodes[i].pkt.count_us - count_us) > (queue->max_pre_delay + post_delay + TX_MARGIN_DELAY))
+            break;
+        target_pre_delay = (ignore_guard && queue->nodes[i].pkt_type == JIT_PKT_TYPE_BEACON) ? TX_START_DELAY : queue->nodes[i].pre_delay;
+        if (jit_collision_test(count_us, pre_delay, post_delay, queue->nodes[i].pkt.count_us, target_pre_delay, queue->nodes[i].post_delay))
+            found[n++] = i;
+    }
 
-    result = (queue->num_pkt == 0)?true:false;
+    for (i = pos - 1; i >= 0 && n < max; i--) {
+        if ((count_us - queue->nodes[i].pkt.count_us) > (pre_delay + queue->max_post_delay + TX_MARGIN_DELAY))
+            break;
+        target_pre_delay = (ignore_guard && queue->nodes[i].pkt_type == JIT_PKT_TYPE_BEACON) ? TX_START_DELAY : queue->nodes[i].pre_delay;
+        if (jit_collision_test(count_us, pre_delay, post_delay, queue->nodes[i].pkt.count_us, target_pre_delay, queue->nodes[i].post_delay))
+            found[n++] = i;
+    }
 
-    pthread_mutex_unlock(&mx_jit_queue);
+    return n;
+}
 
-    return result;
+/*!> first timestamp from count_us on where the packet fits, queue locked
+ *  The queue is sorted so the candidate only moves forward, right after
+ *  the downlink it collides with, until a gap fits. */
+static bool jit_next_gap(struct jit_queue_s *queue, uint32_t *count_us, uint32_t pre_delay, uint32_t post_delay, enum jit_pkt_type_e pkt_type) {
+    int i, c;
+
+    for (i = 0; i <= queue->num_pkt; i++) {
+        if (jit_find_collisions(queue, *count_us, pre_delay, post_delay, pkt_type, &c, 1) == 0)
+            return true;
+        lgw_log(LOG_JIT, "[DEBUG~][JIT] cannot insert downlink at count_us=%u, collides with %u (index=%d)\n", *count_us, queue->nodes[c].pkt.count_us, c);
+        *count_us = queue->nodes[c].pkt.count_us + queue->nodes[c].post_delay + pre_delay + TX_JIT_DELAY + TX_MARGIN_DELAY;
+    }
+
+    return false;
+}
+
+/*!> queue locked, not full, slot checked for collisions */
+static void jit_insert(struct jit_queue_s *queue, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e pkt_type, uint32_t pre_delay, uint32_t post_delay, const struct jit_meta_s *meta) {
+    int i = jit_lower_bound(queue, packet->count_us);
+
+    memmove(&queue->nodes[i + 1], &queue->nodes[i], (queue->num_pkt - i) * sizeof(struct jit_node_s));
+    memcpy(&(queue->nodes[i].pkt), packet, sizeof(struct lgw_pkt_tx_s));
+    queue->nodes[i].pre_delay = pre_delay;
+    queue->nodes[i].post_delay = post_delay;
+    queue->nodes[i].pkt_type = pkt_type;
+    queue->nodes[i].meta = *meta;
+    if (pkt_type == JIT_PKT_TYPE_BEACON) {
+        queue->num_beacon++;
+    }
+    queue->num_pkt++;
+    if (pre_delay > queue->max_pre_delay)
+        queue->max_pre_delay = pre_delay;
+    if (post_delay > queue->max_post_delay)
+        queue->max_post_delay = post_delay;
 }
 
-void jit_queue_init(struct jit_queue_s *queue) {
+/*!> may the packet evict all the colliding nodes, queue locked
+ *  A node is kept if it is a beacon, does not have a lower priority, or is
+ *  about to be programmed: it could not be queued again that late anyway. */
+static bool jit_can_preempt(struct jit_queue_s *queue, uint32_t time_us, enum jit_pkt_type_e pkt_type, const struct jit_meta_s *meta, const int *victims, int nb_victim) {
     int i;
+    struct jit_node_s *node;
 
-    pthread_mutex_lock(&mx_jit_queue);
+    if (!meta->preempt || pkt_type == JIT_PKT_TYPE_BEACON || nb_victim > JIT_PREEMPT_MAX)
+        return false;
 
-    memset(queue, 0, sizeof(*queue));
-    for (i=0; i<JIT_QUEUE_MAX; i++) {
-        queue->nodes[i].pre_delay = 0;
-        queue->nodes[i].post_delay = 0;
+    for (i = 0; i < nb_victim; i++) {
+        node = &queue->nodes[victims[i]];
+        if (node->pkt_type == JIT_PKT_TYPE_BEACON || node->meta.priority >= meta->priority)
+            return false;
+        if ((node->pkt.count_us - time_us) <= (TX_START_DELAY + TX_MARGIN_DELAY + TX_JIT_DELAY))
+            return false;
     }
 
-    pthread_mutex_unlock(&mx_jit_queue);
+    return true;
 }
 
-int compare(const void *a, const void *b, void *arg)
-{
-    struct jit_node_s *p = (struct jit_node_s *)a;
-    struct jit_node_s *q = (struct jit_node_s *)b;
-    int *counter = (int *)arg;
-    int p_count, q_count;
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PUBLIC FUNCTIONS DEFINITION ----------------------------------------- */
+
+bool jit_queue_is_full(struct jit_queue_s *queue) {
+    bool result;
 
-    p_count = p->pkt.count_us;
-    q_count = q->pkt.count_us;
+    pthread_mutex_lock(&queue->mx_queue);
 
-    if (p_count > q_count)
-        *counter = *counter + 1;
+    result = (queue->num_pkt >= queue->capacity)?true:false;
 
-    return p_count - q_count;
+    pthread_mutex_unlock(&queue->mx_queue);
+
+    return result;
 }
 
-void jit_sort_queue(struct jit_queue_s *queue) {
-    int counter = 0;
+bool jit_queue_is_empty(struct jit_queue_s *queue) {
+    bool result;
 
-    if (queue->num_pkt == 0) {
+    pthread_mutex_lock(&queue->mx_queue);
+
+    result = (queue->num_pkt == 0)?true:false;
+
+    pthread_mutex_unlock(&queue->mx_queue);
+
+    return result;
+}
+
+void jit_queue_init(struct jit_queue_s *queue, uint16_t capacity) {
+    pthread_once(&cv_jit_once, cv_jit_create);
+
+    memset(queue, 0, sizeof(*queue));
+    pthread_mutex_init(&queue->mx_queue, NULL);
+
+    if (capacity == 0)
+        capacity = JIT_QUEUE_MAX;
+
+    queue->nodes = lgw_malloc(capacity * sizeof(struct jit_node_s));
+    if (queue->nodes == NULL) {
+        lgw_log(LOG_JIT_ERROR, "[ERROR~][JIT] can't allocate a queue of %u packets\n", capacity);
         return;
     }
-
-    lgw_log(LOG_JIT, "[INFO~][JIT] sorting queue in ascending order packet timestamp - queue size:%u\n", queue->num_pkt);
-    qsort_r(queue->nodes, queue->num_pkt, sizeof(queue->nodes[0]), compare, &counter);
-    lgw_log(LOG_JIT, "[INFO~][JIT] sorting queue done - swapped:%d\n", counter);
+    queue->capacity = capacity;
 }
 
-bool jit_collision_test(uint32_t p1_count_us, uint32_t p1_pre_delay, uint32_t p1_post_delay, uint32_t p2_count_us, uint32_t p2_pre_delay, uint32_t p2_post_delay) {
-    if (((p1_count_us - p2_count_us) <= (p1_pre_delay + p2_post_delay + TX_MARGIN_DELAY)) ||
-        ((p2_count_us - p1_count_us) <= (p2_pre_delay + p1_post_delay + TX_MARGIN_DELAY))) {
-        return true;
-    } else {
-        return false;
+enum jit_priority_e jit_priority_class(enum jit_pkt_type_e pkt_type, const struct lgw_pkt_tx_s *packet) {
+    switch (pkt_type) {
+        case JIT_PKT_TYPE_DOWNLINK_CLASS_A:
+            /*!> MHDR MType 001: join-accept */
+            if (packet->size > 0 && (packet->payload[0] & 0xE0) == 0x20)
+                return JIT_PRIO_JOIN_ACCEPT;
+            return JIT_PRIO_CLASS_A;
+        case JIT_PKT_TYPE_DOWNLINK_CLASS_B:
+            return JIT_PRIO_CLASS_B;
+        default:
+            return JIT_PRIO_CLASS_C;
     }
 }
 
 enum jit_error_e jit_enqueue(struct jit_queue_s *queue, uint32_t time_us, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e pkt_type) {
-    int i = 0;
+    return jit_enqueue_prio(queue, time_us, packet, pkt_type, NULL, NULL, NULL);
+}
+
+enum jit_error_e jit_enqueue_prio(struct jit_queue_s *queue, uint32_t time_us, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e pkt_type, const struct jit_meta_s *meta, struct jit_node_s *evicted, int *nb_evicted) {
+    int i = 0, n;
     uint32_t packet_post_delay = 0;
     uint32_t packet_pre_delay = 0;
-    uint32_t target_pre_delay = 0;
     enum jit_error_e err_collision;
     uint32_t asap_count_us;
+    struct jit_meta_s node_meta;
+    struct jit_node_s victim[JIT_PREEMPT_MAX];
+    int victims[JIT_PREEMPT_MAX + 1];
+    int nb_victim = 0;
 
-    lgw_log(LOG_JIT, "[INFO~][JIT] Current concentrator time is %u, pkt_count=%u, pkt_type=%d\n", time_us, packet->count_us, pkt_type); 
-    if (packet == NULL) {
+    if (packet == NULL || (meta != NULL && meta->preempt && (evicted == NULL || nb_evicted == NULL))) {
         lgw_log(LOG_JIT_ERROR, "[ERROR~][JIT] invalid parameter\n");
         return JIT_ERROR_INVALID;
     }
 
-    if (jit_queue_is_full(queue)) {
-        lgw_log(LOG_JIT_ERROR, "[ERROR~][JIT] cannot enqueue packet, JIT queue is full\n");
-        return JIT_ERROR_FULL;
+    if (nb_evicted != NULL)
+        *nb_evicted = 0;
+
+    if (meta != NULL) {
+        node_meta = *meta;
+    } else {
+        memset(&node_meta, 0, sizeof(node_meta));
+        node_meta.priority = jit_priority_class(pkt_type, packet);
     }
 
+    lgw_log(LOG_JIT, "[INFO~][JIT] Current concentrator time is %u, pkt_count=%u, pkt_type=%d\n", time_us, packet->count_us, pkt_type); 
+
     /*!> Compute packet pre/post delays depending on packet's type */
     switch (pkt_type) {
         case JIT_PKT_TYPE_DOWNLINK_CLASS_A:
@@ -164,7 +303,13 @@ enum jit_error_e jit_enqueue(struct jit_queue_s *queue, uint32_t time_us, struct
             break;
     }
 
-    pthread_mutex_lock(&mx_jit_queue);
+    pthread_mutex_lock(&queue->mx_queue);
+
+    if (queue->num_pkt >= queue->capacity) {
+        pthread_mutex_unlock(&queue->mx_queue);
+        lgw_log(LOG_JIT_ERROR, "[ERROR~][JIT] cannot enqueue packet, JIT queue is full\n");
+        return JIT_ERROR_FULL;
+    }
 
     /*!> An immediate downlink becomes a timestamped downlink "ASAP" */
     /*!> Set the packet count_us to the first available slot */
@@ -172,49 +317,14 @@ enum jit_error_e jit_enqueue(struct jit_queue_s *queue, uint32_t time_us, struct
         /*!> change tx_mode to timestamped */
         packet->tx_mode = TIMESTAMPED;
 
-        /*!> Search for the ASAP timestamp to be given to the packet */
+        /*!> Search for the ASAP timestamp to be given to the packet:
+            - ASAP meaning NOW + MARGIN
+            - else the first gap after it
+        */
         asap_count_us = time_us + 1E6; /*!> TODO: Take 1 second margin, to be refined */
-        if (queue->num_pkt == 0) {
-            /*!> If the jit queue is empty, we can insert this packet */
-            lgw_log(LOG_JIT, "[DEBUG~][JIT] insert IMMEDIATE downlink, first in JiT queue (count_us=%u)\n", asap_count_us);
-        } else {
-            /*!> Else we can try to insert it:
-                - ASAP meaning NOW + MARGIN
-                - at the last index of the queue
-                - between 2 downlinks in the queue
-            */
-
-            /*!> First, try if the ASAP time collides with an already enqueued downlink */
-            for (i=0; i<queue->num_pkt; i++) {
-                if (jit_collision_test(asap_count_us, packet_pre_delay, packet_post_delay, queue->nodes[i].pkt.count_us, queue->nodes[i].pre_delay, queue->nodes[i].post_delay) == true) {
-                    lgw_log(LOG_JIT, "[DEBUG~][JIT] cannot insert IMMEDIATE downlink at count_us=%u, collides with %u (index=%d)\n", asap_count_us, queue->nodes[i].pkt.count_us, i);
-                    break;
-                }
-            }
-            if (i == queue->num_pkt) {
-                /*!> No collision with ASAP time, we can insert it */
-                lgw_log(LOG_JIT, "[DEBUG~][JIT] insert IMMEDIATE downlink ASAP at %u (no collision)\n", asap_count_us);
-            } else {
-                /*!> Search for the best slot then */
-                for (i=0; i<queue->num_pkt; i++) {
-                    asap_count_us = queue->nodes[i].pkt.count_us + queue->nodes[i].post_delay + packet_pre_delay + TX_JIT_DELAY + TX_MARGIN_DELAY;
-                    if (i == (queue->num_pkt - 1)) {
-                        /*!> Last packet index, we can insert after this one */
-                        lgw_log(LOG_JIT, "[DEBUG~][JIT] insert IMMEDIATE downlink, last in JiT queue (count_us=%u)\n", asap_count_us);
-                    } else {
-                        /*!> Check if packet can be inserted between this index and the next one */
-                        lgw_log(LOG_JIT, "[DEBUG~][JIT] try to insert IMMEDIATE downlink (count_us=%u) between index %d and index %d?\n", asap_count_us, i, i+1);
-                        if (jit_collision_test(asap_count_us, packet_pre_delay, packet_post_delay, queue->nodes[i+1].pkt.count_us, queue->nodes[i+1].pre_delay, queue->nodes[i+1].post_delay) == true) {
-                            lgw_log(LOG_JIT, "[DEBUG~][JIT] failed to insert IMMEDIATE downlink (count_us=%u), continue...\n", asap_count_us);
-                            continue;
-                        } else {
-                            lgw_log(LOG_JIT, "[DEBUG~][JIT] insert IMMEDIATE downlink (count_us=%u)\n", asap_count_us);
-                            break;
-                        }
-                    }
-                }
-            }
-        }
+        jit_next_gap(queue, &asap_count_us, packet_pre_delay, packet_post_delay, pkt_type);
+        lgw_log(LOG_JIT, "[DEBUG~][JIT] insert IMMEDIATE downlink ASAP at %u\n", asap_count_us);
+
         /*!> Set packet with ASAP timestamp */
         packet->count_us = asap_count_us;
     }
@@ -229,7 +339,7 @@ enum jit_error_e jit_enqueue(struct jit_queue_s *queue, uint32_t time_us, struct
      */
     if ((packet->count_us - time_us) <= (TX_START_DELAY + TX_MARGIN_DELAY + TX_JIT_DELAY)) {
         lgw_log(LOG_JIT_ERROR, "[ERROR~][JIT] Packet REJECTED, already too late to send it (current=%u, packet=%u, type=%d)\n", time_us, packet->count_us, pkt_type);
-        pthread_mutex_unlock(&mx_jit_queue);
+        pthread_mutex_unlock(&queue->mx_queue);
         return JIT_ERROR_TOO_LATE;
     }
 
@@ -247,7 +357,7 @@ enum jit_error_e jit_enqueue(struct jit_queue_s *queue, uint32_t time_us, struct
     if ((pkt_type == JIT_PKT_TYPE_DOWNLINK_CLASS_A) || (pkt_type == JIT_PKT_TYPE_DOWNLINK_CLASS_B)) {
         if ((packet->count_us - time_us) > TX_MAX_ADVANCE_DELAY) {
             lgw_log(LOG_JIT_ERROR, "[ERROR~][JIT] Packet REJECTED, too much in advance (current=%u, packet=%u, type=%d, max=%u)\n", time_us, packet->count_us, pkt_type, TX_MAX_ADVANCE_DELAY);
-            pthread_mutex_unlock(&mx_jit_queue);
+            pthread_mutex_unlock(&queue->mx_queue);
             return JIT_ERROR_TOO_EARLY;
         }
     }
@@ -256,104 +366,125 @@ enum jit_error_e jit_enqueue(struct jit_queue_s *queue, uint32_t time_us, struct
      *  Note: - need to take into account packet's pre_delay and post_delay of each packet
      *        - Valid for both Downlinks and beacon packets
      *        - Beacon guard can be ignored if we try to queue a Class A downlink
+     *
+     *  [WARNING~][JIT] unsigned arithmetic (handle roll-over)
+     *      t_packet_new - pre_delay_packet_new < t_packet_prev + post_delay_packet_prev (OVERLAP on post delay)
+     *      t_packet_new + post_delay_packet_new > t_packet_prev - pre_delay_packet_prev (OVERLAP on pre delay)
+     *
+     *  With preemption, the colliding packets are evicted instead if they all have a lower priority
      */
-    for (i=0; i<queue->num_pkt; i++) {
-        /*!> We ignore Beacon Guard for Class A/C downlinks */
-        if (((pkt_type == JIT_PKT_TYPE_DOWNLINK_CLASS_A) || (pkt_type == JIT_PKT_TYPE_DOWNLINK_CLASS_C)) && (queue->nodes[i].pkt_type == JIT_PKT_TYPE_BEACON)) {
-            target_pre_delay = TX_START_DELAY;
-        } else {
-            target_pre_delay = queue->nodes[i].pre_delay;
-        }
-
-        /*!> Check if there is a collision
-         *  [WARNING~][JIT] unsigned arithmetic (handle roll-over)
-         *      t_packet_new - pre_delay_packet_new < t_packet_prev + post_delay_packet_prev (OVERLAP on post delay)
-         *      t_packet_new + post_delay_packet_new > t_packet_prev - pre_delay_packet_prev (OVERLAP on pre delay)
-         */
-        if (jit_collision_test(packet->count_us, packet_pre_delay, packet_post_delay, queue->nodes[i].pkt.count_us, target_pre_delay, queue->nodes[i].post_delay) == true) {
-            switch (queue->nodes[i].pkt_type) {
-                case JIT_PKT_TYPE_DOWNLINK_CLASS_A:
-                case JIT_PKT_TYPE_DOWNLINK_CLASS_B:
-                case JIT_PKT_TYPE_DOWNLINK_CLASS_C:
-                    lgw_log(LOG_JIT_ERROR, "[ERROR~][JIT] Packet (type=%d) REJECTED, collision with packet already programmed at %u (%u)\n", pkt_type, queue->nodes[i].pkt.count_us, packet->count_us);
-                    err_collision = JIT_ERROR_COLLISION_PACKET;
-                    break;
-                case JIT_PKT_TYPE_BEACON:
-                    if (pkt_type != JIT_PKT_TYPE_BEACON) {
-                        /*!> do not overload logs for beacon/beacon collision, as it is expected to happen with beacon pre-scheduling algorith used */
-                        lgw_log(LOG_JIT_ERROR, "[ERROR~][JIT] Packet (type=%d) REJECTED, collision with beacon already programmed at %u (%u)\n", pkt_type, queue->nodes[i].pkt.count_us, packet->count_us);
-                    }
-                    err_collision = JIT_ERROR_COLLISION_BEACON;
-                    break;
-                default:
-                    lgw_log(LOG_JIT_ERROR, "[ERROR~][JIT] Unknown packet type, should not occur, BUG?\n");
-                    assert(0);
-                    break;
+    n = jit_find_collisions(queue, packet->count_us, packet_pre_delay, packet_post_delay, pkt_type, victims, JIT_PREEMPT_MAX + 1);
+    if (n > 0 && jit_can_preempt(queue, time_us, pkt_type, &node_meta, victims, n)) {
+        /*!> remove from the highest index down, the lower ones stay valid */
+        for (i = 1; i < n; i++) {
+            int v = victims[i], j = i;
+            while (j > 0 && victims[j - 1] < v) {
+                victims[j] = victims[j - 1];
+                j--;
             }
-            pthread_mutex_unlock(&mx_jit_queue);
-            return err_collision;
+            victims[j] = v;
         }
+        for (i = 0; i < n; i++) {
+            victim[i] = queue->nodes[victims[i]];
+            jit_remove(queue, victims[i]);
+        }
+        nb_victim = n;
+    } else if (n > 0) {
+        i = victims[0];
+        switch (queue->nodes[i].pkt_type) {
+            case JIT_PKT_TYPE_DOWNLINK_CLASS_A:
+            case JIT_PKT_TYPE_DOWNLINK_CLASS_B:
+            case JIT_PKT_TYPE_DOWNLINK_CLASS_C:
+                lgw_log(LOG_JIT_ERROR, "[ERROR~][JIT] Packet (type=%d) REJECTED, collision with packet already programmed at %u (%u)\n", pkt_type, queue->nodes[i].pkt.count_us, packet->count_us);
+                err_collision = JIT_ERROR_COLLISION_PACKET;
+                break;
+            case JIT_PKT_TYPE_BEACON:
+                if (pkt_type != JIT_PKT_TYPE_BEACON) {
+                    /*!> do not overload logs for beacon/beacon collision, as it is expected to happen with beacon pre-scheduling algorith used */
+                    lgw_log(LOG_JIT_ERROR, "[ERROR~][JIT] Packet (type=%d) REJECTED, collision with beacon already programmed at %u (%u)\n", pkt_type, queue->nodes[i].pkt.count_us, packet->count_us);
+                }
+                err_collision = JIT_ERROR_COLLISION_BEACON;
+                break;
+            default:
+                lgw_log(LOG_JIT_ERROR, "[ERROR~][JIT] Unknown packet type, should not occur, BUG?\n");
+                assert(0);
+                err_collision = JIT_ERROR_INVALID;
+                break;
+        }
+        pthread_mutex_unlock(&queue->mx_queue);
+        return err_collision;
     }
 
-    /*!> Finally enqueue it */
-    /*!> Insert packet at the end of the queue */
-    memcpy(&(queue->nodes[queue->num_pkt].pkt), packet, sizeof(struct lgw_pkt_tx_s));
-    queue->nodes[queue->num_pkt].pre_delay = packet_pre_delay;
-    queue->nodes[queue->num_pkt].post_delay = packet_post_delay;
-    queue->nodes[queue->num_pkt].pkt_type = pkt_type;
-    if (pkt_type == JIT_PKT_TYPE_BEACON) {
-        queue->num_beacon++;
+    /*!> Finally enqueue it, at its place in timestamp order */
+    jit_insert(queue, packet, pkt_type, packet_pre_delay, packet_post_delay, &node_meta);
+
+    /*!> Class C downlinks can be sent later, move them to the next gap, hand the others back */
+    for (i = 0; i < nb_victim; i++) {
+        asap_count_us = victim[i].pkt.count_us;
+        if (victim[i].pkt_type == JIT_PKT_TYPE_DOWNLINK_CLASS_C && queue->num_pkt < queue->capacity &&
+            jit_next_gap(queue, &asap_count_us, victim[i].pre_delay, victim[i].post_delay, victim[i].pkt_type) &&
+            (asap_count_us - time_us) < TX_MAX_ADVANCE_DELAY) {
+            lgw_log(LOG_JIT, "[INFO~][JIT] downlink preempted (priority %u > %u), moved from %u to %u\n", node_meta.priority, victim[i].meta.priority, victim[i].pkt.count_us, asap_count_us);
+            victim[i].pkt.count_us = asap_count_us;
+            jit_insert(queue, &victim[i].pkt, victim[i].pkt_type, victim[i].pre_delay, victim[i].post_delay, &victim[i].meta);
+        } else {
+            lgw_log(LOG_JIT_ERROR, "[WARNING~][JIT] downlink at %u evicted by a higher priority one (priority %u > %u)\n", victim[i].pkt.count_us, node_meta.priority, victim[i].meta.priority);
+            evicted[(*nb_evicted)++] = victim[i];
+        }
     }
-    queue->num_pkt++;
-    /*!> Sort the queue in ascending order of packet timestamp */
-    jit_sort_queue(queue);
 
     /*!> Done */
-    pthread_mutex_unlock(&mx_jit_queue);
+    pthread_mutex_unlock(&queue->mx_queue);
+
+    /*!> wake up the JiT thread, the new packet may be due before the one it sleeps on */
+    pthread_mutex_lock(&mx_jit_wait);
+    jit_enqueue_seq++;
+    pthread_cond_broadcast(&cv_jit_queue);
+    pthread_mutex_unlock(&mx_jit_wait);
 
     jit_print_queue(queue, false, LOG_JIT);
 
     lgw_log(LOG_JIT, "[INFO~][JIT] enqueued packet with count_us=%u (size=%u bytes, toa=%u us, type=%u)\n", packet->count_us, packet->size, packet_post_delay, pkt_type);
 
+    /*!> beacons are queued whole periods ahead, they would only blur the downlinks */
+    if (pkt_type != JIT_PKT_TYPE_BEACON)
+        metrics_observe(METRICS_JIT_LEAD, packet->count_us - time_us);
+
     return JIT_ERROR_OK;
 }
 
-enum jit_error_e jit_dequeue(struct jit_queue_s *queue, int index, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e *pkt_type) {
+enum jit_error_e jit_dequeue(struct jit_queue_s *queue, int index, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e *pkt_type, struct jit_meta_s *meta) {
     if (packet == NULL) {
         lgw_log(LOG_JIT_ERROR, "[ERROR~][JIT] invalid parameter\n");
         return JIT_ERROR_INVALID;
     }
 
-    if ((index < 0) || (index >= JIT_QUEUE_MAX)) {
-        lgw_log(LOG_JIT_ERROR, "[ERROR~][JIT] invalid parameter\n");
-        return JIT_ERROR_INVALID;
-    }
+    pthread_mutex_lock(&queue->mx_queue);
 
-    if (jit_queue_is_empty(queue)) {
+    if (queue->num_pkt == 0) {
+        pthread_mutex_unlock(&queue->mx_queue);
         lgw_log(LOG_JIT_ERROR, "[ERROR~][JIT] cannot dequeue packet, JIT queue is empty\n");
         return JIT_ERROR_EMPTY;
     }
 
-    pthread_mutex_lock(&mx_jit_queue);
+    if ((index < 0) || (index >= queue->num_pkt)) {
+        pthread_mutex_unlock(&queue->mx_queue);
+        lgw_log(LOG_JIT_ERROR, "[ERROR~][JIT] invalid parameter\n");
+        return JIT_ERROR_INVALID;
+    }
 
     /*!> Dequeue requested packet */
     memcpy(packet, &(queue->nodes[index].pkt), sizeof(struct lgw_pkt_tx_s));
-    queue->num_pkt--;
     *pkt_type = queue->nodes[index].pkt_type;
-    if (*pkt_type == JIT_PKT_TYPE_BEACON) {
-        queue->num_beacon--;
-        lgw_log(LOG_BEACON, "[INFO~][BEACON] --- Beacon dequeued ---\n");
-    }
-
-    /*!> Replace dequeued packet with last packet of the queue */
-    memcpy(&(queue->nodes[index]), &(queue->nodes[queue->num_pkt]), sizeof(struct jit_node_s));
-    memset(&(queue->nodes[queue->num_pkt]), 0, sizeof(struct jit_node_s));
-
-    /*!> Sort queue in ascending order of packet timestamp */
-    jit_sort_queue(queue);
+    if (meta != NULL)
+        *meta = queue->nodes[index].meta;
+    jit_remove(queue, index);
 
     /*!> Done */
-    pthread_mutex_unlock(&mx_jit_queue);
+    pthread_mutex_unlock(&queue->mx_queue);
+
+    if (*pkt_type == JIT_PKT_TYPE_BEACON)
+        lgw_log(LOG_BEACON, "[INFO~][BEACON] --- Beacon dequeued ---\n");
 
     jit_print_queue(queue, false, LOG_JIT);
 
@@ -363,96 +494,120 @@ enum jit_error_e jit_dequeue(struct jit_queue_s *queue, int index, struct lgw_pk
 }
 
 enum jit_error_e jit_peek(struct jit_queue_s *queue, uint32_t time_us, int *pkt_idx) {
-    /*!> Return index of node containing a packet inline with given time */
-    int i = 0;
-    int idx_highest_priority = -1;
     if (pkt_idx == NULL) {
         lgw_log(LOG_JIT_ERROR, "[ERROR~][JIT] invalid parameter\n");
         return JIT_ERROR_INVALID;
     }
 
-    if (jit_queue_is_empty(queue)) {
+    pthread_mutex_lock(&queue->mx_queue);
+
+    if (queue->num_pkt == 0) {
+        pthread_mutex_unlock(&queue->mx_queue);
         return JIT_ERROR_EMPTY;
     }
 
-    pthread_mutex_lock(&mx_jit_queue);
-
-    /*!> Search for highest priority packet to be sent */
-    for (i = 0; i < queue->num_pkt; i++) {
-        /*!> First check if that packet is outdated:
-         *  If a packet seems too much in advance, and was not rejected at enqueue time,
-         *  it means that we missed it for peeking, we need to drop it
-         *
-         *  [WARNING~][JIT] unsigned arithmetic
-         *      t_packet > t_current + TX_MAX_ADVANCE_DELAY
-         */
-        if ((queue->nodes[i].pkt.count_us - time_us) >= TX_MAX_ADVANCE_DELAY) {
-            /*!> We drop the packet to avoid lock-up */
-            queue->num_pkt--;
-            if (queue->nodes[i].pkt_type == JIT_PKT_TYPE_BEACON) {
-                queue->num_beacon--;
-                lgw_log(LOG_JIT_ERROR, "[WARNING~][JIT] --- Beacon dropped (current_time=%u, packet_time=%u) ---\n", time_us, queue->nodes[i].pkt.count_us);
-            } else {
-                lgw_log(LOG_JIT_ERROR, "[WARNING~][JIT] --- Packet dropped (current_time=%u, packet_time=%u) ---\n", time_us, queue->nodes[i].pkt.count_us);
-            }
-
-            /*!> Replace dropped packet with last packet of the queue */
-            memcpy(&(queue->nodes[i]), &(queue->nodes[queue->num_pkt]), sizeof(struct jit_node_s));
-            memset(&(queue->nodes[queue->num_pkt]), 0, sizeof(struct jit_node_s));
-
-            /*!> Sort queue in ascending order of packet timestamp */
-            jit_sort_queue(queue);
-
-            /*!> restart loop  after purge to find packet to be sent */
-            i = 0;
-            continue;
-        }
-
-        /*!> Then look for highest priority packet to be sent:
-         *  [WARNING~][JIT] unsigned arithmetic (handle roll-over)
-         *      t_packet < t_highest
-         */
-        if ((idx_highest_priority == -1) || (((queue->nodes[i].pkt.count_us - time_us) < (queue->nodes[idx_highest_priority].pkt.count_us - time_us)))) {
-            idx_highest_priority = i;
+    /*!> First drop outdated packets, they sort first:
+     *  If a packet seems too much in advance, and was not rejected at enqueue time,
+     *  it means that we missed it for peeking, we need to drop it
+     *
+     *  [WARNING~][JIT] unsigned arithmetic
+     *      t_packet > t_current + TX_MAX_ADVANCE_DELAY
+     */
+    while (queue->num_pkt > 0 && (queue->nodes[0].pkt.count_us - time_us) >= TX_MAX_ADVANCE_DELAY) {
+        if (queue->nodes[0].pkt_type == JIT_PKT_TYPE_BEACON) {
+            lgw_log(LOG_JIT_ERROR, "[WARNING~][JIT] --- Beacon dropped (current_time=%u, packet_time=%u) ---\n", time_us, queue->nodes[0].pkt.count_us);
+        } else {
+            lgw_log(LOG_JIT_ERROR, "[WARNING~][JIT] --- Packet dropped (current_time=%u, packet_time=%u) ---\n", time_us, queue->nodes[0].pkt.count_us);
         }
+        jit_remove(queue, 0);
     }
 
-    /*!> Peek criteria 1: look for a packet to be sent in next TX_JIT_DELAY ms timeframe
+    /*!> Peek criteria 1: the earliest packet is to be sent in next TX_JIT_DELAY ms timeframe
      *  [WARNING~][JIT] unsigned arithmetic (handle roll-over)
      *      t_packet < t_current + TX_JIT_DELAY
      */
-    if ((queue->nodes[idx_highest_priority].pkt.count_us - time_us) < TX_JIT_DELAY) {
-        *pkt_idx = idx_highest_priority;
-        lgw_log(LOG_JIT, "[INFO~][JIT] peek packet with count_us=%u at index %d\n",
-            queue->nodes[idx_highest_priority].pkt.count_us, idx_highest_priority);
+    if (queue->num_pkt > 0 && (queue->nodes[0].pkt.count_us - time_us) < TX_JIT_DELAY) {
+        *pkt_idx = 0;
+        lgw_log(LOG_JIT, "[INFO~][JIT] peek packet with count_us=%u at index %d\n", queue->nodes[0].pkt.count_us, 0);
     } else {
         *pkt_idx = -1;
     }
 
-    pthread_mutex_unlock(&mx_jit_queue);
+    pthread_mutex_unlock(&queue->mx_queue);
 
     return JIT_ERROR_OK;
 }
 
+uint32_t jit_next_delay(struct jit_queue_s *queue, uint32_t time_us) {
+    uint32_t diff;
+
+    pthread_mutex_lock(&queue->mx_queue);
+    if (queue->num_pkt == 0) {
+        pthread_mutex_unlock(&queue->mx_queue);
+        return JIT_DELAY_NONE;
+    }
+    diff = queue->nodes[0].pkt.count_us - time_us;
+    pthread_mutex_unlock(&queue->mx_queue);
+
+    /*!> outdated, jit_peek will drop it right away */
+    if (diff >= TX_MAX_ADVANCE_DELAY)
+        return 0;
+
+    /*!> jit_peek hands the packet out once it is less than TX_JIT_DELAY away */
+    return (diff < TX_JIT_DELAY) ? 0 : (diff - TX_JIT_DELAY + 1);
+}
+
+uint32_t jit_queue_seq(void) {
+    uint32_t seq;
+
+    pthread_mutex_lock(&mx_jit_wait);
+    seq = jit_enqueue_seq;
+    pthread_mutex_unlock(&mx_jit_wait);
+
+    return seq;
+}
+
+void jit_wait(uint32_t seq, uint32_t timeout_us) {
+    struct timespec deadline;
+    int rc = 0;
+
+    pthread_once(&cv_jit_once, cv_jit_create);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_us / 1000000;
+    deadline.tv_nsec += (long)(timeout_us % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&mx_jit_wait);
+    while (seq == jit_enqueue_seq && rc != ETIMEDOUT)
+        rc = pthread_cond_timedwait(&cv_jit_queue, &mx_jit_wait, &deadline);
+    pthread_mutex_unlock(&mx_jit_wait);
+}
+
 void jit_print_queue(struct jit_queue_s *queue, bool show_all, int debug_level) {
     int i = 0;
     int loop_end;
 
-    if (jit_queue_is_empty(queue)) {
+    pthread_mutex_lock(&queue->mx_queue);
+
+    if (queue->num_pkt == 0) {
         lgw_log(debug_level, "[INFO~][JIT] queue is empty\n");
     } else {
-        pthread_mutex_lock(&mx_jit_queue);
-
         lgw_log(debug_level, "[INFO~][JIT] queue contains %d packets:\n", queue->num_pkt);
         lgw_log(debug_level, "[INFO~][JIT] queue contains %d beacons:\n", queue->num_beacon);
-        loop_end = (show_all == true) ? JIT_QUEUE_MAX : queue->num_pkt;
+        loop_end = (show_all == true) ? queue->capacity : queue->num_pkt;
         for (i=0; i<loop_end; i++) {
             lgw_log(debug_level, "[INFO~][JIT] - node[%d]: count_us=%u, type=%d\n",
                         i,
                         queue->nodes[i].pkt.count_us,
                         queue->nodes[i].pkt_type);
         }
-
-        pthread_mutex_unlock(&mx_jit_queue);
     }
+
+    pthread_mutex_unlock(&queue->mx_queue);
 }
+
+/*!> --- EOF ------------------------------------------------------------------ */
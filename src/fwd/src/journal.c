@@ -0,0 +1,520 @@
+/*!>
+ *  ____  ____      _    ____ ___ _   _  ___
+ *  |  _ \|  _ \    / \  / ___|_ _| \ | |/ _ \
+ *  | | | | |_) |  / _ \| |  _ | ||  \| | | | |
+ *  | |_| |  _ <  / ___ \ |_| || || |\  | |_| |
+ *  |____/|_| \_\/_/   \_\____|___|_| \_|\___/
+ *
+ * Dragino_gw_fwd -- An opensource lora gateway forward
+ *
+ * See http://www.dragino.com for more information about
+ * the lora gateway project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ *
+ * Maintainer: skerlan
+ *
+ */
+
+/*!>!
+ * \file
+ * \brief append-only journal of mmap'd segment files
+ *
+ * Segment files are allocated whole when they are created, so that an
+ * append never extends a file and a full disk shows up as a failed
+ * create instead of a SIGBUS.  Nothing is written to disk on append, the
+ * owner calls journal_sync as often as the records are worth: a crash
+ * loses the records since the last sync and at worst leaves a torn record,
+ * which fails its CRC and is overwritten when the journal is opened again.
+ * The cursor is stored with the read position only, a crash between a
+ * read and its commit replays the records read.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "journal.h"
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define JOURNAL_CURSOR_MAGIC    0x52554344  /*!> "DCUR" */
+#define JOURNAL_CURSOR_NAME     "cursor"
+#define JOURNAL_HDR_SIZE        ((uint32_t)sizeof(struct journal_seg_hdr_s))
+#define JOURNAL_REC_SIZE(len)   ((uint32_t)sizeof(struct journal_rec_hdr_s) + (((uint32_t)(len) + 3) & ~3u))
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PRIVATE TYPES -------------------------------------------------------- */
+
+struct journal_cursor_s {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t off;
+    uint32_t crc;                           /*!> CRC32 of the fields above */
+};
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PRIVATE VARIABLES ---------------------------------------------------- */
+
+static const uint32_t crc32_nibble[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PRIVATE FUNCTIONS ---------------------------------------------------- */
+
+/*!> IEEE 802.3 CRC32, chains: crc32(crc32(0, a), b) == crc32(0, ab) */
+static uint32_t journal_crc32(uint32_t crc, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+
+    crc = ~crc;
+    while (size-- > 0) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ crc32_nibble[crc & 0x0F];
+        crc = (crc >> 4) ^ crc32_nibble[crc & 0x0F];
+    }
+    return ~crc;
+}
+
+static uint32_t journal_rec_crc(uint16_t len, const void *data) {
+    return journal_crc32(journal_crc32(0, &len, sizeof(len)), data, len);
+}
+
+static void journal_path(const struct journal_s *j, uint32_t seq, char *path, size_t size) {
+    snprintf(path, size, "%s/%08x.seg", j->dir, seq);
+}
+
+static bool journal_hdr_valid(const struct journal_s *j, const struct journal_seg_hdr_s *hdr, uint32_t seq) {
+    return hdr->magic == JOURNAL_MAGIC && hdr->version == JOURNAL_VERSION && hdr->hdr_size == JOURNAL_HDR_SIZE &&
+           hdr->seg_size == JOURNAL_SEG_SIZE && hdr->seq == seq && hdr->tag == j->tag;
+}
+
+/*!> length of the record at off, 0 when there is none or it is torn */
+static uint16_t journal_rec_check(const uint8_t *map, uint32_t off, uint32_t end) {
+    const struct journal_rec_hdr_s *rec;
+
+    if (off + sizeof(*rec) > end)
+        return 0;
+    rec = (const struct journal_rec_hdr_s *)(map + off);
+    if (rec->magic != JOURNAL_REC_MAGIC || rec->len == 0 || rec->len > JOURNAL_REC_MAX ||
+        off + JOURNAL_REC_SIZE(rec->len) > end)
+        return 0;
+    if (rec->crc != journal_rec_crc(rec->len, rec + 1))
+        return 0;
+    return rec->len;
+}
+
+static int journal_seg_map(const struct journal_s *j, uint32_t seq, bool writer, uint8_t **map) {
+    char path[JOURNAL_PATH_MAX + 16];
+    struct stat st;
+    void *m;
+    int fd, err;
+
+    journal_path(j, seq, path, sizeof(path));
+    fd = open(path, (writer ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    if (fstat(fd, &st) == -1 || st.st_size < JOURNAL_SEG_SIZE) {
+        err = EPROTO;
+        goto fail;
+    }
+
+    m = mmap(NULL, JOURNAL_SEG_SIZE, writer ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        err = errno;
+        goto fail;
+    }
+    close(fd);
+
+    if (!journal_hdr_valid(j, (const struct journal_seg_hdr_s *)m, seq)) {
+        munmap(m, JOURNAL_SEG_SIZE);
+        errno = EPROTO;
+        return -1;
+    }
+
+    *map = (uint8_t *)m;
+    return 0;
+
+fail:
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+/*!> allocate the segment by writing it, a sparse file would only fail (SIGBUS) on a store through the map */
+static int journal_seg_fill(int fd) {
+    static const uint8_t zero[4096];
+    uint32_t off;
+    ssize_t n;
+
+    for (off = 0; off < JOURNAL_SEG_SIZE; off += n) {
+        n = pwrite(fd, zero, (JOURNAL_SEG_SIZE - off < sizeof(zero)) ? JOURNAL_SEG_SIZE - off : sizeof(zero), off);
+        if (n == -1) {
+            if (errno != EINTR)
+                return errno;   /*!> ENOSPC included, the segment is not created */
+            n = 0;
+        }
+    }
+    return 0;
+}
+
+static int journal_seg_create(const struct journal_s *j, uint32_t seq, uint8_t **map) {
+    char path[JOURNAL_PATH_MAX + 16];
+    struct journal_seg_hdr_s *hdr;
+    void *m;
+    int fd, err;
+
+    journal_path(j, seq, path, sizeof(path));
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+
+    err = posix_fallocate(fd, 0, JOURNAL_SEG_SIZE);
+    if (err == EINVAL || err == EOPNOTSUPP)
+        err = journal_seg_fill(fd);
+    if (err != 0)
+        goto fail;
+
+    m = mmap(NULL, JOURNAL_SEG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        err = errno;
+        goto fail;
+    }
+    close(fd);
+
+    hdr = (struct journal_seg_hdr_s *)m;
+    hdr->version = JOURNAL_VERSION;
+    hdr->hdr_size = JOURNAL_HDR_SIZE;
+    hdr->seg_size = JOURNAL_SEG_SIZE;
+    hdr->seq = seq;
+    hdr->tag = j->tag;
+    hdr->magic = JOURNAL_MAGIC;
+
+    *map = (uint8_t *)m;
+    return 0;
+
+fail:
+    close(fd);
+    unlink(path);
+    errno = err;
+    return -1;
+}
+
+static void journal_seg_remove(const struct journal_s *j, uint32_t seq) {
+    char path[JOURNAL_PATH_MAX + 16];
+
+    journal_path(j, seq, path, sizeof(path));
+    unlink(path);
+}
+
+/*!> records of segment seq from off on */
+static uint32_t journal_seg_count(const struct journal_s *j, uint32_t seq, uint32_t off) {
+    uint8_t *map;
+    uint32_t end = JOURNAL_SEG_SIZE, nb = 0;
+    uint16_t len;
+
+    if (seq == j->wseq) {
+        map = j->wmap;
+        end = j->woff;
+    } else if (journal_seg_map(j, seq, false, &map) == -1) {
+        return 0;
+    }
+
+    while ((len = journal_rec_check(map, off, end)) > 0) {
+        off += JOURNAL_REC_SIZE(len);
+        nb++;
+    }
+
+    if (map != j->wmap)
+        munmap(map, JOURNAL_SEG_SIZE);
+    return nb;
+}
+
+static void journal_flush(struct journal_s *j) {
+    uint32_t from;
+
+    if (j->wmap == NULL || j->woff <= j->wsync)
+        return;
+    from = j->wsync & ~((uint32_t)sysconf(_SC_PAGESIZE) - 1);
+    msync(j->wmap + from, j->woff - from, MS_SYNC);
+    j->wsync = j->woff;
+}
+
+/*!> drop the oldest segment, its unread records are lost */
+static void journal_drop(struct journal_s *j) {
+    uint32_t nb;
+
+    if (j->first == j->rseq) {
+        nb = journal_seg_count(j, j->rseq, j->roff);
+        j->nb_dropped += nb;
+        j->nb_pending = (j->nb_pending > nb) ? j->nb_pending - nb : 0;
+        if (j->rmap != NULL) {
+            munmap(j->rmap, JOURNAL_SEG_SIZE);
+            j->rmap = NULL;
+        }
+        j->rseq++;
+        j->roff = JOURNAL_HDR_SIZE;
+    }
+    journal_seg_remove(j, j->first);
+    j->first++;
+}
+
+static int journal_roll(struct journal_s *j) {
+    uint8_t *map;
+
+    while (j->wseq + 2 - j->first > j->max_segs)
+        journal_drop(j);
+
+    if (journal_seg_create(j, j->wseq + 1, &map) == -1)
+        return -1;
+
+    journal_flush(j);
+    munmap(j->wmap, JOURNAL_SEG_SIZE);
+    j->wmap = map;
+    j->wseq++;
+    j->woff = JOURNAL_HDR_SIZE;
+    j->wsync = 0;           /*!> the header goes with the first records */
+    return 0;
+}
+
+/*!> resume appending after the last whole record of the newest segment */
+static void journal_recover(struct journal_s *j) {
+    uint32_t off = JOURNAL_HDR_SIZE, i;
+    uint16_t len;
+
+    while ((len = journal_rec_check(j->wmap, off, JOURNAL_SEG_SIZE)) > 0)
+        off += JOURNAL_REC_SIZE(len);
+    j->woff = off;
+    j->wsync = off;
+
+    /*!> a torn record, or whole ones written after it, must not pass for records appended later:
+     *   the zeroed tail reaches the disk now, journal_flush only covers [wsync, woff) */
+    for (i = off; i < JOURNAL_SEG_SIZE; i++) {
+        if (j->wmap[i] != 0) {
+            memset(j->wmap + i, 0, JOURNAL_SEG_SIZE - i);
+            i &= ~((uint32_t)sysconf(_SC_PAGESIZE) - 1);
+            msync(j->wmap + i, JOURNAL_SEG_SIZE - i, MS_SYNC);
+            break;
+        }
+    }
+}
+
+static void journal_cursor_load(struct journal_s *j) {
+    struct journal_cursor_s cur;
+    uint32_t end;
+
+    j->rseq = j->first;
+    j->roff = JOURNAL_HDR_SIZE;
+
+    if (pread(j->cfd, &cur, sizeof(cur), 0) != (ssize_t)sizeof(cur) || cur.magic != JOURNAL_CURSOR_MAGIC ||
+        cur.crc != journal_crc32(0, &cur, offsetof(struct journal_cursor_s, crc)))
+        return;
+
+    /*!> a cursor in a dropped segment reads from the oldest one left */
+    end = (cur.seq == j->wseq) ? j->woff : JOURNAL_SEG_SIZE;
+    if (cur.seq < j->first || cur.seq > j->wseq || cur.off < JOURNAL_HDR_SIZE || cur.off > end)
+        return;
+
+    j->rseq = cur.seq;
+    j->roff = cur.off;
+}
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PUBLIC FUNCTIONS ----------------------------------------------------- */
+
+int journal_open(struct journal_s *j, const char *dir, uint64_t quota, uint32_t tag) {
+    char path[JOURNAL_PATH_MAX + 16];
+    struct journal_seg_hdr_s hdr;
+    struct dirent *de;
+    struct stat st;
+    DIR *d;
+    uint32_t seq, first = UINT32_MAX, last = 0;
+    bool found = false;
+    int fd, n, err;
+
+    memset(j, 0, sizeof(*j));
+    j->cfd = -1;
+
+    if (strlen(dir) >= sizeof(j->dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(j->dir, dir);
+    j->tag = tag;
+    j->max_segs = (quota / JOURNAL_SEG_SIZE < 2) ? 2 : (uint32_t)(quota / JOURNAL_SEG_SIZE);
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+        return -1;
+
+    d = opendir(dir);
+    if (d == NULL)
+        return -1;
+
+    /*!> keep the segments of this format, whatever else looks like one goes */
+    while ((de = readdir(d)) != NULL) {
+        n = 0;
+        if (sscanf(de->d_name, "%8x.seg%n", &seq, &n) != 1 || n != 12 || de->d_name[n] != '\0')
+            continue;
+        journal_path(j, seq, path, sizeof(path));
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd != -1 && fstat(fd, &st) == 0 && st.st_size >= JOURNAL_SEG_SIZE &&
+            pread(fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr) && journal_hdr_valid(j, &hdr, seq)) {
+            if (seq < first)
+                first = seq;
+            if (seq > last)
+                last = seq;
+            found = true;
+        } else {
+            unlink(path);
+        }
+        if (fd != -1)
+            close(fd);
+    }
+    closedir(d);
+
+    if (found) {
+        j->first = first;
+        j->wseq = last;
+        if (journal_seg_map(j, j->wseq, true, &j->wmap) == -1)
+            return -1;
+        journal_recover(j);
+    } else {
+        j->first = j->wseq = 0;
+        if (journal_seg_create(j, 0, &j->wmap) == -1)
+            return -1;
+        j->woff = JOURNAL_HDR_SIZE;
+    }
+
+    snprintf(path, sizeof(path), "%s/" JOURNAL_CURSOR_NAME, j->dir);
+    j->cfd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (j->cfd == -1) {
+        err = errno;
+        munmap(j->wmap, JOURNAL_SEG_SIZE);
+        j->wmap = NULL;
+        errno = err;
+        return -1;
+    }
+    journal_cursor_load(j);
+
+    for (seq = j->rseq; seq <= j->wseq; seq++)
+        j->nb_pending += journal_seg_count(j, seq, (seq == j->rseq) ? j->roff : JOURNAL_HDR_SIZE);
+
+    return 0;
+}
+
+void journal_close(struct journal_s *j) {
+    if (j->wmap != NULL) {
+        journal_commit(j);
+        journal_sync(j);
+        munmap(j->wmap, JOURNAL_SEG_SIZE);
+    }
+    if (j->rmap != NULL)
+        munmap(j->rmap, JOURNAL_SEG_SIZE);
+    if (j->cfd != -1)
+        close(j->cfd);
+    memset(j, 0, sizeof(*j));
+    j->cfd = -1;
+}
+
+int journal_append(struct journal_s *j, const void *data, uint16_t len) {
+    struct journal_rec_hdr_s *rec;
+
+    if (len == 0 || len > JOURNAL_REC_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (j->woff + JOURNAL_REC_SIZE(len) > JOURNAL_SEG_SIZE && journal_roll(j) == -1)
+        return -1;
+
+    rec = (struct journal_rec_hdr_s *)(j->wmap + j->woff);
+    memcpy(rec + 1, data, len);
+    rec->len = len;
+    rec->crc = journal_rec_crc(len, data);
+    rec->magic = JOURNAL_REC_MAGIC;
+
+    j->woff += JOURNAL_REC_SIZE(len);
+    j->nb_pending++;
+    return 0;
+}
+
+int journal_read(struct journal_s *j, void *buf, uint16_t max) {
+    uint32_t end, off;
+    uint16_t len;
+
+    for (;;) {
+        end = (j->rseq == j->wseq) ? j->woff : JOURNAL_SEG_SIZE;
+        if (j->rseq == j->wseq && j->roff >= j->woff)
+            return 0;
+
+        if (j->rmap == NULL && journal_seg_map(j, j->rseq, false, &j->rmap) == -1) {
+            j->rmap = NULL;
+            if (j->rseq == j->wseq)
+                return 0;
+            j->rseq++;
+            j->roff = JOURNAL_HDR_SIZE;
+            continue;
+        }
+
+        len = journal_rec_check(j->rmap, j->roff, end);
+        if (len == 0) {
+            /*!> end of a segment written before the last roll */
+            if (j->rseq == j->wseq) {
+                j->roff = j->woff;
+                return 0;
+            }
+            munmap(j->rmap, JOURNAL_SEG_SIZE);
+            j->rmap = NULL;
+            j->rseq++;
+            j->roff = JOURNAL_HDR_SIZE;
+            continue;
+        }
+
+        off = j->roff + sizeof(struct journal_rec_hdr_s);
+        j->roff += JOURNAL_REC_SIZE(len);
+        if (j->nb_pending > 0)
+            j->nb_pending--;
+        if (len > max)
+            continue;
+
+        memcpy(buf, j->rmap + off, len);
+        return len;
+    }
+}
+
+void journal_commit(struct journal_s *j) {
+    struct journal_cursor_s cur;
+
+    cur.magic = JOURNAL_CURSOR_MAGIC;
+    cur.seq = j->rseq;
+    cur.off = j->roff;
+    cur.crc = journal_crc32(0, &cur, offsetof(struct journal_cursor_s, crc));
+    if (pwrite(j->cfd, &cur, sizeof(cur), 0) != (ssize_t)sizeof(cur))
+        return;
+
+    while (j->first < j->rseq) {
+        journal_seg_remove(j, j->first);
+        j->first++;
+    }
+}
+
+void journal_sync(struct journal_s *j) {
+    journal_flush(j);
+    if (j->cfd != -1)
+        fdatasync(j->cfd);
+}
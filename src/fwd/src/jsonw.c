@@ -0,0 +1,286 @@
+/*!>
+ *  ____  ____      _    ____ ___ _   _  ___
+ *  |  _ \|  _ \    / \  / ___|_ _| \ | |/ _ \
+ *  | | | | |_) |  / _ \| |  _ | ||  \| | | | |
+ *  | |_| |  _ <  / ___ \ |_| || || |\  | |_| |
+ *  |____/|_| \_\/_/   \_\____|___|_| \_|\___/
+ *
+ * Dragino_gw_fwd -- An opensource lora gateway forward
+ *
+ * See http://www.dragino.com for more information about
+ * the lora gateway project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ *
+ * Maintainer: skerlan
+ *
+ */
+
+/*!>!
+ * \file
+ * \brief append-only JSON writer, no printf on the uplink path
+ */
+
+#include <stdint.h>				/*!> C99 types */
+#include <stdbool.h>			/*!> bool type */
+#include <string.h>				/*!> memcpy */
+#include <time.h>				/*!> gmtime_r */
+#include <math.h>				/*!> nearbyint, signbit */
+
+#include "jsonw.h"
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PRIVATE VARIABLES ---------------------------------------------------- */
+
+static const char b64_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*!> calendar part of the last day formatted by this thread, "YYYY-MM-DDT" */
+static __thread struct {
+    long day;
+    char date[11];
+} utc_cache = { .day = -1 };
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PRIVATE FUNCTIONS ---------------------------------------------------- */
+
+static inline bool jsonw_room(jsonw_s* w, int n) {
+    if (w->err || w->len + n >= w->size) {
+        w->err = true;
+        return false;
+    }
+    return true;
+}
+
+/*!> zero padded, width digits exactly */
+static inline void put_digits(char* out, uint32_t v, int width) {
+    while (width-- > 0) {
+        out[width] = '0' + (v % 10);
+        v /= 10;
+    }
+}
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PUBLIC FUNCTIONS ----------------------------------------------------- */
+
+void jsonw_init(jsonw_s* w, void* buf, int size, int len) {
+    w->buf = (char*)buf;
+    w->size = size;
+    w->len = len;
+    w->err = false;
+}
+
+void jsonw_reset(jsonw_s* w, int len) {
+    w->len = len;
+    w->err = false;
+}
+
+void jsonw_raw(jsonw_s* w, const char* s, int n) {
+    if (!jsonw_room(w, n))
+        return;
+    memcpy(w->buf + w->len, s, n);
+    w->len += n;
+}
+
+void jsonw_char(jsonw_s* w, char c) {
+    if (!jsonw_room(w, 1))
+        return;
+    w->buf[w->len++] = c;
+}
+
+void jsonw_uint(jsonw_s* w, uint32_t v) {
+    char tmp[10];
+    int i = sizeof(tmp);
+
+    do {
+        tmp[--i] = '0' + (v % 10);
+        v /= 10;
+    } while (v != 0);
+
+    jsonw_raw(w, tmp + i, sizeof(tmp) - i);
+}
+
+void jsonw_int(jsonw_s* w, int32_t v) {
+    if (v < 0) {
+        jsonw_char(w, '-');
+        jsonw_uint(w, (uint32_t)0 - (uint32_t)v);
+    } else {
+        jsonw_uint(w, (uint32_t)v);
+    }
+}
+
+void jsonw_hex32(jsonw_s* w, uint32_t v) {
+    static const char hex[] = "0123456789ABCDEF";
+    char tmp[8];
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        tmp[i] = hex[v & 0xF];
+        v >>= 4;
+    }
+
+    jsonw_raw(w, tmp, sizeof(tmp));
+}
+
+void jsonw_fixed(jsonw_s* w, int64_t v, int decimals) {
+    uint64_t u, scale = 1;
+    char tmp[24];
+    int i;
+
+    for (i = 0; i < decimals; i++)
+        scale *= 10;
+
+    if (v < 0) {
+        jsonw_char(w, '-');
+        u = (uint64_t)0 - (uint64_t)v;
+    } else {
+        u = (uint64_t)v;
+    }
+
+    /*!> integer part then fractional part, both fit in 32 bits for radio values */
+    jsonw_uint(w, (uint32_t)(u / scale));
+    if (decimals > 0 && decimals < (int)sizeof(tmp)) {
+        tmp[0] = '.';
+        put_digits(tmp + 1, (uint32_t)(u % scale), decimals);
+        jsonw_raw(w, tmp, decimals + 1);
+    }
+}
+
+void jsonw_float1(jsonw_s* w, float v) {
+    /*!> v * 10 is exact as a double, nearbyint then rounds halfway cases to even like printf */
+    double r = nearbyint((double)v * 10.0);
+
+    if (r == 0 && signbit(v))
+        jsonw_char(w, '-');     /*!> "-0.0" */
+    jsonw_fixed(w, (int64_t)r, 1);
+}
+
+void jsonw_b64(jsonw_s* w, const uint8_t* data, int size) {
+    int n = ((size + 2) / 3) * 4;
+    char* out;
+    uint32_t b;
+    int i;
+
+    if (size < 0 || !jsonw_room(w, n))
+        return;
+
+    out = w->buf + w->len;
+    for (i = 0; i + 2 < size; i += 3) {
+        b = ((uint32_t)data[i] << 16) | ((uint32_t)data[i + 1] << 8) | data[i + 2];
+        *out++ = b64_table[(b >> 18) & 0x3F];
+        *out++ = b64_table[(b >> 12) & 0x3F];
+        *out++ = b64_table[(b >> 6) & 0x3F];
+        *out++ = b64_table[b & 0x3F];
+    }
+    if (size - i == 1) {
+        b = (uint32_t)data[i] << 16;
+        *out++ = b64_table[(b >> 18) & 0x3F];
+        *out++ = b64_table[(b >> 12) & 0x3F];
+        *out++ = '=';
+        *out++ = '=';
+    } else if (size - i == 2) {
+        b = ((uint32_t)data[i] << 16) | ((uint32_t)data[i + 1] << 8);
+        *out++ = b64_table[(b >> 18) & 0x3F];
+        *out++ = b64_table[(b >> 12) & 0x3F];
+        *out++ = b64_table[(b >> 6) & 0x3F];
+        *out++ = '=';
+    }
+
+    w->len += n;
+}
+
+void jsonw_utc(jsonw_s* w, const struct timespec* t) {
+    /*!> "YYYY-MM-DDTHH:MM:SS.uuuuuuZ" with quotes */
+    char tmp[29];
+    long day = (long)(t->tv_sec / 86400);
+    uint32_t tod = (uint32_t)(t->tv_sec % 86400);
+    time_t midnight;
+    struct tm x;
+
+    if (t->tv_sec < 0) {
+        /*!> never happens with a sane clock, keep the arithmetic below unsigned */
+        day = 0;
+        tod = 0;
+    }
+
+    if (day != utc_cache.day) {
+        midnight = (time_t)day * 86400;
+        gmtime_r(&midnight, &x);
+        put_digits(utc_cache.date, x.tm_year + 1900, 4);
+        utc_cache.date[4] = '-';
+        put_digits(utc_cache.date + 5, x.tm_mon + 1, 2);
+        utc_cache.date[7] = '-';
+        put_digits(utc_cache.date + 8, x.tm_mday, 2);
+        utc_cache.day = day;
+    }
+
+    tmp[0] = '"';
+    memcpy(tmp + 1, utc_cache.date, 10);
+    tmp[11] = 'T';
+    put_digits(tmp + 12, tod / 3600, 2);
+    tmp[14] = ':';
+    put_digits(tmp + 15, (tod / 60) % 60, 2);
+    tmp[17] = ':';
+    put_digits(tmp + 18, tod % 60, 2);
+    tmp[20] = '.';
+    put_digits(tmp + 21, (uint32_t)(t->tv_nsec / 1000), 6);
+    tmp[27] = 'Z';
+    tmp[28] = '"';
+
+    jsonw_raw(w, tmp, sizeof(tmp));
+}
+
+int jsonw_rxpk_modu(jsonw_s* w, const struct lgw_pkt_rx_s* p) {
+    int start = w->len;
+    bool err = w->err;
+
+    switch (p->status) {
+        case STAT_CRC_OK:   jsonw_lit(w, ",\"stat\":1"); break;
+        case STAT_CRC_BAD:  jsonw_lit(w, ",\"stat\":-1"); break;
+        case STAT_NO_CRC:   jsonw_lit(w, ",\"stat\":0"); break;
+        default:            goto unknown;
+    }
+
+    if (p->modulation == MOD_LORA) {
+        jsonw_lit(w, ",\"modu\":\"LORA\",\"datr\":\"SF");
+        switch (p->datarate) {
+            case DR_LORA_SF5:   jsonw_char(w, '5'); break;
+            case DR_LORA_SF6:   jsonw_char(w, '6'); break;
+            case DR_LORA_SF7:   jsonw_char(w, '7'); break;
+            case DR_LORA_SF8:   jsonw_char(w, '8'); break;
+            case DR_LORA_SF9:   jsonw_char(w, '9'); break;
+            case DR_LORA_SF10:  jsonw_lit(w, "10"); break;
+            case DR_LORA_SF11:  jsonw_lit(w, "11"); break;
+            case DR_LORA_SF12:  jsonw_lit(w, "12"); break;
+            default:            goto unknown;
+        }
+        switch (p->bandwidth) {
+            case BW_125KHZ:     jsonw_lit(w, "BW125\""); break;
+            case BW_250KHZ:     jsonw_lit(w, "BW250\""); break;
+            case BW_500KHZ:     jsonw_lit(w, "BW500\""); break;
+            default:            goto unknown;
+        }
+        switch (p->coderate) {
+            case CR_LORA_4_5:   jsonw_lit(w, ",\"codr\":\"4/5\""); break;
+            case CR_LORA_4_6:   jsonw_lit(w, ",\"codr\":\"4/6\""); break;
+            case CR_LORA_4_7:   jsonw_lit(w, ",\"codr\":\"4/7\""); break;
+            case CR_LORA_4_8:   jsonw_lit(w, ",\"codr\":\"4/8\""); break;
+            case 0:             jsonw_lit(w, ",\"codr\":\"OFF\""); break; /*!> treat the CR0 case (mostly false sync) */
+            default:            goto unknown;
+        }
+    } else if (p->modulation == MOD_FSK) {
+        jsonw_lit(w, ",\"modu\":\"FSK\",\"datr\":");
+        jsonw_uint(w, p->datarate);
+    } else {
+        goto unknown;
+    }
+
+    return 0;
+
+unknown:
+    w->len = start;
+    w->err = err;
+    return -1;
+}
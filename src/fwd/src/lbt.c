@@ -0,0 +1,506 @@
+/*!>
+ *  ____  ____      _    ____ ___ _   _  ___
+ *  |  _ \|  _ \    / \  / ___|_ _| \ | |/ _ \
+ *  | | | | |_) |  / _ \| |  _ | ||  \| | | | |
+ *  | |_| |  _ <  / ___ \ |_| || || |\  | |_| |
+ *  |____/|_| \_\/_/   \_\____|___|_| \_|\___/
+ *
+ * Dragino_gw_fwd -- An opensource lora gateway forward
+ *
+ * See http://www.dragino.com for more information about
+ * the lora gateway project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ *
+ * Maintainer: skerlan
+ *
+ */
+
+/*!>!
+ * \file
+ * \brief listen before talk through an external module on a tty
+ *
+ * The downstream threads queue a request per downlink and get back an ID.
+ * The LBT thread sleeps in epoll on the tty and on an eventfd rung by
+ * lbt_enqueue, sends AT+GETCHANSTAT for every request entering its
+ * assessment window (earliest TX first), keeps up to lbt_pipeline_depth
+ * commands in flight and matches the FREE/BUSY replies in order.  A reply
+ * that does not come back in time only fails the commands in flight, the
+ * JiT thread reads the result by ID when it dequeues the downlink.
+ *
+ * Replies carry no tag: with more than one command in flight, a module
+ * which skips a command shifts the following replies onto the wrong
+ * downlinks, so the depth defaults to 1.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "fwd.h"
+#include "lbt.h"
+#include "uart.h"
+#include "timersync.h"
+#include "loragw_aux.h"
+
+DECLARE_GW;
+
+extern volatile bool exit_sig;
+extern volatile bool quit_sig;
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PRIVATE CONSTANTS & TYPES -------------------------------------------- */
+
+#define LBT_REPLY_MARGIN_MS     50      /*!> on top of the scan time before a reply is given up */
+#define LBT_REOPEN_MS           5000    /*!> retry period when the tty cannot be opened */
+#define LBT_IDLE_MS             100     /*!> upper bound of the epoll wait */
+#define LBT_EXPIRE_US           10000000 /*!> requests nobody came for are dropped this long after their TX */
+#define LBT_CMD_SIZE            48
+#define LBT_RX_SIZE             64
+#define LBT_TX_SIZE             (LBT_PIPELINE_MAX * LBT_CMD_SIZE)
+#define LBT_REPLY_LEN           4       /*!> "FREE" or "BUSY" */
+
+enum lbt_req_state_e {
+    LBT_REQ_WAIT,                       /*!> waiting for its assessment window */
+    LBT_REQ_SENT,                       /*!> command in flight */
+    LBT_REQ_DONE                        /*!> chan_is_free is valid */
+};
+
+struct lbt_req_s {
+    uint32_t id;                        /*!> downlink ID, 0 when the slot is unused */
+    uint32_t freq_hz;
+    uint32_t count_us;                  /*!> TX time of the downlink */
+    uint8_t state;
+    bool chan_is_free;
+};
+
+struct lbt_cmd_s {
+    int slot;                           /*!> request the reply belongs to */
+    uint32_t id;                        /*!> the slot may have been released, and reused, meanwhile */
+    uint64_t head_ms;                   /*!> when the module started on it, as far as we know */
+    uint64_t deadline_ms;               /*!> only checked for the head of the pipeline */
+};
+
+/*!> only touched by thread_lbt */
+struct lbt_engine_s {
+    int epfd;
+    uint32_t events;                    /*!> epoll events registered for the tty */
+    uint64_t reopen_ms;                 /*!> next attempt to open the tty */
+    uint64_t quiet_ms;                  /*!> after a timeout, late replies are dropped until then */
+    struct lbt_cmd_s inflight[LBT_PIPELINE_MAX];
+    int nb_inflight;
+    char rx[LBT_RX_SIZE];
+    int rx_len;
+    char tx[LBT_TX_SIZE];
+    int tx_len;
+};
+
+static pthread_mutex_t mx_lbt = PTHREAD_MUTEX_INITIALIZER;  /*!> protects lbt_req and lbt_next_id */
+static struct lbt_req_s lbt_req[NB_LBT_QUEUE];
+static uint32_t lbt_next_id = 0;
+static int lbt_evfd = -1;               /*!> rung by lbt_enqueue */
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PRIVATE FUNCTIONS ---------------------------------------------------- */
+
+static uint64_t lbt_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t lbt_reply_ms(void) {
+    return GW.lbt.lbt_scan_time_ms + LBT_REPLY_MARGIN_MS;
+}
+
+static int lbt_find(uint32_t id) {
+    int i;
+    for (i = 0; i < NB_LBT_QUEUE; i++) {
+        if (lbt_req[i].id == id)
+            return i;
+    }
+    return -1;
+}
+
+/*!> store a result, unless the request was released while its command was in flight */
+static void lbt_complete(const struct lbt_cmd_s *cmd, bool chan_is_free) {
+    struct lbt_req_s *req = &lbt_req[cmd->slot];
+
+    pthread_mutex_lock(&mx_lbt);
+    if (req->id == cmd->id && req->state == LBT_REQ_SENT) {
+        req->state = LBT_REQ_DONE;
+        req->chan_is_free = chan_is_free;
+        lgw_log(LOG_DEBUG, "%s[LBT] chan(%u) is %s, us=%u\n", DEBUGMSG, req->freq_hz, chan_is_free ? "FREE" : "BUSY", req->count_us);
+    }
+    pthread_mutex_unlock(&mx_lbt);
+}
+
+/*!> every command in flight gets a busy result, their replies can no longer be told apart */
+static void lbt_fail_inflight(struct lbt_engine_s *eng) {
+    int i;
+    for (i = 0; i < eng->nb_inflight; i++)
+        lbt_complete(&eng->inflight[i], false);
+    eng->nb_inflight = 0;
+    eng->tx_len = 0;
+    eng->rx_len = 0;
+}
+
+static void lbt_tty_watch(struct lbt_engine_s *eng, uint32_t events) {
+    struct epoll_event ev;
+
+    if (events == eng->events)
+        return;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = GW.lbt.lbt_tty_fd;
+    epoll_ctl(eng->epfd, EPOLL_CTL_MOD, GW.lbt.lbt_tty_fd, &ev);
+    eng->events = events;
+}
+
+static void lbt_tty_close(struct lbt_engine_s *eng, uint64_t now) {
+    lbt_fail_inflight(eng);
+    epoll_ctl(eng->epfd, EPOLL_CTL_DEL, GW.lbt.lbt_tty_fd, NULL);
+    uart_close(GW.lbt.lbt_tty_fd);
+    GW.lbt.lbt_tty_fd = -1;
+    eng->reopen_ms = now + LBT_REOPEN_MS;
+}
+
+static void lbt_tty_open(struct lbt_engine_s *eng, uint64_t now) {
+    struct epoll_event ev;
+    int fd;
+
+    fd = uart_open(GW.lbt.lbt_tty_path);
+    if (fd == -1) {
+        lgw_log(LOG_ERROR, "%s[LBT] cannot open tty path, retry in %ds\n", ERRMSG, LBT_REOPEN_MS / 1000);
+        eng->reopen_ms = now + LBT_REOPEN_MS;
+        return;
+    }
+    uart_config(fd, GW.lbt.lbt_tty_baude, 9, 9, 9, 9);  /*!> 9 use default */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(eng->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        lgw_log(LOG_ERROR, "%s[LBT] cannot watch tty (%s)\n", ERRMSG, strerror(errno));
+        uart_close(fd);
+        eng->reopen_ms = now + LBT_REOPEN_MS;
+        return;
+    }
+    eng->events = EPOLLIN;
+    GW.lbt.lbt_tty_fd = fd;
+    lgw_log(LOG_INFO, "%s[LBT] tty %s open\n", INFOMSG, GW.lbt.lbt_tty_path);
+}
+
+static void lbt_tty_write(struct lbt_engine_s *eng, uint64_t now) {
+    ssize_t n;
+
+    while (eng->tx_len > 0) {
+        n = write(GW.lbt.lbt_tty_fd, eng->tx, eng->tx_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            lgw_log(LOG_ERROR, "%s[LBT] cannot send command to uart (%s)\n", ERRMSG, strerror(errno));
+            lbt_tty_close(eng, now);
+            return;
+        }
+        memmove(eng->tx, eng->tx + n, eng->tx_len - n);
+        eng->tx_len -= n;
+    }
+    lbt_tty_watch(eng, eng->tx_len > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+/*!> replies are FREE or BUSY, whatever else the module prints is skipped */
+static void lbt_tty_read(struct lbt_engine_s *eng, uint64_t now) {
+    ssize_t n;
+    int pos = 0;
+
+    n = read(GW.lbt.lbt_tty_fd, eng->rx + eng->rx_len, sizeof(eng->rx) - eng->rx_len);
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        lgw_log(LOG_ERROR, "%s[LBT] uart closed (%s)\n", ERRMSG, n < 0 ? strerror(errno) : "EOF");
+        lbt_tty_close(eng, now);
+        return;
+    }
+    eng->rx_len += n;
+
+    while (eng->rx_len - pos >= LBT_REPLY_LEN) {
+        if (memcmp(eng->rx + pos, "FREE", LBT_REPLY_LEN) && memcmp(eng->rx + pos, "BUSY", LBT_REPLY_LEN)) {
+            pos++;
+            continue;
+        }
+        /*!> a reply faster than the scan itself is a late one for a command already failed */
+        if (eng->nb_inflight > 0 && now >= eng->quiet_ms && now >= eng->inflight[0].head_ms + GW.lbt.lbt_scan_time_ms) {
+            lbt_complete(&eng->inflight[0], eng->rx[pos] == 'F');
+            eng->nb_inflight--;
+            memmove(eng->inflight, eng->inflight + 1, eng->nb_inflight * sizeof(eng->inflight[0]));
+            /*!> the next command is only processed from now on */
+            if (eng->nb_inflight > 0) {
+                eng->inflight[0].head_ms = now;
+                if (eng->inflight[0].deadline_ms < now + lbt_reply_ms())
+                    eng->inflight[0].deadline_ms = now + lbt_reply_ms();
+            }
+        } else {
+            lgw_log(LOG_DEBUG, "%s[LBT] unexpected reply dropped\n", DEBUGMSG);
+        }
+        pos += LBT_REPLY_LEN;
+    }
+
+    /*!> the tail may be the start of the next reply */
+    memmove(eng->rx, eng->rx + pos, eng->rx_len - pos);
+    eng->rx_len -= pos;
+}
+
+static void lbt_check_timeout(struct lbt_engine_s *eng, uint64_t now) {
+    if (eng->nb_inflight == 0 || now < eng->inflight[0].deadline_ms)
+        return;
+
+    lgw_log(LOG_WARNING, "%s[LBT] no reply within %ums, %d command(s) failed\n", WARNMSG, lbt_reply_ms(), eng->nb_inflight);
+    lbt_fail_inflight(eng);
+    tcflush(GW.lbt.lbt_tty_fd, TCIOFLUSH);
+    lbt_tty_watch(eng, EPOLLIN);
+    eng->quiet_ms = now + LBT_REPLY_MARGIN_MS;
+}
+
+/*!> fill the pipeline, earliest TX first, returns the ms until the next request enters its window */
+static int lbt_schedule(struct lbt_engine_s *eng, uint64_t now) {
+    struct lbt_cmd_s *cmd;
+    struct lbt_req_s *req;
+    uint32_t cnt, diff, best_diff;
+    int i, best, len, wait = LBT_IDLE_MS;
+    int depth = GW.lbt.lbt_pipeline_depth;
+
+    if (get_concentrator_time(&cnt) != 0)
+        return wait;
+
+    pthread_mutex_lock(&mx_lbt);
+
+    for (;;) {
+        best = -1;
+        best_diff = 0;
+        for (i = 0; i < NB_LBT_QUEUE; i++) {
+            req = &lbt_req[i];
+            if (req->id == 0)
+                continue;
+            diff = req->count_us - cnt;
+            if ((int32_t)diff < 0) {
+                /*!> evicted or rejected downlinks are never read back */
+                if (cnt - req->count_us > LBT_EXPIRE_US && req->state != LBT_REQ_SENT)
+                    req->id = 0;
+                else if (req->state == LBT_REQ_WAIT)
+                    req->state = LBT_REQ_DONE;
+                continue;
+            }
+            if (req->state != LBT_REQ_WAIT)
+                continue;
+            if (diff <= LBT_SCAN_LEAD_MIN_US) {
+                lgw_log(LOG_DEBUG, "%s[LBT] chan(%u) not assessed in time, us=%u\n", DEBUGMSG, req->freq_hz, req->count_us);
+                req->state = LBT_REQ_DONE;
+                req->chan_is_free = false;
+                continue;
+            }
+            if (diff > LBT_SCAN_LEAD_MAX_US) {
+                if ((diff - LBT_SCAN_LEAD_MAX_US) / 1000 + 1 < (uint32_t)wait)
+                    wait = (diff - LBT_SCAN_LEAD_MAX_US) / 1000 + 1;
+                continue;
+            }
+            if (best < 0 || diff < best_diff) {
+                best = i;
+                best_diff = diff;
+            }
+        }
+
+        if (best < 0 || eng->nb_inflight >= depth || now < eng->quiet_ms || eng->tx_len + LBT_CMD_SIZE > LBT_TX_SIZE)
+            break;
+
+        req = &lbt_req[best];
+        len = snprintf(eng->tx + eng->tx_len, LBT_CMD_SIZE, "AT+GETCHANSTAT=%u,%i,%u\r\n", req->freq_hz, GW.lbt.lbt_rssi_target, GW.lbt.lbt_scan_time_ms);
+        lgw_log(LOG_DEBUG, "%s[LBT] command: %s", DEBUGMSG, eng->tx + eng->tx_len);
+        eng->tx_len += len;
+        req->state = LBT_REQ_SENT;
+
+        cmd = &eng->inflight[eng->nb_inflight++];
+        cmd->slot = best;
+        cmd->id = req->id;
+        cmd->head_ms = now;
+        cmd->deadline_ms = now + (uint64_t)eng->nb_inflight * lbt_reply_ms();
+    }
+
+    pthread_mutex_unlock(&mx_lbt);
+
+    return wait;
+}
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PUBLIC FUNCTIONS ----------------------------------------------------- */
+
+enum jit_error_e lbt_enqueue(const struct lgw_pkt_tx_s *packet, uint32_t time_us, uint32_t *id) {
+    uint64_t one = 1;
+    int i;
+
+    if (packet == NULL || id == NULL) {
+        lgw_log(LOG_JIT_ERROR, "%s[PKTS][LBT] invalid parameter\n", ERRMSG);
+        return JIT_ERROR_INVALID;
+    }
+
+    pthread_mutex_lock(&mx_lbt);
+    for (i = 0; i < NB_LBT_QUEUE; i++) {
+        /*!> a slot is free, or holds a request whose TX is over */
+        if (lbt_req[i].id == 0 || (lbt_req[i].state != LBT_REQ_SENT && (int32_t)(lbt_req[i].count_us - time_us) < 0))
+            break;
+    }
+    if (i == NB_LBT_QUEUE) {
+        pthread_mutex_unlock(&mx_lbt);
+        return JIT_ERROR_FULL;
+    }
+    if (++lbt_next_id == 0)
+        ++lbt_next_id;
+    lbt_req[i].id = lbt_next_id;
+    lbt_req[i].freq_hz = packet->freq_hz;
+    lbt_req[i].count_us = packet->count_us;
+    lbt_req[i].state = LBT_REQ_WAIT;
+    lbt_req[i].chan_is_free = false;
+    *id = lbt_next_id;
+    pthread_mutex_unlock(&mx_lbt);
+
+    if (lbt_evfd >= 0 && write(lbt_evfd, &one, sizeof(one)) < 0)
+        lgw_log(LOG_DEBUG, "%s[LBT] cannot wake up lbt thread (%s)\n", DEBUGMSG, strerror(errno));
+
+    return JIT_ERROR_OK;
+}
+
+void lbt_cancel(uint32_t id) {
+    int i;
+
+    if (id == 0)
+        return;
+    pthread_mutex_lock(&mx_lbt);
+    i = lbt_find(id);
+    if (i >= 0)
+        lbt_req[i].id = 0;
+    pthread_mutex_unlock(&mx_lbt);
+}
+
+bool lbt_chan_is_free(uint32_t id, uint32_t count_us) {
+    bool chan_is_free = false;
+    int i;
+
+    if (id == 0) {
+        lgw_log(LOG_DEBUG, "%s[LBT] no assessment requested for us=%u\n", DEBUGMSG, count_us);
+        return false;
+    }
+
+    pthread_mutex_lock(&mx_lbt);
+    i = lbt_find(id);
+    if (i < 0) {
+        lgw_log(LOG_DEBUG, "%s[LBT] assessment of downlink %u lost\n", DEBUGMSG, id);
+    } else if (lbt_req[i].state != LBT_REQ_DONE) {
+        lgw_log(LOG_DEBUG, "%s[LBT] chan(%u) assessment still pending, us=%u\n", DEBUGMSG, lbt_req[i].freq_hz, count_us);
+    } else if (lbt_req[i].count_us != count_us) {
+        /*!> the downlink was moved to another slot after it was assessed */
+        lgw_log(LOG_DEBUG, "%s[LBT] time not matching (%u, assessed for %u)\n", DEBUGMSG, count_us, lbt_req[i].count_us);
+    } else {
+        chan_is_free = lbt_req[i].chan_is_free;
+    }
+    if (i >= 0)
+        lbt_req[i].id = 0;
+    pthread_mutex_unlock(&mx_lbt);
+
+    return chan_is_free;
+}
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- THREAD : LBT ENGINE -------------------------------------------------- */
+
+void thread_lbt(void) {
+    struct lbt_engine_s eng;
+    struct epoll_event ev, events[2];
+    uint64_t now, value;
+    int i, n, timeout;
+
+    memset(&eng, 0, sizeof(eng));
+    GW.lbt.lbt_tty_fd = -1;
+
+    eng.epfd = epoll_create1(EPOLL_CLOEXEC);
+    lbt_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eng.epfd == -1 || lbt_evfd == -1) {
+        lgw_log(LOG_ERROR, "%s[LBT] cannot set up the lbt engine (%s)\n", ERRMSG, strerror(errno));
+        return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = lbt_evfd;
+    epoll_ctl(eng.epfd, EPOLL_CTL_ADD, lbt_evfd, &ev);
+
+    lgw_log(LOG_INFO, "%s[LBT] start lbt scan program (pipeline depth %u)\n", INFOMSG, GW.lbt.lbt_pipeline_depth);
+
+    while (!exit_sig && !quit_sig) {
+        now = lbt_now_ms();
+        timeout = LBT_IDLE_MS;
+
+        if (GW.lbt.lbt_tty_fd < 0 && now >= eng.reopen_ms)
+            lbt_tty_open(&eng, now);
+
+        if (GW.lbt.lbt_tty_fd >= 0) {
+            lbt_check_timeout(&eng, now);
+            timeout = lbt_schedule(&eng, now);
+            if (eng.tx_len > 0)
+                lbt_tty_write(&eng, now);
+        }
+
+        /*!> wake up for the head reply deadline, the end of a quiet period or the next tty open */
+        if (GW.lbt.lbt_tty_fd < 0) {
+            if (eng.reopen_ms - now < (uint64_t)timeout)
+                timeout = eng.reopen_ms - now;
+        } else {
+            if (eng.nb_inflight > 0 && eng.inflight[0].deadline_ms - now < (uint64_t)timeout)
+                timeout = eng.inflight[0].deadline_ms > now ? eng.inflight[0].deadline_ms - now : 0;
+            if (eng.quiet_ms > now && eng.quiet_ms - now < (uint64_t)timeout)
+                timeout = eng.quiet_ms - now;
+        }
+
+        n = epoll_wait(eng.epfd, events, 2, timeout);
+        if (n < 0 && errno != EINTR) {
+            lgw_log(LOG_ERROR, "%s[LBT] epoll_wait failed (%s)\n", ERRMSG, strerror(errno));
+            wait_ms(LBT_IDLE_MS);
+            continue;
+        }
+
+        now = lbt_now_ms();
+        for (i = 0; i < n; i++) {
+            if (events[i].data.fd == lbt_evfd) {
+                if (read(lbt_evfd, &value, sizeof(value)) < 0) { /*!> just a wake up */ }
+                continue;
+            }
+            if (GW.lbt.lbt_tty_fd < 0 || events[i].data.fd != GW.lbt.lbt_tty_fd)
+                continue;
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                lbt_tty_read(&eng, now);
+            if (GW.lbt.lbt_tty_fd >= 0 && (events[i].events & EPOLLOUT))
+                lbt_tty_write(&eng, now);
+        }
+    }
+
+    if (GW.lbt.lbt_tty_fd >= 0)
+        lbt_tty_close(&eng, lbt_now_ms());
+    close(eng.epfd);
+
+    lgw_log(LOG_INFO, "%s[THREAD][LBT] Exited!\n", INFOMSG);
+}
+
+/*!> --- EOF ------------------------------------------------------------------ */
@@ -32,6 +32,8 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "fwd.h"
 #include "logger.h"
@@ -82,6 +84,7 @@ void *__lgw_malloc(size_t size, const char *file, int lineno, const char *func)
     p = malloc(size);
     if (!p) {
         MALLOC_FAILURE_MSG;
+        return NULL;
     }
 
     memset(p, 0, size);
@@ -192,3 +195,239 @@ void lgw_free_ptr(void *ptr)
 {
     lgw_free(ptr);
 }
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- OBJECT POOLS --------------------------------------------------------- */
+
+#define SLAB_CACHE_SLOTS    8       /*!> pools a thread caches objects of, the others go through the lock */
+#define SLAB_CACHE_BATCH    8       /*!> objects moved at once between a thread cache and its pool, unless the pool sets less */
+#define SLAB_POISON         0x6b
+
+#define SLAB_NEXT(obj)      (*(void **)(obj))
+#define SLAB_BATCH(pool)    (((pool)->cache_batch > 0 && (pool)->cache_batch < SLAB_CACHE_BATCH) ? (pool)->cache_batch : SLAB_CACHE_BATCH)
+
+struct slab_cache_s {
+    lgw_slab_s *pool;
+    void *head;
+    unsigned nb;
+};
+
+static __thread struct slab_cache_s slab_cache[SLAB_CACHE_SLOTS];
+
+static pthread_key_t slab_key;      /*!> only there for its destructor */
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t mx_slab_list = PTHREAD_MUTEX_INITIALIZER;
+static lgw_slab_s *slab_list = NULL;
+
+/*!> pool locked: carve a new chunk into the free list */
+static int slab_grow(lgw_slab_s *pool) {
+    uint8_t *chunk;
+    unsigned i;
+
+    chunk = malloc(pool->size * pool->chunk_objs);
+    if (chunk == NULL)
+        return -1;
+
+    for (i = 0; i < pool->chunk_objs; i++) {
+#ifdef LGW_MM_DEBUG
+        memset(chunk + i * pool->size, SLAB_POISON, pool->size);
+#endif
+        SLAB_NEXT(chunk + i * pool->size) = pool->free_list;
+        pool->free_list = chunk + i * pool->size;
+    }
+    pool->nb_free += pool->chunk_objs;
+
+    if (pool->nb_total == 0) {
+        pthread_mutex_lock(&mx_slab_list);
+        pool->next = slab_list;
+        slab_list = pool;
+        pthread_mutex_unlock(&mx_slab_list);
+    }
+    __atomic_store_n(&pool->nb_total, pool->nb_total + pool->chunk_objs, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*!> pool locked */
+static void *slab_pop(lgw_slab_s *pool) {
+    void *obj;
+
+    if (pool->free_list == NULL && slab_grow(pool) == -1)
+        return NULL;
+    obj = pool->free_list;
+    pool->free_list = SLAB_NEXT(obj);
+    pool->nb_free--;
+    return obj;
+}
+
+/*!> pool locked */
+static void slab_push(lgw_slab_s *pool, void *obj) {
+    SLAB_NEXT(obj) = pool->free_list;
+    pool->free_list = obj;
+    pool->nb_free++;
+}
+
+/*!> give nb objects of the thread cache back to its pool */
+static void slab_drain(struct slab_cache_s *c, unsigned nb) {
+    void *obj;
+
+    pthread_mutex_lock(&c->pool->mx_slab);
+    while (nb-- > 0 && c->head != NULL) {
+        obj = c->head;
+        c->head = SLAB_NEXT(obj);
+        c->nb--;
+        slab_push(c->pool, obj);
+    }
+    pthread_mutex_unlock(&c->pool->mx_slab);
+}
+
+static void slab_refill(struct slab_cache_s *c) {
+    void *obj;
+
+    pthread_mutex_lock(&c->pool->mx_slab);
+    while (c->nb < SLAB_BATCH(c->pool) && (obj = slab_pop(c->pool)) != NULL) {
+        SLAB_NEXT(obj) = c->head;
+        c->head = obj;
+        c->nb++;
+    }
+    pthread_mutex_unlock(&c->pool->mx_slab);
+}
+
+/*!> thread exit: objects cached by the thread go back to their pools */
+static void slab_thread_exit(void *arg) {
+    int i;
+
+    (void)arg;
+    for (i = 0; i < SLAB_CACHE_SLOTS && slab_cache[i].pool != NULL; i++) {
+        slab_drain(&slab_cache[i], slab_cache[i].nb);
+        slab_cache[i].pool = NULL;
+    }
+}
+
+static void slab_key_create(void) {
+    pthread_key_create(&slab_key, slab_thread_exit);
+}
+
+static struct slab_cache_s *slab_cache_get(lgw_slab_s *pool) {
+    int i;
+
+    for (i = 0; i < SLAB_CACHE_SLOTS; i++) {
+        if (slab_cache[i].pool == pool)
+            return &slab_cache[i];
+        if (slab_cache[i].pool == NULL)
+            break;
+    }
+    if (i == SLAB_CACHE_SLOTS)
+        return NULL;
+
+    if (i == 0) {
+        pthread_once(&slab_once, slab_key_create);
+        pthread_setspecific(slab_key, slab_cache);
+    }
+    slab_cache[i].pool = pool;
+    slab_cache[i].head = NULL;
+    slab_cache[i].nb = 0;
+    return &slab_cache[i];
+}
+
+#ifdef LGW_MM_DEBUG
+static void slab_check_poison(lgw_slab_s *pool, void *obj) {
+    const uint8_t *p = obj;
+    size_t i;
+
+    for (i = sizeof(void *); i < pool->size; i++) {
+        if (p[i] != SLAB_POISON) {
+            lgw_log(LOG_MEM, "[MEM] %s object %p written after free at offset %u\n", pool->name, obj, (unsigned)i);
+            return;
+        }
+    }
+}
+#endif
+
+void *lgw_slab_alloc(lgw_slab_s *pool) {
+    struct slab_cache_s *c = slab_cache_get(pool);
+    uint32_t used, max;
+    void *obj = NULL;
+
+    if (c != NULL) {
+        if (c->nb == 0)
+            slab_refill(c);
+        if (c->nb > 0) {
+            obj = c->head;
+            c->head = SLAB_NEXT(obj);
+            c->nb--;
+        }
+    } else {
+        pthread_mutex_lock(&pool->mx_slab);
+        obj = slab_pop(pool);
+        pthread_mutex_unlock(&pool->mx_slab);
+    }
+
+    if (obj == NULL) {
+        lgw_log(LOG_MEM, "[MEM] %s pool can't grow, %u objects in use\n", pool->name, pool->nb_used);
+        return NULL;
+    }
+
+#ifdef LGW_MM_DEBUG
+    slab_check_poison(pool, obj);
+#endif
+
+    used = __atomic_add_fetch(&pool->nb_used, 1, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&pool->nb_used_max, __ATOMIC_RELAXED);
+    while (used > max && !__atomic_compare_exchange_n(&pool->nb_used_max, &max, used, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    return obj;
+}
+
+void *lgw_slab_zalloc(lgw_slab_s *pool) {
+    void *obj = lgw_slab_alloc(pool);
+
+    if (obj != NULL)
+        memset(obj, 0, pool->size);
+    return obj;
+}
+
+void lgw_slab_free(lgw_slab_s *pool, void *obj) {
+    struct slab_cache_s *c;
+
+    if (obj == NULL)
+        return;
+
+    __atomic_sub_fetch(&pool->nb_used, 1, __ATOMIC_RELAXED);
+#ifdef LGW_MM_DEBUG
+    memset(obj, SLAB_POISON, pool->size);
+#endif
+
+    c = slab_cache_get(pool);
+    if (c == NULL) {
+        pthread_mutex_lock(&pool->mx_slab);
+        slab_push(pool, obj);
+        pthread_mutex_unlock(&pool->mx_slab);
+        return;
+    }
+
+    SLAB_NEXT(obj) = c->head;
+    c->head = obj;
+    c->nb++;
+    if (c->nb >= 2 * SLAB_BATCH(pool))
+        slab_drain(c, SLAB_BATCH(pool));
+}
+
+int lgw_slab_stats(lgw_slab_stat_s *stat, int max) {
+    lgw_slab_s *pool;
+    int nb = 0;
+
+    pthread_mutex_lock(&mx_slab_list);
+    for (pool = slab_list; pool != NULL && nb < max; pool = pool->next, nb++) {
+        stat[nb].name = pool->name;
+        stat[nb].size = pool->size;
+        stat[nb].nb_total = __atomic_load_n(&pool->nb_total, __ATOMIC_RELAXED);
+        stat[nb].nb_used = __atomic_load_n(&pool->nb_used, __ATOMIC_RELAXED);
+        stat[nb].nb_used_max = __atomic_load_n(&pool->nb_used_max, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&mx_slab_list);
+
+    return nb;
+}
@@ -1,23 +1,648 @@
-#include <stdarg.h> 
+/*!>
+ *  ____  ____      _    ____ ___ _   _  ___
+ *  |  _ \|  _ \    / \  / ___|_ _| \ | |/ _ \
+ *  | | | | |_) |  / _ \| |  _ | ||  \| | | | |
+ *  | |_| |  _ <  / ___ \ |_| || || |\  | |_| |
+ *  |____/|_| \_\/_/   \_\____|___|_| \_|\___/
+ *
+ * Dragino_gw_fwd -- An opensource lora gateway forward
+ *
+ * See http://www.dragino.com for more information about
+ * the lora gateway project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ *
+ * Maintainer: skerlan
+ *
+ */
+
+/*!>!
+ * \file
+ * \brief asynchronous logger
+ *
+ * A logging thread only stores the format pointer, a timestamp and its
+ * arguments in binary form into a ring of its own.  The logger thread
+ * drains every ring, formats, timestamps and writes the messages in
+ * batches.  Until lgw_log_start and after lgw_log_stop, messages are
+ * printed synchronously, with the same timestamp; so are the ones which
+ * do not fit a record, such as a string longer than LOG_STR_MAX.  Output
+ * cut at PRINT_SIZE ends with "...".
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 #include "logger.h"
 #include "gwcfg.h"
 
 DECLARE_GW;
 
-void lgw_log(int FLAG, const char *format, ...) {  
-    if (FLAG & GW.log.debug_mask) {                        
-        char buffer[PRINT_SIZE];
-        va_list args;  
-        va_start(args, format); 
-        int numChars = vsnprintf(buffer, PRINT_SIZE, format, args);  
-  
-        if (numChars >= (int)PRINT_SIZE) {  
-            buffer[PRINT_SIZE - 1] = '\0'; 
-            fprintf(stderr, "[WARNING~][LOGGER] Output truncated due to buffer size limit.\n");  
-        }  
-        va_end(args); 
-        printf("%s", buffer);
-    }
-}  
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PRIVATE CONSTANTS & TYPES -------------------------------------------- */
+
+#define LOG_RING_SIZE       (64 * 1024)     /*!> bytes per thread, power of 2 */
+#define LOG_ARGS_MAX        1024            /*!> encoded arguments of one message */
+#define LOG_STR_MAX         512             /*!> %s arguments are copied up to this length, longer ones are printed in place */
+#define LOG_OUT_SIZE        (16 * 1024)     /*!> writer batch */
+#define LOG_DRAIN_MS        20              /*!> writer period */
+#define LOG_POOL_MAX        8               /*!> rings kept for the next threads */
+#define LOG_REC_ALIGN       32              /*!> any gap left at the end of a ring holds a record header */
+
+/*!> a message in a ring, followed by its encoded arguments, fits in LOG_REC_ALIGN */
+typedef struct {
+    uint32_t size;              /*!> whole record, header included, multiple of LOG_REC_ALIGN */
+    uint32_t flag;
+    uint64_t ts_ns;             /*!> CLOCK_REALTIME when logged */
+    const char* fmt;            /*!> NULL: padding up to the end of the ring */
+} log_rec_s;
+
+/*!> single producer (owner thread), single consumer (whoever holds mx_drain) */
+typedef struct _log_ring {
+    uint32_t head;              /*!> bytes written, by the owner */
+    uint32_t tail;              /*!> bytes consumed, by the drainer */
+    uint32_t dropped;           /*!> messages lost because the ring was full */
+    uint32_t orphan;            /*!> owner exited, recycled once drained */
+    struct _log_ring* next;
+    uint8_t buf[LOG_RING_SIZE];
+} log_ring_s;
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PRIVATE VARIABLES ---------------------------------------------------- */
+
+static pthread_mutex_t mx_rings = PTHREAD_MUTEX_INITIALIZER;   /*!> rings and pool lists */
+static pthread_mutex_t mx_drain = PTHREAD_MUTEX_INITIALIZER;   /*!> one consumer at a time */
+static log_ring_s* rings = NULL;
+static log_ring_s* pool = NULL;
+static int nb_pool = 0;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread log_ring_s* my_ring = NULL;
+
+static pthread_t thrid_log;
+static bool log_running = false;
+static bool log_stop = false;
+
+static bool at_line_start = true;   /*!> writer side, protected by mx_drain */
+static char out[LOG_OUT_SIZE];      /*!> idem */
+static int out_len = 0;             /*!> idem */
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PRIVATE FUNCTIONS ---------------------------------------------------- */
+
+/*!> ends a message cut at size with "...", it keeps its line */
+static int mark_cut(char* buf, int size) {
+    memcpy(buf + size - 5, "...\n", 5);
+    return size - 1;
+}
+
+static void ring_release(void* arg) {
+    log_ring_s* ring = (log_ring_s*)arg;
+
+    __atomic_store_n(&ring->orphan, 1, __ATOMIC_RELEASE);
+}
+
+static void ring_key_create(void) {
+    pthread_key_create(&ring_key, ring_release);
+}
+
+static log_ring_s* ring_get(void) {
+    log_ring_s* ring;
+
+    if (my_ring != NULL)
+        return my_ring;
+
+    pthread_once(&ring_key_once, ring_key_create);
+
+    pthread_mutex_lock(&mx_rings);
+    ring = pool;
+    if (ring != NULL) {
+        pool = ring->next;
+        nb_pool--;
+    }
+    pthread_mutex_unlock(&mx_rings);
+
+    if (ring == NULL) {
+        /*!> not lgw_malloc, it may log */
+        ring = malloc(sizeof(log_ring_s));
+        if (ring == NULL)
+            return NULL;
+    }
+    ring->head = ring->tail = 0;
+    ring->dropped = 0;
+    ring->orphan = 0;
+
+    pthread_mutex_lock(&mx_rings);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&mx_rings);
+
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+/*!> conversion specification, shared by the encoder and the formatter */
+typedef struct {
+    char spec[32];              /*!> rebuilt with "ll" for integers, no length for the others */
+    int nb_star;                /*!> '*' width and precision taken from the arguments */
+    char conv;
+    int len;                    /*!> length of the specification in the format */
+} log_spec_s;
+
+static int spec_parse(const char* p, log_spec_s* s, int* lmod) {
+    const char* start = p;
+    int n = 0;
+
+    /*!> p points after '%' */
+    s->spec[n++] = '%';
+    s->nb_star = 0;
+    *lmod = 0;
+    while (*p && strchr("-+ #0'", *p) && n < 8)
+        s->spec[n++] = *p++;
+    if (*p == '*') {
+        s->spec[n++] = *p++;
+        s->nb_star++;
+    } else {
+        while (*p >= '0' && *p <= '9' && n < 16)
+            s->spec[n++] = *p++;
+    }
+    if (*p == '.') {
+        s->spec[n++] = *p++;
+        if (*p == '*') {
+            s->spec[n++] = *p++;
+            s->nb_star++;
+        } else {
+            while (*p >= '0' && *p <= '9' && n < 24)
+                s->spec[n++] = *p++;
+        }
+    }
+    /*!> length modifier: 1 hh/h/none, 2 l, 3 ll/q/L, 4 z, 5 j, 6 t */
+    if (p[0] == 'h') {
+        p += (p[1] == 'h') ? 2 : 1;
+    } else if (p[0] == 'l' && p[1] == 'l') {
+        p += 2;
+        *lmod = 3;
+    } else if (p[0] == 'l') {
+        p += 1;
+        *lmod = 2;
+    } else if (p[0] == 'q' || p[0] == 'L') {
+        p += 1;
+        *lmod = 3;
+    } else if (p[0] == 'z') {
+        p += 1;
+        *lmod = 4;
+    } else if (p[0] == 'j') {
+        p += 1;
+        *lmod = 5;
+    } else if (p[0] == 't') {
+        p += 1;
+        *lmod = 6;
+    }
+    s->conv = *p;
+    if (*p == '\0' || !strchr("diouxXcsfFeEgGaApn%", *p))
+        return -1;
+    if (strchr("diouxX", *p)) {
+        s->spec[n++] = 'l';
+        s->spec[n++] = 'l';
+    }
+    s->spec[n++] = *p++;
+    s->spec[n] = '\0';
+    s->len = p - start;
+    return 0;
+}
+
+static int put_arg(uint8_t* args, int len, const void* v) {
+    if (len + 8 > LOG_ARGS_MAX)
+        return -1;
+    memcpy(args + len, v, 8);
+    return len + 8;
+}
+
+/*!> arguments in binary form: 8 bytes per value, strings as a 16 bits length then the bytes */
+static int log_encode(uint8_t* args, const char* fmt, va_list ap) {
+    const char* p = fmt;
+    log_spec_s s;
+    int lmod, i, len = 0;
+    int64_t iv;
+    uint64_t uv;
+    double dv;
+    const char* str;
+    const char* dot;
+    uint16_t slen;
+    size_t smax, limit;
+
+    while ((p = strchr(p, '%')) != NULL) {
+        if (spec_parse(p + 1, &s, &lmod) != 0)
+            break;
+        p += 1 + s.len;
+        if (s.conv == '%')
+            continue;
+        for (i = 0; i < s.nb_star; i++) {
+            iv = va_arg(ap, int);
+            if ((len = put_arg(args, len, &iv)) < 0)
+                return -1;
+        }
+        switch (s.conv) {
+            case 'd': case 'i':
+                switch (lmod) {
+                    case 2: iv = va_arg(ap, long); break;
+                    case 3: iv = va_arg(ap, long long); break;
+                    case 4: iv = va_arg(ap, ssize_t); break;
+                    case 5: iv = va_arg(ap, intmax_t); break;
+                    case 6: iv = va_arg(ap, ptrdiff_t); break;
+                    default: iv = va_arg(ap, int); break;
+                }
+                len = put_arg(args, len, &iv);
+                break;
+            case 'o': case 'u': case 'x': case 'X':
+                switch (lmod) {
+                    case 2: uv = va_arg(ap, unsigned long); break;
+                    case 3: uv = va_arg(ap, unsigned long long); break;
+                    case 4: uv = va_arg(ap, size_t); break;
+                    case 5: uv = va_arg(ap, uintmax_t); break;
+                    case 6: uv = va_arg(ap, ptrdiff_t); break;
+                    default: uv = va_arg(ap, unsigned int); break;
+                }
+                len = put_arg(args, len, &uv);
+                break;
+            case 'c':
+                iv = va_arg(ap, int);
+                len = put_arg(args, len, &iv);
+                break;
+            case 'p': case 'n':
+                uv = (uintptr_t)va_arg(ap, void*);
+                len = put_arg(args, len, &uv);
+                break;
+            case 's':
+                str = va_arg(ap, const char*);
+                if (str == NULL)
+                    str = "(null)";
+                /*!> "%.Ns" reads N bytes at most, the string may not be terminated */
+                limit = SIZE_MAX;
+                if ((dot = strchr(s.spec, '.')) != NULL) {
+                    if (dot[1] != '*')
+                        limit = (size_t)atoi(dot + 1);
+                    else if (iv >= 0)  /*!> the precision is the last '*' argument */
+                        limit = (size_t)iv;
+                }
+                smax = (limit > LOG_STR_MAX) ? LOG_STR_MAX : limit;
+                slen = strnlen(str, smax);
+                /*!> longer than a record holds, str[smax] is within limit */
+                if (slen == smax && smax < limit && str[smax] != '\0')
+                    return -1;
+                if (len + 2 + slen > LOG_ARGS_MAX)
+                    return -1;
+                memcpy(args + len, &slen, 2);
+                memcpy(args + len + 2, str, slen);
+                len += 2 + slen;
+                break;
+            default:
+                if (lmod == 3)
+                    dv = (double)va_arg(ap, long double);
+                else
+                    dv = va_arg(ap, double);
+                len = put_arg(args, len, &dv);
+                break;
+        }
+        if (len < 0)
+            return -1;
+    }
+
+    return len;
+}
+
+#define FMT_ONE(buf, room, spec, nb_star, star, v) \
+    ((nb_star) == 0 ? snprintf(buf, room, spec, v) : \
+     (nb_star) == 1 ? snprintf(buf, room, spec, star[0], v) : \
+                      snprintf(buf, room, spec, star[0], star[1], v))
+
+/*!> formats a record, mirror of log_encode */
+static int log_format(char* buf, int size, const char* fmt, const uint8_t* args) {
+    const char* p = fmt;
+    const char* pct;
+    log_spec_s s;
+    int lmod, i, n, len = 0, off = 0;
+    int star[2];
+    int64_t iv;
+    uint64_t uv;
+    double dv;
+    uint16_t slen;
+    char str[LOG_STR_MAX + 1];
+    bool cut = false;
+
+    while (len < size - 1) {
+        pct = strchr(p, '%');
+        n = (pct == NULL) ? (int)strlen(p) : (int)(pct - p);
+        if (n > size - 1 - len) {
+            n = size - 1 - len;
+            cut = true;
+        }
+        memcpy(buf + len, p, n);
+        len += n;
+        if (pct == NULL || spec_parse(pct + 1, &s, &lmod) != 0) {
+            /*!> nothing left, or a specification log_encode stopped at */
+            if (pct != NULL && len < size - 1)
+                buf[len++] = '%';
+            if (pct == NULL)
+                break;
+            p = pct + 1;
+            continue;
+        }
+        p = pct + 1 + s.len;
+        if (s.conv == '%') {
+            buf[len++] = '%';
+            continue;
+        }
+        for (i = 0; i < s.nb_star; i++) {
+            memcpy(&iv, args + off, 8);
+            off += 8;
+            star[i] = (int)iv;
+        }
+        switch (s.conv) {
+            case 'd': case 'i': case 'c':
+                memcpy(&iv, args + off, 8);
+                off += 8;
+                if (s.conv == 'c')
+                    n = FMT_ONE(buf + len, size - len, s.spec, s.nb_star, star, (int)iv);
+                else
+                    n = FMT_ONE(buf + len, size - len, s.spec, s.nb_star, star, (long long)iv);
+                break;
+            case 'o': case 'u': case 'x': case 'X':
+                memcpy(&uv, args + off, 8);
+                off += 8;
+                n = FMT_ONE(buf + len, size - len, s.spec, s.nb_star, star, (unsigned long long)uv);
+                break;
+            case 'p':
+                memcpy(&uv, args + off, 8);
+                off += 8;
+                n = FMT_ONE(buf + len, size - len, s.spec, s.nb_star, star, (void*)(uintptr_t)uv);
+                break;
+            case 'n':
+                off += 8;
+                n = 0;
+                break;
+            case 's':
+                memcpy(&slen, args + off, 2);
+                memcpy(str, args + off + 2, slen);
+                str[slen] = '\0';
+                off += 2 + slen;
+                n = FMT_ONE(buf + len, size - len, s.spec, s.nb_star, star, str);
+                break;
+            default:
+                memcpy(&dv, args + off, 8);
+                off += 8;
+                n = FMT_ONE(buf + len, size - len, s.spec, s.nb_star, star, dv);
+                break;
+        }
+        if (n >= size - len)
+            cut = true;
+        if (n > 0)
+            len += (n < size - len) ? n : size - 1 - len;
+    }
+
+    buf[len] = '\0';
+    return cut ? mark_cut(buf, size) : len;
+}
+
+static void out_flush(void) {
+    if (out_len > 0) {
+        fwrite(out, 1, out_len, stdout);
+        fflush(stdout);
+        out_len = 0;
+    }
+}
+
+/*!> appends a message, each line it starts gets the time it was logged at */
+static void out_put(const char* msg, int len, uint64_t ts_ns) {
+    char stamp[20];
+    int stamp_len = 0;
+    time_t sec = ts_ns / 1000000000ULL;
+    struct tm x;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        if (at_line_start && msg[i] != '\n') {
+            if (stamp_len == 0) {
+                localtime_r(&sec, &x);
+                stamp_len = snprintf(stamp, sizeof(stamp), "%02d:%02d:%02d.%03u ", x.tm_hour, x.tm_min, x.tm_sec, (unsigned)((ts_ns / 1000000ULL) % 1000));
+            }
+            if (out_len + stamp_len > LOG_OUT_SIZE)
+                out_flush();
+            memcpy(out + out_len, stamp, stamp_len);
+            out_len += stamp_len;
+            at_line_start = false;
+        }
+        if (out_len + 1 > LOG_OUT_SIZE)
+            out_flush();
+        out[out_len++] = msg[i];
+        if (msg[i] == '\n')
+            at_line_start = true;
+    }
+}
+
+/*!> consume every ring, oldest message first, mx_drain held */
+static void log_drain(void) {
+    char msg[PRINT_SIZE];
+    log_ring_s* ring;
+    log_ring_s* oldest;
+    log_ring_s** pp;
+    log_rec_s* rec;
+    log_rec_s* oldest_rec;
+    uint32_t head, dropped;
+    struct timespec now;
+    int len;
+
+    pthread_mutex_lock(&mx_rings);
+    for (;;) {
+        oldest = NULL;
+        oldest_rec = NULL;
+        for (ring = rings; ring != NULL; ring = ring->next) {
+            head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            while (ring->tail != head) {
+                rec = (log_rec_s*)(ring->buf + (ring->tail & (LOG_RING_SIZE - 1)));
+                if (rec->fmt != NULL)
+                    break;
+                __atomic_store_n(&ring->tail, ring->tail + rec->size, __ATOMIC_RELEASE);
+            }
+            if (ring->tail == head)
+                continue;
+            if (oldest == NULL || rec->ts_ns < oldest_rec->ts_ns) {
+                oldest = ring;
+                oldest_rec = rec;
+            }
+        }
+        if (oldest == NULL)
+            break;
+
+        len = log_format(msg, sizeof(msg), oldest_rec->fmt, (const uint8_t*)(oldest_rec + 1));
+        out_put(msg, len, oldest_rec->ts_ns);
+        __atomic_store_n(&oldest->tail, oldest->tail + oldest_rec->size, __ATOMIC_RELEASE);
+    }
+
+    /*!> report losses, recycle the rings of the threads which exited */
+    pp = &rings;
+    while ((ring = *pp) != NULL) {
+        dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped > 0) {
+            clock_gettime(CLOCK_REALTIME, &now);
+            len = snprintf(msg, sizeof(msg), "[WARNING~][LOGGER] %u messages dropped, log ring full\n", dropped);
+            out_put(msg, len, (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec);
+        }
+        if (__atomic_load_n(&ring->orphan, __ATOMIC_ACQUIRE) && ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            *pp = ring->next;
+            if (nb_pool < LOG_POOL_MAX) {
+                ring->next = pool;
+                pool = ring;
+                nb_pool++;
+            } else {
+                free(ring);
+            }
+            continue;
+        }
+        pp = &ring->next;
+    }
+    pthread_mutex_unlock(&mx_rings);
+
+    out_flush();
+}
+
+/*!> prints a message in place, after the ones queued before it */
+static void log_sync(const char* format, va_list args) {
+    char buffer[PRINT_SIZE];
+    struct timespec now;
+    int len;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    len = vsnprintf(buffer, sizeof(buffer), format, args);
+    if (len < 0)
+        return;
+    if (len >= (int)sizeof(buffer))
+        len = mark_cut(buffer, sizeof(buffer));
+
+    pthread_mutex_lock(&mx_drain);
+    if (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+        log_drain();
+    out_put(buffer, len, (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec);
+    out_flush();
+    pthread_mutex_unlock(&mx_drain);
+}
+
+static void* thread_log(void* arg) {
+    struct timespec t = { 0, LOG_DRAIN_MS * 1000000L };
+
+    (void)arg;
+    while (!__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&mx_drain);
+        log_drain();
+        pthread_mutex_unlock(&mx_drain);
+        nanosleep(&t, NULL);
+    }
+    return NULL;
+}
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PUBLIC FUNCTIONS ----------------------------------------------------- */
+
+void lgw_log_msg(int FLAG, const char *format, ...) {
+    uint8_t args[LOG_ARGS_MAX];
+    log_ring_s* ring;
+    log_rec_s* rec;
+    struct timespec now;
+    uint32_t size, pos, room, tail;
+    int len;
+    va_list ap;
+
+    if (!(FLAG & GW.log.debug_mask))
+        return;
+
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE) || (ring = ring_get()) == NULL) {
+        va_start(ap, format);
+        log_sync(format, ap);
+        va_end(ap);
+        return;
+    }
+
+    va_start(ap, format);
+    len = log_encode(args, format, ap);
+    va_end(ap);
+    if (len < 0) {
+        /*!> too many arguments or too long a string to store, rare enough to be printed in place */
+        va_start(ap, format);
+        log_sync(format, ap);
+        va_end(ap);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    size = (sizeof(log_rec_s) + len + LOG_REC_ALIGN - 1) & ~(LOG_REC_ALIGN - 1U);
+
+    /*!> records do not wrap, the end of the ring is padded when too short */
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    pos = ring->head & (LOG_RING_SIZE - 1);
+    room = LOG_RING_SIZE - pos;
+    if (room < size) {
+        if (LOG_RING_SIZE - (ring->head - tail) < room + size) {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        rec = (log_rec_s*)(ring->buf + pos);
+        rec->size = room;
+        rec->fmt = NULL;
+        __atomic_store_n(&ring->head, ring->head + room, __ATOMIC_RELEASE);
+        pos = 0;
+    } else if (LOG_RING_SIZE - (ring->head - tail) < size) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    rec = (log_rec_s*)(ring->buf + pos);
+    rec->size = size;
+    rec->flag = FLAG;
+    rec->ts_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    rec->fmt = format;
+    memcpy(rec + 1, args, len);
+    __atomic_store_n(&ring->head, ring->head + size, __ATOMIC_RELEASE);
+}
+
+void lgw_log_flush(void) {
+    pthread_mutex_lock(&mx_drain);
+    log_drain();
+    pthread_mutex_unlock(&mx_drain);
+}
+
+int lgw_log_start(void) {
+    if (log_running)
+        return 0;
+
+    log_stop = false;
+    if (pthread_create(&thrid_log, NULL, thread_log, NULL) != 0) {
+        fprintf(stderr, "[ERROR~][LOGGER] can't start the logger thread, logging synchronously\n");
+        return -1;
+    }
+    /*!> messages queued before an exit() are not lost */
+    atexit(lgw_log_flush);
+    __atomic_store_n(&log_running, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void lgw_log_stop(void) {
+    if (!log_running)
+        return;
 
+    __atomic_store_n(&log_running, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&log_stop, true, __ATOMIC_RELEASE);
+    pthread_join(thrid_log, NULL);
+    lgw_log_flush();
+}
@@ -19,13 +19,6 @@ Maintainer: skerlan
  */
 #define LORAMAC_MIC_BLOCK_B0_SIZE                   16
 
-/*!>!
- * MIC field computation initial data
- */
-static uint8_t MicBlockB0[] = { 0x49, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-                                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-                              };
-
 /*!>!
  * Contains the computed MIC field.
  *
@@ -33,16 +26,6 @@ static uint8_t MicBlockB0[] = { 0x49, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
  */
 static uint8_t Mic[16];
 
-/*!>!
- * Encryption aBlock and sBlock
- */
-static uint8_t aBlock[] = { 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-                            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-                          };
-static uint8_t sBlock[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-                            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-                          };
-
 /*!>!
  * AES computation context variable
  */
@@ -66,76 +49,91 @@ static AES_CMAC_CTX AesCmacCtx[1];
  */
 void LoRaMacComputeMic( const uint8_t *buffer, uint16_t size, const uint8_t *key, uint32_t address, uint8_t dir, uint32_t sequenceCounter, uint32_t *mic )
 {
-    MicBlockB0[5] = dir;
-    
-    MicBlockB0[6] = ( address ) & 0xFF;
-    MicBlockB0[7] = ( address >> 8 ) & 0xFF;
-    MicBlockB0[8] = ( address >> 16 ) & 0xFF;
-    MicBlockB0[9] = ( address >> 24 ) & 0xFF;
+    aes_context ctx;
+
+    LoRaMacKeySchedule( key, &ctx );
+    LoRaMacComputeMicKeyed( buffer, size, &ctx, address, dir, sequenceCounter, mic );
+}
+
+void LoRaMacKeySchedule( const uint8_t *key, aes_context *ctx )
+{
+    lgw_memset( ctx->ksch, '\0', sizeof( ctx->ksch ) );
+    aes_set_key( key, 16, ctx );
+}
+
+/*!>!
+ * The keyed variants only use the stack, several threads may run them at
+ * the same time with their own or a shared (read only) key schedule.
+ */
+void LoRaMacComputeMicKeyed( const uint8_t *buffer, uint16_t size, const aes_context *key, uint32_t address, uint8_t dir, uint32_t sequenceCounter, uint32_t *mic )
+{
+    AES_CMAC_CTX cmac;
+    uint8_t b0[LORAMAC_MIC_BLOCK_B0_SIZE] = { 0x49 };
+    uint8_t digest[16];
 
-    MicBlockB0[10] = ( sequenceCounter ) & 0xFF;
-    MicBlockB0[11] = ( sequenceCounter >> 8 ) & 0xFF;
-    MicBlockB0[12] = ( sequenceCounter >> 16 ) & 0xFF;
-    MicBlockB0[13] = ( sequenceCounter >> 24 ) & 0xFF;
+    b0[5] = dir;
 
-    MicBlockB0[15] = size & 0xFF;
+    b0[6] = ( address ) & 0xFF;
+    b0[7] = ( address >> 8 ) & 0xFF;
+    b0[8] = ( address >> 16 ) & 0xFF;
+    b0[9] = ( address >> 24 ) & 0xFF;
 
-    AES_CMAC_Init( AesCmacCtx );
+    b0[10] = ( sequenceCounter ) & 0xFF;
+    b0[11] = ( sequenceCounter >> 8 ) & 0xFF;
+    b0[12] = ( sequenceCounter >> 16 ) & 0xFF;
+    b0[13] = ( sequenceCounter >> 24 ) & 0xFF;
 
-    AES_CMAC_SetKey( AesCmacCtx, key );
+    b0[15] = size & 0xFF;
+
+    AES_CMAC_Init( &cmac );
+
+    cmac.rijndael = *key;
 
-    AES_CMAC_Update( AesCmacCtx, MicBlockB0, LORAMAC_MIC_BLOCK_B0_SIZE );
+    AES_CMAC_Update( &cmac, b0, LORAMAC_MIC_BLOCK_B0_SIZE );
     
-    AES_CMAC_Update( AesCmacCtx, buffer, size & 0xFF );
+    AES_CMAC_Update( &cmac, buffer, size & 0xFF );
     
-    AES_CMAC_Final( Mic, AesCmacCtx );
+    AES_CMAC_Final( digest, &cmac );
     
-    *mic = ( uint32_t )( ( uint32_t )Mic[3] << 24 | ( uint32_t )Mic[2] << 16 | ( uint32_t )Mic[1] << 8 | ( uint32_t )Mic[0] );
+    *mic = ( uint32_t )( ( uint32_t )digest[3] << 24 | ( uint32_t )digest[2] << 16 | ( uint32_t )digest[1] << 8 | ( uint32_t )digest[0] );
 }
 
 void LoRaMacPayloadEncrypt( const uint8_t *buffer, uint16_t size, const uint8_t *key, uint32_t address, uint8_t dir, uint32_t sequenceCounter, uint8_t *encBuffer )
 {
-    uint16_t i;
-    uint8_t bufferIndex = 0;
-    uint16_t ctr = 1;
+    aes_context ctx;
 
-    lgw_memset( AesContext.ksch, '\0', 240 );
-    aes_set_key( key, 16, &AesContext );
-
-    aBlock[5] = dir;
+    LoRaMacKeySchedule( key, &ctx );
+    LoRaMacPayloadEncryptKeyed( buffer, size, &ctx, address, dir, sequenceCounter, encBuffer );
+}
 
-    aBlock[6] = ( address ) & 0xFF;
-    aBlock[7] = ( address >> 8 ) & 0xFF;
-    aBlock[8] = ( address >> 16 ) & 0xFF;
-    aBlock[9] = ( address >> 24 ) & 0xFF;
+void LoRaMacPayloadEncryptKeyed( const uint8_t *buffer, uint16_t size, const aes_context *key, uint32_t address, uint8_t dir, uint32_t sequenceCounter, uint8_t *encBuffer )
+{
+    uint16_t i;
+    uint16_t bufferIndex = 0;
+    uint16_t ctr = 1;
+    uint8_t a[16] = { 0x01 };
+    uint8_t s[16];
 
-    aBlock[10] = ( sequenceCounter ) & 0xFF;
-    aBlock[11] = ( sequenceCounter >> 8 ) & 0xFF;
-    aBlock[12] = ( sequenceCounter >> 16 ) & 0xFF;
-    aBlock[13] = ( sequenceCounter >> 24 ) & 0xFF;
+    a[5] = dir;
 
-    /*!> FOR DEBUG 
-    printf("\naBlock:");
-    for (i = 0; i < 16; i++) {
-        printf("%02X", aBlock[i]);
-    }
-    printf("\n+++++++++++++++++++++++++++++++++++++++\n");
+    a[6] = ( address ) & 0xFF;
+    a[7] = ( address >> 8 ) & 0xFF;
+    a[8] = ( address >> 16 ) & 0xFF;
+    a[9] = ( address >> 24 ) & 0xFF;
 
-    printf("\nSKEY:");
-    for (i = 0; i < 16; i++) {
-        printf("%02X", key[i]);
-    }
-    printf("\n+++++++++++++++++++++++++++++++++++++++\n");
-    */
+    a[10] = ( sequenceCounter ) & 0xFF;
+    a[11] = ( sequenceCounter >> 8 ) & 0xFF;
+    a[12] = ( sequenceCounter >> 16 ) & 0xFF;
+    a[13] = ( sequenceCounter >> 24 ) & 0xFF;
 
     while( size >= 16 )
     {
-        aBlock[15] = ( ( ctr ) & 0xFF );
+        a[15] = ( ( ctr ) & 0xFF );
         ctr++;
-        aes_encrypt( aBlock, sBlock, &AesContext );
+        aes_encrypt( a, s, key );
         for( i = 0; i < 16; i++ )
         {
-            encBuffer[bufferIndex + i] = buffer[bufferIndex + i] ^ sBlock[i];
+            encBuffer[bufferIndex + i] = buffer[bufferIndex + i] ^ s[i];
         }
         size -= 16;
         bufferIndex += 16;
@@ -143,18 +141,11 @@ void LoRaMacPayloadEncrypt( const uint8_t *buffer, uint16_t size, const uint8_t
 
     if( size > 0 )
     {
-        aBlock[15] = ( ( ctr ) & 0xFF );
-        aes_encrypt( aBlock, sBlock, &AesContext );
-        /*!>
-        printf("\nsBlock:");
-        for (i = 0; i < 16; i++) {
-            printf("%02X", sBlock[i]);
-        }
-        printf("\n+++++++++++++++++++++++++++++++++++++++\n");
-        */
+        a[15] = ( ( ctr ) & 0xFF );
+        aes_encrypt( a, s, key );
         for( i = 0; i < size; i++ )
         {
-            encBuffer[bufferIndex + i] = buffer[bufferIndex + i] ^ sBlock[i];
+            encBuffer[bufferIndex + i] = buffer[bufferIndex + i] ^ s[i];
         }
     }
 }
@@ -164,6 +155,11 @@ void LoRaMacPayloadDecrypt( const uint8_t *buffer, uint16_t size, const uint8_t
     LoRaMacPayloadEncrypt( buffer, size, key, address, dir, sequenceCounter, decBuffer );
 }
 
+void LoRaMacPayloadDecryptKeyed( const uint8_t *buffer, uint16_t size, const aes_context *key, uint32_t address, uint8_t dir, uint32_t sequenceCounter, uint8_t *decBuffer )
+{
+    LoRaMacPayloadEncryptKeyed( buffer, size, key, address, dir, sequenceCounter, decBuffer );
+}
+
 void LoRaMacJoinComputeMic( const uint8_t *buffer, uint16_t size, const uint8_t *key, uint32_t *mic )
 {
     AES_CMAC_Init( AesCmacCtx );
@@ -82,6 +82,92 @@ LoRaMacParserStatus_t LoRaMacParserData( LoRaMacMessageData_t* macMsg )
     return LORAMAC_PARSER_SUCCESS;
 }
 
+static uint64_t mac_eui(const uint8_t* buf) {
+    uint64_t eui = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)    /*!> little endian on air */
+        eui = (eui << 8) | buf[i];
+    return eui;
+}
+
+void mac_meta_parse(mac_meta_s* meta, const uint8_t* payload, uint16_t size)
+{
+    uint16_t bufItr;
+
+    memset(meta, 0, sizeof(*meta));
+
+    if (payload == NULL || size < 13)
+        return;
+
+    meta->mtype = payload[0] >> 5;
+
+    switch (meta->mtype) {
+        case FRAME_TYPE_JOIN_ACCEPT:
+            meta->valid = true;
+            return;
+        case FRAME_TYPE_JOIN_REQ:
+            if (size < 17)
+                return;
+            meta->joineui = mac_eui(&payload[1]);
+            meta->deveui = mac_eui(&payload[9]);
+            meta->valid = true;
+            return;
+        default:
+            break;
+    }
+
+    meta->devaddr = payload[1] | ((uint32_t)payload[2] << 8) | ((uint32_t)payload[3] << 16) | ((uint32_t)payload[4] << 24);
+    meta->fctrl = payload[5];
+    meta->fopts_len = meta->fctrl & 0x0F;
+    meta->fcnt = payload[6] | (payload[7] << 8);
+    bufItr = 8 + meta->fopts_len;
+
+    if (size > bufItr + LORAMAC_MIC_FIELD_SIZE) {
+        meta->fport = payload[bufItr++];
+        meta->frm_size = size - bufItr - LORAMAC_MIC_FIELD_SIZE;
+    }
+
+    bufItr = size - LORAMAC_MIC_FIELD_SIZE;
+    meta->mic = payload[bufItr] | ((uint32_t)payload[bufItr + 1] << 8) | ((uint32_t)payload[bufItr + 2] << 16) | ((uint32_t)payload[bufItr + 3] << 24);
+    meta->valid = true;
+}
+
+bool mac_meta_msg(const mac_meta_s* meta, uint8_t* payload, uint16_t size, LoRaMacMessageData_t* macMsg)
+{
+    memset(macMsg, 0, sizeof(*macMsg));
+    macMsg->Buffer = payload;
+
+    if (!meta->valid)
+        return false;
+
+    macMsg->BufSize = size;
+    macMsg->MHDR.Value = payload[0];
+
+    switch (meta->mtype) {
+        case FRAME_TYPE_JOIN_ACCEPT:
+            return true;
+        case FRAME_TYPE_JOIN_REQ:
+            snprintf((char*)macMsg->AppEUI, sizeof(macMsg->AppEUI), "%016llX", (unsigned long long)meta->joineui);
+            snprintf((char*)macMsg->DevEUI, sizeof(macMsg->DevEUI), "%016llX", (unsigned long long)meta->deveui);
+            return true;
+        default:
+            break;
+    }
+
+    macMsg->FHDR.DevAddr = meta->devaddr;
+    macMsg->FHDR.FCtrl.Value = meta->fctrl;
+    macMsg->FHDR.FCnt = meta->fcnt;
+    lgw_memcpy(macMsg->FHDR.FOpts, &payload[8], meta->fopts_len);
+    macMsg->FPort = meta->fport;
+    macMsg->FRMPayloadSize = meta->frm_size;
+    if (meta->frm_size > 0)
+        macMsg->FRMPayload = &payload[9 + meta->fopts_len];
+    macMsg->MIC = meta->mic;
+
+    return true;
+}
+
 LoRaMacParserStatus_t LoRaMacParserJoinAccept( LoRaMacMessageJoinAccept_t* macMsg )
 {
     if( ( macMsg == 0 ) || ( macMsg->Buffer == 0 ) )
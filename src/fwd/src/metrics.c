@@ -0,0 +1,394 @@
+/*!>
+ *  ____  ____      _    ____ ___ _   _  ___
+ *  |  _ \|  _ \    / \  / ___|_ _| \ | |/ _ \
+ *  | | | | |_) |  / _ \| |  _ | ||  \| | | | |
+ *  | |_| |  _ <  / ___ \ |_| || || |\  | |_| |
+ *  |____/|_| \_\/_/   \_\____|___|_| \_|\___/
+ *
+ * Dragino_gw_fwd -- An opensource lora gateway forward
+ *
+ * See http://www.dragino.com for more information about
+ * the lora gateway project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ *
+ * Maintainer: skerlan
+ *
+ */
+
+/*!>!
+ * \file
+ * \brief latency histograms and their Prometheus endpoint
+ *
+ * The endpoint is plain HTTP/1.0 on the loopback, one connection at a time:
+ * a scrape every few seconds is all it is meant for.  Every bucket up to
+ * the highest one which counted something is listed, so the le set of a
+ * histogram only grows from one scrape to the next.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "fwd.h"
+#include "stats.h"
+#include "metrics.h"
+#include "loragw_hal.h"
+#include "ghost.h"
+
+DECLARE_GW;
+
+extern volatile bool exit_sig;
+extern volatile bool quit_sig;
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PRIVATE CONSTANTS & TYPES -------------------------------------------- */
+
+#define METRICS_POLL_MS         1000    /*!> exit_sig is checked this often */
+#define METRICS_IO_TIMEOUT_S    2       /*!> a stuck client is dropped after this */
+#define METRICS_OUT_SIZE        1024
+#define METRICS_REQ_SIZE        2048
+#define METRICS_POOLS_MAX       16
+
+typedef struct {
+    uint32_t bucket[METRICS_NB_BUCKET];
+    uint32_t sum_lo;                    /*!> microseconds, modulo 2^32 */
+    uint32_t sum_hi;                    /*!> wraps of sum_lo */
+} metrics_hist_s;
+
+typedef struct {
+    int fd;
+    bool err;
+    size_t len;
+    char buf[METRICS_OUT_SIZE];
+} metrics_out_s;
+
+static const struct {
+    const char *name;
+    const char *help;
+} hist_info[METRICS_NB_HIST] = {
+    [METRICS_RX_DEQUEUE]   = { "rx_dequeue_seconds",   "Fetch of an uplink batch by thread_up to its dequeue by a service" },
+    [METRICS_DEQUEUE_SEND] = { "dequeue_send_seconds", "Dequeue of an uplink batch to the send of its PUSH_DATA" },
+    [METRICS_PUSH_ACK]     = { "push_ack_rtt_seconds", "PUSH_DATA to PUSH_ACK round trip" },
+    [METRICS_PULL_ACK]     = { "pull_ack_rtt_seconds", "PULL_DATA to PULL_ACK round trip" },
+    [METRICS_JIT_LEAD]     = { "jit_lead_seconds",     "Time left before the TX when a downlink enters the JiT queue" },
+    [METRICS_LGW_SEND]     = { "lgw_send_seconds",     "Duration of lgw_send" },
+};
+
+#define CNT(field)  offsetof(stat_cnt_s, field)
+
+static const struct {
+    const char *name;
+    size_t offset;
+} cnt_info[] = {
+    { "rx_received",                CNT(stat_up.meas_nb_rx_rcv) },
+    { "rx_crc_ok",                  CNT(stat_up.meas_nb_rx_ok) },
+    { "rx_crc_bad",                 CNT(stat_up.meas_nb_rx_bad) },
+    { "rx_no_crc",                  CNT(stat_up.meas_nb_rx_nocrc) },
+    { "up_packets_forwarded",       CNT(stat_up.meas_up_pkt_fwd) },
+    { "up_network_bytes",           CNT(stat_up.meas_up_network_byte) },
+    { "up_payload_bytes",           CNT(stat_up.meas_up_payload_byte) },
+    { "up_datagrams_sent",          CNT(stat_up.meas_up_dgram_sent) },
+    { "up_acks_received",           CNT(stat_up.meas_up_ack_rcv) },
+    { "dw_pulls_sent",              CNT(stat_down.meas_dw_pull_sent) },
+    { "dw_acks_received",           CNT(stat_down.meas_dw_ack_rcv) },
+    { "dw_datagrams_received",      CNT(stat_down.meas_dw_dgram_rcv) },
+    { "dw_datagrams_accepted",      CNT(stat_down.meas_dw_dgram_acp) },
+    { "dw_network_bytes",           CNT(stat_down.meas_dw_network_byte) },
+    { "dw_payload_bytes",           CNT(stat_down.meas_dw_payload_byte) },
+    { "tx_requested",               CNT(stat_down.meas_nb_tx_requested) },
+    { "tx_ok",                      CNT(stat_down.meas_nb_tx_ok) },
+    { "tx_rejected_collision_packet", CNT(stat_down.meas_nb_tx_rejected_collision_packet) },
+    { "tx_rejected_collision_beacon", CNT(stat_down.meas_nb_tx_rejected_collision_beacon) },
+    { "tx_rejected_too_late",       CNT(stat_down.meas_nb_tx_rejected_too_late) },
+    { "tx_rejected_too_early",      CNT(stat_down.meas_nb_tx_rejected_too_early) },
+    { "beacons_queued",             CNT(meas_nb_beacon_queued) },
+    { "beacons_rejected",           CNT(meas_nb_beacon_rejected) },
+};
+
+static metrics_hist_s metrics_hist[METRICS_NB_HIST];
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PRIVATE FUNCTIONS ---------------------------------------------------- */
+
+static int bucket_index(uint32_t us) {
+    int e;
+
+    if (us < (1U << METRICS_SUB_BITS))
+        return us;
+    e = 31 - __builtin_clz(us);
+    return ((e - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) + ((us >> (e - METRICS_SUB_BITS)) & ((1U << METRICS_SUB_BITS) - 1));
+}
+
+/*!> largest value counted in bucket i */
+static uint32_t bucket_upper(int i) {
+    int e, sub;
+
+    if (i < (1 << METRICS_SUB_BITS))
+        return i;
+    e = (i >> METRICS_SUB_BITS) + METRICS_SUB_BITS - 1;
+    sub = i & ((1 << METRICS_SUB_BITS) - 1);
+    return (((uint32_t)((1 << METRICS_SUB_BITS) + sub) << (e - METRICS_SUB_BITS)) - 1) + (1U << (e - METRICS_SUB_BITS));
+}
+
+static void out_flush(metrics_out_s *out) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (!out->err && done < out->len) {
+        n = send(out->fd, out->buf + done, out->len - done, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            out->err = true;
+        } else {
+            done += n;
+        }
+    }
+    out->len = 0;
+}
+
+static void out_printf(metrics_out_s *out, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    if (out->err)
+        return;
+
+    va_start(ap, fmt);
+    n = vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0 || (size_t)n >= sizeof(out->buf) - out->len) {
+        /*!> did not fit, flush and write it again, a single line is always shorter than buf */
+        out_flush(out);
+        va_start(ap, fmt);
+        n = vsnprintf(out->buf, sizeof(out->buf), fmt, ap);
+        va_end(ap);
+        if (n < 0 || (size_t)n >= sizeof(out->buf)) {
+            out->err = true;
+            return;
+        }
+    }
+    out->len += n;
+}
+
+static void out_seconds(metrics_out_s *out, uint64_t us) {
+    out_printf(out, "%llu.%06u", (unsigned long long)(us / 1000000), (unsigned)(us % 1000000));
+}
+
+static void write_hist(metrics_out_s *out, metrics_hist_e h) {
+    metrics_hist_s *hist = &metrics_hist[h];
+    uint32_t n[METRICS_NB_BUCKET], count = 0;
+    uint32_t lo, hi;
+    int i, top = -1;
+
+    out_printf(out, "# HELP dragino_fwd_%s %s.\n# TYPE dragino_fwd_%s histogram\n", hist_info[h].name, hist_info[h].help, hist_info[h].name);
+
+    /*!> buckets are never cleared, the highest one hit so far is the highest non-empty one */
+    for (i = 0; i < METRICS_NB_BUCKET; i++) {
+        n[i] = __atomic_load_n(&hist->bucket[i], __ATOMIC_RELAXED);
+        if (n[i] != 0)
+            top = i;
+    }
+
+    for (i = 0; i <= top; i++) {
+        count += n[i];
+        out_printf(out, "dragino_fwd_%s_bucket{le=\"", hist_info[h].name);
+        out_seconds(out, bucket_upper(i));
+        out_printf(out, "\"} %u\n", count);
+    }
+    out_printf(out, "dragino_fwd_%s_bucket{le=\"+Inf\"} %u\n", hist_info[h].name, count);
+
+    do {
+        hi = __atomic_load_n(&hist->sum_hi, __ATOMIC_ACQUIRE);
+        lo = __atomic_load_n(&hist->sum_lo, __ATOMIC_RELAXED);
+    } while (hi != __atomic_load_n(&hist->sum_hi, __ATOMIC_ACQUIRE));
+
+    out_printf(out, "dragino_fwd_%s_sum ", hist_info[h].name);
+    out_seconds(out, ((uint64_t)hi << 32) | lo);
+    out_printf(out, "\ndragino_fwd_%s_count %u\n", hist_info[h].name, count);
+}
+
+static void write_counters(metrics_out_s *out) {
+    serv_s *serv_entry = NULL;
+    stat_cnt_s *sums = NULL;
+    stat_dw_s gw_dw;
+    uint32_t nb_rx, nb_drop, nb_beacon_sent;
+    int nb_serv = 0, n;
+    size_t i;
+
+    /*!> one snapshot per service, every row of a service comes from the same one */
+    LGW_LIST_TRAVERSE(&GW.serv_list, serv_entry, list) {
+        nb_serv++;
+    }
+    if (nb_serv > 0 && (sums = lgw_malloc(nb_serv * sizeof(stat_cnt_s))) != NULL) {
+        n = 0;
+        LGW_LIST_TRAVERSE(&GW.serv_list, serv_entry, list) {
+            if (n < nb_serv && serv_entry->report != NULL)
+                stat_sum(serv_entry->report, &sums[n]);
+            n++;
+        }
+
+        for (i = 0; i < sizeof(cnt_info) / sizeof(cnt_info[0]); i++) {
+            out_printf(out, "# TYPE dragino_fwd_%s_total counter\n", cnt_info[i].name);
+            n = 0;
+            LGW_LIST_TRAVERSE(&GW.serv_list, serv_entry, list) {
+                if (n < nb_serv && serv_entry->report != NULL)
+                    out_printf(out, "dragino_fwd_%s_total{service=\"%s\"} %u\n", cnt_info[i].name, serv_entry->info.name, *(uint32_t *)((uint8_t *)&sums[n] + cnt_info[i].offset));
+                n++;
+            }
+        }
+        lgw_free(sums);
+    }
+
+    out_printf(out, "# HELP dragino_fwd_rx_ring_overrun_total Uplink batches a lapped service lost.\n# TYPE dragino_fwd_rx_ring_overrun_total counter\n");
+    LGW_LIST_TRAVERSE(&GW.serv_list, serv_entry, list) {
+        out_printf(out, "dragino_fwd_rx_ring_overrun_total{service=\"%s\"} %u\n", serv_entry->info.name, __atomic_load_n(&serv_entry->rxbus.overrun, __ATOMIC_RELAXED));
+    }
+
+    pthread_mutex_lock(&GW.log.mx_report);
+    gw_dw = GW.log.stat_dw;
+    nb_beacon_sent = GW.beacon.meas_nb_beacon_sent;
+    pthread_mutex_unlock(&GW.log.mx_report);
+
+    out_printf(out, "# HELP dragino_fwd_jit_tx_total Downlinks handed to lgw_send by the JiT thread.\n# TYPE dragino_fwd_jit_tx_total counter\n");
+    out_printf(out, "dragino_fwd_jit_tx_total{result=\"ok\"} %u\n", gw_dw.meas_nb_tx_ok);
+    out_printf(out, "dragino_fwd_jit_tx_total{result=\"fail\"} %u\n", gw_dw.meas_nb_tx_fail);
+
+    out_printf(out, "# HELP dragino_fwd_beacons_sent_total Beacons handed to lgw_send by the JiT thread.\n# TYPE dragino_fwd_beacons_sent_total counter\n");
+    out_printf(out, "dragino_fwd_beacons_sent_total %u\n", nb_beacon_sent);
+
+    if (GW.cfg.ghoststream_enabled) {
+        ghost_counters(&nb_rx, &nb_drop);
+        out_printf(out, "# HELP dragino_fwd_ghost_packets_total Ghost node datagrams received, and dropped because thread_up lagged.\n# TYPE dragino_fwd_ghost_packets_total counter\n");
+        out_printf(out, "dragino_fwd_ghost_packets_total{result=\"received\"} %u\n", nb_rx);
+        out_printf(out, "dragino_fwd_ghost_packets_total{result=\"dropped\"} %u\n", nb_drop);
+    }
+}
+
+static void write_pools(metrics_out_s *out) {
+    lgw_slab_stat_s stat[METRICS_POOLS_MAX];
+    int i, nb;
+
+    nb = lgw_slab_stats(stat, METRICS_POOLS_MAX);
+
+    out_printf(out, "# HELP dragino_fwd_pool_objects Objects of the fixed size pools: carved, in use, and most in use at once.\n# TYPE dragino_fwd_pool_objects gauge\n");
+    for (i = 0; i < nb; i++) {
+        out_printf(out, "dragino_fwd_pool_objects{pool=\"%s\",state=\"total\"} %u\n", stat[i].name, stat[i].nb_total);
+        out_printf(out, "dragino_fwd_pool_objects{pool=\"%s\",state=\"used\"} %u\n", stat[i].name, stat[i].nb_used);
+        out_printf(out, "dragino_fwd_pool_objects{pool=\"%s\",state=\"used_max\"} %u\n", stat[i].name, stat[i].nb_used_max);
+    }
+}
+
+static void metrics_serve(int fd) {
+    struct timeval tv = { METRICS_IO_TIMEOUT_S, 0 };
+    char req[METRICS_REQ_SIZE];
+    metrics_out_s out;
+    size_t len = 0;
+    ssize_t n;
+    int h;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    /*!> the request is not looked at, only read to its end so that closing does not reset it */
+    while (len < sizeof(req) - 1) {
+        n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+        if (n <= 0)
+            break;
+        len += n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL)
+            break;
+    }
+
+    out.fd = fd;
+    out.err = false;
+    out.len = 0;
+
+    out_printf(&out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+    for (h = 0; h < METRICS_NB_HIST; h++)
+        write_hist(&out, h);
+    write_counters(&out);
+    write_pools(&out);
+    out_flush(&out);
+}
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PUBLIC FUNCTIONS ----------------------------------------------------- */
+
+void metrics_observe(metrics_hist_e h, uint32_t us) {
+    metrics_hist_s *hist = &metrics_hist[h];
+
+    __atomic_fetch_add(&hist->bucket[bucket_index(us)], 1, __ATOMIC_RELAXED);
+    /*!> 64 bits atomics are not native on the MIPS32 gateways, carry by hand */
+    if (__atomic_fetch_add(&hist->sum_lo, us, __ATOMIC_RELAXED) > UINT32_MAX - us)
+        __atomic_fetch_add(&hist->sum_hi, 1, __ATOMIC_RELEASE);
+}
+
+void metrics_observe_ts(metrics_hist_e h, const struct timespec *start, const struct timespec *end) {
+    int64_t us;
+
+    us = (int64_t)(end->tv_sec - start->tv_sec) * 1000000 + (end->tv_nsec - start->tv_nsec) / 1000;
+    if (us < 0)
+        return;
+    metrics_observe(h, us > UINT32_MAX ? UINT32_MAX : (uint32_t)us);
+}
+
+void thread_metrics(void) {
+    struct sockaddr_in addr;
+    struct pollfd pfd;
+    int sock, fd, opt = 1;
+
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        lgw_log(LOG_ERROR, "%s[METRICS] socket: %s\n", ERRMSG, strerror(errno));
+        return;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(GW.cfg.metrics_port);
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, 4) == -1) {
+        lgw_log(LOG_ERROR, "%s[METRICS] can't listen on 127.0.0.1:%u: %s\n", ERRMSG, GW.cfg.metrics_port, strerror(errno));
+        close(sock);
+        return;
+    }
+
+    lgw_log(LOG_INFO, "%s[THREAD][METRICS] serving on 127.0.0.1:%u\n", INFOMSG, GW.cfg.metrics_port);
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+
+    while (!exit_sig && !quit_sig) {
+        if (poll(&pfd, 1, METRICS_POLL_MS) <= 0)
+            continue;
+        fd = accept(sock, NULL, NULL);
+        if (fd == -1)
+            continue;
+        metrics_serve(fd);
+        close(fd);
+    }
+
+    close(sock);
+    lgw_log(LOG_INFO, "%s[THREAD][METRICS] Ended!\n", INFOMSG);
+}
+
+/*!> --- EOF ------------------------------------------------------------------ */
@@ -71,7 +71,7 @@ static void mqtt_dnlink_cb(struct MessageData *data, void* s) {
 }
 
 void dnlink_handler(MessageData* data) {
-    lgw_log(LOG_INFO, "[INFO~]mqtt suscribe %d bytes message: %s/%s\n", data->message->payloadlen, (char*)data->topicName, (char*)data->message->payload);
+    lgw_log(LOG_INFO, "[INFO~]mqtt suscribe %d bytes message: %s/%s\n", (int)data->message->payloadlen, (char*)data->topicName, (char*)data->message->payload);
 }
 
 static int mqtt_connect(serv_s *serv) {
@@ -200,9 +200,7 @@ int mqtt_start(serv_s* serv) {
         return -1;
     }
 
-    LGW_LIST_LOCK(&GW.rxpkts_list);
-    GW.info.service_count++;
-    LGW_LIST_UNLOCK(&GW.rxpkts_list);
+    rxpkt_attach(serv);
     lgw_db_put("service/mqtt", serv->info.name, "running");
     lgw_db_put("thread", serv->info.name, "running");
 
@@ -219,9 +217,7 @@ void mqtt_stop(serv_s* serv) {
     mqtt_cleanup((mqttsession_s*)serv->net->mqtt->session);
     serv->state.connecting = false;
     serv->state.live = false;
-    LGW_LIST_LOCK(&GW.rxpkts_list);
-    GW.info.service_count--;
-    LGW_LIST_UNLOCK(&GW.rxpkts_list);
+    rxpkt_detach(serv);
     snprintf(family, sizeof(family), "service/mqtt/%s", serv->info.name);
     lgw_db_del(family, "network");
     lgw_db_del("service/mqtt", serv->info.name);
@@ -247,13 +243,14 @@ static void mqtt_push_up(void* arg) {
     while (!serv->thread.stop_sig) {
         // wait for data to arrive
         sem_wait(&serv->thread.sema);
-        serv_ct_s *serv_ct = lgw_malloc(sizeof(serv_ct_s));
-        serv_ct->serv = serv;
+        serv_ct_s *serv_ct = serv_ct_new(serv);
+        if (serv_ct == NULL)
+            continue;
 
         nb_pkt = serv_ct->nb_pkt = get_rxpkt(serv_ct);     //only get the first rxpkt of list
 
         if (nb_pkt == 0) {
-            lgw_free(serv_ct);
+            serv_ct_free(serv_ct);
             continue;
         }
 
@@ -289,7 +286,7 @@ static void mqtt_push_up(void* arg) {
                 lgw_log(LOG_INFO, "[INFO~][%s] send data to mqtt server succeed.\n", serv->info.name);
             }
         }
-        lgw_free(serv_ct);
+        serv_ct_free(serv_ct);
     }
 
     lgw_log(LOG_INFO, "[INFO~][%s] END of mqtt_push_up thread...\n", serv->info.name);
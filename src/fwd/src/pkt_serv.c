@@ -29,6 +29,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
+#include <errno.h>
+#include <poll.h>
 
 #include <semaphore.h>
 #include <time.h>
@@ -36,6 +38,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/inotify.h>
 
 #include "db.h"
 #include "fwd.h"
@@ -82,13 +85,335 @@ static uint32_t rx2freq;
  * Each thread now uses local variables to avoid data races between RX and downlink threads
  */
 
-LGW_LIST_HEAD_STATIC(dn_list, _dn_pkt); // downlink for customer
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- CUSTOM DOWNLINK QUEUE ------------------------------------------------- */
+
+/*!>!
+ * Downlinks read from DNPATH wait here for an uplink of their device, in
+ * the order their files were written.  Devices hash by binary devaddr, so
+ * the lookup done for every uplink costs the same however many are pending.
+ */
+
+#define DNQ_HASH_SIZE       64
+#define DNQ_DEV_MAX         8       /*!> pending per device, the oldest is dropped for a new one, the newest for one put back */
+#define DNQ_MAX             128     /*!> pending overall, new files are dropped above */
+#define DN_EVENT_BUF_SIZE   4096
+
+typedef struct _dnq {
+    struct _dnq *next;
+    uint32_t devaddr;
+    int size;
+    dn_pkt_s *first;
+    dn_pkt_s *last;
+} dnq_s;
+
+static pthread_mutex_t mx_dnq = PTHREAD_MUTEX_INITIALIZER;
+static dnq_s *dnq_hash[DNQ_HASH_SIZE];
+static int dnq_count = 0;
+
+/*!> custom and relayed downlinks, one per file or relay packet */
+static lgw_slab_s dn_pkt_slab = LGW_SLAB_INIT("dn_pkt", sizeof(dn_pkt_s), 8);
+
+static void dn_pkt_free(dn_pkt_s *entry) {
+    if (entry->fopt)
+        lgw_free(entry->fopt);
+    lgw_slab_free(&dn_pkt_slab, entry);
+}
+
+/*!>! \note mx_dnq is assumed to be held */
+static dnq_s **dnq_find(uint32_t devaddr) {
+    dnq_s **q;
+
+    for (q = &dnq_hash[devaddr % DNQ_HASH_SIZE]; *q != NULL; q = &(*q)->next) {
+        if ((*q)->devaddr == devaddr)
+            break;
+    }
+    return q;
+}
+
+/*!>!
+ * \brief queue a downlink for devaddr
+ * \param front put it back at the head, it was popped and could not be sent
+ * \retval false queue full, entry is left to the caller
+ */
+static bool dnq_push(uint32_t devaddr, dn_pkt_s *entry, bool front) {
+    dnq_s **slot, *q;
+    dn_pkt_s *drop = NULL, *prev;
+
+    pthread_mutex_lock(&mx_dnq);
+    if (!front && dnq_count >= DNQ_MAX) {
+        pthread_mutex_unlock(&mx_dnq);
+        return false;
+    }
+
+    slot = dnq_find(devaddr);
+    if ((q = *slot) == NULL) {
+        q = lgw_malloc(sizeof(dnq_s));
+        if (q == NULL) {
+            pthread_mutex_unlock(&mx_dnq);
+            return false;
+        }
+        q->devaddr = devaddr;
+        *slot = q;
+    }
+
+    if (front) {
+        entry->list.next = q->first;
+        q->first = entry;
+        if (q->last == NULL)
+            q->last = entry;
+    } else {
+        entry->list.next = NULL;
+        if (q->last != NULL)
+            q->last->list.next = entry;
+        else
+            q->first = entry;
+        q->last = entry;
+    }
+    q->size++;
+    dnq_count++;
+
+    if (q->size > DNQ_DEV_MAX || (front && dnq_count > DNQ_MAX && q->size > 1)) {
+        if (front) {
+            /*!> the entry put back goes out first, the newest one makes room */
+            for (prev = q->first; prev->list.next != q->last; prev = prev->list.next)
+                ;
+            drop = q->last;
+            prev->list.next = NULL;
+            q->last = prev;
+        } else {
+            drop = q->first;
+            q->first = drop->list.next;
+        }
+        q->size--;
+        dnq_count--;
+    }
+    pthread_mutex_unlock(&mx_dnq);
+
+    if (drop != NULL) {
+        lgw_log(LOG_INFO, "%s[DNLK]Too many downlinks pending for %08X, %s dropped\n", INFOMSG, devaddr, front ? "newest" : "oldest");
+        dn_pkt_free(drop);
+    }
+
+    return true;
+}
+
+/*!>!
+ * \brief oldest downlink pending for devaddr, NULL when none
+ */
+static dn_pkt_s *dnq_pop(uint32_t devaddr) {
+    dnq_s **slot, *q;
+    dn_pkt_s *entry = NULL;
+
+    pthread_mutex_lock(&mx_dnq);
+    slot = dnq_find(devaddr);
+    if ((q = *slot) != NULL) {
+        entry = q->first;
+        q->first = entry->list.next;
+        q->size--;
+        dnq_count--;
+        if (q->first == NULL) {
+            *slot = q->next;
+            lgw_free(q);
+        }
+    }
+    pthread_mutex_unlock(&mx_dnq);
+
+    return entry;
+}
 
 static int pthread_pkt_count = 0;
 pthread_mutex_t  mx_pthread_pkt_count = PTHREAD_MUTEX_INITIALIZER;
+static serv_ct_s* pkt_ct_done = NULL;     /*!> contexts of the ended decode threads, under mx_pthread_pkt_count */
 
 static uint32_t current_concentrator_time;
 
+/*!> -------------------------------------------------------------------------- */
+/*!> --- DEVICE SESSION CACHE ------------------------------------------------- */
+
+/*!>!
+ * ABP session keys by devaddr, parsed and expanded once. Devaddr without
+ * keys in the db are cached too, so foreign devices cost no SQL either.
+ * The whole cache is dropped when the /devinfo tree changes.
+ */
+
+#define DEVSESS_HASH_SIZE   256
+#define DEVSESS_MAX         4096
+
+typedef struct _devsess {
+    struct _devsess *next;
+    bool valid;                 /*!> false: no session keys for this devaddr */
+    devinfo_s info;
+} devsess_s;
+
+static pthread_rwlock_t rw_devsess = PTHREAD_RWLOCK_INITIALIZER;
+static devsess_s *devsess_hash[DEVSESS_HASH_SIZE];
+static int devsess_count = 0;
+static unsigned devsess_gen = 0;     /*!> generation of /devinfo the cache holds */
+
+/*!>! \note rw_devsess is assumed to be write locked */
+static void devsess_flush(void) {
+    devsess_s *entry;
+    int i;
+
+    for (i = 0; i < DEVSESS_HASH_SIZE; i++) {
+        while ((entry = devsess_hash[i]) != NULL) {
+            devsess_hash[i] = entry->next;
+            lgw_free(entry);
+        }
+    }
+    devsess_count = 0;
+}
+
+/*!>! \note rw_devsess is assumed to be held */
+static devsess_s *devsess_find(uint32_t devaddr) {
+    devsess_s *entry;
+
+    for (entry = devsess_hash[devaddr % DEVSESS_HASH_SIZE]; entry; entry = entry->next) {
+        if (entry->info.devaddr == devaddr)
+            return entry;
+    }
+    return NULL;
+}
+
+static void devsess_load(devsess_s *entry, uint32_t devaddr) {
+    char db_family[32];
+    char tmpstr[16];
+
+    entry->info.devaddr = devaddr;
+    snprintf(db_family, sizeof(db_family), "devinfo/%08X", devaddr);
+    if ((lgw_db_get(db_family, "appskey", entry->info.appskey_str, sizeof(entry->info.appskey_str)) == -1) || 
+        (lgw_db_get(db_family, "nwkskey", entry->info.nwkskey_str, sizeof(entry->info.nwkskey_str)) == -1)) {
+        entry->valid = false;
+        return;
+    }
+
+    str2hex(entry->info.appskey, entry->info.appskey_str, sizeof(entry->info.appskey));
+    str2hex(entry->info.nwkskey, entry->info.nwkskey_str, sizeof(entry->info.nwkskey));
+    LoRaMacKeySchedule(entry->info.appskey, &entry->info.appskey_ctx);
+    LoRaMacKeySchedule(entry->info.nwkskey, &entry->info.nwkskey_ctx);
+    entry->valid = true;
+
+    snprintf(db_family, sizeof(db_family), "uplink/%08X", devaddr);
+    if (lgw_db_get(db_family, "fcnt", tmpstr, sizeof(tmpstr)) != -1) {
+        entry->info.fcntup = strtoul(tmpstr, NULL, 10);
+        entry->info.fcntup_valid = true;
+    }
+}
+
+/*!>!
+ * \brief session keys of devaddr
+ * \retval false no session keys for this device
+ */
+static bool devsess_get(uint32_t devaddr, devinfo_s *devinfo) {
+    unsigned gen = lgw_db_generation(LGW_DB_TREE_DEVINFO);
+    devsess_s *entry, *fresh;
+    bool valid = false;
+
+    pthread_rwlock_rdlock(&rw_devsess);
+    if (gen == devsess_gen && (entry = devsess_find(devaddr)) != NULL) {
+        valid = entry->valid;
+        if (valid)
+            *devinfo = entry->info;
+        pthread_rwlock_unlock(&rw_devsess);
+        return valid;
+    }
+    pthread_rwlock_unlock(&rw_devsess);
+
+    /*!> miss, read the db without holding the cache */
+    fresh = lgw_malloc(sizeof(devsess_s));
+    if (fresh == NULL)
+        return false;
+    devsess_load(fresh, devaddr);
+    valid = fresh->valid;
+    if (valid)
+        *devinfo = fresh->info;
+
+    pthread_rwlock_wrlock(&rw_devsess);
+    if (gen > devsess_gen) {
+        devsess_flush();
+        devsess_gen = gen;
+    }
+    if (gen < devsess_gen || devsess_find(devaddr) != NULL) {
+        lgw_free(fresh);    /*!> loaded from an older tree, or raced by another thread */
+    } else {
+        if (devsess_count >= DEVSESS_MAX)
+            devsess_flush();
+        fresh->next = devsess_hash[devaddr % DEVSESS_HASH_SIZE];
+        devsess_hash[devaddr % DEVSESS_HASH_SIZE] = fresh;
+        devsess_count++;
+    }
+    pthread_rwlock_unlock(&rw_devsess);
+
+    return valid;
+}
+
+/*!>!
+ * \brief remember the full uplink counter confirmed by a MIC
+ *
+ * The counter is written to the db only when its upper 16 bits move, that
+ * is once per rollover, so a reloaded cache entry starts close enough.
+ */
+static void devsess_fcnt_update(uint32_t devaddr, uint32_t fcnt) {
+    devsess_s *entry;
+    bool persist = false;
+    char db_family[32];
+    char tmpstr[16];
+
+    pthread_rwlock_wrlock(&rw_devsess);
+    entry = devsess_find(devaddr);
+    if (entry != NULL && entry->valid) {
+        persist = !entry->info.fcntup_valid || (entry->info.fcntup >> 16) != (fcnt >> 16);
+        entry->info.fcntup = fcnt;
+        entry->info.fcntup_valid = true;
+    }
+    pthread_rwlock_unlock(&rw_devsess);
+
+    if (persist) {
+        snprintf(db_family, sizeof(db_family), "uplink/%08X", devaddr);
+        snprintf(tmpstr, sizeof(tmpstr), "%u", fcnt);
+        lgw_db_put(db_family, "fcnt", tmpstr);
+    }
+}
+
+/*!>!
+ * \brief find the 32 bits counter of an uplink from its 16 bits FCnt
+ *
+ * The counter following the last confirmed one is tried first, the search
+ * over the fcnt_gap upper values only runs when that MIC does not match
+ * (first frame, device reset or lost frames across a rollover).
+ *
+ * \retval false no counter within fcnt_gap gives a valid MIC
+ */
+static bool fcnt_resolve(devinfo_s* devinfo, LoRaMacMessageData_t* macmsg, uint32_t* fcnt) {
+    uint32_t mic, guess = 0;
+    int j;
+
+    if (devinfo->fcntup_valid) {
+        guess = (devinfo->fcntup & 0xFFFF0000) | macmsg->FHDR.FCnt;
+        if (guess < devinfo->fcntup)
+            guess += 0x10000;
+        /* msglen = p-size - len(MIC) */
+        LoRaMacComputeMicKeyed(macmsg->Buffer, macmsg->BufSize - 4, &devinfo->nwkskey_ctx, devinfo->devaddr, UP, guess, &mic);
+        if (mic == macmsg->MIC) {
+            *fcnt = guess;
+            return true;
+        }
+    }
+
+    for (j = 0; j < GW.cfg.fcnt_gap; j++) {   
+        *fcnt = macmsg->FHDR.FCnt | (j * 0x10000);
+        if (devinfo->fcntup_valid && *fcnt == guess)
+            continue;
+        LoRaMacComputeMicKeyed(macmsg->Buffer, macmsg->BufSize - 4, &devinfo->nwkskey_ctx, devinfo->devaddr, UP, *fcnt, &mic);
+        if (mic == macmsg->MIC)
+            return true;
+    }
+
+    return false;
+}
+
 static void pkt_prepare_downlink(void* arg);
 static void pkt_deal_up(void* arg);
 static void thread_pkt_deal_up(void* arg);
@@ -183,13 +508,7 @@ static enum jit_error_e custom_rx2dn(dn_pkt_s* dnelem, devinfo_s *devinfo, uint3
         txpkt.size = dnelem->psize;
     }
 
-#ifdef SX1302MOD
-    pthread_mutex_lock(&GW.hal.mx_concent);
-    lgw_get_instcnt(&current_concentrator_time);
-    pthread_mutex_unlock(&GW.hal.mx_concent);
-#else
     get_concentrator_time(&current_concentrator_time);
-#endif
     jit_result = jit_enqueue(&GW.tx.jit_queue[txpkt.rf_chain], current_concentrator_time, &txpkt, downlink_type);
     lgw_log(LOG_DEBUG, "%s[DNLK] DNRX2-> tmst=%u, freq=%u, size=%u, BW%uSF%u, ipol=%s\n", DEBUGMSG, txpkt.count_us, txpkt.freq_hz, txpkt.size, txpkt.bandwidth, txpkt.datarate, txpkt.invert_pol ? "true" : "false");
     lgw_log(LOG_DEBUG, "%s[DNLK][PAYLOAD]####################################################\n", DEBUGMSG);
@@ -203,7 +522,6 @@ static enum jit_error_e custom_rx2dn(dn_pkt_s* dnelem, devinfo_s *devinfo, uint3
 static void prepare_frame(dn_pkt_s* dnelem, devinfo_s* devinfo, uint32_t downcnt, uint8_t* frame, int* frame_size) {
 	uint32_t mic;
 	uint8_t index = 0;
-	uint8_t* encrypt_payload;
 
 	LoRaMacHeader_t hdr;
 	LoRaMacFrameCtrl_t fctrl;
@@ -248,15 +566,12 @@ static void prepare_frame(dn_pkt_s* dnelem, devinfo_s* devinfo, uint32_t downcnt
 	frame[++index] = dnelem->txport&0xFF;
 
 	/*!>encrypt the payload*/
-	encrypt_payload = lgw_malloc(sizeof(uint8_t) * dnelem->psize);
-	LoRaMacPayloadEncrypt(dnelem->payload, dnelem->psize, (dnelem->txport == 0) ? devinfo->nwkskey : devinfo->appskey, devinfo->devaddr, DOWN, downcnt, encrypt_payload);
 	++index;
-	memcpy(frame + index, encrypt_payload, dnelem->psize);
-	lgw_free(encrypt_payload);
+	LoRaMacPayloadEncryptKeyed(dnelem->payload, dnelem->psize, (dnelem->txport == 0) ? &devinfo->nwkskey_ctx : &devinfo->appskey_ctx, devinfo->devaddr, DOWN, downcnt, frame + index);
 	index += dnelem->psize;
 
 	/*!>calculate the mic*/
-	LoRaMacComputeMic(frame, index, devinfo->nwkskey, devinfo->devaddr, DOWN, downcnt, &mic);
+	LoRaMacComputeMicKeyed(frame, index, &devinfo->nwkskey_ctx, devinfo->devaddr, DOWN, downcnt, &mic);
     //printf("%s[MIC] %08X\n", INFOMSG, mic);
 	frame[index] = mic&0xFF;
 	frame[++index] = (mic>>8)&0xFF;
@@ -265,19 +580,6 @@ static void prepare_frame(dn_pkt_s* dnelem, devinfo_s* devinfo, uint32_t downcnt
 	*frame_size = index + 1;
 }
 
-static inline dn_pkt_s* search_dn_list(const char* addr) {
-    dn_pkt_s* entry = NULL;
-
-    LGW_LIST_LOCK(&dn_list);
-    LGW_LIST_TRAVERSE(&dn_list, entry, list) {
-        if (!strcasecmp(entry->devaddr, addr))
-            break;
-    }
-    LGW_LIST_UNLOCK(&dn_list);
-
-    return entry;
-}
-
 
 int pkt_start(serv_s* serv) {
     if (lgw_pthread_create_background(&serv->thread.t_up, NULL, (void *(*)(void *))pkt_deal_up, serv)) {
@@ -365,9 +667,7 @@ int pkt_start(serv_s* serv) {
         }
     }
 
-    LGW_LIST_LOCK(&GW.rxpkts_list);
-    GW.info.service_count++;
-    LGW_LIST_UNLOCK(&GW.rxpkts_list);
+    rxpkt_attach(serv);
 
     lgw_db_put("service/pkt", serv->info.name, "runing");
     lgw_db_put("thread", serv->info.name, "runing");
@@ -382,9 +682,7 @@ void pkt_stop(serv_s* serv) {
     if (GW.cfg.custom_downlink) {
 	    pthread_join(serv->thread.t_down, NULL);
     }
-    LGW_LIST_LOCK(&GW.rxpkts_list);
-    GW.info.service_count--;
-    LGW_LIST_UNLOCK(&GW.rxpkts_list);
+    rxpkt_detach(serv);
     lgw_db_del("service/pkt", serv->info.name);
     lgw_db_del("thread", serv->info.name);
 }
@@ -423,9 +721,11 @@ static void thread_pkt_deal_up(void* arg) {
     uint8_t payload_txt[PKT_PAYLOAD_SIZE] = {'\0'};
 
     LoRaMacMessageData_t macmsg;
+    const mac_meta_s* meta;
 
     for (i = 0; i < serv_ct->nb_pkt; i++) {
         p = &serv_ct->rxpkt[i];
+        meta = &serv_ct->rxmeta[i];
 
         if (p->if_chain == IF_DELAY) {
             lgw_log(LOG_DEBUG, "%s[%s-UP] skip from Storage\n", DEBUGMSG, serv->info.name);
@@ -465,7 +765,9 @@ static void thread_pkt_deal_up(void* arg) {
             count_us |= (uint32_t)p->payload[3]<<16;
             count_us |= (uint32_t)p->payload[4]<<24;
             dn_pkt_s* entry = NULL;
-            entry = (dn_pkt_s*) lgw_malloc(sizeof(dn_pkt_s));
+            entry = lgw_slab_zalloc(&dn_pkt_slab);
+            if (entry == NULL)
+                continue;
             entry->optlen = 0;
             entry->fopt = NULL;
             entry->txpw = 0;
@@ -485,59 +787,40 @@ static void thread_pkt_deal_up(void* arg) {
             else {
                 lgw_log(LOG_DEBUG, "%s[RELAY]customer downlink time:%u, size:%d\n", DEBUGMSG, count_us, entry->psize);
             }
-            lgw_free(entry);
+            dn_pkt_free(entry);
 
             continue;   /*!> next packet */
         }
 
-        memset(&macmsg, 0, sizeof(macmsg));
-        macmsg.Buffer = p->payload;
-        macmsg.BufSize = p->size;
-
-        if (LORAMAC_PARSER_SUCCESS != LoRaMacParserData(&macmsg))    /*!> MAC decode */
+        if (!meta->valid)    /*!> MAC decode */
             continue;
 
         /* 计算FRMPayload大小: 总长度 - MHDR(1) - DevAddr(4) - FCtrl(1) - FCnt(2) - FOpts(FOptsLen) - FPort(1) - MIC(4) */
-        fsize = p->size - 13 - macmsg.FHDR.FCtrl.Bits.FOptsLen; 
+        fsize = p->size - 13 - meta->fopts_len; 
 
         if (fsize < 1) {
-            lgw_log(LOG_DEBUG, "%s[DECODE] frmpayload (fsize=%d) not match! FOptsLen=%d\n", DEBUGMSG, fsize, macmsg.FHDR.FCtrl.Bits.FOptsLen);
+            lgw_log(LOG_DEBUG, "%s[DECODE] frmpayload (fsize=%d) not match! FOptsLen=%d\n", DEBUGMSG, fsize, meta->fopts_len);
             continue;
         }
 
-        if (serv->filter.fport != NOFILTER || serv->filter.devaddr != NOFILTER || 
-            serv->filter.nwkid != NOFILTER || serv->filter.deveui != NOFILTER ||
-            serv->filter.joineui != NOFILTER) {
-            FilterParams_t FP = {0};
-            memset(&FP, 0x00, sizeof(FilterParams_t));
-            FP.addr = macmsg.FHDR.DevAddr;
-            FP.fport = macmsg.FPort;
-            memcpy(FP.deveui, macmsg.DevEUI, sizeof(macmsg.DevEUI));
-            memcpy(FP.joineui, macmsg.AppEUI, sizeof(macmsg.AppEUI));
+        if (pkt_filter_enabled(serv)) {
+            FilterParams_t FP;
+            pkt_filter_params(&FP, meta);
             if (pkt_basic_filter(serv, &FP)) {
-                lgw_log(LOG_DEBUG, "%s[%s-UP] Drop a packet has fport(%u) of %08X.\n", DEBUGMSG, serv->info.name, macmsg.FPort, macmsg.FHDR.DevAddr);
+                lgw_log(LOG_DEBUG, "%s[%s-UP] Drop a packet has fport(%u) of %08X.\n", DEBUGMSG, serv->info.name, meta->fport, meta->devaddr);
                 continue;
             }
         }
 
+        mac_meta_msg(meta, p->payload, p->size, &macmsg);
         decode_mac_pkt_up(&macmsg, p);
 
         if (GW.cfg.mac_decode || GW.cfg.custom_downlink) {
-            devinfo_s devinfo = { .devaddr = macmsg.FHDR.DevAddr, 
-                                  .devaddr_str = {0},
-                                  .appskey_str = {0},
-                                  .nwkskey_str = {0}
-                                };
-            char db_family[32];
-            snprintf(db_family, sizeof(db_family), "devinfo/%08X", devinfo.devaddr);
-            if ((lgw_db_get(db_family, "appskey", devinfo.appskey_str, sizeof(devinfo.appskey_str)) == -1) || 
-                (lgw_db_get(db_family, "nwkskey", devinfo.nwkskey_str, sizeof(devinfo.nwkskey_str)) == -1)) {
+            devinfo_s devinfo;
+            if (!devsess_get(macmsg.FHDR.DevAddr, &devinfo)) {
                 continue;
             }
 
-            str2hex(devinfo.appskey, devinfo.appskey_str, sizeof(devinfo.appskey));
-            str2hex(devinfo.nwkskey, devinfo.nwkskey_str, sizeof(devinfo.nwkskey));
-
             /*!> Debug message of appskey */
 
             /*
@@ -562,28 +845,20 @@ static void thread_pkt_deal_up(void* arg) {
             lgw_log(LOG_DEBUG, "\n%s[DECODE][PAYLOAD]####################################################\n", DEBUGMSG);
 
             if (GW.cfg.mac_decode) {
-                uint32_t fcnt, mic;
-                bool fcnt_valid = false;
+                uint32_t fcnt;
                 lgw_memcpy(payload_encrypt, p->payload + 9 + macmsg.FHDR.FCtrl.Bits.FOptsLen, fsize);
-                for (j = 0; j < GW.cfg.fcnt_gap; j++) {   
-                    fcnt = macmsg.FHDR.FCnt | (j * 0x10000);
-                    /* msglen = p-size - len(MIC) */
-                    LoRaMacComputeMic(p->payload, p->size - 4, devinfo.nwkskey, devinfo.devaddr, UP, fcnt, &mic);
-                    if (mic == macmsg.MIC) {
-                        fcnt_valid = true;
-                        lgw_log(LOG_DEBUG, "%s[DECODE] Found a match MIC, fcnt=(%u)\n", DEBUGMSG, fcnt);
-                        break;
-                    }
-                }
-
-                if (!fcnt_valid) {
+                if (fcnt_resolve(&devinfo, &macmsg, &fcnt)) {
+                    lgw_log(LOG_DEBUG, "%s[DECODE] Found a match MIC, fcnt=(%u)\n", DEBUGMSG, fcnt);
+                    if (!devinfo.fcntup_valid || fcnt != devinfo.fcntup)
+                        devsess_fcnt_update(devinfo.devaddr, fcnt);
+                } else {
                     fcnt = macmsg.FHDR.FCnt;
                 }
 
                 if (macmsg.FPort == 0)
-                    LoRaMacPayloadDecrypt(payload_encrypt, fsize, devinfo.nwkskey, devinfo.devaddr, UP, fcnt, payload_txt);
+                    LoRaMacPayloadDecryptKeyed(payload_encrypt, fsize, &devinfo.nwkskey_ctx, devinfo.devaddr, UP, fcnt, payload_txt);
                 else
-                    LoRaMacPayloadDecrypt(payload_encrypt, fsize, devinfo.appskey, devinfo.devaddr, UP, fcnt, payload_txt);
+                    LoRaMacPayloadDecryptKeyed(payload_encrypt, fsize, &devinfo.appskey_ctx, devinfo.devaddr, UP, fcnt, payload_txt);
 
                 /*!> Debug message of decoded payload */
                 /*!>*/
@@ -628,20 +903,16 @@ static void thread_pkt_deal_up(void* arg) {
 
             if (GW.cfg.custom_downlink) {
                 /*!> Customer downlink process */
-                dn_pkt_s* dnelem = NULL;
-                char tmpstr[16];
-                sprintf(tmpstr, "%08X", devinfo.devaddr);
-                dnelem = search_dn_list(tmpstr);
+                dn_pkt_s* dnelem = dnq_pop(devinfo.devaddr);
                 if (dnelem != NULL) {
-                    lgw_log(LOG_DEBUG, "%s[DNLK]Found a match devaddr: %s, prepare a downlink!\n", DEBUGMSG, tmpstr);
+                    lgw_log(LOG_DEBUG, "%s[DNLK]Found a match devaddr: %08X, prepare a downlink!\n", DEBUGMSG, devinfo.devaddr);
                     jit_result = custom_rx2dn(dnelem, &devinfo, p->count_us, TIMESTAMPED);
                     if (jit_result == JIT_ERROR_OK) { /*!> Next upmsg willbe indicate if received by note */
-                        LGW_LIST_LOCK(&dn_list);
-                        LGW_LIST_REMOVE(&dn_list, dnelem, list);
-                        lgw_free(dnelem);
-                        LGW_LIST_UNLOCK(&dn_list);
+                        dn_pkt_free(dnelem);
                     } else {
                         lgw_log(LOG_ERROR, "%s[DNLK]Packet REJECTED (jit error=%d)\n", ERRMSG, jit_result);
+                        if (!dnq_push(devinfo.devaddr, dnelem, true))   /*!> try again on the next uplink */
+                            dn_pkt_free(dnelem);
                     }
 
                 } else
@@ -650,9 +921,12 @@ static void thread_pkt_deal_up(void* arg) {
         }
     } // for nb_pkt loop
 
-    lgw_free(serv_ct);
+    /*!> the batch goes back now, the context to pkt_deal_up which allocated it */
+    release_rxpkt(serv_ct);
 
     pthread_mutex_lock(&mx_pthread_pkt_count);
+    serv_ct->next = pkt_ct_done;
+    pkt_ct_done = serv_ct;
     pthread_pkt_count--;
     pthread_mutex_unlock(&mx_pthread_pkt_count);
 
@@ -661,18 +935,16 @@ static void thread_pkt_deal_up(void* arg) {
     //lgw_log(LOG_DEBUG, "THREAD~>> [tid=%ld, end=%u:%u, start=%u:%u, sub=%u] (R=%d)\n", tid, end_us.tv_sec, end_us.tv_usec, start_us.tv_sec, start_us.tv_usec, timeval_sub(&start_us, &end_us), pthread_pkt_count);
 }
 
-static void pkt_prepare_downlink(void* arg) {
-    serv_s* serv = (serv_s*) arg;
-    lgw_log(LOG_INFO, "%s[THREAD][%s] Staring pkt_prepare_downlink thread...\n", INFOMSG, serv->info.name);
-    
+/*!>!
+ * \brief read, delete and queue one downlink file of DNPATH
+ */
+static void dn_file_ingest(const char* name) {
     int i, j, start; /*!> loop variables, start of cpychar */
     uint8_t psize = 0, size = 0; /*!> sizeof payload, file char lenth */
 
     uint32_t uaddr;
 
-    DIR *dir;
     FILE *fp;
-    struct dirent *ptr;
     struct stat statbuf;
     char dn_file[256]; 
 
@@ -686,333 +958,388 @@ static void pkt_prepare_downlink(void* arg) {
     uint32_t bw_display;
     
     dn_pkt_s* entry = NULL;
-    dn_pkt_s* element = NULL;
 
     enum jit_error_e jit_result = JIT_ERROR_OK;
 
-    while (!serv->thread.stop_sig) {
-        
-        /*!> lookup file */
-        if ((dir = opendir(DNPATH)) == NULL) {
-            //lgw_log(LOG_ERROR, "%s[push]open sending path error\n", ERRMSG);
-            wait_ms(100); 
-            continue;
-        }
+    snprintf(dn_file, sizeof(dn_file), "%s/%s", DNPATH, name);
 
-	    while ((ptr = readdir(dir)) != NULL) {
-            if (strcmp(ptr->d_name, ".") == 0 || strcmp(ptr->d_name, "..") == 0) /*!> current dir OR parrent dir */
-                continue;
+    if (stat(dn_file, &statbuf) < 0) {
+        if (errno != ENOENT) /*!> already taken by the scan that raced its event */
+            lgw_log(LOG_ERROR, "%s[DNLK]Canot stat %s!\n", ERRMSG, name);
+        return;
+    }
 
-            lgw_log(LOG_INFO, "%s[DNLK]Looking file : %s\n", INFOMSG, ptr->d_name);
+    if ((statbuf.st_mode & S_IFMT) != S_IFREG)
+        return;
 
-            snprintf(dn_file, sizeof(dn_file), "%s/%s", DNPATH, ptr->d_name);
+    lgw_log(LOG_INFO, "%s[DNLK]Looking file : %s\n", INFOMSG, name);
 
-            if (stat(dn_file, &statbuf) < 0) {
-                lgw_log(LOG_ERROR, "%s[DNLK]Canot stat %s!\n", ERRMSG, ptr->d_name);
-                continue;
-            }
+    if ((fp = fopen(dn_file, "r")) == NULL) {
+        lgw_log(LOG_ERROR, "%s[DNLK]Cannot open %s\n", ERRMSG, name);
+        return;
+    }
 
-            if ((statbuf.st_mode & S_IFMT) == S_IFREG) {
-                if ((fp = fopen(dn_file, "r")) == NULL) {
-                    lgw_log(LOG_ERROR, "%s[DNLK]Cannot open %s\n", ERRMSG, ptr->d_name);
-                    continue;
-                }
+    lgw_memset(buff_down, '\0', sizeof(buff_down));
 
-                lgw_memset(buff_down, '\0', sizeof(buff_down));
+    size = fread(buff_down, sizeof(char), sizeof(buff_down), fp); /*!> the size less than buff_down return EOF */
+    fclose(fp);
 
-                size = fread(buff_down, sizeof(char), sizeof(buff_down), fp); /*!> the size less than buff_down return EOF */
-                fclose(fp);
+    unlink(dn_file); /*!> delete the file */
 
-                unlink(dn_file); /*!> delete the file */
+    for (i = 0, j = 0; i < size; i++) {
+        if (buff_down[i] == ',')
+            j++;
+    }
 
-                for (i = 0, j = 0; i < size; i++) {
-                    if (buff_down[i] == ',')
-                        j++;
-                }
+    if (j < 3) { /*!> Error Format, ',' must be greater than or equal to 3*/
+        lgw_log(LOG_INFO, "%s[DNLK]Format error: %s\n", INFOMSG, buff_down);
+        return;
+    }
 
-                if (j < 3) { /*!> Error Format, ',' must be greater than or equal to 3*/
-                    lgw_log(LOG_INFO, "%s[DNLK]Format error: %s\n", INFOMSG, buff_down);
-                    continue;
-                }
+    start = 0;
+
+    /*!>*******************************************************/
+    /*!> constrator dn_pkt_s, first fill default value */
+    /*!>*******************************************************/
+    entry = lgw_slab_zalloc(&dn_pkt_slab);
+    if (entry == NULL)
+        return;
+    entry->optlen = 0; 
+    entry->fopt = NULL;
+    entry->txpw = 0;
+    entry->txbw = 0; 
+    entry->txdr = 0; 
+    entry->txfreq = 0; 
+    entry->relay = 0; 
+    entry->rxwindow = 2; 
+    entry->txport = DEFAULT_DOWN_FPORT; 
+    entry->ftype = FRAME_TYPE_DATA_UNCONFIRMED_DOWN;        
+
+    /*!>* TODO: should be rewrite the function process **/
+
+    /*!>* 1. addr **/
+    if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) < 1) { 
+        dn_pkt_free(entry);
+        return;
+    } else
+        strcpy(entry->devaddr, swap_str);
 
-                start = 0;
-
-                /*!>*******************************************************/
-                /*!> constrator dn_pkt_s, first fill default value */
-                /*!>*******************************************************/
-                entry = (dn_pkt_s*) lgw_malloc(sizeof(dn_pkt_s));
-                entry->optlen = 0; 
-                entry->fopt = NULL;
-                entry->txpw = 0;
-                entry->txbw = 0; 
-                entry->txdr = 0; 
-                entry->txfreq = 0; 
-                entry->relay = 0; 
-                entry->rxwindow = 2; 
-                entry->txport = DEFAULT_DOWN_FPORT; 
-                entry->ftype = FRAME_TYPE_DATA_UNCONFIRMED_DOWN;        
-
-                /*!>* TODO: should be rewrite the function process **/
-
-                /*!>* 1. addr **/
-                if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) < 1) { 
-                    lgw_free(entry);
-                    continue;
-                } else
-                    strcpy(entry->devaddr, swap_str);
 
+    /*!>* 2. txmode **/
+    if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) < 1)
+        strcpy(entry->txmode, "time");
+    else
+        strcpy(entry->txmode, swap_str); 
 
-                /*!>* 2. txmode **/
-                if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) < 1)
-                    strcpy(entry->txmode, "time");
-                else
-                    strcpy(entry->txmode, swap_str); 
+    /*!>* 3. payload format **/
+    if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) < 1)
+        strcpy(entry->pdformat, "txt"); 
+    else
+        strcpy(entry->pdformat, swap_str); 
 
-                /*!>* 3. payload format **/
-                if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) < 1)
-                    strcpy(entry->pdformat, "txt"); 
-                else
-                    strcpy(entry->pdformat, swap_str); 
+    /*!>* 4. payload **/
+    psize = strcpypt((char*)dnpld, (char*)buff_down, &start, size, sizeof(dnpld)); 
+    if (psize < 1) {
+        dn_pkt_free(entry);
+        return;
+    }
 
-                /*!>* 4. payload **/
-                psize = strcpypt((char*)dnpld, (char*)buff_down, &start, size, sizeof(dnpld)); 
-                if (psize < 1) {
-                    lgw_free(entry);
-                    continue;
-                }
+    /*!>* 5. tx power **/
+    if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) > 0) {
+        entry->txpw = atoi(swap_str);
+    } 
+
+    /*!>* 6. tx bandwith **/
+    if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) > 0) {
+        entry->txbw = atoi(swap_str);
+    } 
+
+    /*!>* 7. tx sf **/
+    if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) > 0) {
+        if (!strncmp(swap_str, "SF7", 3))
+            entry->txdr = DR_LORA_SF7; 
+        else if (!strncmp(swap_str, "SF8", 3))
+            entry->txdr = DR_LORA_SF8; 
+        else if (!strncmp(swap_str, "SF9", 3))
+            entry->txdr = DR_LORA_SF9; 
+        else if (!strncmp(swap_str, "SF10", 4))
+            entry->txdr = DR_LORA_SF10; 
+        else if (!strncmp(swap_str, "SF11", 4))
+            entry->txdr = DR_LORA_SF11; 
+        else if (!strncmp(swap_str, "SF12", 4))
+            entry->txdr = DR_LORA_SF12; 
+        else if (!strncmp(swap_str, "SF5", 3))
+            entry->txdr = DR_LORA_SF5; 
+        else if (!strncmp(swap_str, "SF6", 3))
+            entry->txdr = DR_LORA_SF6; 
+        else 
+            entry->txdr = 0; 
+    } 
+    /*!>* 8. tx frequency **/
+    if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) > 0) {
+        i = sscanf(swap_str, "%u", &entry->txfreq);
+        if (i != 1)
+            entry->txfreq = 0;
+    } 
+
+    /*!>* 9. tx window **/
+    if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) > 0) {
+        entry->rxwindow = atoi(swap_str);
+        if (entry->rxwindow > 2 || entry->rxwindow < 1)
+            entry->rxwindow = 0;
+    } 
+
+    /*!>* 10. tx fport **/
+    if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) > 0) {
+        entry->txport = atoi(swap_str);
+        if (entry->txport > 255 || entry->txport < 0)
+            entry->txport = DEFAULT_DOWN_FPORT;
+    } 
 
-                /*!>* 5. tx power **/
-                if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) > 0) {
-                    entry->txpw = atoi(swap_str);
-                } 
-
-                /*!>* 6. tx bandwith **/
-                if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) > 0) {
-                    entry->txbw = atoi(swap_str);
-                } 
-
-                /*!>* 7. tx sf **/
-                if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) > 0) {
-                    if (!strncmp(swap_str, "SF7", 3))
-                        entry->txdr = DR_LORA_SF7; 
-                    else if (!strncmp(swap_str, "SF8", 3))
-                        entry->txdr = DR_LORA_SF8; 
-                    else if (!strncmp(swap_str, "SF9", 3))
-                        entry->txdr = DR_LORA_SF9; 
-                    else if (!strncmp(swap_str, "SF10", 4))
-                        entry->txdr = DR_LORA_SF10; 
-                    else if (!strncmp(swap_str, "SF11", 4))
-                        entry->txdr = DR_LORA_SF11; 
-                    else if (!strncmp(swap_str, "SF12", 4))
-                        entry->txdr = DR_LORA_SF12; 
-                    else if (!strncmp(swap_str, "SF5", 3))
-                        entry->txdr = DR_LORA_SF5; 
-                    else if (!strncmp(swap_str, "SF6", 3))
-                        entry->txdr = DR_LORA_SF6; 
-                    else 
-                        entry->txdr = 0; 
-                } 
-                /*!>* 8. tx frequency **/
-                if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) > 0) {
-                    i = sscanf(swap_str, "%u", &entry->txfreq);
-                    if (i != 1)
-                        entry->txfreq = 0;
-                } 
-
-                /*!>* 9. tx window **/
-                if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) > 0) {
-                    entry->rxwindow = atoi(swap_str);
-                    if (entry->rxwindow > 2 || entry->rxwindow < 1)
-                        entry->rxwindow = 0;
-                } 
-
-                /*!>* 10. tx fport **/
-                if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) > 0) {
-                    entry->txport = atoi(swap_str);
-                    if (entry->txport > 255 || entry->txport < 0)
-                        entry->txport = DEFAULT_DOWN_FPORT;
-                } 
-
-                /*!>* 11. tx optlen **/
-                if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) > 0) {
-                    entry->optlen = atoi(swap_str);
-                    if (entry->optlen > 32 || entry->optlen < 0)
-                        entry->optlen = 0;
-                } 
-
-                /*!>* 12. tx opts **/
-                if ((j = strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str))) > 0) {
-                    if (entry->optlen > 0 && (j < 32)) {
-                        hex2str((uint8_t*)swap_str, hexopt, j);
-                        entry->fopt = lgw_malloc(sizeof(uint8_t) * j/2);
-                        lgw_memcpy(entry->fopt, hexopt, j/2);
-                        entry->optlen = j/2;  // fix optlen 
-                        lgw_log(LOG_DEBUG, "%s[DNLK] mac-command optlen = %i.\n", DEBUGMSG, entry->optlen);
-                    } else {
-                        entry->optlen = 0;
-                        entry->fopt = NULL;
-                    }
-                } 
-
-                /*!>* 13. FTYPE **/
-                if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) > 0) {
-                    switch (atoi(swap_str)) {
-                        case 1:
-                            entry->ftype = FRAME_TYPE_DATA_CONFIRMED_DOWN;
-                            break;
-                        default:
-                            entry->ftype = FRAME_TYPE_DATA_UNCONFIRMED_DOWN;
-                            break;
-                    }
-                }
+    /*!>* 11. tx optlen **/
+    if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) > 0) {
+        entry->optlen = atoi(swap_str);
+        if (entry->optlen > 32 || entry->optlen < 0)
+            entry->optlen = 0;
+    } 
+
+    /*!>* 12. tx opts **/
+    if ((j = strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str))) > 0) {
+        if (entry->optlen > 0 && (j < 32)) {
+            hex2str((uint8_t*)swap_str, hexopt, j);
+            entry->fopt = lgw_malloc(sizeof(uint8_t) * j/2);
+            lgw_memcpy(entry->fopt, hexopt, j/2);
+            entry->optlen = j/2;  // fix optlen 
+            lgw_log(LOG_DEBUG, "%s[DNLK] mac-command optlen = %i.\n", DEBUGMSG, entry->optlen);
+        } else {
+            entry->optlen = 0;
+            entry->fopt = NULL;
+        }
+    } 
+
+    /*!>* 13. FTYPE **/
+    if (strcpypt(swap_str, (char*)buff_down, &start, size, sizeof(swap_str)) > 0) {
+        switch (atoi(swap_str)) {
+            case 1:
+                entry->ftype = FRAME_TYPE_DATA_CONFIRMED_DOWN;
+                break;
+            default:
+                entry->ftype = FRAME_TYPE_DATA_UNCONFIRMED_DOWN;
+                break;
+        }
+    }
 
-                /*!>******************************************************************/
-                /*!>* End of prepare customer donwlink constractor **/
-                /*!>******************************************************************/
+    /*!>******************************************************************/
+    /*!>* End of prepare customer donwlink constractor **/
+    /*!>******************************************************************/
 
 
-                if (strstr(entry->pdformat, "hex") != NULL) { 
-                    if (psize % 2) {
-                        lgw_log(LOG_INFO, "%s[DNLK] Size of hex payload invalid.\n", INFOMSG);
-                        if (entry->fopt)
-                            lgw_free(entry->fopt);
-                        lgw_free(entry);
-                        continue;
-                    }
-                    hex2str(dnpld, hexpld, psize);
-                    psize = psize/2;
-                    lgw_memcpy(entry->payload, hexpld, psize + 1);
-                } else
-                    lgw_memcpy(entry->payload, dnpld, psize + 1);
+    if (strstr(entry->pdformat, "hex") != NULL) { 
+        if (psize % 2) {
+            lgw_log(LOG_INFO, "%s[DNLK] Size of hex payload invalid.\n", INFOMSG);
+            dn_pkt_free(entry);
+            return;
+        }
+        hex2str(dnpld, hexpld, psize);
+        psize = psize/2;
+        lgw_memcpy(entry->payload, hexpld, psize + 1);
+    } else
+        lgw_memcpy(entry->payload, dnpld, psize + 1);
 
-                entry->psize = psize;
+    entry->psize = psize;
 #ifdef SX1302MOD
-                switch(entry->txbw) {
-                    case 0x1:
-                        entry->txbw = 0x6;
-                        bw_display = 500000;
-                        break;
-                    case 0x2:
-                        entry->txbw = 0x5;
-                        bw_display = 250000;
-                        break;
-                    case 0x3:
-                        entry->txbw = 0x4;
-                        bw_display = 125000;
-                        break;
-                    default:
-                        bw_display = 0;
-                        break;
-                }
+    switch(entry->txbw) {
+        case 0x1:
+            entry->txbw = 0x6;
+            bw_display = 500000;
+            break;
+        case 0x2:
+            entry->txbw = 0x5;
+            bw_display = 250000;
+            break;
+        case 0x3:
+            entry->txbw = 0x4;
+            bw_display = 125000;
+            break;
+        default:
+            bw_display = 0;
+            break;
+    }
 #else
-                switch(entry->txbw) {
-                    case 0x1:
-                        bw_display = 500000;
-                        break;
-                    case 0x2:
-                        bw_display = 250000;
-                        break;
-                    case 0x3:
-                        bw_display = 125000;
-                        break;
-                    case 0x4:
-                        bw_display = 62000;
-                        break;
-                    case 0x5:
-                        bw_display = 31200;
-                        break;
-                    case 0x6:
-                        bw_display = 15600;
-                        break;
-                    case 0x7:
-                        bw_display = 7800;
-                        break;
-                    default:
-                        bw_display = 0;
-                        break;
-                }
+    switch(entry->txbw) {
+        case 0x1:
+            bw_display = 500000;
+            break;
+        case 0x2:
+            bw_display = 250000;
+            break;
+        case 0x3:
+            bw_display = 125000;
+            break;
+        case 0x4:
+            bw_display = 62000;
+            break;
+        case 0x5:
+            bw_display = 31200;
+            break;
+        case 0x6:
+            bw_display = 15600;
+            break;
+        case 0x7:
+            bw_display = 7800;
+            break;
+        default:
+            bw_display = 0;
+            break;
+    }
 #endif
 
-                lgw_log(LOG_DEBUG, "%s[DNLK]devaddr:%s, txmode:%s, pdfm:%s, size:%d, freq:%u, bw:%u, dr:%u, ftype:%s\n", DEBUGMSG, entry->devaddr, entry->txmode, entry->pdformat, entry->psize, entry->txfreq, bw_display, entry->txdr, entry->ftype == FRAME_TYPE_DATA_CONFIRMED_DOWN ? "CONFIMED" : "UNCONF");
+    lgw_log(LOG_DEBUG, "%s[DNLK]devaddr:%s, txmode:%s, pdfm:%s, size:%d, freq:%u, bw:%u, dr:%u, ftype:%s\n", DEBUGMSG, entry->devaddr, entry->txmode, entry->pdformat, entry->psize, entry->txfreq, bw_display, entry->txdr, entry->ftype == FRAME_TYPE_DATA_CONFIRMED_DOWN ? "CONFIMED" : "UNCONF");
 
-                lgw_log(LOG_DEBUG, "%s[DNLK]payload:\"%s\"\n", DEBUGMSG, entry->payload); 
+    lgw_log(LOG_DEBUG, "%s[DNLK]payload:\"%s\"\n", DEBUGMSG, entry->payload); 
 
-                if (strstr(entry->txmode, "imme") != NULL) {
-                    lgw_log(LOG_INFO, "%s[DNLK] Pending IMMEDIATE downlink for %s\n", INFOMSG, entry->devaddr);
+    uaddr = strtoul(entry->devaddr, NULL, 16);
 
-                    uaddr = strtoul(entry->devaddr, NULL, 16);
+    if (strstr(entry->txmode, "imme") != NULL) {
+        lgw_log(LOG_INFO, "%s[DNLK] Pending IMMEDIATE downlink for %s\n", INFOMSG, entry->devaddr);
 
-                    devinfo_s devinfo = { .devaddr = uaddr, 
-                                          .devaddr_str = {0},
-                                          .appskey_str = {0},
-                                          .nwkskey_str = {0}
-                                        };
+        devinfo_s devinfo;
+        if (!devsess_get(uaddr, &devinfo)) {
+            dn_pkt_free(entry);
+            return;
+        }
 
-                    char db_family[32];
-                    sprintf(db_family, "devinfo/%08X", devinfo.devaddr);
-
-                    if ((lgw_db_get(db_family, "appskey", devinfo.appskey_str, sizeof(devinfo.appskey_str)) == -1) || 
-                        (lgw_db_get(db_family, "nwkskey", devinfo.nwkskey_str, sizeof(devinfo.nwkskey_str)) == -1)) {
-                        if (entry->fopt)
-                            lgw_free(entry->fopt);
-                        lgw_free(entry);
-                        continue;
-                    }
+        lgw_log(LOG_DEBUG, "\n%s[DNLK][DECODE]devaddr: %08X, appSkey:", DEBUGMSG, devinfo.devaddr);
+        for (j = 0; j < (int)sizeof(devinfo.appskey); ++j) {
+            lgw_log(LOG_DEBUG, "%02X", devinfo.appskey[j]);
+        }
+        lgw_log(LOG_DEBUG, "\n");
+
+        jit_result = custom_rx2dn(entry, &devinfo, 0, IMMEDIATE);
 
+        if (jit_result != JIT_ERROR_OK)  
+            lgw_log(LOG_ERROR, "%s[DNLK]Packet REJECTED (jit error=%d)\n", ERRMSG, jit_result);
+        else
+            lgw_log(LOG_INFO, "%s[DNLK]customer immediate downlink for %s ready\n", INFOMSG, entry->devaddr);
 
-                    str2hex(devinfo.appskey, devinfo.appskey_str, sizeof(devinfo.appskey));
-                    str2hex(devinfo.nwkskey, devinfo.nwkskey_str, sizeof(devinfo.nwkskey));
+        dn_pkt_free(entry);
+        return;
+    }
 
-                    lgw_log(LOG_DEBUG, "\n%s[DNLK][DECODE]devaddr: %08X, appSkey:", DEBUGMSG, devinfo.devaddr);
-                    for (j = 0; j < (int)sizeof(devinfo.appskey); ++j) {
-                        lgw_log(LOG_DEBUG, "%02X", devinfo.appskey[j]);
-                    }
-                    lgw_log(LOG_DEBUG, "\n");
 
-                    jit_result = custom_rx2dn(entry, &devinfo, 0, IMMEDIATE);
+    if (!dnq_push(uaddr, entry, false)) {
+        lgw_log(LOG_WARNING, "%s[DNLK]%d downlinks pending, %s dropped\n", WARNMSG, DNQ_MAX, name);
+        dn_pkt_free(entry);
+    }
+}
 
-                    if (jit_result != JIT_ERROR_OK)  
-                        lgw_log(LOG_ERROR, "%s[DNLK]Packet REJECTED (jit error=%d)\n", ERRMSG, jit_result);
-                    else
-                        lgw_log(LOG_INFO, "%s[DNLK]customer immediate downlink for %s ready\n", INFOMSG, entry->devaddr);
+/*!>!
+ * \brief ingest the files already in DNPATH
+ * \return number of files skipped because they were modified within the last second
+ *
+ * Such a file may still be written, its IN_CLOSE_WRITE takes it.  The
+ * caller scans again later in case the close came before the watch.
+ */
+static int dn_dir_scan(void) {
+    DIR *dir;
+    struct dirent *ptr;
+    struct stat statbuf;
+    struct timespec now;
+    char dn_file[256];
+    int recent = 0;
 
-                    if (entry->fopt)
-                        lgw_free(entry->fopt);
-                    lgw_free(entry);
-                    continue;
-                }
+    if ((dir = opendir(DNPATH)) == NULL)
+        return 0;
 
-                LGW_LIST_LOCK(&dn_list);
-                if (dn_list.size > 16) { 
-                    element = LGW_LIST_REMOVE_HEAD(&dn_list, list);
-                    if (element != NULL) {
-                        dn_list.size--;
-                        if (element->fopt)
-                            lgw_free(element->fopt);
-                        lgw_free(element);
-                    }
-                }
+    clock_gettime(CLOCK_REALTIME, &now);
+    while ((ptr = readdir(dir)) != NULL) {
+        if (strcmp(ptr->d_name, ".") == 0 || strcmp(ptr->d_name, "..") == 0) /*!> current dir OR parrent dir */
+            continue;
+        snprintf(dn_file, sizeof(dn_file), "%s/%s", DNPATH, ptr->d_name);
+        if (stat(dn_file, &statbuf) == 0 && difftimespec(now, statbuf.st_mtim) < 1.0) {
+            recent++;
+            continue;
+        }
+        dn_file_ingest(ptr->d_name);
+    }
 
-                LGW_LIST_TRAVERSE_SAFE_BEGIN(&dn_list, element, list) { 
-                    if (!strcmp(element->devaddr, entry->devaddr)) {
-                        LGW_LIST_REMOVE_CURRENT(list);
-                        dn_list.size--;
-                        if (element->fopt)
-                            lgw_free(element->fopt);
-                        lgw_free(element);
-                    }
-                }
-                LGW_LIST_TRAVERSE_SAFE_END;
+    if (closedir(dir) < 0)
+        lgw_log(LOG_INFO, "%s[DNLK]Cannot close DIR: %s\n", INFOMSG, DNPATH);
+
+    return recent;
+}
+
+/*!>!
+ * \brief ingest downlink files as they are written to DNPATH
+ *
+ * Writers either close the file (IN_CLOSE_WRITE) or rename it into the
+ * directory (IN_MOVED_TO), a file is never read half written.  The watch
+ * is set again when DNPATH is removed or moved away, and a full scan
+ * catches up with files written while there was none or events overflowed.
+ */
+static void pkt_prepare_downlink(void* arg) {
+    serv_s* serv = (serv_s*) arg;
+    lgw_log(LOG_INFO, "%s[THREAD][%s] Staring pkt_prepare_downlink thread...\n", INFOMSG, serv->info.name);
+
+    char evbuf[DN_EVENT_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    struct pollfd pfd;
+    ssize_t len;
+    char *q;
+    int fd, wd = -1;
+    int recent = 0;     /*!> files the last scan left to their IN_CLOSE_WRITE */
+    bool rescan;
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1) {
+        lgw_log(LOG_ERROR, "%s[DNLK]inotify_init1: %s\n", ERRMSG, strerror(errno));
+        return;
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
 
-                LGW_LIST_INSERT_TAIL(&dn_list, entry, list);
-                LGW_LIST_UNLOCK(&dn_list);
+    while (!serv->thread.stop_sig) {
+        if (wd == -1) {
+            wd = inotify_add_watch(fd, DNPATH, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVE_SELF | IN_ONLYDIR);
+            if (wd == -1) { /*!> DNPATH not created yet */
+                wait_ms(1000);
+                continue;
             }
-            wait_ms(100); /*!> wait for HAT send or other process */
+            recent = dn_dir_scan();
+        }
+
+        if (poll(&pfd, 1, 1000) <= 0) {
+            if (recent > 0 && wd != -1)     /*!> their close may have come before the watch */
+                recent = dn_dir_scan();
+            continue;
         }
-        if (closedir(dir) < 0)
-            lgw_log(LOG_INFO, "%s[DNLK]Cannot close DIR: %s\n", INFOMSG, DNPATH);
-        wait_ms(100);
+
+        len = read(fd, evbuf, sizeof(evbuf));
+        if (len <= 0)
+            continue;
+
+        rescan = false;
+        for (q = evbuf; q < evbuf + len; q += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *)q;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                rescan = true;
+            } else if (ev->wd != wd) {
+                continue;       /*!> left over of a previous watch */
+            } else if (ev->mask & IN_MOVE_SELF) {
+                inotify_rm_watch(fd, wd);
+                wd = -1;
+            } else if (ev->mask & IN_IGNORED) {
+                wd = -1;        /*!> DNPATH deleted */
+            } else if (ev->len > 0 && !(ev->mask & IN_ISDIR)) {
+                dn_file_ingest(ev->name);
+            }
+        }
+
+        if (rescan && wd != -1)
+            recent = dn_dir_scan();
     }
+
+    close(fd);
     lgw_log(LOG_INFO, "%s[THREAD][%s] END of pkt_prepare_downlink thread\n", INFOMSG, serv->info.name);
 }
 
@@ -1063,46 +1390,81 @@ static int strcpypt(char* dest, const char* src, int* start, int size, int len)
     return j;
 }
 
+/*!> free the contexts of the ended decode threads of serv, from the thread which allocated them */
+static int pkt_ct_reap(serv_s* serv) {
+    serv_ct_s **pp, *serv_ct, *mine = NULL;
+    int nb = 0;
+
+    pthread_mutex_lock(&mx_pthread_pkt_count);
+    for (pp = &pkt_ct_done; *pp != NULL; ) {
+        serv_ct = *pp;
+        if (serv_ct->serv == serv) {
+            *pp = serv_ct->next;
+            serv_ct->next = mine;
+            mine = serv_ct;
+        } else
+            pp = &serv_ct->next;
+    }
+    pthread_mutex_unlock(&mx_pthread_pkt_count);
+
+    while (mine != NULL) {
+        serv_ct = mine;
+        mine = serv_ct->next;
+        serv_ct_free(serv_ct);
+        nb++;
+    }
+    return nb;
+}
+
 static void pkt_deal_up(void* arg) {
     serv_s* serv = (serv_s*) arg;
+    int nb_running = 0;     /*!> decode threads started and not reaped yet */
     lgw_log(LOG_INFO, "%s[THREAD][%s] Staring...\n", INFOMSG, serv->info.name);
 
 	while (!serv->thread.stop_sig) {
 
 		sem_wait(&serv->thread.sema);
 
+        nb_running -= pkt_ct_reap(serv);
+
         if (pthread_pkt_count > MAX_PKT_PTHREADS) {
             lgw_log(LOG_DEBUG, "THREAD~ [%s] WAR! More decode threads(=%d), skip current pacakege!\n", serv->info.name, pthread_pkt_count);
             continue;   //wait for , next trigger, next time, will miss some package
         }
 
     //do {
-        serv_ct_s *serv_ct = lgw_malloc(sizeof(serv_ct_s));
-        serv_ct->serv = serv;
+        serv_ct_s *serv_ct = serv_ct_new(serv);
+        if (serv_ct == NULL)
+            continue;
         serv_ct->nb_pkt = get_rxpkt(serv_ct);     //only get the first rxpkt of list
 
         if (serv_ct->nb_pkt == 0) {
-            lgw_free(serv_ct);
+            serv_ct_free(serv_ct);
             continue;
         }
 
         pthread_t ntid;
 
+        lgw_log(LOG_DEBUG, "%s[THREAD][%s] pkt_push_up(count=%d) fetch %d %s.\n", DEBUGMSG, serv->info.name, pthread_pkt_count, serv_ct->nb_pkt, serv_ct->nb_pkt < 2 ? "packet" : "packets");
+
         if (lgw_pthread_create(&ntid, NULL, (void *(*)(void *))thread_pkt_deal_up, (void *)serv_ct)) {
-            lgw_free(serv_ct);
+            serv_ct_free(serv_ct);
             lgw_log(LOG_WARNING, "%s[THREAD][%s] Can't create push_up pthread.\n", WARNMSG, serv->info.name);
         } else {
             pthread_detach(ntid);
             pthread_mutex_lock(&mx_pthread_pkt_count);
             pthread_pkt_count++;
             pthread_mutex_unlock(&mx_pthread_pkt_count);
+            nb_running++;
         }
 
-        lgw_log(LOG_DEBUG, "%s[THREAD][%s] pkt_push_up(count=%d) fetch %d %s.\n", DEBUGMSG, serv->info.name, pthread_pkt_count, serv_ct->nb_pkt, serv_ct->nb_pkt < 2 ? "packet" : "packets");
-
     //} while (GW.rxpkts_list.size > 1 && (!serv->thread.stop_sig));  
     }
 
+    /*!> the decode threads still running hand their context back here */
+    while ((nb_running -= pkt_ct_reap(serv)) > 0)
+        wait_ms(10);
+
     lgw_log(LOG_INFO, "%s[THREAD][%s] ENDED!\n", INFOMSG, serv->info.name);
 }
 
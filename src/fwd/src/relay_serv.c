@@ -67,9 +67,7 @@ int relay_start(serv_s* serv) {
     serv->state.stall_time = 0;
     serv->state.startup_time = time(NULL);  //UTC seconds
     serv->state.connecting = false;
-    LGW_LIST_LOCK(&GW.rxpkts_list);
-    GW.info.service_count++;
-    LGW_LIST_UNLOCK(&GW.rxpkts_list);
+    rxpkt_attach(serv);
     lgw_db_put("service/relay", serv->info.name, "running");
     lgw_db_put("thread", serv->info.name, "running");
 
@@ -83,9 +81,7 @@ int relay_stop(serv_s* serv) {
     sem_post(&serv->thread.sema);
     pthread_join(serv->thread.t_up, NULL);
     serv->state.live = false;
-    LGW_LIST_LOCK(&GW.rxpkts_list);
-    GW.info.service_count--;
-    LGW_LIST_UNLOCK(&GW.rxpkts_list);
+    rxpkt_detach(serv);
     lgw_db_del("service/relay", serv->info.name);
     lgw_db_del("thread", serv->info.name);
     return 0;
@@ -104,12 +100,13 @@ static void relay_push_up(void* arg) {
     while (!serv->thread.stop_sig) {
         sem_wait(&serv->thread.sema);
         do {
-            serv_ct_s *serv_ct = lgw_malloc(sizeof(serv_ct_s));
-            serv_ct->serv = serv;
+            serv_ct_s *serv_ct = serv_ct_new(serv);
+            if (serv_ct == NULL)
+                break;
             serv_ct->nb_pkt = get_rxpkt(serv_ct);     //only get the first rxpkt of list
 
             if (serv_ct->nb_pkt == 0) { 
-                lgw_free(serv_ct);
+                serv_ct_free(serv_ct);
                 break;
             }
 
@@ -172,9 +169,9 @@ static void relay_push_up(void* arg) {
 
             lgw_log(LOG_DEBUG, "%s[%s] relay_push_up push %d %s.\n", DEBUGMSG, serv->info.name, serv_ct->nb_pkt, serv_ct->nb_pkt < 2 ? "packet" : "packets");
 
-            lgw_free(serv_ct);
+            serv_ct_free(serv_ct);
 
-        } while (GW.rxpkts_list.size > 1 && (!serv->thread.stop_sig));
+        } while (rxpkt_pending(serv) && (!serv->thread.stop_sig));
     }
 
     lgw_log(LOG_INFO, "\n%s[THREAD][%s-UP] Ended!\n", INFOMSG, serv->info.name);
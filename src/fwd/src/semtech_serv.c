@@ -39,25 +39,45 @@
 
 #include "fwd.h"
 #include "uart.h"
+#include "lbt.h"
 #include "service.h"
 #include "semtech_service.h"
 #include "jitqueue.h"
 #include "parson.h"
 #include "base64.h"
+#include "jsonw.h"
 
 #include "timersync.h"
 #include "loragw_aux.h"
 #include "mac-header-decode.h"
+#include "metrics.h"
 
 DECLARE_GW;
-extern int pthread_count;
-extern pthread_mutex_t mx_pthread_count;
+
+#define PUSH_ACK_PENDING    16          /*!> PUSH_DATA datagrams waiting for their PUSH_ACK */
+
+typedef struct {
+    bool wait;
+    uint8_t token_h;
+    uint8_t token_l;
+    struct timespec send_time;
+} push_token_s;
+
+/*!> tokens sent by semtech_push_up, matched by semtech_push_ack */
+typedef struct {
+    serv_s* serv;
+    pthread_mutex_t mx_token;
+    uint8_t index;
+    push_token_s token[PUSH_ACK_PENDING];
+} push_ack_s;
 
 static void semtech_pull_down(void* arg);
+static void post_tx_reject(serv_s* serv, uint16_t token);
+static void send_tx_rejects(serv_s* serv);
 static void semtech_push_up(void* arg);
-static void thread_push_up(void* arg);
+static void semtech_push_ack(void* arg);
+static void push_up_dgram(serv_ct_s* serv_ct, push_ack_s* ack, uint8_t* buff_up);
 
-static enum jit_error_e lbt_enqueue(struct lgw_pkt_tx_s* packet, uint32_t time_us);
 
 int semtech_start(serv_s* serv) {
 
@@ -79,9 +99,7 @@ int semtech_start(serv_s* serv) {
     serv->state.connecting = false;
     lgw_db_put("service/lorawan", serv->info.name, "running");
     lgw_db_put("thread", serv->info.name, "running");
-    LGW_LIST_LOCK(&GW.rxpkts_list);
-    GW.info.service_count++;
-    LGW_LIST_UNLOCK(&GW.rxpkts_list);
+    rxpkt_attach(serv);
 
     char family[96], status_value[32];
     snprintf(family, sizeof(family), "service/lorawan/%s", serv->info.name);
@@ -94,9 +112,7 @@ int semtech_start(serv_s* serv) {
 int semtech_stop(serv_s* serv) {
     char family[128] = {'\0'};
     char status_value[32] = {'\0'};
-    LGW_LIST_LOCK(&GW.rxpkts_list);
-    GW.info.service_count--;
-    LGW_LIST_UNLOCK(&GW.rxpkts_list);
+    rxpkt_detach(serv);
     serv->thread.stop_sig = true;
     sem_post(&serv->thread.sema);
     pthread_join(serv->thread.t_up, NULL);
@@ -114,12 +130,9 @@ int semtech_stop(serv_s* serv) {
     return 0;
 }
 
-static void thread_push_up(void* arg) {
-    serv_ct_s* serv_ct = (serv_ct_s*) arg;
+static void push_up_dgram(serv_ct_s* serv_ct, push_ack_s* ack, uint8_t* buff_up) {
     serv_s* serv = serv_ct->serv;
 
-    //lgw_log(LOG_DEBUG, "THREAD~<< [%s tid=%ld] thread_semtech_push_up\n", serv->info.name, pthread_self());
-
     int i, j; /*!> loop variables */
 
     unsigned pkt_in_dgram = 0; /*!> nb on Lora packet in the current datagram */
@@ -132,26 +145,27 @@ static void thread_push_up(void* arg) {
     struct tref local_ref; /*!> time reference used for UTC <-> timestamp conversion */
 
     /*!> data buffers */
-    uint8_t buff_up[TX_BUFF_SIZE]; /*!> buffer to compose the upstream packet */
     int buff_index;
-    uint8_t buff_ack[32];          /*!> buffer to receive acknowledges */
+    jsonw_s w;      /*!> rxpk array writer on buff_up */
+    int pkt_start;  /*!> where the current rxpk object starts, to drop it */
 
-    uint8_t tmp_payload[256];      /*!> buffer for swap payload if relay */
+    struct lgw_pkt_rx_s relay_pkt; /*!> private copy of a relayed packet, the batch is shared */
 
     /*!> protocol variables */
     uint8_t token_h; /*!> random token for acknowledgement matching */
     uint8_t token_l; /*!> random token for acknowledgement matching */
 
-    /*!> ping measurement variables */
-    struct timespec send_time;
-    struct timespec recv_time;
+    /*!> pending acknowledge slot */
+    push_token_s* pending;
 
     /*!> GPS synchronization variables */
     struct timespec pkt_utc_time;
-    struct tm* x; /*!> broken-up UTC time */
+    struct timespec sent_time;
 
     /*!> mote info variables */
     LoRaMacMessageData_t macmsg;
+    const mac_meta_s* meta;
+    mac_meta_s relay_meta;
 
     /*!> pre-fill the data buffer with fixed fields */
     buff_up[0] = PROTOCOL_VERSION;
@@ -180,10 +194,11 @@ static void thread_push_up(void* arg) {
 
     /*!> serialize Lora packets metadata and payload */
     pkt_in_dgram = 0;
-
+    jsonw_init(&w, buff_up, TX_BUFF_SIZE, buff_index);
 
     for (i = 0; i < serv_ct->nb_pkt; i++) {
         p = &serv_ct->rxpkt[i];
+        meta = &serv_ct->rxmeta[i];
 
         if (p->if_chain == 8 && (GW.relay.as_relay || GW.relay.has_relay)) { 
 
@@ -193,54 +208,47 @@ static void thread_push_up(void* arg) {
 
             if (GW.relay.has_relay) {   /*!> Ooh! receive from RELAY */
                 lgw_log(LOG_DEBUG, "%s[RELAY] packet receive from relay! \n", DEBUGMSG);
-                p->count_us = (uint32_t)p->payload[1];
-                p->count_us |= (uint32_t)p->payload[2]<<8;
-                p->count_us |= (uint32_t)p->payload[3]<<16;
-                p->count_us |= (uint32_t)p->payload[4]<<24;
-                lgw_memcpy(tmp_payload, p->payload, p->size);
-                p->size -= 5;
-                lgw_memset(p->payload, 0, sizeof(p->payload));
-                lgw_memcpy(p->payload, tmp_payload + 5, p->size);
+                relay_pkt = *p;
+                relay_pkt.count_us = (uint32_t)p->payload[1];
+                relay_pkt.count_us |= (uint32_t)p->payload[2]<<8;
+                relay_pkt.count_us |= (uint32_t)p->payload[3]<<16;
+                relay_pkt.count_us |= (uint32_t)p->payload[4]<<24;
+                relay_pkt.size = p->size - 5;
+                lgw_memset(relay_pkt.payload, 0, sizeof(relay_pkt.payload));
+                lgw_memcpy(relay_pkt.payload, p->payload + 5, relay_pkt.size);
+                p = &relay_pkt;
+                mac_meta_parse(&relay_meta, p->payload, p->size);  /*!> the shared one is of the relay header */
+                meta = &relay_meta;
             }
         }
 
-        memset(&macmsg, 0, sizeof(macmsg));
-        macmsg.Buffer = p->payload;
-        macmsg.BufSize = p->size;
-
-        if (LORAMAC_PARSER_SUCCESS != LoRaMacParserData(&macmsg)) {
-            macmsg.BufSize = 0;
+        if (!mac_meta_msg(meta, p->payload, p->size, &macmsg)) {
             lgw_log(LOG_WARNING, "%s[PKTS][%s-UP] LoraMacParser error, not a valid LoraWan package(size=%d)!\n", WARNMSG, serv->info.name, p->size);
         }
 
         /*!> basic packet filtering */
-        pthread_mutex_lock(&serv->report->mx_report);
-        serv->report->stat_up.meas_nb_rx_rcv += 1;
+        STAT_ADD(serv->report, STAT_BLK_UP, stat_up.meas_nb_rx_rcv, 1);
         switch(p->status) {
             case STAT_CRC_OK:
-                serv->report->stat_up.meas_nb_rx_ok += 1;
+                STAT_ADD(serv->report, STAT_BLK_UP, stat_up.meas_nb_rx_ok, 1);
                 if (!serv->filter.fwd_valid_pkt) {
-                    pthread_mutex_unlock(&serv->report->mx_report);
                     continue; /*!> skip that packet */
                 }
                 break;
             case STAT_CRC_BAD:
-                serv->report->stat_up.meas_nb_rx_bad += 1;
+                STAT_ADD(serv->report, STAT_BLK_UP, stat_up.meas_nb_rx_bad, 1);
                 if (!serv->filter.fwd_error_pkt) {
-                    pthread_mutex_unlock(&serv->report->mx_report);
                     continue; /*!> skip that packet */
                 }
                 break;
             case STAT_NO_CRC:
-                serv->report->stat_up.meas_nb_rx_nocrc += 1;
+                STAT_ADD(serv->report, STAT_BLK_UP, stat_up.meas_nb_rx_nocrc, 1);
                 if (!serv->filter.fwd_nocrc_pkt) {
-                    pthread_mutex_unlock(&serv->report->mx_report);
                     continue; /*!> skip that packet */
                 }
                 break;
             default:
                 lgw_log(LOG_WARNING, "%s[PKTS][%s-UP] received packet with unknown status %u (size %u, modulation %u, BW %u, DR %u, RSSI %.1f)\n", WARNMSG, serv->info.name, p->status, p->size, p->modulation, p->bandwidth, p->datarate, p->rssic);
-                pthread_mutex_unlock(&serv->report->mx_report);
                 continue;    /*!> skip that packet */
         }
 
@@ -248,27 +256,19 @@ static void thread_push_up(void* arg) {
         //
 
         if (macmsg.BufSize != 0) {
-            if (serv->filter.fport != NOFILTER || serv->filter.devaddr != NOFILTER || 
-                serv->filter.nwkid != NOFILTER || serv->filter.deveui != NOFILTER ||
-                serv->filter.joineui != NOFILTER) {
-                FilterParams_t FP = {0};
-                memset(&FP, 0x00, sizeof(FilterParams_t));
-                FP.addr = macmsg.FHDR.DevAddr;
-                FP.fport = macmsg.FPort;
-                memcpy(FP.deveui, macmsg.DevEUI, sizeof(macmsg.DevEUI));
-                memcpy(FP.joineui, macmsg.AppEUI, sizeof(macmsg.AppEUI));
+            if (pkt_filter_enabled(serv)) {
+                FilterParams_t FP;
+                pkt_filter_params(&FP, meta);
                 if (pkt_basic_filter(serv, &FP)) {
-                    lgw_log(LOG_INFO, "%s[PKTS][%s-UP] Filter packet has fport(%u) of %08X.\n", INFOMSG, serv->info.name, macmsg.FPort, macmsg.FHDR.DevAddr);
-                    pthread_mutex_unlock(&serv->report->mx_report);
+                    lgw_log(LOG_INFO, "%s[PKTS][%s-UP] Filter packet has fport(%u) of %08X.\n", INFOMSG, serv->info.name, meta->fport, meta->devaddr);
                     continue;
                 }
             }
         }
         decode_mac_pkt_up(&macmsg, p);
 
-        serv->report->stat_up.meas_up_pkt_fwd += 1;
-        serv->report->stat_up.meas_up_payload_byte += p->size;
-        pthread_mutex_unlock(&serv->report->mx_report);
+        STAT_ADD(serv->report, STAT_BLK_UP, stat_up.meas_up_pkt_fwd, 1);
+        STAT_ADD(serv->report, STAT_BLK_UP, stat_up.meas_up_payload_byte, p->size);
         if (macmsg.BufSize != 0) {
             if(macmsg.MHDR.Bits.MType == FRAME_TYPE_JOIN_REQ){
                 lgw_log(LOG_INFO, "%s[PKTS][%s-UP] received Join_Req from DevEui: %s (fcnt=%u)\n", INFOMSG, serv->info.name, macmsg.DevEUI, macmsg.FHDR.FCnt);
@@ -278,303 +278,83 @@ static void thread_push_up(void* arg) {
         }
 
         /*!> Start of packet, add inter-packet separator if necessary */
-        if (pkt_in_dgram == 0) {
-            buff_up[buff_index] = '{';
-            ++buff_index;
-        } else {
-            buff_up[buff_index] = ',';
-            buff_up[buff_index+1] = '{';
-            buff_index += 2;
-        }
+        pkt_start = w.len;
+        if (pkt_in_dgram > 0)
+            jsonw_char(&w, ',');
 
-        /*!> JSON rxpk frame format version, 8 useful chars */
-        j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, "\"jver\":%d", PROTOCOL_JSON_RXPK_FRAME_FORMAT);
-        if (j > 0) {
-            buff_index += j;
-        } else {
-            lgw_log(LOG_ERROR, "%s[PKTS][%s-UP] snprintf failed line %u\n", ERRMSG, serv->info.name, (__LINE__ - 4));
-            buff_index = 21; /*!> skip that packet */
-            continue;
-        }
+        /*!> JSON rxpk frame format version, RAW timestamp */
+        jsonw_lit(&w, "{\"jver\":");
+        jsonw_uint(&w, PROTOCOL_JSON_RXPK_FRAME_FORMAT);
+        jsonw_lit(&w, ",\"tmst\":");
+        jsonw_uint(&w, p->count_us);
 
-        /*!> RAW timestamp, 8-17 useful chars */
-        j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"tmst\":%u", p->count_us);
-        if (j > 0) {
-            buff_index += j;
-        } else {
-            lgw_log(LOG_ERROR, "%s[PKTS][%s-UP] snprintf failed line %u\n", ERRMSG, serv->info.name, (__LINE__ - 4));
-            buff_index = 21; /*!> skip that packet */
-            continue;
-        }
-
-        /*!> Packet RX time (GPS based), 37 useful chars */
+        /*!> Packet RX time (GPS based if possible, system time otherwise) */
         if (ref_ok == true) {
             /*!> convert packet timestamp to UTC absolute time */
-            j = lgw_cnt2utc(local_ref, p->count_us, &pkt_utc_time);
-            if (j == LGW_GPS_SUCCESS) {
-                /*!> split the UNIX timestamp to its calendar components */
-                x = gmtime(&(pkt_utc_time.tv_sec));
-                j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, ",\"time\":\"%04i-%02i-%02iT%02i:%02i:%02i.%06liZ\"", (x->tm_year)+1900, (x->tm_mon)+1, x->tm_mday, x->tm_hour, x->tm_min, x->tm_sec, (pkt_utc_time.tv_nsec)/1000); /*!> ISO 8601 format */
-                if (j > 0) {
-                    buff_index += j;
-                } else {
-                    lgw_log(LOG_ERROR, "%s[PKTS][%s-UP] snprintf failed line %u\n", ERRMSG, serv->info.name, (__LINE__ - 4));
-                    buff_index = 21; /*!> skip that packet */
-                    continue;
-                }
+            if (lgw_cnt2utc(local_ref, p->count_us, &pkt_utc_time) == LGW_GPS_SUCCESS) {
+                jsonw_lit(&w, ",\"time\":");
+                jsonw_utc(&w, &pkt_utc_time);
             }
-
-            /*!> convert packet timestamp to GPS absolute time */
-            /*!>
-            j = lgw_cnt2gps(local_ref, p->count_us, &pkt_gps_time);
-            if (j == LGW_GPS_SUCCESS) {
-                pkt_gps_time_ms = pkt_gps_time.tv_sec * 1E3 + pkt_gps_time.tv_nsec / 1E6;
-                j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"tmms\":%" PRIu64 "", pkt_gps_time_ms); 
-                if (j > 0) {
-                    buff_index += j;
-                } else {
-                    lgw_log(LOG_ERROR, "%s[%s-UP] snprintf failed line %u\n", ERRMSG, serv->info.name, (__LINE__ - 4));
-                    buff_index = 21; 
-                    continue;
-                }
-            }
-            */
-
         } else { 
             clock_gettime(CLOCK_REALTIME, &pkt_utc_time);
-            x = gmtime(&(pkt_utc_time.tv_sec)); /*!> split the UNIX timestamp to its calendar components */
-            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, ",\"time\":\"%04i-%02i-%02iT%02i:%02i:%02i.%06liZ\"", (x->tm_year)+1900, (x->tm_mon)+1, x->tm_mday, x->tm_hour, x->tm_min, x->tm_sec, (pkt_utc_time.tv_nsec)/1000); /*!> ISO 8601 format */
-            if (j > 0) {
-                buff_index += j;
-            } else {
-                lgw_log(LOG_ERROR, "%s[PKTS][%s-UP] snprintf failed line %u\n", ERRMSG, serv->info.name, (__LINE__ - 4));
-                buff_index = 21; /*!> skip that packet */
-                continue;
-            }
+            jsonw_lit(&w, ",\"time\":");
+            jsonw_utc(&w, &pkt_utc_time);
         }
 
-        /*!> Packet concentrator channel, RF chain & RX frequency, 34-36 useful chars */
+        /*!> Packet concentrator channel, RF chain & RX frequency */
+        jsonw_lit(&w, ",\"chan\":");
+        jsonw_uint(&w, p->if_chain);
+        jsonw_lit(&w, ",\"rfch\":");
+        jsonw_uint(&w, p->rf_chain);
+        jsonw_lit(&w, ",\"freq\":");
+        jsonw_fixed(&w, p->freq_hz, 6);
+        jsonw_lit(&w, ",\"mid\":");
 #ifdef SX1302MOD
-        j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, ",\"chan\":%1u,\"rfch\":%1u,\"freq\":%.6lf,\"mid\":%2u", p->if_chain, p->rf_chain, ((double)p->freq_hz / 1e6), p->modem_id);
+        if (p->modem_id < 10)
+            jsonw_char(&w, ' ');    /*!> the "%2u" the field was always written with */
+        jsonw_uint(&w, p->modem_id);
 #else
-        j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, ",\"chan\":%1u,\"rfch\":%1u,\"freq\":%.6lf,\"mid\":0", p->if_chain, p->rf_chain, ((double)p->freq_hz / 1e6));
+        jsonw_char(&w, '0');
 #endif
-        if (j > 0) {
-            buff_index += j;
-        } else {
-            lgw_log(LOG_ERROR, "%s[PKTS][%s-UP] snprintf failed line %u\n", ERRMSG, serv->info.name, (__LINE__ - 4));
-            buff_index = 21; /*!> skip that packet */
-            continue;
-            //exit(EXIT_FAILURE);
-        }
 
-        /*!> Packet status, 9-10 useful chars */
-        switch (p->status) {
-            case STAT_CRC_OK:
-                memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":1", 9);
-                buff_index += 9;
-                break;
-            case STAT_CRC_BAD:
-                memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":-1", 10);
-                buff_index += 10;
-                break;
-            case STAT_NO_CRC:
-                memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":0", 9);
-                buff_index += 9;
-                break;
-            default:
-                lgw_log(LOG_ERROR, "%s[PKTS][%s-UP] received packet with unknown status 0x%02X\n", ERRMSG, serv->info.name, p->status);
-                memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":?", 9);
-                buff_index += 9;
-                continue;
-                //exit(EXIT_FAILURE);
+        /*!> Packet status, modulation, datarate & coding rate */
+        if (jsonw_rxpk_modu(&w, p) != 0) {
+            lgw_log(LOG_WARNING, "%s[PKTS][%s-UP] received packet with unknown radio parameters (status 0x%02X, modulation 0x%02X, DR 0x%02X, BW 0x%02X, CR 0x%02X)\n", WARNMSG, serv->info.name, p->status, p->modulation, p->datarate, p->bandwidth, p->coderate);
+            jsonw_reset(&w, pkt_start);
+            continue; /*!> skip that packet */
         }
 
-        /*!> Packet modulation, 13-14 useful chars */
         if (p->modulation == MOD_LORA) {
-            memcpy((void *)(buff_up + buff_index), (void *)",\"modu\":\"LORA\"", 14);
-            buff_index += 14;
-
-            /*!> Lora datarate & bandwidth, 16-19 useful chars */
-            switch (p->datarate) {
-                case DR_LORA_SF5:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF5", 12);
-                    buff_index += 12;
-                    break;
-                case DR_LORA_SF6:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF6", 12);
-                    buff_index += 12;
-                    break;
-                case DR_LORA_SF7:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF7", 12);
-                    buff_index += 12;
-                    break;
-                case DR_LORA_SF8:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF8", 12);
-                    buff_index += 12;
-                    break;
-                case DR_LORA_SF9:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF9", 12);
-                    buff_index += 12;
-                    break;
-                case DR_LORA_SF10:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF10", 13);
-                    buff_index += 13;
-                    break;
-                case DR_LORA_SF11:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF11", 13);
-                    buff_index += 13;
-                    break;
-                case DR_LORA_SF12:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF12", 13);
-                    buff_index += 13;
-                    break;
-                default:
-                    lgw_log(LOG_ERROR, "%s[PKTS][%s-UP] lora packet with unknown datarate 0x%02X\n", ERRMSG, serv->info.name, p->datarate);
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF?", 12);
-                    buff_index += 12;
-                    continue;
-            }
-            switch (p->bandwidth) {
-                case BW_125KHZ:
-                    memcpy((void *)(buff_up + buff_index), (void *)"BW125\"", 6);
-                    buff_index += 6;
-                    break;
-                case BW_250KHZ:
-                    memcpy((void *)(buff_up + buff_index), (void *)"BW250\"", 6);
-                    buff_index += 6;
-                    break;
-                case BW_500KHZ:
-                    memcpy((void *)(buff_up + buff_index), (void *)"BW500\"", 6);
-                    buff_index += 6;
-                    break;
-                default:
-                    lgw_log(LOG_WARNING, "%s[NETWORK][%s-UP] lora packet with unknown bandwidth 0x%02X\n", WARNMSG, serv->info.name, p->bandwidth);
-                    memcpy((void *)(buff_up + buff_index), (void *)"BW?\"", 4);
-                    buff_index += 4;
-                    continue;
-                    //exit(EXIT_FAILURE);
-            }
-
-            /*!> Packet ECC coding rate, 11-13 useful chars */
-            switch (p->coderate) {
-                case CR_LORA_4_5:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/5\"", 13);
-                    buff_index += 13;
-                    break;
-                case CR_LORA_4_6:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/6\"", 13);
-                    buff_index += 13;
-                    break;
-                case CR_LORA_4_7:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/7\"", 13);
-                    buff_index += 13;
-                    break;
-                case CR_LORA_4_8:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/8\"", 13);
-                    buff_index += 13;
-                    break;
-                case 0: /*!> treat the CR0 case (mostly false sync) */
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"OFF\"", 13);
-                    buff_index += 13;
-                    break;
-                default:
-                    lgw_log(LOG_WARNING, "%s[PKTS][%s-UP] lora packet with unknown coderate 0x%02X\n", WARNMSG, serv->info.name, p->coderate);
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"?\"", 11);
-                    buff_index += 11;
-                    continue;
-                    //exit(EXIT_FAILURE);
-            }
-
-            /*!> Signal RSSI, payload size */
-            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, ",\"rssis\":%.0f", roundf(p->rssis));
-            if (j > 0) {
-                buff_index += j;
-            } else {
-                lgw_log(LOG_ERROR, "%s[PKTS][%s-UP] snprintf failed line %u\n", ERRMSG, serv->info.name, (__LINE__ - 4));
-                buff_index = 21; /*!> skip that packet */
-                continue;
-                //exit(EXIT_FAILURE);
-            }
-
-            /*!> Lora SNR */
-            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, ",\"lsnr\":%.1f", p->snr);
-            if (j > 0) {
-                buff_index += j;
-            } else {
-                lgw_log(LOG_ERROR, "%s[PKTS][%s-UP] snprintf failed line %u\n", ERRMSG, serv->info.name, (__LINE__ - 4));
-                buff_index = 21; /*!> skip that packet */
-                continue;
-                //exit(EXIT_FAILURE);
-            }
-
-            /*!> Lora frequency offset */
-            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, ",\"foff\":%d", p->freq_offset);
-            if (j > 0) {
-                buff_index += j;
-            } else {
-                lgw_log(LOG_ERROR, "%s[PKTS][%s-UP] snprintf failed line %u\n", ERRMSG, serv->info.name, (__LINE__ - 4));
-                buff_index = 21; /*!> skip that packet */
-                continue;
-                //exit(EXIT_FAILURE);
-            }
-        } else if (p->modulation == MOD_FSK) {
-            memcpy((void *)(buff_up + buff_index), (void *)",\"modu\":\"FSK\"", 13);
-            buff_index += 13;
-
-            /*!> FSK datarate, 11-14 useful chars */
-            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, ",\"datr\":%u", p->datarate);
-            if (j > 0) {
-                buff_index += j;
-            } else {
-                lgw_log(LOG_ERROR, "%s[PKTS][%s-UP] snprintf failed line %u\n", ERRMSG, serv->info.name, (__LINE__ - 4));
-                buff_index = 21; /*!> skip that packet */
-                continue;
-                //exit(EXIT_FAILURE);
-            }
-        } else {
-            lgw_log(LOG_ERROR, "%s[PKTS][%s-UP] received packet with unknown modulation 0x%02X\n", ERRMSG, serv->info.name, p->modulation);
-            buff_index = 21; /*!> skip that packet */
-            continue;
-            //exit(EXIT_FAILURE);
+            /*!> Signal RSSI, Lora SNR, frequency offset */
+            jsonw_lit(&w, ",\"rssis\":");
+            jsonw_int(&w, lroundf(p->rssis));
+            jsonw_lit(&w, ",\"lsnr\":");
+            jsonw_float1(&w, p->snr);
+            jsonw_lit(&w, ",\"foff\":");
+            jsonw_int(&w, p->freq_offset);
         }
 
-        /*!> Channel RSSI, payload size, 18-23 useful chars */
-        j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, ",\"rssi\":%.0f,\"size\":%u", roundf(p->rssic), p->size);
-        if (j > 0) {
-            buff_index += j;
-        } else {
-            lgw_log(LOG_ERROR, "%s[PKTS][%s-UP] snprintf failed line %u\n", ERRMSG, serv->info.name, (__LINE__ - 4));
-            buff_index = 21; /*!> skip that packet */
-            continue;
-        }
-
-        /*!> Packet base64-encoded payload, 14-350 useful chars */
-        memcpy((void *)(buff_up + buff_index), (void *)",\"data\":\"", 9);
-        buff_index += 9;
-        {
-            int max_out = TX_BUFF_SIZE - buff_index - 2; /* leave room for closing quotes/brackets */
-            if (max_out < 0) max_out = 0;
-            int max_b64_len = (max_out < 341) ? max_out : 341; /* 255 bytes -> 340 chars + NUL */
-            j = bin_to_b64(p->payload, p->size, (char *)(buff_up + buff_index), max_b64_len);
-        }
-        if (j>=0) {
-            buff_index += j;
-        } else {
-            lgw_log(LOG_ERROR, "%s[PKTS][%s-UP] bin_to_b64 failed line %u\n", ERRMSG, serv->info.name, (__LINE__ - 5));
-            buff_index = 21; /*!> skip that packet */
+        /*!> Channel RSSI, payload size */
+        jsonw_lit(&w, ",\"rssi\":");
+        jsonw_int(&w, lroundf(p->rssic));
+        jsonw_lit(&w, ",\"size\":");
+        jsonw_uint(&w, p->size);
+
+        /*!> Packet base64-encoded payload */
+        jsonw_lit(&w, ",\"data\":\"");
+        jsonw_b64(&w, p->payload, p->size);
+        jsonw_lit(&w, "\"}");
+
+        /*!> End of packet serialization, drop it whole if it did not fit */
+        if (w.err) {
+            lgw_log(LOG_ERROR, "%s[PKTS][%s-UP] datagram buffer full, packet skipped\n", ERRMSG, serv->info.name);
+            jsonw_reset(&w, pkt_start);
             continue;
-            //exit(EXIT_FAILURE);
         }
-        buff_up[buff_index] = '"';
-        ++buff_index;
-
-        /*!> End of packet serialization */
-        buff_up[buff_index] = '}';
-        ++buff_index;
         ++pkt_in_dgram;
 
     }
+    buff_index = w.len;
 
     /*!> restart fetch sequence without sending empty JSON if all packets have been filtered out */
     if (pkt_in_dgram == 0) {
@@ -583,10 +363,6 @@ static void thread_push_up(void* arg) {
             buff_index -= 8; /*!> removes "rxpk":[ */
         } else {
             /*!> all packet have been filtered out and no report, restart loop */
-            lgw_free(serv_ct);
-            pthread_mutex_lock(&mx_pthread_count);
-            pthread_count--;
-            pthread_mutex_unlock(&mx_pthread_count);
             return;
         }
     } else {
@@ -626,65 +402,142 @@ static void thread_push_up(void* arg) {
         lgw_log(LOG_PKT, "%s[%s-UP] %s\n", PKTMSG, serv->info.name, (char *)(buff_up + 12)); /*!> DEBUG: display JSON payload */
 
     /*!> send datagram to server */
-    if (serv->net->sock_up == -1)    
+    pthread_mutex_lock(&serv->net->mx_sock);
+    if (serv->net->sock_up == -1) {
         serv->net->sock_up = init_sock((char *)&serv->net->addr, (char *)&serv->net->port_up, (void*)&serv->net->push_timeout_half, sizeof(struct timeval));
+        serv->net->sock_gen++;
+    }
+    pthread_mutex_unlock(&serv->net->mx_sock);
 
     if (serv->net->sock_up == -1) {    
         lgw_log(LOG_PKT, "%s[PKTS][%s-UP] send blocking ... Disconnect!\n", ERRMSG, serv->info.name); 
-        lgw_free(serv_ct);
-        pthread_mutex_lock(&mx_pthread_count);
-        pthread_count--;
-        pthread_mutex_unlock(&mx_pthread_count);
         return;
     }
 
-    pthread_mutex_lock(&mx_pthread_count);
+    /*!> register the token before sending, the ACK can be faster than us */
+    pthread_mutex_lock(&ack->mx_token);
+    pending = &ack->token[ack->index];
+    ack->index = (ack->index + 1) % PUSH_ACK_PENDING;
+    pending->wait = true;
+    pending->token_h = token_h;
+    pending->token_l = token_l;
+    clock_gettime(CLOCK_MONOTONIC, &pending->send_time);
+    pthread_mutex_unlock(&ack->mx_token);
+
+    pthread_mutex_lock(&serv->net->mx_sock);
     if (send(serv->net->sock_up, (void *)buff_up, buff_index, 0) == -1) {
+        pthread_mutex_unlock(&serv->net->mx_sock);
         lgw_log(LOG_PKT, "%s[PKTS][%s-UP] sending: %s\n", ERRMSG, serv->info.name, strerror(errno)); 
-        lgw_free(serv_ct);
-        pthread_count--;
-        pthread_mutex_unlock(&mx_pthread_count);
+        pthread_mutex_lock(&ack->mx_token);
+        pending->wait = false;
+        pthread_mutex_unlock(&ack->mx_token);
         return;
     }
-    pthread_mutex_unlock(&mx_pthread_count);
+    pthread_mutex_unlock(&serv->net->mx_sock);
+
+    if (serv_ct->nb_pkt > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &sent_time);
+        metrics_observe_ts(METRICS_DEQUEUE_SEND, &serv_ct->dequeue_time, &sent_time);
+    }
+
+    STAT_ADD(serv->report, STAT_BLK_UP, stat_up.meas_up_dgram_sent, 1);
+    STAT_ADD(serv->report, STAT_BLK_UP, stat_up.meas_up_network_byte, buff_index);
+}
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- THREAD : MATCHING PUSH_ACK WITH THE PENDING TOKENS ------------------- */
 
-    clock_gettime(CLOCK_MONOTONIC, &send_time);
+static void semtech_push_ack(void* arg) {
+    push_ack_s* ack = (push_ack_s*) arg;
+    serv_s* serv = ack->serv;
+
+    int i, j;
+    int sock = -1;              /*!> dup of sock_up, pull_down may close the original while recv waits */
+    uint32_t sock_gen = 0;
+    int latency_ms = -1;
+    uint8_t buff_ack[32];          /*!> buffer to receive acknowledges */
+    struct timespec recv_time;
 
-    //pthread_mutex_lock(&serv->report->mx_report);
-    serv->report->stat_up.meas_up_dgram_sent += 1;
-    serv->report->stat_up.meas_up_network_byte += buff_index;
-    //pthread_mutex_unlock(&serv->report->mx_report);
+    lgw_log(LOG_INFO, "%s[THREAD][%s] Semtech PUSH_ACK matcher Starting...\n", INFOMSG, serv->info.name);
+
+    while (!serv->thread.stop_sig) {
+        pthread_mutex_lock(&serv->net->mx_sock);
+        if (sock == -1 || sock_gen != serv->net->sock_gen) {
+            Close(sock);
+            sock = (serv->net->sock_up == -1) ? -1 : dup(serv->net->sock_up);
+            sock_gen = serv->net->sock_gen;
+        }
+        pthread_mutex_unlock(&serv->net->mx_sock);
+
+        if (sock == -1) {
+            wait_ms(DEFAULT_FETCH_SLEEP_MS * 10);
+            continue;
+        }
 
-    /*!> wait for acknowledge (in 2 times, to catch extra packets) */
-    for (i=0; i<2; ++i) {
-        j = recv(serv->net->sock_up, (void *)buff_ack, sizeof buff_ack, 0);
+        /*!> socket has a receive timeout, so stop_sig is checked regularly */
+        j = recv(sock, (void *)buff_ack, sizeof buff_ack, 0);
         clock_gettime(CLOCK_MONOTONIC, &recv_time);
         if (j == -1) {
-            if (errno == EAGAIN) { /*!> timeout */
-                continue;
-            } else { /*!> server connection error */
-                break;
-            }
+            if (errno != EAGAIN && errno != EINTR)  /*!> server connection error, let pull_down reconnect */
+                wait_ms(DEFAULT_FETCH_SLEEP_MS * 10);
+            continue;
         } else if ((j < 4) || (buff_ack[0] != PROTOCOL_VERSION) || (buff_ack[3] != PKT_PUSH_ACK)) {
             //lgw_log(LOG_ERROR, "%s[up] ignored invalid non-ACL packet\n", WARNMSG);
             continue;
-        } else if ((buff_ack[1] != token_h) || (buff_ack[2] != token_l)) {
+        }
+
+        latency_ms = -1;
+        pthread_mutex_lock(&ack->mx_token);
+        for (i = 0; i < PUSH_ACK_PENDING; i++) {
+            if (ack->token[i].wait && ack->token[i].token_h == buff_ack[1] && ack->token[i].token_l == buff_ack[2]) {
+                ack->token[i].wait = false;
+                latency_ms = (int)(1000 * difftimespec(recv_time, ack->token[i].send_time));
+                metrics_observe_ts(METRICS_PUSH_ACK, &ack->token[i].send_time, &recv_time);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&ack->mx_token);
+
+        if (latency_ms < 0) {
             //lgw_log(LOG_ERROR, "%s[up] ignored out-of sync ACK packet\n", WARNMSG);
             continue;
-        } else {
-            lgw_log(LOG_INFO, "%s[NETWORK][%s-UP] PUSH_ACK received in %i ms\n", INFOMSG, serv->info.name, (int)(1000 * difftimespec(recv_time, send_time)));
-            time(&serv->state.contact);
-            pthread_mutex_lock(&serv->report->mx_report);
-            serv->report->stat_up.meas_up_ack_rcv += 1;
-            pthread_mutex_unlock(&serv->report->mx_report);
-            break;
         }
+
+        lgw_log(LOG_INFO, "%s[NETWORK][%s-UP] PUSH_ACK received in %i ms\n", INFOMSG, serv->info.name, latency_ms);
+        time(&serv->state.contact);
+        STAT_ADD(serv->report, STAT_BLK_ACK, stat_up.meas_up_ack_rcv, 1);
     }
-    lgw_free(serv_ct);
-    pthread_mutex_lock(&mx_pthread_count);
-    pthread_count--;
-    pthread_mutex_unlock(&mx_pthread_count);
-    //lgw_log(LOG_DEBUG, "THREAD~>> [%s tid=%ld] End of thread_semtech_push_up\n", serv->info.name, pthread_self());
+
+    Close(sock);
+    lgw_log(LOG_INFO, "%s[THREAD][%s] Semtech PUSH_ACK matcher Ended!\n", INFOMSG, serv->info.name);
+}
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PREEMPTED DOWNLINKS, REJECTED BY THEIR OWN SERVICE ------------------- */
+
+/*!> called from the thread of the preempting service, serv is the owner */
+static void post_tx_reject(serv_s* serv, uint16_t token) {
+    pthread_mutex_lock(&serv->net->mx_reject);
+    if (serv->net->nb_reject < SERV_REJECT_MAX)
+        serv->net->reject[serv->net->nb_reject++] = token;
+    else
+        lgw_log(LOG_WARNING, "%s[%s-DOWN] too many preempted downlinks, no TX_ACK for token %04X\n", WARNMSG, serv->info.name, token);
+    pthread_mutex_unlock(&serv->net->mx_reject);
+}
+
+/*!> pull_down thread of serv: TX_ACK the downlinks other services preempted */
+static void send_tx_rejects(serv_s* serv) {
+    uint16_t reject[SERV_REJECT_MAX];
+    int i, nb;
+
+    pthread_mutex_lock(&serv->net->mx_reject);
+    nb = serv->net->nb_reject;
+    memcpy(reject, serv->net->reject, nb * sizeof(uint16_t));
+    serv->net->nb_reject = 0;
+    pthread_mutex_unlock(&serv->net->mx_reject);
+
+    for (i = 0; i < nb; i++)
+        send_tx_ack(serv, reject[i] >> 8, reject[i] & 0xFF, JIT_ERROR_COLLISION_PACKET, 0);
 }
 
 /*!> -------------------------------------------------------------------------- */
@@ -758,6 +611,9 @@ static void semtech_pull_down(void* arg) {
     enum jit_error_e jit_result = JIT_ERROR_OK;
     enum jit_pkt_type_e downlink_type;
     enum jit_error_e warning_result = JIT_ERROR_OK;
+    struct jit_meta_s jit_meta;
+    struct jit_node_s evicted[JIT_PREEMPT_MAX];
+    int nb_evicted = 0;
     int32_t warning_value = 0;
     uint8_t tx_lut_idx = 0;
 
@@ -885,7 +741,7 @@ static void semtech_pull_down(void* arg) {
             pull_send = 0;
             pull_ack = 0;
 
-            pthread_mutex_lock(&mx_pthread_count);
+            pthread_mutex_lock(&serv->net->mx_sock);
 
             serv->state.connecting = false;
             GW.info.network_status = false;
@@ -893,9 +749,10 @@ static void semtech_pull_down(void* arg) {
             Close(serv->net->sock_up);
 
             serv->net->sock_down = init_sock((char*)&serv->net->addr, (char*)&serv->net->port_down, (void*)&serv->net->pull_timeout, sizeof(struct timeval));
-            serv->net->sock_up = init_sock((char*)&serv->net->addr, (char*)&serv->net->port_down, (void*)&serv->net->pull_timeout, sizeof(struct timeval));
+            serv->net->sock_up = init_sock((char*)&serv->net->addr, (char*)&serv->net->port_up, (void*)&serv->net->push_timeout_half, sizeof(struct timeval));
+            serv->net->sock_gen++;
 
-            pthread_mutex_unlock(&mx_pthread_count);
+            pthread_mutex_unlock(&serv->net->mx_sock);
         }
         
 
@@ -934,9 +791,7 @@ static void semtech_pull_down(void* arg) {
             continue;
         }
 
-        pthread_mutex_lock(&serv->report->mx_report);
-        serv->report->stat_down.meas_dw_pull_sent += 1;
-        pthread_mutex_unlock(&serv->report->mx_report);
+        STAT_ADD(serv->report, STAT_BLK_DOWN, stat_down.meas_dw_pull_sent, 1);
 
         req_ack = false;
 
@@ -950,6 +805,9 @@ static void semtech_pull_down(void* arg) {
             msg_len = recv(serv->net->sock_down, (void *)buff_down, sizeof buff_down, 0);
             clock_gettime(CLOCK_MONOTONIC, &recv_time);
 
+            /*!> downlinks of this service preempted by another one */
+            send_tx_rejects(serv);
+
             /*!> Pre-allocate beacon slots in JiT queue, to check downlink collisions */
             beacon_loop = JIT_NUM_BEACON_IN_QUEUE - GW.tx.jit_queue[0].num_beacon;
             retry = 0;
@@ -1012,19 +870,11 @@ static void semtech_pull_down(void* arg) {
                     beacon_pkt.payload[beacon_pyld_idx++] = 0xFF & (field_crc1 >> 8);
 
                     /*!> Insert beacon packet in JiT queue */
-#ifdef SX1302MOD
-                   pthread_mutex_lock(&GW.hal.mx_concent);
-                   lgw_get_instcnt(&current_concentrator_time);
-                   pthread_mutex_unlock(&GW.hal.mx_concent);
-#else
                    get_concentrator_time(&current_concentrator_time);
-#endif
                    jit_result = jit_enqueue(&GW.tx.jit_queue[0], current_concentrator_time, &beacon_pkt, JIT_PKT_TYPE_BEACON);
                    if (jit_result == JIT_ERROR_OK) {
                         /*!> update stats */
-                        pthread_mutex_lock(&serv->report->mx_report);
-                        serv->report->meas_nb_beacon_queued += 1;
-                        pthread_mutex_unlock(&serv->report->mx_report);
+                        STAT_ADD(serv->report, STAT_BLK_DOWN, meas_nb_beacon_queued, 1);
 
                         /*!> One more beacon in the queue */
                         beacon_loop--;
@@ -1041,11 +891,9 @@ static void semtech_pull_down(void* arg) {
                     } else {
                         lgw_log(LOG_BEACON, "%s[BEACON][%s]--> beacon queuing failed with %d\n", INFOMSG, serv->info.name, jit_result);
                         /*!> update stats */
-                        pthread_mutex_lock(&serv->report->mx_report);
                         if (jit_result != JIT_ERROR_COLLISION_BEACON) {
-                            serv->report->meas_nb_beacon_rejected += 1;
+                            STAT_ADD(serv->report, STAT_BLK_DOWN, meas_nb_beacon_rejected, 1);
                         }
-                        pthread_mutex_unlock(&serv->report->mx_report);
                         /*!> In case previous enqueue failed, we retry one period later until it succeeds */
                         /*!> Note: In case the GPS has been unlocked for a while, there can be lots of retries */
                         /*!>       to be done from last beacon time to a new valid one */
@@ -1079,10 +927,9 @@ static void semtech_pull_down(void* arg) {
                         req_ack = true;
                         pull_ack++;
                         autoquit_cnt = 0;
-                        pthread_mutex_lock(&serv->report->mx_report);
-                        serv->report->stat_down.meas_dw_ack_rcv += 1;
-                        pthread_mutex_unlock(&serv->report->mx_report);
+                        STAT_ADD(serv->report, STAT_BLK_DOWN, stat_down.meas_dw_ack_rcv, 1);
                         serv->state.connecting = true;
+                        metrics_observe_ts(METRICS_PULL_ACK, &send_time, &recv_time);
                         lgw_log(LOG_INFO, "%s[NETWORK][%s-DOWN] PULL_ACK received in %i ms\n", INFOMSG, serv->info.name, (int)(1000 * difftimespec(recv_time, send_time)));
                     }
                 } else { /*!> out-of-sync token */
@@ -1388,11 +1235,9 @@ static void semtech_pull_down(void* arg) {
             }
 
             /*!> record measurement data */
-            pthread_mutex_lock(&serv->report->mx_report);
-            serv->report->stat_down.meas_dw_dgram_rcv += 1; /*!> count only datagrams with no JSON errors */
-            serv->report->stat_down.meas_dw_network_byte += msg_len; /*!> meas_dw_network_byte */
-            serv->report->stat_down.meas_dw_payload_byte += txpkt.size;
-            pthread_mutex_unlock(&serv->report->mx_report);
+            STAT_ADD(serv->report, STAT_BLK_DOWN, stat_down.meas_dw_dgram_rcv, 1); /*!> count only datagrams with no JSON errors */
+            STAT_ADD(serv->report, STAT_BLK_DOWN, stat_down.meas_dw_network_byte, msg_len); /*!> meas_dw_network_byte */
+            STAT_ADD(serv->report, STAT_BLK_DOWN, stat_down.meas_dw_payload_byte, txpkt.size);
 
             /*!> reset error/warning results */
             jit_result = warning_result = JIT_ERROR_OK;
@@ -1423,30 +1268,36 @@ static void semtech_pull_down(void* arg) {
 
             /*!> insert packet to be sent into JIT queue */
             if (jit_result == JIT_ERROR_OK) {
-#ifdef SX1302MOD
-                pthread_mutex_lock(&GW.hal.mx_concent);
-                lgw_get_instcnt(&current_concentrator_time);
-                pthread_mutex_unlock(&GW.hal.mx_concent);
-#else
                 get_concentrator_time(&current_concentrator_time);
-#endif
+                jit_meta.id = 0;
                 if (GW.lbt.lbt_tty_enabled) {
-                    jit_result = lbt_enqueue(&txpkt, current_concentrator_time);
+                    jit_result = lbt_enqueue(&txpkt, current_concentrator_time, &jit_meta.id);
                     if (jit_result != JIT_ERROR_OK) 
                         lgw_log(LOG_ERROR, "%s[PKTS][%s-LBT] Packet lbt queue (error=%d)\n", ERRMSG, serv->info.name, jit_result);
                 }
-                jit_result = jit_enqueue(&GW.tx.jit_queue[txpkt.rf_chain], current_concentrator_time, &txpkt, downlink_type);
+                jit_meta.priority = serv->info.dn_prio[jit_priority_class(downlink_type, &txpkt)];
+                jit_meta.preempt = GW.cfg.jit_preemption;
+                jit_meta.origin = serv;
+                jit_meta.token = ((uint16_t)buff_down[1] << 8) | buff_down[2];
+                jit_result = jit_enqueue_prio(&GW.tx.jit_queue[txpkt.rf_chain], current_concentrator_time, &txpkt, downlink_type, &jit_meta, evicted, &nb_evicted);
+                /*!> the downlinks this one preempted are rejected towards their own server */
+                for (i = 0; i < nb_evicted; i++) {
+                    lbt_cancel(evicted[i].meta.id);
+                    if (evicted[i].meta.origin == NULL)
+                        continue;
+                    lgw_log(LOG_WARNING, "%s[PKTS][%s-DOWN] downlink at %u preempted, rejected to %s\n", WARNMSG, serv->info.name, evicted[i].pkt.count_us, ((serv_s*)evicted[i].meta.origin)->info.name);
+                    post_tx_reject((serv_s*)evicted[i].meta.origin, evicted[i].meta.token);
+                }
                 if (jit_result != JIT_ERROR_OK) {
+                    lbt_cancel(jit_meta.id);
                     lgw_log(LOG_ERROR, "%s[PKTS][%s-DOWN] Packet REJECTED (jit error=%d)\n", ERRMSG, serv->info.name, jit_result);
                 } else {
                     lgw_log(LOG_INFO, "%s[PKTS][%s-DOWN] A packet enqueue, us=%u, cur_us=%u\n", DEBUGMSG, serv->info.name, txpkt.count_us, current_concentrator_time);
                     /*!> In case of a warning having been raised before, we notify it */
                     jit_result = warning_result;
                 }
-                pthread_mutex_lock(&serv->report->mx_report);
-                serv->report->stat_down.meas_nb_tx_requested += 1;
-                serv->report->stat_down.meas_nb_tx_ok += 1;
-                pthread_mutex_unlock(&serv->report->mx_report);
+                STAT_ADD(serv->report, STAT_BLK_DOWN, stat_down.meas_nb_tx_requested, 1);
+                STAT_ADD(serv->report, STAT_BLK_DOWN, stat_down.meas_nb_tx_ok, 1);
             }
 
             /*!> Send acknoledge datagram to server */
@@ -1529,64 +1380,59 @@ static void semtech_pull_down(void* arg) {
 
 }
 
-static enum jit_error_e lbt_enqueue(struct lgw_pkt_tx_s* packet, uint32_t time_us)
-{
-    int i;
-
-    if (packet == NULL) {
-        lgw_log(LOG_JIT_ERROR, "%s[PKTS][LBT] invalid parameter\n", ERRMSG);
-        return JIT_ERROR_INVALID;
-    }
-    
-    for (i = 0; i < NB_LBT_QUEUE; i++) {
-        if (GW.lbt.lbt_stat[i].count_us <  time_us) {
-            GW.lbt.lbt_stat[i].freq_hz = packet->freq_hz;
-            GW.lbt.lbt_stat[i].count_us = packet->count_us;
-            GW.lbt.lbt_stat[i].chan_is_free = false;
-            return JIT_ERROR_OK;
-        }
-    }
-
-    return JIT_ERROR_FULL;
-
-}
-
 static void semtech_push_up(void* arg) {
     serv_s* serv = (serv_s*) arg;
-    int nb_pkt = 0;
+    pthread_t thrid_ack;
+    push_ack_s ack;
+    serv_ct_s* serv_ct = NULL;
+    uint8_t* buff_up = NULL;       /*!> buffer to compose the upstream packet */
 
     lgw_log(LOG_INFO, "%s[THREAD][%s] Semtech UP service Starting...\n", INFOMSG, serv->info.name);
 
+    /*!> one batch and one datagram at a time, allocated for the whole life of the service */
+    serv_ct = lgw_malloc(sizeof(serv_ct_s));
+    buff_up = lgw_malloc(TX_BUFF_SIZE);
+    if (NULL == serv_ct || NULL == buff_up) {
+        lgw_log(LOG_ERROR, "%s[THREAD][%s] Semtech UP service can't allocate buffers!\n", ERRMSG, serv->info.name);
+        lgw_free(serv_ct);
+        lgw_free(buff_up);
+        return;
+    }
+    serv_ct->serv = serv;
+
+    memset(&ack, 0, sizeof(ack));
+    ack.serv = serv;
+    pthread_mutex_init(&ack.mx_token, NULL);
+
+    if (lgw_pthread_create(&thrid_ack, NULL, (void *(*)(void *))semtech_push_ack, (void*)&ack)) {
+        lgw_log(LOG_ERROR, "%s[THREAD][%s] Can't create PUSH_ACK pthread.\n", ERRMSG, serv->info.name);
+        lgw_free(serv_ct);
+        lgw_free(buff_up);
+        pthread_mutex_destroy(&ack.mx_token);
+        return;
+    }
+
     while (!serv->thread.stop_sig) {
         sem_wait(&serv->thread.sema);
         do {
-            serv_ct_s *serv_ct = lgw_malloc(sizeof(serv_ct_s));
-            serv_ct->serv = serv;
             serv_ct->nb_pkt = get_rxpkt(serv_ct);     /* only get the first rxpkt of list */
-            nb_pkt = serv_ct->nb_pkt;                                                   
-            if (serv_ct->nb_pkt == 0 && serv->report->report_ready == false) { 
-                lgw_free(serv_ct);
+            if (serv_ct->nb_pkt == 0 && serv->report->report_ready == false) 
                 break;
-            }
 
-            pthread_t ntid;
-            if (lgw_pthread_create(&ntid, NULL, (void *(*)(void *))thread_push_up, (void*)serv_ct)) {
-                lgw_free(serv_ct);
-            } else {
-                pthread_detach(ntid);
-                pthread_mutex_lock(&mx_pthread_count);
-                pthread_count++;
-                pthread_mutex_unlock(&mx_pthread_count);
-            }
-
-            lgw_log(LOG_DEBUG, "%s[PKTS][%s] semtech_push_up(count=%d) fetch %d %s.\n", DEBUGMSG, serv->info.name, pthread_count, serv_ct->nb_pkt, serv_ct->nb_pkt < 2 ? "packet" : "packets");
+            lgw_log(LOG_DEBUG, "%s[PKTS][%s] semtech_push_up fetch %d %s.\n", DEBUGMSG, serv->info.name, serv_ct->nb_pkt, serv_ct->nb_pkt < 2 ? "packet" : "packets");
 
-            if (nb_pkt == 0) break;
+            push_up_dgram(serv_ct, &ack, buff_up);
 
-        } while (pthread_count < MAX_PTHREADS_COUNT && (GW.rxpkts_list.size > 1) && (!serv->thread.stop_sig));
+        } while (rxpkt_pending(serv) && (!serv->thread.stop_sig));
 
     }
 
+    pthread_join(thrid_ack, NULL);
+    pthread_mutex_destroy(&ack.mx_token);
+    release_rxpkt(serv_ct);
+    lgw_free(serv_ct);
+    lgw_free(buff_up);
+
     lgw_log(LOG_INFO, "\n%s[THREAD][%s-UP] Ended!\n", INFOMSG, serv->info.name);
 }
 
@@ -27,6 +27,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <sys/socket.h>			/* socket specific definitions */
 #include <netinet/in.h>			/* INET constants and stuff */
@@ -111,137 +112,75 @@ int init_sock(const char *addr, const char *port, const void *timeout, int size)
     return sockfd;
 }
 
+/*!> INCLUDE drops the listed values, EXCLUDE drops everything not listed */
+static bool filter_level_drop(filter_e level, bool listed) {
+    switch (level) {
+        case INCLUDE:
+            return listed;
+        case EXCLUDE:
+            return !listed;
+        default:
+            return false;
+    }
+}
+
 bool pkt_basic_filter(serv_s* serv, FilterParams_t *FP) {
-    char addr_key[64] = {0};
-    char fport_key[48] = {0};
-    char nwkid_key[64] = {0};
-    char deveui_key[64] = {0};
-    char appeui_key[64] = {0};
     uint8_t nwkid = 0;
 
     FilterParams_t *pParams = FP;
-    snprintf(addr_key, sizeof(addr_key), "%s/devaddr/%08X", serv->info.name, pParams->addr);
-    snprintf(fport_key, sizeof(fport_key), "%s/fport/%u", serv->info.name, pParams->fport);
 
     nwkid = (pParams->addr >> 25) & 0x7F;   /* Devaddr Format:  31..25(NwkID)  24..0(NwkAddr) */
 
-    snprintf(nwkid_key, sizeof(nwkid_key), "%s/nwkid/%02X", serv->info.name, nwkid);
-    snprintf(appeui_key, sizeof(appeui_key), "%s/joineui/", serv->info.name);
-    snprintf(deveui_key, sizeof(deveui_key), "%s/deveui/", serv->info.name);
-
-    lgw_log(LOG_INFO, "%s[%s-filter] fport-lv=%d, addr-lv=%d, nwkid-lv=%d, joineui-lv=%d, deveui-lv=%d, "
-                      "addr_key=%s, fport_key=%s, nwkid_key=%s, appeui_key=%s, deveui_key=%s\n", INFOMSG, 
-                        serv->info.name, serv->filter.fport, serv->filter.devaddr, serv->filter.nwkid, 
-                        serv->filter.joineui, serv->filter.deveui,
-                        addr_key, fport_key, nwkid_key, appeui_key, deveui_key);
-
-    switch (serv->filter.fport) {
-        case INCLUDE: // 1
-            if (lgw_db_key_exist(fport_key)) {
-                lgw_log(LOG_INFO, "%s[%s-filter] fport filter include\n", INFOMSG, serv->info.name);
-                return true;  // filter
-            }
-            lgw_log(LOG_INFO, "%s[%s-filter] fport filter not include\n", INFOMSG, serv->info.name);
-            break;
-        case EXCLUDE: // 2
-            if (!lgw_db_key_exist(fport_key)) {
-                lgw_log(LOG_INFO, "%s[%s-filter] fport filter exclude\n", INFOMSG, serv->info.name);
-                return true;  //filter
-            }
-            lgw_log(LOG_INFO, "%s[%s-filter] fport filter not exclude\n", INFOMSG, serv->info.name);
-            break;
-        default:
-            lgw_log(LOG_INFO, "%s[%s-filter] fport no filter\n", INFOMSG, serv->info.name);
-            break;
+    if (serv->filter.fport != NOFILTER &&
+        filter_level_drop(serv->filter.fport, lgw_db_filter_exist(serv->info.name, LGW_FILTER_FPORT, pParams->fport))) {
+        lgw_log(LOG_DEBUG, "%s[%s-filter] fport(%u) filtered, level(%d)\n", DEBUGMSG, serv->info.name, pParams->fport, serv->filter.fport);
+        return true;
     }
 
-    switch(serv->filter.devaddr) {
-        case INCLUDE: //1
-            if (lgw_db_key_exist(addr_key)) {
-                lgw_log(LOG_INFO, "%s[%s-filter] devaddr filter include\n", INFOMSG, serv->info.name);
-                return true; // filter
-            }
-            lgw_log(LOG_INFO, "%s[%s-filter] devaddr filter not include\n", INFOMSG, serv->info.name);
-            break;
-        case EXCLUDE:
-            if (!lgw_db_key_exist(addr_key) && pParams->addr>0) {
-                lgw_log(LOG_INFO, "%s[%s-filter] devaddr filter exclude\n", INFOMSG, serv->info.name);
-                return true; 
-            }
-            lgw_log(LOG_INFO, "%s[%s-filter] devaddr filter not exclude\n", INFOMSG, serv->info.name);
-            break;
-        default:
-            lgw_log(LOG_INFO, "%s[%s-filter] devaddr no filter\n", INFOMSG, serv->info.name);
-            break;
+    /*!> EXCLUDE never drops a frame without devaddr (join request) */
+    if (serv->filter.devaddr != NOFILTER && (serv->filter.devaddr == INCLUDE || pParams->addr > 0) &&
+        filter_level_drop(serv->filter.devaddr, lgw_db_filter_exist(serv->info.name, LGW_FILTER_DEVADDR, pParams->addr))) {
+        lgw_log(LOG_DEBUG, "%s[%s-filter] devaddr(%08X) filtered, level(%d)\n", DEBUGMSG, serv->info.name, pParams->addr, serv->filter.devaddr);
+        return true;
     }
 
-    switch(serv->filter.nwkid) {
-        case INCLUDE: //1
-            if (lgw_db_key_exist(nwkid_key)) {
-                lgw_log(LOG_INFO, "%s[%s-filter] nwkid(%02X) filter include \n", INFOMSG, serv->info.name, nwkid);
-                return true; // filter
-            }
-            lgw_log(LOG_INFO, "%s[%s-filter] nwkid(%02X) filter not include \n", INFOMSG, serv->info.name, nwkid);
-            break;
-        case EXCLUDE:
-            if (!lgw_db_key_exist(nwkid_key) && pParams->addr>0) {
-                lgw_log(LOG_INFO, "%s[%s-filter] nwkid(%02X) filter exclude \n", INFOMSG, serv->info.name, nwkid);
-                return true; 
-            }
-            lgw_log(LOG_INFO, "%s[%s-filter] nwkid(%02X) filter not exclude \n", INFOMSG, serv->info.name, nwkid);
-            break;
-        default:
-            lgw_log(LOG_INFO, "%s[%s-filter] nwkid(%02X) no filter\n", INFOMSG, serv->info.name, nwkid);
-            break;
+    if (serv->filter.nwkid != NOFILTER && (serv->filter.nwkid == INCLUDE || pParams->addr > 0) &&
+        filter_level_drop(serv->filter.nwkid, lgw_db_filter_exist(serv->info.name, LGW_FILTER_NWKID, nwkid))) {
+        lgw_log(LOG_DEBUG, "%s[%s-filter] nwkid(%02X) filtered, level(%d)\n", DEBUGMSG, serv->info.name, nwkid, serv->filter.nwkid);
+        return true;
     }
 
-    if (strlen(pParams->deveui) > 0) {
-        switch(serv->filter.deveui) {
-            case INCLUDE: //1
-                if (lgw_db_key_exist_ex(deveui_key, pParams->deveui)) {
-                    lgw_log(LOG_INFO, "%s[%s-filter] deveui(%s) filter include \n", INFOMSG, serv->info.name, pParams->deveui);
-                    return true; // filter
-                }
-                lgw_log(LOG_INFO, "%s[%s-filter] deveui(%s) filter not include \n", INFOMSG, serv->info.name, pParams->deveui);
-                break;
-            case EXCLUDE:
-                if (!lgw_db_key_exist_ex(deveui_key, pParams->deveui)) {
-                    lgw_log(LOG_INFO, "%s[%s-filter] deveui(%s) filter exclude \n", INFOMSG, serv->info.name, pParams->deveui);
-                    return true;
-                }
-                lgw_log(LOG_INFO, "%s[%s-filter] deveui(%s) filter not exclude \n", INFOMSG, serv->info.name, pParams->deveui);
-                break;
-            default:
-                lgw_log(LOG_INFO, "%s[%s-filter] deveui(%s) no filter\n", INFOMSG, serv->info.name, pParams->deveui);
-                break;
-        }
+    if (serv->filter.deveui != NOFILTER && pParams->has_eui &&
+        filter_level_drop(serv->filter.deveui, lgw_db_filter_exist(serv->info.name, LGW_FILTER_DEVEUI, pParams->deveui))) {
+        lgw_log(LOG_DEBUG, "%s[%s-filter] deveui(%016llX) filtered, level(%d)\n", DEBUGMSG, serv->info.name, (unsigned long long)pParams->deveui, serv->filter.deveui);
+        return true;
     }
 
-    if (strlen(pParams->joineui) > 0) {
-        switch(serv->filter.joineui) {
-            case INCLUDE: //1
-                if (lgw_db_key_exist_ex(deveui_key, pParams->joineui)) {
-                    lgw_log(LOG_INFO, "%s[%s-filter] joineui(%s) filter include \n", INFOMSG, serv->info.name, pParams->joineui);
-                    return true; // filter
-                }
-                lgw_log(LOG_INFO, "%s[%s-filter] joineui(%s) filter not include \n", INFOMSG, serv->info.name, pParams->joineui);
-                break;
-            case EXCLUDE:
-                if (!lgw_db_key_exist_ex(deveui_key, pParams->joineui)) {
-                    lgw_log(LOG_INFO, "%s[%s-filter] joineui(%s) filter exclude \n", INFOMSG, serv->info.name, pParams->joineui);
-                    return true; 
-                }
-                lgw_log(LOG_INFO, "%s[%s-filter] joineui(%s) filter not exclude \n", INFOMSG, serv->info.name, pParams->joineui);
-                break;
-            default:
-                lgw_log(LOG_INFO, "%s[%s-filter] joineui(%s) no filter\n", INFOMSG, serv->info.name, pParams->joineui);
-                break;
-        }
+    if (serv->filter.joineui != NOFILTER && pParams->has_eui &&
+        filter_level_drop(serv->filter.joineui, lgw_db_filter_exist(serv->info.name, LGW_FILTER_JOINEUI, pParams->joineui))) {
+        lgw_log(LOG_DEBUG, "%s[%s-filter] joineui(%016llX) filtered, level(%d)\n", DEBUGMSG, serv->info.name, (unsigned long long)pParams->joineui, serv->filter.joineui);
+        return true;
     }
-    //lgw_log(LOG_DEBUG, "%s[%s-filter] default: no filter\n", DEBUGMSG, serv->info.name);
+
     return false;  // no-filter
 }
 
+bool pkt_filter_enabled(serv_s* serv) {
+    return serv->filter.fport != NOFILTER || serv->filter.devaddr != NOFILTER ||
+           serv->filter.nwkid != NOFILTER || serv->filter.deveui != NOFILTER ||
+           serv->filter.joineui != NOFILTER;
+}
+
+void pkt_filter_params(FilterParams_t *FP, const mac_meta_s *meta) {
+    memset(FP, 0, sizeof(FilterParams_t));
+    FP->addr = meta->devaddr;
+    FP->fport = meta->fport;
+    if (meta->mtype == FRAME_TYPE_JOIN_REQ) {
+        FP->has_eui = true;
+        FP->deveui = meta->deveui;
+        FP->joineui = meta->joineui;
+    }
+}
 
 /*
 void service_handle_rxpkt(rxpkts_s* rxpkt) {
@@ -0,0 +1,283 @@
+/*!>
+ *  ____  ____      _    ____ ___ _   _  ___
+ *  |  _ \|  _ \    / \  / ___|_ _| \ | |/ _ \
+ *  | | | | |_) |  / _ \| |  _ | ||  \| | | | |
+ *  | |_| |  _ <  / ___ \ |_| || || |\  | |_| |
+ *  |____/|_| \_\/_/   \_\____|___|_| \_|\___/
+ *
+ * Dragino_gw_fwd -- An opensource lora gateway forward
+ *
+ * See http://www.dragino.com for more information about
+ * the lora gateway project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ *
+ * Maintainer: skerlan
+ *
+ */
+
+/*!>!
+ * \file
+ * \brief spectral scan results: mmap'd ring file and UDP export
+ *
+ * Records are published seqlock style: the writer marks the slot busy,
+ * fills it, stores its number and then moves head.  A reader copies the
+ * slot and keeps the copy only when the number read before and after is
+ * the one it asked for.  Numbers are 32 bits so that MIPS32 has native
+ * atomics for them; when they wrap the slots move once and a few records
+ * read as missing.  Nothing here logs, so that the readers do not need
+ * the forwarder logger.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "sscan.h"
+#include "jsonw.h"
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define SSCAN_JSON_SIZE         1024
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PRIVATE FUNCTIONS ---------------------------------------------------- */
+
+static size_t sscan_file_size(uint32_t capacity) {
+    return sizeof(struct sscan_hdr_s) + (size_t)capacity * sizeof(struct sscan_rec_s);
+}
+
+static bool sscan_hdr_valid(const struct sscan_hdr_s *hdr) {
+    return hdr->magic == SSCAN_MAGIC && hdr->version == SSCAN_VERSION &&
+           hdr->rec_size == sizeof(struct sscan_rec_s) && hdr->nb_bins == SSCAN_NB_BINS && hdr->capacity > 0;
+}
+
+static int sscan_map(struct sscan_ring_s *ring, size_t size, int prot) {
+    void *map;
+
+    map = mmap(NULL, size, prot, MAP_SHARED, ring->fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    ring->size = size;
+    ring->hdr = (struct sscan_hdr_s *)map;
+    ring->recs = (struct sscan_rec_s *)((uint8_t *)map + sizeof(struct sscan_hdr_s));
+    return 0;
+}
+
+/*!> -------------------------------------------------------------------------- */
+/*!> --- PUBLIC FUNCTIONS ----------------------------------------------------- */
+
+int sscan_ring_create(struct sscan_ring_s *ring, const char *path, uint32_t capacity) {
+    struct sscan_hdr_s hdr;
+    struct stat st;
+    size_t size = sscan_file_size(capacity);
+    bool keep = false;
+    int err;
+
+    memset(ring, 0, sizeof(*ring));
+    if (capacity == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ring->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (ring->fd == -1)
+        return -1;
+    ring->writer = true;
+
+    /*!> a survey survives a restart of the forwarder when the geometry did not change */
+    if (fstat(ring->fd, &st) == 0 && (size_t)st.st_size == size &&
+        pread(ring->fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr) &&
+        sscan_hdr_valid(&hdr) && hdr.capacity == capacity)
+        keep = true;
+
+    if (!keep && (ftruncate(ring->fd, 0) == -1 || ftruncate(ring->fd, size) == -1))
+        goto fail;
+
+    if (sscan_map(ring, size, PROT_READ | PROT_WRITE) == -1)
+        goto fail;
+
+    if (!keep) {
+        ring->hdr->version = SSCAN_VERSION;
+        ring->hdr->rec_size = sizeof(struct sscan_rec_s);
+        ring->hdr->capacity = capacity;
+        ring->hdr->nb_bins = SSCAN_NB_BINS;
+        ring->hdr->head = 0;
+        /*!> readers check the magic first */
+        __atomic_store_n(&ring->hdr->magic, SSCAN_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+
+fail:
+    err = errno;
+    close(ring->fd);
+    ring->fd = -1;
+    errno = err;
+    return -1;
+}
+
+int sscan_ring_attach(struct sscan_ring_s *ring, const char *path) {
+    struct sscan_hdr_s hdr;
+    struct stat st;
+    int err;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (ring->fd == -1)
+        return -1;
+
+    if (pread(ring->fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) || !sscan_hdr_valid(&hdr) ||
+        fstat(ring->fd, &st) == -1 || (size_t)st.st_size < sscan_file_size(hdr.capacity)) {
+        errno = EPROTO;
+        goto fail;
+    }
+
+    if (sscan_map(ring, sscan_file_size(hdr.capacity), PROT_READ) == -1)
+        goto fail;
+
+    return 0;
+
+fail:
+    err = errno;
+    close(ring->fd);
+    ring->fd = -1;
+    errno = err;
+    return -1;
+}
+
+void sscan_ring_close(struct sscan_ring_s *ring) {
+    if (ring->hdr != NULL) {
+        if (ring->writer)
+            msync(ring->hdr, ring->size, MS_ASYNC);
+        munmap(ring->hdr, ring->size);
+    }
+    if (ring->fd != -1)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+void sscan_ring_set_levels(struct sscan_ring_s *ring, const int16_t *levels_dbm) {
+    memcpy(ring->hdr->levels_dbm, levels_dbm, sizeof(ring->hdr->levels_dbm));
+}
+
+void sscan_ring_append(struct sscan_ring_s *ring, struct sscan_rec_s *rec) {
+    uint32_t seq = ring->hdr->head;
+    struct sscan_rec_s *slot = &ring->recs[seq % ring->hdr->capacity];
+
+    __atomic_store_n(&slot->seq, SSCAN_SEQ_BUSY, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->seq = SSCAN_SEQ_BUSY;
+    memcpy(slot, rec, sizeof(*slot));
+    __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->hdr->head, seq + 1, __ATOMIC_RELEASE);
+    rec->seq = seq;
+}
+
+uint32_t sscan_ring_head(const struct sscan_ring_s *ring) {
+    return __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE);
+}
+
+int sscan_ring_read(const struct sscan_ring_s *ring, uint32_t seq, struct sscan_rec_s *rec) {
+    const struct sscan_rec_s *slot;
+    uint32_t head = sscan_ring_head(ring);
+
+    /*!> written and not overwritten yet, modulo 2^32; the busy mark cannot be told from that record */
+    if (seq == SSCAN_SEQ_BUSY || head - seq - 1 >= ring->hdr->capacity)
+        return -1;
+
+    slot = &ring->recs[seq % ring->hdr->capacity];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq)
+        return -1;
+    memcpy(rec, slot, sizeof(*rec));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+        return -1;
+    rec->seq = seq;
+
+    return 0;
+}
+
+int sscan_export_open(const char *host, const char *port) {
+    struct addrinfo hints;
+    struct addrinfo *result, *q;
+    int sock = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if (getaddrinfo(host, port, &hints, &result) != 0)
+        return -1;
+
+    for (q = result; q != NULL; q = q->ai_next) {
+        sock = socket(q->ai_family, q->ai_socktype | SOCK_CLOEXEC, q->ai_protocol);
+        if (sock == -1)
+            continue;
+        if (connect(sock, q->ai_addr, q->ai_addrlen) == 0)
+            break;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(result);
+
+    return sock;
+}
+
+int sscan_export_send(int sock, const struct sscan_rec_s *rec, const int16_t *levels_dbm) {
+    char buff[SSCAN_JSON_SIZE];
+    struct timespec t;
+    jsonw_s w;
+    int i;
+
+    t.tv_sec = rec->time_ns / 1000000000ULL;
+    t.tv_nsec = rec->time_ns % 1000000000ULL;
+
+    jsonw_init(&w, buff, sizeof(buff), 0);
+    jsonw_lit(&w, "{\"sscan\":{\"time\":");
+    jsonw_utc(&w, &t);
+    jsonw_lit(&w, ",\"seq\":");
+    jsonw_uint(&w, rec->seq);
+    jsonw_lit(&w, ",\"sweep\":");
+    jsonw_uint(&w, rec->sweep);
+    jsonw_lit(&w, ",\"freq\":");
+    jsonw_uint(&w, rec->freq_hz);
+    jsonw_lit(&w, ",\"nb_scan\":");
+    jsonw_uint(&w, rec->nb_scan);
+    jsonw_lit(&w, ",\"duration\":");
+    jsonw_uint(&w, rec->duration_ms);
+    jsonw_lit(&w, ",\"levels\":[");
+    for (i = 0; i < SSCAN_NB_BINS; i++) {
+        if (i > 0)
+            jsonw_char(&w, ',');
+        jsonw_int(&w, levels_dbm[i]);
+    }
+    jsonw_lit(&w, "],\"results\":[");
+    for (i = 0; i < SSCAN_NB_BINS; i++) {
+        if (i > 0)
+            jsonw_char(&w, ',');
+        jsonw_uint(&w, rec->results[i]);
+    }
+    jsonw_lit(&w, "]}}");
+
+    if (w.err)
+        return -1;
+
+    return send(sock, buff, w.len, MSG_DONTWAIT) == w.len ? 0 : -1;
+}
+
+/*!> --- EOF ------------------------------------------------------------------ */
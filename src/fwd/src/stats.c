@@ -48,6 +48,36 @@
 
 DECLARE_GW;
 
+void stat_sum(report_s *report, stat_cnt_s *sum) {
+    uint32_t *t = (uint32_t *)sum;
+    size_t i;
+    int b;
+
+    for (i = 0; i < sizeof(stat_cnt_s) / sizeof(uint32_t); i++) {
+        t[i] = 0;
+        for (b = 0; b < STAT_NB_BLK; b++)
+            t[i] += __atomic_load_n((uint32_t *)&report->blk_cnt[b].cnt + i, __ATOMIC_RELAXED);
+    }
+}
+
+/*!>!
+ * \brief counts since the previous report
+ *
+ * Blocks are read while their threads keep adding: a count landing between
+ * two reads goes to this report or to the next one, none is lost.
+ */
+static void stat_collect(report_s *report, stat_cnt_s *delta) {
+    uint32_t *d = (uint32_t *)delta;
+    uint32_t *last = (uint32_t *)&report->last;
+    size_t i;
+
+    stat_sum(report, delta);
+    for (i = 0; i < sizeof(stat_cnt_s) / sizeof(uint32_t); i++) {
+        d[i] -= last[i];        /*!> modulo 2^32, wraps cancel out */
+        last[i] += d[i];
+    }
+}
+
 static void semtech_report(serv_s *serv) {
     int i;
     time_t current_time;
@@ -98,38 +128,47 @@ static void semtech_report(serv_s *serv) {
     float up_ack_ratio;
     float dw_ack_ratio;
 
-    /*!> access upstream statistics, copy and reset them */
-    pthread_mutex_lock(&(serv->report->mx_report));
+    stat_cnt_s delta;
 
-    cp_nb_rx_rcv = serv->report->stat_up.meas_nb_rx_rcv;
-    cp_nb_rx_ok = serv->report->stat_up.meas_nb_rx_ok;
-    cp_nb_rx_bad = serv->report->stat_up.meas_nb_rx_bad;
-    cp_nb_rx_nocrc = serv->report->stat_up.meas_nb_rx_nocrc;
-    cp_up_pkt_fwd = serv->report->stat_up.meas_up_pkt_fwd;
-    cp_up_network_byte = serv->report->stat_up.meas_up_network_byte;
-    cp_up_payload_byte = serv->report->stat_up.meas_up_payload_byte;
-
-    cp_nb_rx_drop = cp_nb_rx_rcv - cp_nb_rx_ok - cp_nb_rx_bad - cp_nb_rx_nocrc;
+    /*!> counts since the previous report, the writers are not stopped */
+    stat_collect(serv->report, &delta);
 
-    cp_up_dgram_sent = serv->report->stat_up.meas_up_dgram_sent;
-    cp_up_ack_rcv = serv->report->stat_up.meas_up_ack_rcv;
+    cp_nb_rx_rcv = delta.stat_up.meas_nb_rx_rcv;
+    cp_nb_rx_ok = delta.stat_up.meas_nb_rx_ok;
+    cp_nb_rx_bad = delta.stat_up.meas_nb_rx_bad;
+    cp_nb_rx_nocrc = delta.stat_up.meas_nb_rx_nocrc;
+    cp_up_pkt_fwd = delta.stat_up.meas_up_pkt_fwd;
+    cp_up_network_byte = delta.stat_up.meas_up_network_byte;
+    cp_up_payload_byte = delta.stat_up.meas_up_payload_byte;
 
-    serv->report->stat_up.meas_nb_rx_rcv = 0;
-    serv->report->stat_up.meas_nb_rx_ok = 0;
-    serv->report->stat_up.meas_nb_rx_bad = 0;
-    serv->report->stat_up.meas_nb_rx_nocrc = 0;
-    serv->report->stat_up.meas_up_pkt_fwd = 0;
-    serv->report->stat_up.meas_up_network_byte = 0;
-    serv->report->stat_up.meas_up_payload_byte = 0;
-    serv->report->stat_up.meas_up_dgram_sent = 0;
-    serv->report->stat_up.meas_up_ack_rcv = 0;
+    cp_nb_rx_drop = cp_nb_rx_rcv - cp_nb_rx_ok - cp_nb_rx_bad - cp_nb_rx_nocrc;
 
-    /*!> get timestamp for statistics (must be done inside the lock) */
+    cp_up_dgram_sent = delta.stat_up.meas_up_dgram_sent;
+    cp_up_ack_rcv = delta.stat_up.meas_up_ack_rcv;
+
+    cp_dw_pull_sent  = delta.stat_down.meas_dw_pull_sent;
+    cp_dw_ack_rcv = delta.stat_down.meas_dw_ack_rcv;
+    cp_dw_dgram_rcv = delta.stat_down.meas_dw_dgram_rcv;
+    cp_dw_dgram_acp = delta.stat_down.meas_dw_dgram_acp;
+
+    cp_dw_network_byte = delta.stat_down.meas_dw_network_byte;
+    cp_dw_payload_byte = delta.stat_down.meas_dw_payload_byte;
+    cp_nb_tx_ok = delta.stat_down.meas_nb_tx_ok;
+    cp_nb_tx_fail = delta.stat_down.meas_nb_tx_fail;
+
+    cp_nb_tx_requested = delta.stat_down.meas_nb_tx_requested;
+    cp_nb_tx_rejected_collision_packet = delta.stat_down.meas_nb_tx_rejected_collision_packet;
+    cp_nb_tx_rejected_collision_beacon = delta.stat_down.meas_nb_tx_rejected_collision_beacon;
+    cp_nb_tx_rejected_too_late = delta.stat_down.meas_nb_tx_rejected_too_late;
+    cp_nb_tx_rejected_too_early = delta.stat_down.meas_nb_tx_rejected_too_early;
+    cp_nb_beacon_queued = delta.meas_nb_beacon_queued;
+    cp_nb_beacon_sent = delta.meas_nb_beacon_sent;
+    cp_nb_beacon_rejected = delta.meas_nb_beacon_rejected;
+
+    /*!> get timestamp for statistics */
     current_time = time(NULL);
     serv->state.stall_time = (int)(current_time - serv->state.contact);
 
-    pthread_mutex_unlock(&serv->report->mx_report);
-
     /*!> Do the math */
     strftime(stat_timestamp, sizeof stat_timestamp, "%F %T %Z", gmtime(&current_time));
     strftime(iso_timestamp, sizeof stat_timestamp, "%FT%TZ", gmtime(&current_time));
@@ -150,50 +189,6 @@ static void semtech_report(serv_s *serv) {
         up_ack_ratio = 0.0;
     }
 
-    /*!> access downstream statistics, copy and reset them */
-
-    pthread_mutex_lock(&serv->report->mx_report);
-
-    cp_dw_pull_sent  = serv->report->stat_down.meas_dw_pull_sent;
-    cp_dw_ack_rcv = serv->report->stat_down.meas_dw_ack_rcv;
-    cp_dw_dgram_rcv = serv->report->stat_down.meas_dw_dgram_rcv;
-    cp_dw_dgram_acp = serv->report->stat_down.meas_dw_dgram_acp;
-
-    cp_dw_network_byte = serv->report->stat_down.meas_dw_network_byte;
-    cp_dw_payload_byte = serv->report->stat_down.meas_dw_payload_byte;
-    cp_nb_tx_ok = serv->report->stat_down.meas_nb_tx_ok;
-    cp_nb_tx_fail = serv->report->stat_down.meas_nb_tx_fail;
-
-    //TODO: Why were here all '+=' instead of '='?? The summed values grow unbounded and eventually overflow!
-    cp_nb_tx_requested += serv->report->stat_down.meas_nb_tx_requested;	
-    cp_nb_tx_rejected_collision_packet += serv->report->stat_down.meas_nb_tx_rejected_collision_packet;	
-    cp_nb_tx_rejected_collision_beacon += serv->report->stat_down.meas_nb_tx_rejected_collision_beacon;	
-    cp_nb_tx_rejected_too_late += serv->report->stat_down.meas_nb_tx_rejected_too_late;	
-    cp_nb_tx_rejected_too_early += serv->report->stat_down.meas_nb_tx_rejected_too_early;	
-    cp_nb_beacon_queued += serv->report->meas_nb_beacon_queued;	
-    cp_nb_beacon_sent += serv->report->meas_nb_beacon_sent;	
-    cp_nb_beacon_rejected += serv->report->meas_nb_beacon_rejected;	
-
-    serv->report->stat_down.meas_dw_pull_sent = 0;
-    serv->report->stat_down.meas_dw_ack_rcv = 0;
-
-    serv->report->stat_down.meas_dw_dgram_rcv = 0;
-    serv->report->stat_down.meas_dw_dgram_acp = 0;
-
-    serv->report->stat_down.meas_dw_network_byte = 0;
-    serv->report->stat_down.meas_dw_payload_byte = 0;
-    serv->report->stat_down.meas_nb_tx_ok = 0;
-    serv->report->stat_down.meas_nb_tx_fail = 0;
-    serv->report->stat_down.meas_nb_tx_requested = 0;
-    serv->report->stat_down.meas_nb_tx_rejected_collision_packet = 0;
-    serv->report->stat_down.meas_nb_tx_rejected_collision_beacon = 0;
-    serv->report->stat_down.meas_nb_tx_rejected_too_late = 0;
-    serv->report->stat_down.meas_nb_tx_rejected_too_early = 0;
-    serv->report->meas_nb_beacon_queued = 0;
-    serv->report->meas_nb_beacon_sent = 0;
-    serv->report->meas_nb_beacon_rejected = 0;
-    pthread_mutex_unlock(&serv->report->mx_report);
-
     if (cp_dw_pull_sent > 0) {
         dw_ack_ratio = (float)cp_dw_ack_rcv / (float)cp_dw_pull_sent;
     } else {
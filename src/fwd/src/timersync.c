@@ -18,6 +18,7 @@ Maintainer: Michael Coracin
 /* --- DEPENDANCIES --------------------------------------------------------- */
 
 #include <pthread.h>
+#include <time.h>
 
 #include "logger.h"
 #include "gwcfg.h"
@@ -29,24 +30,35 @@ Maintainer: Michael Coracin
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE CONSTANTS & TYPES -------------------------------------------- */
 
-/* -------------------------------------------------------------------------- */
-/* --- PRIVATE MACROS ------------------------------------------------------- */
-
-#define timer_sub(a, b, result)                                                \
-  do {                                                                        \
-    (result)->tv_sec = (a)->tv_sec - (b)->tv_sec;                             \
-    (result)->tv_usec = (a)->tv_usec - (b)->tv_usec;                          \
-    if ((result)->tv_usec < 0) {                                              \
-      --(result)->tv_sec;                                                     \
-      (result)->tv_usec += 1000000;                                           \
-    }                                                                         \
-  } while (0)
+#define TIMERSYNC_PERIOD_MS     60000   /* delay between two samples */
+#define TIMERSYNC_NB_SAMPLE     8       /* samples used for the drift estimate */
+#define TIMERSYNC_MAX_DRIFT_PPB 200000  /* 200ppm, a steeper fit means a glitch in the samples */
+#define TIMERSYNC_MAX_ERROR_US  10000   /* prediction error above which the model restarts */
+#define TIMERSYNC_MAX_AGE_US    100000  /* SX1302: age of the counter sample above which it is read again */
+
+/* host <-> concentrator clock model, count_us = count_ref + dt + dt * drift_ppb / 1E9
+   with dt = host time - host_ref, readers use a seqlock */
+struct timersync_model_s {
+    uint32_t seq;               /* odd while the model is being updated */
+    uint32_t valid;             /* at least one sample taken */
+    int64_t host_ref;           /* CLOCK_MONOTONIC_RAW, in µs */
+    int64_t count_ref;          /* unwrapped concentrator counter at host_ref, in µs */
+    int64_t drift_ppb;          /* concentrator rate relative to host, in parts per billion */
+};
+
+struct timersync_sample_s {
+    int64_t host;               /* CLOCK_MONOTONIC_RAW, in µs */
+    int64_t count;              /* unwrapped concentrator counter, in µs */
+};
 
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE VARIABLES (GLOBAL) ------------------------------------------- */
 
-static pthread_mutex_t mx_timersync = PTHREAD_MUTEX_INITIALIZER; /* control access to timer sync offsets */
-static struct timeval offset_unix_concent = {0,0}; /* timer offset between unix host and concentrator */
+static struct timersync_model_s model;
+
+#ifdef SX1302MOD
+static pthread_mutex_t mx_refresh = PTHREAD_MUTEX_INITIALIZER; /* one SPI read at a time for a stale sample */
+#endif
 
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE SHARED VARIABLES (GLOBAL) ------------------------------------ */
@@ -54,45 +66,140 @@ extern bool exit_sig;
 extern bool quit_sig;
 
 /* -------------------------------------------------------------------------- */
-/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+static int64_t host_time_us(void) {
+    struct timespec t;
+
+    /* not slewed by NTP, the drift estimate takes care of the host crystal */
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+    return (int64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static int64_t model_predict(const struct timersync_model_s *m, int64_t host) {
+    int64_t dt = host - m->host_ref;
+
+    return m->count_ref + dt + dt * m->drift_ppb / 1000000000;
+}
+
+/* writer side of the seqlock, only thread_timersync updates the model;
+   the 64 bits fields are plain volatile accesses between the fences, MIPS32
+   has no 64 bits atomics and the seq word already tells a torn read */
+static void model_publish(int64_t host_ref, int64_t count_ref, int64_t drift_ppb) {
+    volatile struct timersync_model_s *vm = &model;
+    uint32_t seq = model.seq;
+
+    __atomic_store_n(&model.seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    vm->host_ref = host_ref;
+    vm->count_ref = count_ref;
+    vm->drift_ppb = drift_ppb;
+    vm->valid = 1;
+    __atomic_store_n(&model.seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* least-squares line through the samples, the rate is fitted as an offset
+   from 1 to keep the doubles well conditioned; anchored on the last sample */
+static void model_fit(const struct timersync_sample_s *smp, int nb, int last, int64_t *count_ref, int64_t *drift_ppb) {
+    double mx = 0, my = 0, sxx = 0, sxy = 0, x, y, d = 0;
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        mx += (double)(smp[i].host - smp[last].host);
+        my += (double)(smp[i].count - smp[last].count - (smp[i].host - smp[last].host));
+    }
+    mx /= nb;
+    my /= nb;
+
+    for (i = 0; i < nb; i++) {
+        x = (double)(smp[i].host - smp[last].host);
+        y = (double)(smp[i].count - smp[last].count) - x;
+        sxx += (x - mx) * (x - mx);
+        sxy += (x - mx) * (y - my);
+    }
+    if (sxx > 0)
+        d = sxy / sxx;
+
+    /* value of the fitted line at x = 0, the last sample */
+    *count_ref = smp[last].count + (int64_t)(my - d * mx);
+    *drift_ppb = (int64_t)(d * 1E9);
+}
 
 DECLARE_GW;
 
-int get_concentrator_time(uint32_t* concent_time) {
-    struct timeval local_timeval;
-    struct timeval unix_time;
+#ifdef SX1302MOD
+/* SX1302: no sync thread, the counter is sampled on demand once the sample gets
+   older than TIMERSYNC_MAX_AGE_US and extrapolated with the host clock in between,
+   20ppm over that age is a 2µs error */
+static void model_refresh(void) {
+    uint32_t instcnt = 0;
+    int64_t host, host_before, host_after;
+
+    pthread_mutex_lock(&mx_refresh);
+    /* sampled once the lock is held, another thread may have refreshed meanwhile */
+    host = host_time_us();
+    /* only this function writes on SX1302, under mx_refresh: plain reads are safe */
+    if (!model.valid || host - model.host_ref > TIMERSYNC_MAX_AGE_US) {
+        pthread_mutex_lock(&GW.hal.mx_concent);
+        host_before = host_time_us();
+        lgw_get_instcnt(&instcnt);
+        host_after = host_time_us();
+        pthread_mutex_unlock(&GW.hal.mx_concent);
+        model_publish(host_before + (host_after - host_before) / 2, instcnt, 0);
+    }
+    pthread_mutex_unlock(&mx_refresh);
+}
+#endif
 
-    gettimeofday(&unix_time, NULL);
-    //clock_gettime(CLOCK_MONOTONIC, &unix_time);
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+
+int get_concentrator_time(uint32_t* concent_time) {
+    const volatile struct timersync_model_s *vm = &model;
+    struct timersync_model_s m;
+    uint32_t seq;
+    int64_t host;
 
     if (concent_time == NULL) {
         lgw_log(LOG_ERROR, "ERROR: %s invalid parameter\n", __FUNCTION__);
         return -1;
     }
 
-    pthread_mutex_lock(&mx_timersync); /* protect global variable access */
-    timer_sub(&unix_time, &offset_unix_concent, &local_timeval);
-    pthread_mutex_unlock(&mx_timersync);
-
-    *concent_time = local_timeval.tv_sec * 1000000UL + local_timeval.tv_usec;
-    //lgw_log(LOG_TIMERSYNC, "INFO~ [timesync] localtime: %u\n", *concent_time);
+    host = host_time_us();
+
+    /* reader side of the seqlock, retry if the model changed meanwhile */
+    do {
+        seq = __atomic_load_n(&model.seq, __ATOMIC_ACQUIRE);
+        m.valid = vm->valid;
+        m.host_ref = vm->host_ref;
+        m.count_ref = vm->count_ref;
+        m.drift_ppb = vm->drift_ppb;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+#ifdef SX1302MOD
+        if (!m.valid || host - m.host_ref > TIMERSYNC_MAX_AGE_US) {
+            model_refresh();
+            /* the refresh may have blocked on mx_refresh or mx_concent */
+            host = host_time_us();
+            seq = 1;    /* read the fresh sample */
+        }
+#endif
+    } while ((seq & 1) || seq != __atomic_load_n(&model.seq, __ATOMIC_RELAXED));
 
-    lgw_log(LOG_TIMERSYNC, " --> TIME: unix current time is   %ld,%ld\n", unix_time.tv_sec, unix_time.tv_usec);
-    lgw_log(LOG_TIMERSYNC, "           offset is              %ld,%ld\n", offset_unix_concent.tv_sec, offset_unix_concent.tv_usec);
-    lgw_log(LOG_TIMERSYNC, "           sx130x current time is %ld,%ld\n", local_timeval.tv_sec, local_timeval.tv_usec);
+    /* the sx130x counter is 32 bits wide, the truncation wraps it like the hardware */
+    *concent_time = (uint32_t)model_predict(&m, host);
 
-    return 0;
+    return m.valid ? 0 : -1;
 }
 
 /* ---------------------------------------------------------------------------------------------- */
 /* --- THREAD 6: REGULARLAY MONITOR THE OFFSET BETWEEN UNIX CLOCK AND CONCENTRATOR CLOCK -------- */
 
 void thread_timersync(void) {
-    struct timeval unix_timeval;
-    struct timeval concentrator_timeval;
+    struct timersync_sample_s samples[TIMERSYNC_NB_SAMPLE];
+    int nb_sample = 0, last = 0;
     uint32_t sx130x_timecount = 0;
-    struct timeval offset_previous = {0,0};
-    struct timeval offset_drift = {0,0}; /* delta between current and previous offset */
+    int64_t host_before, host_after, host, predicted, count, error;
+    int64_t count_ref, drift_ppb;
 
     lgw_log(LOG_INFO, "\nINFO~ [TimerSync] Timesysnc thread start...\n");
     while (!exit_sig && !quit_sig) {
@@ -105,41 +212,15 @@ void thread_timersync(void) {
         pthread_mutex_unlock(&GW.hal.mx_concent);
 #endif
 
-        /* Get current unix time */
-        gettimeofday(&unix_timeval, NULL);
-        //clock_gettime(CLOCK_MONOTONIC, &unix_timeval);
-
-        /* Get current concentrator counter value (1MHz) */
+        /* Get current concentrator counter value (1MHz), the host time is taken
+            on both sides of the SPI access to cancel its latency */
         pthread_mutex_lock(&GW.hal.mx_concent);
+        host_before = host_time_us();
         lgw_get_trigcnt(&sx130x_timecount);
+        host_after = host_time_us();
         pthread_mutex_unlock(&GW.hal.mx_concent);
+        host = host_before + (host_after - host_before) / 2;
 
-        concentrator_timeval.tv_sec = sx130x_timecount / 1000000UL;
-        concentrator_timeval.tv_usec = sx130x_timecount - (concentrator_timeval.tv_sec * 1000000UL);
-
-        /* Compute offset between unix and concentrator timers, with microsecond precision */
-        offset_previous.tv_sec = offset_unix_concent.tv_sec;
-        offset_previous.tv_usec = offset_unix_concent.tv_usec;
-
-        /* TODO: handle sx130x coutner wrap-up */
-        pthread_mutex_lock(&mx_timersync); /* protect global variable access */
-        timer_sub(&unix_timeval, &concentrator_timeval, &offset_unix_concent);
-        pthread_mutex_unlock(&mx_timersync);
-
-        //printf("#DEBUG#DEBUG# offset=%ld,%ld\n", offset_unix_concent.tv_sec, offset_unix_concent.tv_usec);
-
-        timer_sub(&offset_unix_concent, &offset_previous, &offset_drift);
-
-        lgw_log(LOG_TIMERSYNC, "  sx130x = %u (µs) - timeval (%ld,%ld)\n",
-                                          sx130x_timecount,
-                                          concentrator_timeval.tv_sec,
-                                          concentrator_timeval.tv_usec);
-        lgw_log(LOG_TIMERSYNC, "  unix_timeval = %ld,%ld\n", unix_timeval.tv_sec, unix_timeval.tv_usec);
-
-        lgw_log(LOG_TIMERSYNC, "INFO~ [TimerSync] host/sx130x time offset=(%lds:%ldµs) - drift=%ldµs\n",
-                            offset_unix_concent.tv_sec,
-                            offset_unix_concent.tv_usec,
-                            offset_drift.tv_sec * 1000000UL + offset_drift.tv_usec);
 #ifdef SX1301MOD
         lgw_log(LOG_TIMERSYNC, "INFO~ [TimerSync] Enabling GPS mode for concentrator's counter.\n\n");
         pthread_mutex_lock(&GW.hal.mx_concent); /* TODO: Is it necessary to protect here? */
@@ -147,13 +228,53 @@ void thread_timersync(void) {
         pthread_mutex_unlock(&GW.hal.mx_concent);
 #endif
 
+        /* Unwrap the counter around the value the model expects: it wraps every ~71 minutes,
+            far more than the sync period, so the 32 bits difference is unambiguous */
+        if (nb_sample > 0) {
+            predicted = model_predict(&model, host);
+            error = (int32_t)(sx130x_timecount - (uint32_t)predicted);
+            count = predicted + error;
+        } else {
+            error = 0;
+            count = sx130x_timecount;
+        }
+
+        if (error > TIMERSYNC_MAX_ERROR_US || error < -TIMERSYNC_MAX_ERROR_US) {
+            /* concentrator restarted or host suspended: the old samples do not fit anymore */
+            lgw_log(LOG_TIMERSYNC, "INFO~ [TimerSync] sx130x counter is %ldµs off the model, restarting it\n", (long)error);
+            nb_sample = 0;
+            count = sx130x_timecount;
+        }
+
+        last = (nb_sample == 0) ? 0 : (last + 1) % TIMERSYNC_NB_SAMPLE;
+        samples[last].host = host;
+        samples[last].count = count;
+        if (nb_sample < TIMERSYNC_NB_SAMPLE)
+            nb_sample++;
+
+        model_fit(samples, nb_sample, last, &count_ref, &drift_ppb);
+        if (drift_ppb > TIMERSYNC_MAX_DRIFT_PPB || drift_ppb < -TIMERSYNC_MAX_DRIFT_PPB) {
+            lgw_log(LOG_TIMERSYNC, "INFO~ [TimerSync] implausible drift %ldppb, restarting the model\n", (long)drift_ppb);
+            samples[0] = samples[last];
+            nb_sample = 1;
+            last = 0;
+            count_ref = count;
+            drift_ppb = 0;
+        }
+
+        model_publish(host, count_ref, drift_ppb);
+
+        lgw_log(LOG_TIMERSYNC, "  sx130x = %u (µs) - host = %lld (µs), spi access %lldµs\n",
+                                          sx130x_timecount, (long long)host, (long long)(host_after - host_before));
+        lgw_log(LOG_TIMERSYNC, "INFO~ [TimerSync] host/sx130x model error=%ldµs - drift=%ldppb over %d samples\n",
+                            (long)error, (long)drift_ppb, nb_sample);
+
         /* delay next sync */
         /* If we consider a crystal oscillator precision of about 20ppm worst case, and a clock
             running at 1MHz, this would mean 1µs drift every 50000µs (10000000/20).
-            As here the time precision is not critical, we should be able to cope with at least 1ms drift,
-            which should occur after 50s (50000µs * 1000).
-            Let's set the thread sleep to 1 minute for now */
-        wait_ms(60000);
+            The drift is now estimated and compensated between two samples, the period only
+            bounds how fast a change of drift (temperature) is followed */
+        wait_ms(TIMERSYNC_PERIOD_MS);
     }
     lgw_log(LOG_INFO, "\nINFO~ [TimerSync] END of Timesysnc thread! \n");
 }
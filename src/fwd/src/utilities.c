@@ -273,7 +273,7 @@ void DO_CRASH_NORETURN __lgw_assert_failed(int condition, const char *condition_
 	 * someone saw the message on stderr ...
 	 */
 	fprintf(stderr, "FRACK!, Failed assertion %s (%d) at line %d in %s of %s\n", condition_str, condition, line, function, file);
-	lgw_log(LOG_ERROR, file, line, function, "FRACK!, Failed assertion %s (%d)\n", condition_str, condition);
+	lgw_log(LOG_ERROR, "FRACK!, Failed assertion %s (%d) at line %d in %s of %s\n", condition_str, condition, line, function, file);
 
 	/*!> Generate a backtrace for the assert */
 	//lgw_log_backtrace();
@@ -0,0 +1,171 @@
+/*
+ * rxpk serialization micro benchmark: the former chained snprintf encoder of
+ * semtech_serv.c against the jsonw writer, on the same packet batch.
+ *
+ * Usage: rxpk_bench [loops]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+
+#include "base64.h"
+#include "jsonw.h"
+
+#define BENCH_BUFF_SIZE     (540 * 16)
+#define BENCH_NB_PKT        8
+
+static double difftimespec(struct timespec end, struct timespec beginning) {
+    return (double)(end.tv_sec - beginning.tv_sec) + 1e-9 * (double)(end.tv_nsec - beginning.tv_nsec);
+}
+
+/* copy of the encoder formerly used by push_up_dgram, error handling stripped */
+static int encode_snprintf(const struct lgw_pkt_rx_s* pkts, int nb_pkt, const struct timespec* utc, char* buff, int size) {
+    int i, j, idx = 0;
+    struct tm* x;
+    const struct lgw_pkt_rx_s* p;
+
+    idx += snprintf(buff + idx, size - idx, "{\"rxpk\":[");
+    for (i = 0; i < nb_pkt; i++) {
+        p = &pkts[i];
+        if (i > 0)
+            buff[idx++] = ',';
+        idx += snprintf(buff + idx, size - idx, "{\"jver\":%d", 1);
+        idx += snprintf(buff + idx, size - idx, ",\"tmst\":%u", p->count_us);
+        x = gmtime(&utc->tv_sec);
+        idx += snprintf(buff + idx, size - idx, ",\"time\":\"%04i-%02i-%02iT%02i:%02i:%02i.%06liZ\"", (x->tm_year)+1900, (x->tm_mon)+1, x->tm_mday, x->tm_hour, x->tm_min, x->tm_sec, (utc->tv_nsec)/1000);
+        idx += snprintf(buff + idx, size - idx, ",\"chan\":%1u,\"rfch\":%1u,\"freq\":%.6lf,\"mid\":0", p->if_chain, p->rf_chain, ((double)p->freq_hz / 1e6));
+        memcpy(buff + idx, ",\"stat\":1", 9);
+        idx += 9;
+        memcpy(buff + idx, ",\"modu\":\"LORA\"", 14);
+        idx += 14;
+        memcpy(buff + idx, ",\"datr\":\"SF7", 12);
+        idx += 12;
+        memcpy(buff + idx, "BW125\"", 6);
+        idx += 6;
+        memcpy(buff + idx, ",\"codr\":\"4/5\"", 13);
+        idx += 13;
+        idx += snprintf(buff + idx, size - idx, ",\"rssis\":%.0f", roundf(p->rssis));
+        idx += snprintf(buff + idx, size - idx, ",\"lsnr\":%.1f", p->snr);
+        idx += snprintf(buff + idx, size - idx, ",\"foff\":%d", p->freq_offset);
+        idx += snprintf(buff + idx, size - idx, ",\"rssi\":%.0f,\"size\":%u", roundf(p->rssic), p->size);
+        memcpy(buff + idx, ",\"data\":\"", 9);
+        idx += 9;
+        j = bin_to_b64(p->payload, p->size, buff + idx, size - idx);
+        idx += j;
+        buff[idx++] = '"';
+        buff[idx++] = '}';
+    }
+    buff[idx++] = ']';
+    buff[idx++] = '}';
+    buff[idx] = 0;
+    return idx;
+}
+
+static int encode_jsonw(const struct lgw_pkt_rx_s* pkts, int nb_pkt, const struct timespec* utc, char* buff, int size) {
+    int i;
+    jsonw_s w;
+    const struct lgw_pkt_rx_s* p;
+
+    jsonw_init(&w, buff, size, 0);
+    jsonw_lit(&w, "{\"rxpk\":[");
+    for (i = 0; i < nb_pkt; i++) {
+        p = &pkts[i];
+        if (i > 0)
+            jsonw_char(&w, ',');
+        jsonw_lit(&w, "{\"jver\":");
+        jsonw_uint(&w, 1);
+        jsonw_lit(&w, ",\"tmst\":");
+        jsonw_uint(&w, p->count_us);
+        jsonw_lit(&w, ",\"time\":");
+        jsonw_utc(&w, utc);
+        jsonw_lit(&w, ",\"chan\":");
+        jsonw_uint(&w, p->if_chain);
+        jsonw_lit(&w, ",\"rfch\":");
+        jsonw_uint(&w, p->rf_chain);
+        jsonw_lit(&w, ",\"freq\":");
+        jsonw_fixed(&w, p->freq_hz, 6);
+        jsonw_lit(&w, ",\"mid\":0");
+        jsonw_rxpk_modu(&w, p);
+        jsonw_lit(&w, ",\"rssis\":");
+        jsonw_int(&w, lroundf(p->rssis));
+        jsonw_lit(&w, ",\"lsnr\":");
+        jsonw_float1(&w, p->snr);
+        jsonw_lit(&w, ",\"foff\":");
+        jsonw_int(&w, p->freq_offset);
+        jsonw_lit(&w, ",\"rssi\":");
+        jsonw_int(&w, lroundf(p->rssic));
+        jsonw_lit(&w, ",\"size\":");
+        jsonw_uint(&w, p->size);
+        jsonw_lit(&w, ",\"data\":\"");
+        jsonw_b64(&w, p->payload, p->size);
+        jsonw_lit(&w, "\"}");
+    }
+    jsonw_lit(&w, "]}");
+    if (w.err)
+        return -1;
+    buff[w.len] = 0;
+    return w.len;
+}
+
+int main(int argc, char* argv[]) {
+    static char out_a[BENCH_BUFF_SIZE], out_b[BENCH_BUFF_SIZE];
+    struct lgw_pkt_rx_s pkts[BENCH_NB_PKT];
+    struct timespec utc, start, end;
+    double t_a, t_b;
+    long loops = 100000, l;
+    int i, j, len_a = 0, len_b = 0;
+
+    if (argc > 1)
+        loops = atol(argv[1]);
+
+    srand(1);
+    memset(pkts, 0, sizeof(pkts));
+    for (i = 0; i < BENCH_NB_PKT; i++) {
+        pkts[i].freq_hz = 868100000 + 200000 * i;
+        pkts[i].if_chain = i;
+        pkts[i].rf_chain = i & 1;
+        pkts[i].status = STAT_CRC_OK;
+        pkts[i].count_us = (uint32_t)rand();
+        pkts[i].modulation = MOD_LORA;
+        pkts[i].bandwidth = BW_125KHZ;
+        pkts[i].datarate = DR_LORA_SF7;
+        pkts[i].coderate = CR_LORA_4_5;
+        pkts[i].rssic = -(float)(rand() % 120) - 0.25f;
+        pkts[i].rssis = pkts[i].rssic - 3.0f;
+        pkts[i].snr = (float)(rand() % 200 - 150) / 10.0f + 0.03f;
+        pkts[i].freq_offset = rand() % 2000 - 1000;
+        pkts[i].size = 13 + (rand() % 100);
+        for (j = 0; j < pkts[i].size; j++)
+            pkts[i].payload[j] = (uint8_t)rand();
+    }
+    clock_gettime(CLOCK_REALTIME, &utc);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (l = 0; l < loops; l++)
+        len_a = encode_snprintf(pkts, BENCH_NB_PKT, &utc, out_a, sizeof(out_a));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    t_a = difftimespec(end, start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (l = 0; l < loops; l++)
+        len_b = encode_jsonw(pkts, BENCH_NB_PKT, &utc, out_b, sizeof(out_b));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    t_b = difftimespec(end, start);
+
+    printf("%d packets per datagram, %ld loops\n", BENCH_NB_PKT, loops);
+    printf("snprintf: %8.3f us/datagram (%d bytes)\n", 1e6 * t_a / loops, len_a);
+    printf("jsonw   : %8.3f us/datagram (%d bytes)\n", 1e6 * t_b / loops, len_b);
+    printf("speedup : %.2fx\n", t_a / t_b);
+
+    if (len_a != len_b || memcmp(out_a, out_b, len_a) != 0) {
+        printf("outputs differ!\nsnprintf: %s\njsonw   : %s\n", out_a, out_b);
+        return 1;
+    }
+    printf("outputs identical\n");
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Print the spectral scan ring file as CSV: one line per channel scan,
+ * utc,sweep,freq_hz,nb_scan,duration_ms then the count of each level bin.
+ * The first line names the bins by their lower level in dBm.
+ *
+ * Usage: sscan_dump [-f] [ring_path]
+ *        -f: keep following the file, like tail -f
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "sscan.h"
+
+static void print_rec(const struct sscan_rec_s* rec) {
+    char date[32];
+    time_t sec = rec->time_ns / 1000000000ULL;
+    struct tm* x = gmtime(&sec);
+    int i;
+
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", x);
+    printf("%s.%03uZ,%u,%u,%u,%u", date, (unsigned)(rec->time_ns / 1000000 % 1000), rec->sweep, rec->freq_hz, rec->nb_scan, rec->duration_ms);
+    for (i = 0; i < SSCAN_NB_BINS; i++)
+        printf(",%u", rec->results[i]);
+    printf("\n");
+}
+
+int main(int argc, char* argv[]) {
+    struct sscan_ring_s ring;
+    struct sscan_rec_s rec;
+    const char* path = SSCAN_RING_PATH;
+    uint32_t seq, head;
+    int follow = 0, i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0)
+            follow = 1;
+        else
+            path = argv[i];
+    }
+
+    if (sscan_ring_attach(&ring, path) != 0) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    printf("utc,sweep,freq_hz,nb_scan,duration_ms");
+    for (i = 0; i < SSCAN_NB_BINS; i++)
+        printf(",%d", ring.hdr->levels_dbm[i]);
+    printf("\n");
+
+    head = sscan_ring_head(&ring);
+    seq = head > ring.hdr->capacity ? head - ring.hdr->capacity : 0;
+
+    for (;;) {
+        head = sscan_ring_head(&ring);
+        if (head - seq > ring.hdr->capacity) {
+            fprintf(stderr, "%u records overwritten before they were read\n", head - seq - ring.hdr->capacity);
+            seq = head - ring.hdr->capacity;
+        }
+        for (; seq != head; seq++) {
+            if (sscan_ring_read(&ring, seq, &rec) == 0)
+                print_rec(&rec);
+        }
+        if (!follow)
+            break;
+        fflush(stdout);
+        usleep(200000);
+    }
+
+    sscan_ring_close(&ring);
+    return EXIT_SUCCESS;
+}
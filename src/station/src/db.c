@@ -35,6 +35,8 @@
 #include <pthread.h>
 #include <signal.h>
 #include <dirent.h>
+#include <ctype.h>
+#include <inttypes.h>
 #include <sqlite3.h>
 
 #include "db.h"
@@ -103,6 +105,8 @@ DEFINE_SQL_STATEMENT(gettree_all_stmt, "SELECT key, value FROM gwdb ORDER BY key
 DEFINE_SQL_STATEMENT(showkey_stmt, "SELECT key, value FROM gwdb WHERE key LIKE '%' || '/' || ? ORDER BY key;")
 DEFINE_SQL_STATEMENT(showkey_stmt_ex, "SELECT key FROM gwdb WHERE key LIKE '%' || '/' || ? || '%' ORDER BY key;")
 DEFINE_SQL_STATEMENT(gettree_prefix_stmt, "SELECT key, value FROM gwdb WHERE key > ?1 AND key <= ?1 || X'ffff';")
+DEFINE_SQL_STATEMENT(filter_stmt, "SELECT key FROM gwdb WHERE key LIKE '/filter/%';")
+DEFINE_SQL_STATEMENT(data_version_stmt, "PRAGMA data_version;")
 DEFINE_SQL_STATEMENT(put_pkt_stmt, "INSERT INTO livepkts (pdtype, freq, dr, cnt, devaddr, content, payload) VALUES (?, ?, ?, ?, ?, ?, ?);")
 //DEFINE_SQL_STATEMENT(import_stmt, "ATTACH DATABASE '/etc/lora/devskey' AS a; SELECT devaddr, appskey, nwkskey FROM a.abpdevs;");
 
@@ -115,6 +119,7 @@ static int doexit;
 static int dosync;
 
 static void db_sync(void);
+static void filter_touch(const char *key);
 
 static int init_stmt(sqlite3_stmt **stmt, const char *sql, size_t len)
 {
@@ -159,6 +164,8 @@ static void clean_statements(void)
 	clean_stmt(&gettree_prefix_stmt, gettree_prefix_stmt_sql);
 	clean_stmt(&showkey_stmt, showkey_stmt_sql);
 	clean_stmt(&showkey_stmt_ex, showkey_stmt_ex_sql);
+	clean_stmt(&filter_stmt, filter_stmt_sql);
+	clean_stmt(&data_version_stmt, data_version_stmt_sql);
 	clean_stmt(&put_stmt, put_stmt_sql);
 	clean_stmt(&put_pkt_stmt, put_pkt_stmt_sql);
 }
@@ -176,6 +183,8 @@ static int init_statements(void)
 	|| init_stmt(&gettree_prefix_stmt, gettree_prefix_stmt_sql, sizeof(gettree_prefix_stmt_sql))
 	|| init_stmt(&showkey_stmt, showkey_stmt_sql, sizeof(showkey_stmt_sql))
     || init_stmt(&showkey_stmt_ex, showkey_stmt_ex_sql, sizeof(showkey_stmt_ex_sql))
+	|| init_stmt(&filter_stmt, filter_stmt_sql, sizeof(filter_stmt_sql))
+	|| init_stmt(&data_version_stmt, data_version_stmt_sql, sizeof(data_version_stmt_sql))
 	|| init_stmt(&put_stmt, put_stmt_sql, sizeof(put_stmt_sql))
 	|| init_stmt(&put_pkt_stmt, put_pkt_stmt_sql, sizeof(put_pkt_stmt_sql));
 }
@@ -285,6 +294,7 @@ int lgw_db_put(const char *family, const char *key, const char *value)
 	}
 
 	sqlite3_reset(put_stmt);
+	filter_touch(fullkey);
 	db_sync();
 	pthread_mutex_unlock(&mx_dblock);
 
@@ -451,6 +461,263 @@ bool lgw_db_key_exist_ex(const char *prefix, const char *key) {
     return false;
 }
 
+/*!> -------------------------------------------------------------------------- */
+/*!> --- FILTER INDEX --------------------------------------------------------- */
+
+/*!>!
+ * The /filter/<name>/<type>/<value> keys are compiled into one index per
+ * service, so a filter decision costs a few binary searches instead of a
+ * SQLite query per key. The index is rebuilt lazily by the first lookup
+ * after a change: writes through this file bump filter_gen, writes from
+ * other processes are seen by polling PRAGMA data_version once a second.
+ */
+
+#define FILTER_EUI_LEN      16
+
+typedef struct {
+	uint64_t *value;                        /*!> sorted, complete values */
+	int nb_value;
+	char (*part)[FILTER_EUI_LEN + 1];       /*!> partial EUI, matched anywhere in the EUI */
+	int nb_part;
+} filter_set_s;
+
+typedef struct _filter_index {
+	char name[64];
+	filter_set_s set[LGW_FILTER_NB];
+	struct _filter_index *next;
+} filter_index_s;
+
+static const char *filter_type_name[LGW_FILTER_NB] = { "fport", "devaddr", "nwkid", "deveui", "joineui" };
+
+static pthread_rwlock_t rw_filter = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t mx_filter_build = PTHREAD_MUTEX_INITIALIZER;
+static filter_index_s *filter_index = NULL;
+static unsigned filter_gen = 1;              /*!> generation of the /filter keys, 0 is never built */
+static unsigned filter_built = 0;            /*!> generation filter_index was built from */
+static time_t filter_polled = 0;
+static int filter_data_version = -1;
+
+/*!>! \internal
+ * \note mx_dblock is assumed to be held, key NULL means the whole db
+ */
+static void filter_touch(const char *key)
+{
+	if (key == NULL || !strncmp(key, "/filter", 7))
+		__atomic_add_fetch(&filter_gen, 1, __ATOMIC_RELEASE);
+}
+
+static int filter_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void filter_free(filter_index_s *index)
+{
+	int i;
+	filter_index_s *next;
+
+	while (index) {
+		next = index->next;
+		for (i = 0; i < LGW_FILTER_NB; i++) {
+			lgw_free(index->set[i].value);
+			lgw_free(index->set[i].part);
+		}
+		lgw_free(index);
+		index = next;
+	}
+}
+
+static int filter_add_value(filter_set_s *set, uint64_t value)
+{
+	uint64_t *p = lgw_realloc(set->value, sizeof(uint64_t) * (set->nb_value + 1));
+	if (!p)
+		return -1;
+	set->value = p;
+	set->value[set->nb_value++] = value;
+	return 0;
+}
+
+static int filter_add_part(filter_set_s *set, const char *part)
+{
+	char (*p)[FILTER_EUI_LEN + 1] = lgw_realloc(set->part, sizeof(*p) * (set->nb_part + 1));
+	if (!p)
+		return -1;
+	set->part = p;
+	strcpy(set->part[set->nb_part++], part);
+	return 0;
+}
+
+/*!>! \internal
+ * \brief add one /filter/<name>/<type>/<value> key to the index list
+ */
+static int filter_add_key(filter_index_s **head, const char *key)
+{
+	char name[64], type[16], value[64], eui[FILTER_EUI_LEN + 1];
+	char *end = NULL;
+	unsigned long long num;
+	filter_index_s *index;
+	int i, t, len = 0;
+
+	if (sscanf(key, "/filter/%63[^/]/%15[^/]/%63s", name, type, value) != 3)
+		return 0;
+
+	for (t = 0; t < LGW_FILTER_NB; t++) {
+		if (!strcmp(type, filter_type_name[t]))
+			break;
+	}
+	if (t == LGW_FILTER_NB)
+		return 0;
+
+	for (index = *head; index; index = index->next) {
+		if (!strcmp(index->name, name))
+			break;
+	}
+	if (!index) {
+		index = lgw_malloc(sizeof(filter_index_s));
+		if (!index)
+			return -1;
+		strcpy(index->name, name);
+		index->next = *head;
+		*head = index;
+	}
+
+	switch (t) {
+		case LGW_FILTER_DEVEUI:
+		case LGW_FILTER_JOINEUI:
+			/*!> same as get_key: keep the hex digits, a partial EUI is a wildcard */
+			for (i = 0; value[i] != '\0'; i++) {
+				if (!isxdigit((unsigned char)value[i]))
+					continue;
+				if (len == FILTER_EUI_LEN)
+					return 0;   /*!> longer than an EUI, never matches */
+				eui[len++] = toupper((unsigned char)value[i]);
+			}
+			eui[len] = '\0';
+			if (len == FILTER_EUI_LEN)
+				return filter_add_value(&index->set[t], strtoull(eui, NULL, 16));
+			return filter_add_part(&index->set[t], eui);
+		default:
+			num = strtoull(value, &end, t == LGW_FILTER_FPORT ? 10 : 16);
+			if (end == value || *end != '\0') {
+				MSG("%s[DB] ignore invalid filter key: %s\n", WARNMSG, key);
+				return 0;
+			}
+			return filter_add_value(&index->set[t], num);
+	}
+}
+
+static filter_index_s *filter_build(void)
+{
+	filter_index_s *head = NULL, *index;
+	const char *key;
+	int i;
+
+	pthread_mutex_lock(&mx_dblock);
+	while (sqlite3_step(filter_stmt) == SQLITE_ROW) {
+		key = (const char *) sqlite3_column_text(filter_stmt, 0);
+		if (key && filter_add_key(&head, key)) {
+			MSG("%s[DB] out of memory building the filter index\n", ERRMSG);
+			break;
+		}
+	}
+	sqlite3_reset(filter_stmt);
+	pthread_mutex_unlock(&mx_dblock);
+
+	for (index = head; index; index = index->next) {
+		for (i = 0; i < LGW_FILTER_NB; i++) {
+			if (index->set[i].nb_value > 1)
+				qsort(index->set[i].value, index->set[i].nb_value, sizeof(uint64_t), filter_cmp);
+		}
+	}
+
+	return head;
+}
+
+static void filter_refresh(void)
+{
+	time_t now = time(NULL);
+	filter_index_s *fresh, *old;
+	unsigned gen;
+	int version;
+
+	/*!> other processes writing the db are only visible through data_version */
+	if (now != __atomic_load_n(&filter_polled, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&filter_polled, now, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&mx_dblock);
+		if (sqlite3_step(data_version_stmt) == SQLITE_ROW) {
+			version = sqlite3_column_int(data_version_stmt, 0);
+			if (version != filter_data_version) {
+				filter_data_version = version;
+				filter_touch(NULL);
+			}
+		}
+		sqlite3_reset(data_version_stmt);
+		pthread_mutex_unlock(&mx_dblock);
+	}
+
+	gen = __atomic_load_n(&filter_gen, __ATOMIC_ACQUIRE);
+	if (gen == __atomic_load_n(&filter_built, __ATOMIC_ACQUIRE))
+		return;
+
+	/*!> one rebuild at a time, the others keep using the current index */
+	if (pthread_mutex_trylock(&mx_filter_build))
+		return;
+
+	fresh = filter_build();
+
+	pthread_rwlock_wrlock(&rw_filter);
+	old = filter_index;
+	filter_index = fresh;
+	__atomic_store_n(&filter_built, gen, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&rw_filter);
+
+	pthread_mutex_unlock(&mx_filter_build);
+
+	filter_free(old);
+}
+
+/*!>! \internal
+ * \note rw_filter is assumed to be held
+ */
+static filter_set_s *filter_find(const char *name, lgw_filter_type_e type)
+{
+	filter_index_s *index;
+
+	for (index = filter_index; index; index = index->next) {
+		if (!strcmp(index->name, name))
+			return &index->set[type];
+	}
+	return NULL;
+}
+
+bool lgw_db_filter_exist(const char *name, lgw_filter_type_e type, uint64_t value)
+{
+	bool found = false;
+	filter_set_s *set;
+	char eui[FILTER_EUI_LEN + 1];
+	int i;
+
+	if (type >= LGW_FILTER_NB)
+		return false;
+
+	filter_refresh();
+
+	pthread_rwlock_rdlock(&rw_filter);
+	set = filter_find(name, type);
+	if (set) {
+		found = set->nb_value > 0 && bsearch(&value, set->value, set->nb_value, sizeof(uint64_t), filter_cmp) != NULL;
+		if (!found && set->nb_part > 0) {
+			snprintf(eui, sizeof(eui), "%016" PRIX64, value);
+			for (i = 0; i < set->nb_part && !found; i++)
+				found = strstr(eui, set->part[i]) != NULL;
+		}
+	}
+	pthread_rwlock_unlock(&rw_filter);
+
+	return found;
+}
+
 int lgw_db_get(const char *family, const char *key, char *value, int valuelen)
 {
 	lgw_assert(value != NULL);
@@ -490,6 +757,7 @@ int lgw_db_del(const char *family, const char *key)
 		res = -1;
 	}
 	sqlite3_reset(del_stmt);
+	filter_touch(fullkey);
 	db_sync();
 	pthread_mutex_unlock(&mx_dblock);
 
@@ -525,6 +793,7 @@ int lgw_db_deltree(const char *family, const char *keytree)
 	}
 	res = sqlite3_changes(GWDB);
 	sqlite3_reset(stmt);
+	filter_touch(lgw_strlen_zero(prefix) ? NULL : prefix);
 	db_sync();
 	pthread_mutex_unlock(&mx_dblock);
 
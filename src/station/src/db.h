@@ -42,6 +42,16 @@ struct lgw_db_entry {
 	char data[0];
 };
 
+/*! \brief kind of value kept under /filter/<name>/<type>/<value> */
+typedef enum {
+	LGW_FILTER_FPORT,
+	LGW_FILTER_DEVADDR,
+	LGW_FILTER_NWKID,
+	LGW_FILTER_DEVEUI,
+	LGW_FILTER_JOINEUI,
+	LGW_FILTER_NB
+} lgw_filter_type_e;
+
 /*! \brief initial database */
 int lgw_db_init(void);
 
@@ -51,6 +61,17 @@ bool lgw_db_key_exist(const char *key);
 /*! \brief find key specified by family, only for deveui and appeui */
 bool lgw_db_key_exist_ex(const char *prefix, const char *key);
 
+/*!
+ * \brief find value in the filter index of service name
+ *
+ * \details
+ * Lookup in memory, the index is compiled from the /filter keys and
+ * rebuilt after they change. EUI may also match a partial EUI filter.
+ *
+ * \retval true value is listed for this service and type
+ */
+bool lgw_db_filter_exist(const char *name, lgw_filter_type_e type, uint64_t value);
+
 /*! \brief Get key value specified by family/key */
 int lgw_db_get(const char *family, const char *key, char *value, int valuelen);
 
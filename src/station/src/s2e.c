@@ -50,138 +50,57 @@ extern inline rps_t rps_make (int sf, int bw);
 static void s2e_txtimeout (tmr_t* tmr);
 static void s2e_bcntimeout (tmr_t* tmr);
 
-static bool basic_station_filter(StationFilter_t *pBSFilter, LoraParam_t *pLoraParam) {
-    char addr_key[64] = {0};
-    char fport_key[64] = {0};
-    char nwkid_key[64] = {0};
-    char deveui_key[64] = {0};
-    char appeui_key[64] = {0};
-    uint8_t nwkid = 0;
-
-    snprintf(addr_key, sizeof(addr_key), "%s/devaddr/%08X", pBSFilter->server_name, pLoraParam->devAddr);
-    snprintf(fport_key, sizeof(fport_key), "%s/fport/%u", pBSFilter->server_name, pLoraParam->fPort);
-
-    nwkid = (pLoraParam->devAddr >> 25) & 0x7F;   /* Devaddr Format:  31..25(NwkID)  24..0(NwkAddr) */
-
-    snprintf(nwkid_key, sizeof(nwkid_key), "%s/nwkid/%02X", pBSFilter->server_name, nwkid);
+static bool filter_level_drop(filter_e level, bool listed) {
+    switch (level) {
+        case INCLUDE:
+            return listed;
+        case EXCLUDE:
+            return !listed;
+        default:
+            return false;
+    }
+}
 
-    snprintf(deveui_key, sizeof(deveui_key), "%s/deveui/", pBSFilter->server_name);
-    snprintf(appeui_key, sizeof(appeui_key), "%s/joineui/", pBSFilter->server_name);
+static bool basic_station_filter(StationFilter_t *pBSFilter, LoraParam_t *pLoraParam) {
+    const char *name = pBSFilter->server_name;
+    uint8_t nwkid = ((uint32_t)pLoraParam->devAddr >> 25) & 0x7F;   /* Devaddr Format:  31..25(NwkID)  24..0(NwkAddr) */
 
-    LOG(MOD_S2E|INFO, "[%s-filter] fport-lv=%d, addr-lv=%d, nwkid-lv=%d, joineui-lv=%d, deveui-lv=%d, "
-                      "addr_key=%s, fport_key=%s, nwkid_key=%s, appeui_key=%s, deveui_key=%s\n", 
-                        pBSFilter->server_name, pBSFilter->filter.fport, pBSFilter->filter.devaddr, 
-                        pBSFilter->filter.nwkid, pBSFilter->filter.joineui, pBSFilter->filter.deveui,
-                        addr_key, fport_key, nwkid_key, appeui_key, deveui_key);
-    
-    switch (pBSFilter->filter.fport) {
-        case INCLUDE: // 1
-            if (lgw_db_key_exist(fport_key)) {
-                LOG(MOD_S2E|INFO, "[%s-filter] fport filter include\n", pBSFilter->server_name);
-                return true;  // filter
-            }
-            LOG(MOD_S2E|INFO, "[%s-filter] fport filter not include\n", pBSFilter->server_name);
-            break;
-        case EXCLUDE: // 2
-            if (!lgw_db_key_exist(fport_key)) {
-                LOG(MOD_S2E|INFO, "[%s-filter] fport filter exclude\n", pBSFilter->server_name);
-                return true;  //filter
-            }
-            LOG(MOD_S2E|INFO, "[%s-filter] fport filter not exclude\n", pBSFilter->server_name);
-            break;
-        default:
-            LOG(MOD_S2E|INFO, "[%s-filter] fport no filter\n", pBSFilter->server_name);
-            break;
+    if (pBSFilter->filter.fport != NOFILTER &&
+            filter_level_drop(pBSFilter->filter.fport,
+                lgw_db_filter_exist(name, LGW_FILTER_FPORT, pLoraParam->fPort))) {
+        LOG(MOD_S2E|DEBUG, "[%s-filter] drop fport %u\n", name, pLoraParam->fPort);
+        return true;
     }
 
-    switch (pBSFilter->filter.devaddr) {
-        case INCLUDE: //1
-            if (lgw_db_key_exist(addr_key)) {
-                LOG(MOD_S2E|INFO, "[%s-filter] devaddr filter include\n", pBSFilter->server_name);
-                return true; // filter
-            }
-            LOG(MOD_S2E|INFO, "[%s-filter] devaddr filter not include\n", pBSFilter->server_name);
-            break;
-        case EXCLUDE:
-            if (!lgw_db_key_exist(addr_key) && pLoraParam->devAddr>0) {
-                LOG(MOD_S2E|INFO, "[%s-filter] devaddr filter exclude\n", pBSFilter->server_name);
-                return true; 
-            }
-            LOG(MOD_S2E|INFO, "[%s-filter] devaddr filter not exclude\n", pBSFilter->server_name);
-            break;
-        default:
-            LOG(MOD_S2E|INFO, "[%s-filter] devaddr no filter\n", pBSFilter->server_name);
-            break;
+    /* EXCLUDE never drops a frame without devaddr (join request) */
+    if (pBSFilter->filter.devaddr != NOFILTER &&
+            (pBSFilter->filter.devaddr == INCLUDE || pLoraParam->devAddr > 0) &&
+            filter_level_drop(pBSFilter->filter.devaddr,
+                lgw_db_filter_exist(name, LGW_FILTER_DEVADDR, (uint32_t)pLoraParam->devAddr))) {
+        LOG(MOD_S2E|DEBUG, "[%s-filter] drop devaddr %08X\n", name, pLoraParam->devAddr);
+        return true;
     }
 
-    switch (pBSFilter->filter.nwkid) {
-        case INCLUDE: //1
-            if (lgw_db_key_exist(nwkid_key)) {
-                LOG(MOD_S2E|INFO, "[%s-filter] nwkid(%02X) filter include \n", pBSFilter->server_name, nwkid);
-                return true; // filter
-            }
-            LOG(MOD_S2E|INFO, "[%s-filter] nwkid(%02X) filter not include \n", pBSFilter->server_name, nwkid);
-            break;
-        case EXCLUDE:
-            if (!lgw_db_key_exist(nwkid_key) && pLoraParam->devAddr>0) {
-                LOG(MOD_S2E|INFO, "[%s-filter] nwkid(%02X) filter exclude \n", pBSFilter->server_name, nwkid);
-                return true; 
-            }
-            LOG(MOD_S2E|INFO, "[%s-filter] nwkid(%02X) filter not exclude \n", pBSFilter->server_name, nwkid);
-            break;
-        default:
-            LOG(MOD_S2E|INFO, "[%s-filter] nwkid(%02X) no filter\n", pBSFilter->server_name, nwkid);
-            break;
+    if (pBSFilter->filter.nwkid != NOFILTER &&
+            (pBSFilter->filter.nwkid == INCLUDE || pLoraParam->devAddr > 0) &&
+            filter_level_drop(pBSFilter->filter.nwkid,
+                lgw_db_filter_exist(name, LGW_FILTER_NWKID, nwkid))) {
+        LOG(MOD_S2E|DEBUG, "[%s-filter] drop nwkid %02X\n", name, nwkid);
+        return true;
     }
 
-    if (pLoraParam->deveui > 0) {
-        char deveui_str[17]={0};
-        sprintf(deveui_str, "%16llX", pLoraParam->deveui);
-        deveui_str[16]='\0';
-        switch (pBSFilter->filter.deveui) {
-            case INCLUDE: //1
-                if (lgw_db_key_exist_ex(deveui_key, deveui_str)) {
-                    LOG(MOD_S2E|INFO, "[%s-filter] deveui(%s) filter include \n", pBSFilter->server_name, deveui_str);
-                    return true; // filter
-                }
-                LOG(MOD_S2E|INFO, "[%s-filter] deveui(%s) filter not include \n", pBSFilter->server_name, deveui_str);
-                break;
-            case EXCLUDE:
-                if (!lgw_db_key_exist_ex(deveui_key, deveui_str)) {
-                    LOG(MOD_S2E|INFO, "[%s-filter] deveui(%s) filter exclude \n", pBSFilter->server_name, deveui_str);
-                    return true; 
-                }
-                LOG(MOD_S2E|INFO, "[%s-filter] deveui(%s) filter not exclude \n", pBSFilter->server_name, deveui_str);
-                break;
-            default:
-                LOG(MOD_S2E|INFO, "[%s-filter] deveui(%s) no filter\n", pBSFilter->server_name, deveui_str);
-                break;
-        }
+    if (pBSFilter->filter.deveui != NOFILTER && pLoraParam->deveui > 0 &&
+            filter_level_drop(pBSFilter->filter.deveui,
+                lgw_db_filter_exist(name, LGW_FILTER_DEVEUI, pLoraParam->deveui))) {
+        LOG(MOD_S2E|DEBUG, "[%s-filter] drop deveui %016llX\n", name, (unsigned long long)pLoraParam->deveui);
+        return true;
     }
 
-    if (pLoraParam->joineui > 0) {
-        char appeui_str[17]={0};
-        sprintf(appeui_str, "%16llX", pLoraParam->joineui);
-        appeui_str[16]='\0';
-        switch (pBSFilter->filter.joineui) {
-            case INCLUDE: //1
-                if (lgw_db_key_exist_ex(appeui_key, appeui_str)) {
-                    LOG(MOD_S2E|INFO, "[%s-filter] joineui(%s) filter include \n", pBSFilter->server_name, appeui_str);
-                    return true; // filter
-                }
-                LOG(MOD_S2E|INFO, "[%s-filter] joineui(%s) filter not include \n", pBSFilter->server_name, appeui_str);
-                break;
-            case EXCLUDE:
-                if (!lgw_db_key_exist_ex(appeui_key, appeui_str)) {
-                    LOG(MOD_S2E|INFO, "[%s-filter] joineui(%s) filter exclude \n", pBSFilter->server_name, appeui_str);
-                    return true;
-                }
-                LOG(MOD_S2E|INFO, "[%s-filter] joineui(%s) filter not exclude \n", pBSFilter->server_name, appeui_str);
-                break;
-            default:
-                LOG(MOD_S2E|INFO, "[%s-filter] joineui(%s) no filter\n", pBSFilter->server_name, appeui_str);
-                break;
-        }
+    if (pBSFilter->filter.joineui != NOFILTER && pLoraParam->joineui > 0 &&
+            filter_level_drop(pBSFilter->filter.joineui,
+                lgw_db_filter_exist(name, LGW_FILTER_JOINEUI, pLoraParam->joineui))) {
+        LOG(MOD_S2E|DEBUG, "[%s-filter] drop joineui %016llX\n", name, (unsigned long long)pLoraParam->joineui);
+        return true;
     }
 
     return false;  // no-filter